@@ -1,6 +1,7 @@
 #include "ccore/c_target.h"
 #include "ccore/c_allocator.h"
 #include "ccore/c_debug.h"
+#include "ccore/c_memory.h"
 #include "cbase/c_binmap.h"
 #include "cbase/c_integer.h"
 #include "cbase/c_memory.h"
@@ -94,6 +95,9 @@ namespace ncore
             binmap_t m_entity_free_hbb; // 8 bytes, which entity is free
             binmap_t m_entity_used_hbb; // 8 bytes, which entity is used
             u8*      m_a_entity_gen;    // 8 bytes * max_entities, these are just generation values
+            u32      m_num_alive;       // Number of alive entities
+            u32*     m_a_rank;          // Number of alive entities before every 512 entities, built lazily (see g_rank)
+            u32      m_rank_valid;      // Number of valid entries in m_a_rank
         };
 
         struct en_type_mgr_t
@@ -116,6 +120,8 @@ namespace ncore
             cp_type_mgr_t m_component_store;
             tg_type_mgr_t m_tag_type_store;
             en_type_mgr_t m_entity_type_store;
+            s32           m_num_singletons;                  // Number of registered singletons
+            void*         m_a_singleton[ECS_MAX_SINGLETONS]; // The flat table of singletons
         };
 
         // --------------------------------------------------------------------------------------------------------
@@ -127,8 +133,17 @@ namespace ncore
             s32         cp_id; // Initialize to -1, calling 'g_register_tag_type' will initialize it
             s32         cp_sizeof;
             const char* cp_name;
+            s32         cp_alignof;
         };
 
+        // The distance between two components, the size padded to the alignment so that every component is aligned
+        static inline s32 s_cp_stride(cp_type_t const& cp_type)
+        {
+            s32 const align = math::max(cp_type.cp_alignof, (s32)1);
+            ASSERT(math::ispo2((u32)align) && align <= ECS_MAX_ALIGNMENT);
+            return math::alignUp(cp_type.cp_sizeof, (u32)align);
+        }
+
         static void s_init(cp_type_mgr_t* cps, alloc_t* allocator)
         {
             // g_hbb_init(cps->m_a_cp_hbb_hdr, cp_type_mgr_t::COMPONENTS_MAX);
@@ -159,6 +174,7 @@ namespace ncore
                 cp_nctype_t* cp_nctype = (cp_nctype_t*)&cps->m_a_cp_type[cp_id];
                 cp_nctype->cp_sizeof   = cp_type->cp_sizeof;
                 cp_nctype->cp_name     = cp_type->cp_name;
+                cp_nctype->cp_alignof  = cp_type->cp_alignof;
                 cp_nctype->cp_id       = cp_id;
                 cp_type->cp_id         = cp_id;
 
@@ -258,6 +274,9 @@ namespace ncore
             et->m_entity_free_hbb.reset();
             et->m_entity_used_hbb.reset();
             et->m_a_entity_gen = nullptr;
+            et->m_num_alive    = 0;
+            et->m_a_rank       = nullptr;
+            et->m_rank_valid   = 0;
             et->m_cp_hbb.reset();
             et->m_tg_hbb.reset();
         }
@@ -267,6 +286,14 @@ namespace ncore
         static en_type_t*& s_get_entity_type(en_type_mgr_t* es, u32 entity_type_id) { return es->m_entity_type_array[entity_type_id]; }
         static bool        s_has_component(en_type_t const* et, u32 cp_id) { return et->m_cp_hbb.is_used(cp_id); }
 
+        // The number of alive entities before every 512 entities after the one of 'entity_id' is out of date
+        static inline void s_rank_invalidate(en_type_t* et, u32 entity_id)
+        {
+            u32 const rank_valid = (entity_id >> 9) + 1;
+            if (rank_valid < et->m_rank_valid)
+                et->m_rank_valid = rank_valid;
+        }
+
         static entity_t s_create_entity(en_type_t* et)
         {
             if (s_is_registered(et))
@@ -279,6 +306,8 @@ namespace ncore
                     // g_hbb_set(et->m_entity_hbb_hdr, et->m_entity_used_hbb, entity_id);
                     et->m_entity_free_hbb.set_used(entity_id);
                     et->m_entity_used_hbb.set_free(entity_id);
+                    et->m_num_alive += 1;
+                    s_rank_invalidate(et, entity_id);
 
                     u8&              eVER  = et->m_a_entity_gen[entity_id];
                     entity_type_id_t eTYPE = et->m_en_type_id;
@@ -301,6 +330,8 @@ namespace ncore
                     // g_hbb_clr(et->m_entity_hbb_hdr, et->m_entity_used_hbb, entity_id);
                     et->m_entity_free_hbb.set_free(entity_id);
                     et->m_entity_used_hbb.set_used(entity_id);
+                    et->m_num_alive -= 1;
+                    s_rank_invalidate(et, entity_id);
 
                     // For all components in this entity type, set_used them as unused for this entity.
                     // Even if not all of them might be marked as 'used' for this specific entity.
@@ -357,6 +388,11 @@ namespace ncore
                     et->m_a_entity_gen[i] = 0;
                 }
 
+                et->m_num_alive  = 0;
+                et->m_a_rank     = (u32*)allocator->allocate(sizeof(u32) * (((max_entities + 511) >> 9) + 1));
+                et->m_a_rank[0]  = 0; // There are no alive entities before the first entity
+                et->m_rank_valid = 1;
+
                 // g_hbb_init(et->m_tg_hbb_hdr, tg_type_mgr_t::TAGS_MAX);
                 // g_hbb_init(et->m_tg_hbb_hdr, et->m_tg_hbb, 0);
                 // g_hbb_init(et->m_cp_hbb_hdr, cp_type_mgr_t::COMPONENTS_MAX);
@@ -411,6 +447,7 @@ namespace ncore
                 allocator->deallocate(et->m_a_cp_store);
                 allocator->deallocate(et->m_a_cp_store_hbb);
                 allocator->deallocate(et->m_a_entity_gen);
+                allocator->deallocate(et->m_a_rank);
                 allocator->deallocate(et->m_a_tg_hbb);
 
                 // g_hbb_release((hbb_data_t&)et->m_entity_free_hbb, allocator);
@@ -464,12 +501,20 @@ namespace ncore
             s_init(&ecs->m_component_store, allocator);
             s_init(&ecs->m_tag_type_store, allocator);
             s_init(&ecs->m_entity_type_store, allocator);
+            ecs->m_num_singletons = 0;
+            for (s32 i = 0; i < ECS_MAX_SINGLETONS; ++i)
+                ecs->m_a_singleton[i] = nullptr;
             return ecs;
         }
 
         void g_destroy_ecs(ecs_t* ecs)
         {
             alloc_t* allocator = ecs->m_allocator;
+            for (s32 i = 0; i < ECS_MAX_SINGLETONS; ++i)
+            {
+                if (ecs->m_a_singleton[i] != nullptr)
+                    allocator->deallocate(ecs->m_a_singleton[i]);
+            }
             s_exit(&ecs->m_entity_type_store, allocator);
             s_exit(&ecs->m_tag_type_store, allocator);
             s_exit(&ecs->m_component_store, allocator);
@@ -482,6 +527,26 @@ namespace ncore
         void g_register_component_type(ecs_t* r, cp_type_t* cp_type) { return s_register_cp_type(&r->m_component_store, cp_type); }
         void g_register_tag_type(ecs_t* r, tg_type_t* tg_type) { return s_register_tag_type(&r->m_tag_type_store, tg_type); }
 
+        void* g_register_singleton_type(ecs_t* r, sg_type_t* sg_type)
+        {
+            if (sg_type->sg_id < 0) // Not registered yet ?
+            {
+                ASSERTS(r->m_num_singletons < ECS_MAX_SINGLETONS, "Too many singletons");
+                if (r->m_num_singletons >= ECS_MAX_SINGLETONS)
+                    return nullptr;
+                sg_type->sg_id = r->m_num_singletons++;
+            }
+            void*& singleton = r->m_a_singleton[sg_type->sg_id];
+            if (singleton == nullptr)
+            {
+                singleton = r->m_allocator->allocate(sg_type->sg_sizeof);
+                g_memclr(singleton, sg_type->sg_sizeof);
+            }
+            return singleton;
+        }
+
+        void* g_get_singleton(ecs_t* ecs, sg_type_t* sg_type) { return ecs->m_a_singleton[sg_type->sg_id]; }
+
         // --------------------------------------------------------------------------------------------------------
         // entity functionality
 
@@ -505,7 +570,7 @@ namespace ncore
                 return nullptr;
             u8*       cp_store_data = entity_type->m_a_cp_store[cp_type.cp_id];
             u32 const cp_offset     = g_entity_id(e);
-            return cp_store_data + (cp_offset * cp_type.cp_sizeof);
+            return cp_store_data + (cp_offset * s_cp_stride(cp_type));
         }
 
         static void s_entity_set_component(ecs_t* ecs, entity_t e, cp_type_t& cp_type)
@@ -516,7 +581,7 @@ namespace ncore
             if (cp_store_data == nullptr)
             {
                 u32 const count = entity_type->m_max_entities;
-                cp_store_data   = (u8*)ecs->m_allocator->allocate(count * cp_type.cp_sizeof);
+                cp_store_data   = (u8*)ecs->m_allocator->allocate(count * s_cp_stride(cp_type), ECS_MAX_ALIGNMENT);
                 // u32* cp_store_hbb = (u32*)ecs->m_allocator->allocate(sizeof(u32) * g_hbb_sizeof_data(count));
                 // g_hbb_init(entity_type->m_cp_hbb_hdr, cp_store_hbb, 0);
                 binmap_t::config_t cfg = binmap_t::config_t::compute(count);
@@ -612,22 +677,32 @@ namespace ncore
             m_ecs         = ecs;
             m_en_type     = nullptr;
             m_en_id       = 0;
-            m_cp_type_cnt = 0;
-            m_tg_type_cnt = 0;
+            m_cp_type_cnt   = 0;
+            m_tg_type_cnt   = 0;
+            m_sg_read_mask  = 0;
+            m_sg_write_mask = 0;
         }
 
         void en_iterator_t::initialize(en_type_t* en_type)
         {
-            m_ecs         = nullptr;
-            m_en_type     = en_type;
-            m_en_id       = 0;
-            m_cp_type_cnt = 0;
-            m_tg_type_cnt = 0;
+            m_ecs           = nullptr;
+            m_en_type       = en_type;
+            m_en_id         = 0;
+            m_cp_type_cnt   = 0;
+            m_tg_type_cnt   = 0;
+            m_sg_read_mask  = 0;
+            m_sg_write_mask = 0;
         }
 
         // Mark the things you want to iterate on
         void en_iterator_t::cp_type(cp_type_t* cp) { m_cp_type_arr[m_cp_type_cnt++] = (u16)cp->cp_id; }
         void en_iterator_t::tg_type(tg_type_t* tg) { m_tg_type_arr[m_tg_type_cnt++] = (u8)tg->tg_id; }
+        void en_iterator_t::sg_read(sg_type_t* sg) { m_sg_read_mask |= ((u32)1 << sg->sg_id); }
+        void en_iterator_t::sg_write(sg_type_t* sg)
+        {
+            m_sg_read_mask |= ((u32)1 << sg->sg_id);
+            m_sg_write_mask |= ((u32)1 << sg->sg_id);
+        }
 
         static inline u32 s_first_entity(en_type_t* en_type)
         {
@@ -764,6 +839,16 @@ namespace ncore
             }
         }
 
+        void en_iterator_t::begin(u32 en_id)
+        {
+            m_en_type = s_search_matching_entity_type(*this);
+            if (m_en_type != nullptr)
+            {
+                m_en_id = (en_id == 0) ? s_first_entity(m_en_type) : s_next_entity(m_en_type, en_id - 1);
+                m_en_id = s_search_matching_entity(*this);
+            }
+        }
+
         entity_t en_iterator_t::item() const { return g_make_entity(m_en_type->m_a_entity_gen[m_en_id], m_en_type->m_en_type_id, m_en_id); }
 
         void en_iterator_t::next()
@@ -774,5 +859,205 @@ namespace ncore
 
         bool en_iterator_t::end() const { return m_en_type == nullptr; }
 
+        //////////////////////////////////////////////////////////////////////////
+        // cardinality
+
+        static bool s_entity_matches(en_iterator_t const& iter, en_type_t const* en_type, u32 en_id)
+        {
+            for (s16 i = 0; i < iter.m_cp_type_cnt; ++i)
+                if (!en_type->m_a_cp_store_hbb[iter.m_cp_type_arr[i]].is_used(en_id))
+                    return false;
+            for (s16 i = 0; i < iter.m_tg_type_cnt; ++i)
+                if (!en_type->m_a_tg_hbb[iter.m_tg_type_arr[i]].is_used(en_id))
+                    return false;
+            return true;
+        }
+
+        static u32 s_count_matching_entities(en_iterator_t const& iter, en_type_t* en_type)
+        {
+            // Drive the walk with the binmap of the first required component (or tag), every entity that is set in there
+            // only needs to be tested against the remaining binmaps. Without any, the set entities of the free binmap are
+            // the alive entities.
+            binmap_t* driver = &en_type->m_entity_free_hbb;
+            if (iter.m_cp_type_cnt > 0)
+                driver = &en_type->m_a_cp_store_hbb[iter.m_cp_type_arr[0]];
+            else if (iter.m_tg_type_cnt > 0)
+                driver = &en_type->m_a_tg_hbb[iter.m_tg_type_arr[0]];
+
+            u32              count = 0;
+            binmap_t::iter_t en_iter(driver, 0, en_type->m_max_entities);
+            en_iter.begin();
+            while (!en_iter.end())
+            {
+                u32 const en_id = en_iter.get();
+                if (s_entity_matches(iter, en_type, en_id))
+                    count++;
+                en_iter.next();
+            }
+            return count;
+        }
+
+        u32 g_count(en_iterator_t const& query)
+        {
+            en_iterator_t iter = query;
+            if (iter.m_ecs != nullptr)
+                iter.m_en_type = s_first_entity_type(iter.m_ecs);
+
+            u32 count = 0;
+            while ((iter.m_en_type = s_search_matching_entity_type(iter)) != nullptr)
+            {
+                count += s_count_matching_entities(iter, iter.m_en_type);
+                if (iter.m_ecs == nullptr)
+                    break;
+                iter.m_en_type = s_next_entity_type(iter.m_ecs, iter.m_en_type);
+            }
+            return count;
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+        // rank / select
+
+        // Bring the number of alive entities before every 512 entities up to date until (and including) 'block'
+        static void s_rank_build(en_type_t* et, u32 block)
+        {
+            for (u32 b = et->m_rank_valid; b <= block; ++b)
+            {
+                u32       count = et->m_a_rank[b - 1];
+                u32 const end   = math::min(b << 9, et->m_max_entities);
+                for (u32 en_id = (b - 1) << 9; en_id < end; ++en_id)
+                {
+                    if (et->m_entity_free_hbb.is_used(en_id))
+                        count++;
+                }
+                et->m_a_rank[b] = count;
+            }
+            if (et->m_rank_valid <= block)
+                et->m_rank_valid = block + 1;
+        }
+
+        // Number of alive entities before 'en_id'
+        static u32 s_rank(en_type_t* et, u32 en_id)
+        {
+            u32 const block = en_id >> 9;
+            s_rank_build(et, block);
+            u32 rank = et->m_a_rank[block];
+            for (u32 i = block << 9; i < en_id; ++i)
+            {
+                if (et->m_entity_free_hbb.is_used(i))
+                    rank++;
+            }
+            return rank;
+        }
+
+        // Entity id of the k-th alive entity, -1 if there are not that many alive entities
+        static s32 s_select(en_type_t* et, u32 k)
+        {
+            if (k >= et->m_num_alive)
+                return -1;
+
+            // Only build as far as the block that holds the k-th alive entity
+            u32 const num_blocks = (et->m_max_entities + 511) >> 9;
+            while (et->m_rank_valid <= num_blocks && et->m_a_rank[et->m_rank_valid - 1] <= k)
+                s_rank_build(et, et->m_rank_valid);
+
+            // Binary search for the last block that has less than or equal to k alive entities before it
+            u32 lo = 0;
+            u32 hi = et->m_rank_valid - 1;
+            while (lo < hi)
+            {
+                u32 const mid = (lo + hi + 1) >> 1;
+                if (et->m_a_rank[mid] <= k)
+                    lo = mid;
+                else
+                    hi = mid - 1;
+            }
+
+            // Then walk the entities of that block
+            u32 remaining = k - et->m_a_rank[lo];
+            for (u32 en_id = lo << 9; en_id < et->m_max_entities; ++en_id)
+            {
+                if (et->m_entity_free_hbb.is_used(en_id) && remaining-- == 0)
+                    return (s32)en_id;
+            }
+            return -1;
+        }
+
+        static en_type_t* s_first_matching_entity_type(en_iterator_t& iter, en_iterator_t const& query)
+        {
+            iter.m_en_type = (query.m_ecs != nullptr) ? s_first_entity_type(query.m_ecs) : query.m_en_type;
+            return iter.m_en_type = s_search_matching_entity_type(iter);
+        }
+
+        static en_type_t* s_next_matching_entity_type(en_iterator_t& iter)
+        {
+            iter.m_en_type = (iter.m_ecs != nullptr) ? s_next_entity_type(iter.m_ecs, iter.m_en_type) : nullptr;
+            return iter.m_en_type = s_search_matching_entity_type(iter);
+        }
+
+        void g_rank_build(en_type_t* en_type) { s_rank_build(en_type, (en_type->m_max_entities + 511) >> 9); }
+
+        u32 g_rank(ecs_t* ecs, entity_t entity)
+        {
+            en_type_t* et = s_get_entity_type(&ecs->m_entity_type_store, g_entity_type_id(entity));
+            return s_rank(et, g_entity_id(entity));
+        }
+
+        entity_t g_select(en_type_t* en_type, u32 k)
+        {
+            s32 const en_id = s_select(en_type, k);
+            return en_id >= 0 ? g_make_entity(en_type->m_a_entity_gen[en_id], en_type->m_en_type_id, en_id) : g_null_entity;
+        }
+
+        u32 g_partition_begin(en_type_t* en_type, u32 part, u32 num_parts)
+        {
+            u32 const k     = (u32)(((u64)en_type->m_num_alive * part) / num_parts);
+            s32 const en_id = s_select(en_type, k);
+            return en_id >= 0 ? (u32)en_id : en_type->m_max_entities;
+        }
+
+        entity_t g_sample(en_iterator_t const& query, u32 random)
+        {
+            // The alive entities of all the matching entity types are the candidates
+            en_iterator_t iter      = query;
+            u32           num_alive = 0;
+            for (en_type_t* et = s_first_matching_entity_type(iter, query); et != nullptr; et = s_next_matching_entity_type(iter))
+                num_alive += et->m_num_alive;
+            if (num_alive == 0)
+                return g_null_entity;
+
+            // Pick uniformly among the candidates and reject the ones that do not match the query
+            for (s32 attempt = 0; attempt < 16; ++attempt)
+            {
+                u32 k = random % num_alive;
+                for (en_type_t* et = s_first_matching_entity_type(iter, query); et != nullptr; et = s_next_matching_entity_type(iter))
+                {
+                    if (k < et->m_num_alive)
+                    {
+                        s32 const en_id = s_select(et, k);
+                        if (s_entity_matches(iter, et, en_id))
+                            return g_make_entity(et->m_a_entity_gen[en_id], et->m_en_type_id, en_id);
+                        break;
+                    }
+                    k -= et->m_num_alive;
+                }
+                random = random * 1664525u + 1013904223u; // next value of a linear congruential generator
+            }
+
+            // Matches are rare, pick uniformly among the matching entities
+            u32 const count = g_count(query);
+            if (count == 0)
+                return g_null_entity;
+            u32 k = random % count;
+            for (en_type_t* et = s_first_matching_entity_type(iter, query); et != nullptr; et = s_next_matching_entity_type(iter))
+            {
+                for (u32 en_id = 0; en_id < et->m_max_entities; ++en_id)
+                {
+                    if (et->m_entity_free_hbb.is_used(en_id) && s_entity_matches(iter, et, en_id) && k-- == 0)
+                        return g_make_entity(et->m_a_entity_gen[en_id], et->m_en_type_id, en_id);
+                }
+            }
+            return g_null_entity;
+        }
+
     } // namespace necs
 } // namespace ncore
@@ -1,6 +1,7 @@
 #include "ccore/c_target.h"
 #include "ccore/c_allocator.h"
 #include "ccore/c_debug.h"
+#include "ccore/c_memory.h"
 #include "cbase/c_duomap.h"
 #include "cbase/c_integer.h"
 
@@ -24,11 +25,20 @@ namespace ncore
         // type definitions and utility functions
         static inline entity_t s_entity_make(entity_generation_t genid, entity_index_t index) { return ((u32)genid << ECS_ENTITY_GEN_SHIFT) | (index & ECS_ENTITY_INDEX_MASK); }
 
+        // The distance between two components, the size padded to the alignment so that every component is aligned
+        static inline s32 s_component_stride(s32 cp_sizeof, s32 cp_alignof)
+        {
+            s32 const align = math::max(cp_alignof, (s32)1);
+            ASSERT(math::ispo2((u32)align) && align <= ECS_MAX_ALIGNMENT);
+            return math::alignUp(cp_sizeof, (u32)align);
+        }
+
         // Component Type, component_type_t and tag_type_t
         struct component_type_t
         {
             const char* cp_name;           // Name of the component
             s32         cp_sizeof;         // Size of the component in bits
+            s32         cp_stride;         // Distance between two components, the size padded to the alignment
             s16         cp_alignof;        // Alignment requirement of the component
             s8          cp_group_index;    // The group index
             s8          cp_group_cp_index; // The component index in the group
@@ -94,7 +104,7 @@ namespace ncore
                 // Only create entity-component data array for components and *not* for tags
                 if (cp_type->cp_sizeof > 0)
                 {
-                    group->m_a_en_cp_data[cp_id] = g_allocate_array<byte>(group->m_allocator, group->m_max_entities * cp_type->cp_sizeof);
+                    group->m_a_en_cp_data[cp_id] = (byte*)group->m_allocator->allocate(group->m_max_entities * cp_type->cp_stride, ECS_MAX_ALIGNMENT);
                 }
                 return (s8)cp_id;
             }
@@ -156,15 +166,19 @@ namespace ncore
             duomap_t             m_entity_state; // Which entities are alive/dead
             entity_generation_t* m_a_entity_ver; // The generation Id of each entity
             entity_instance_t*   m_a_entity;     // The array of entities entries
+            u32                  m_num_alive;    // The number of alive entities
+            u32*                 m_a_rank;       // The number of alive entities before every 512 entities, built lazily
+            u32                  m_rank_valid;   // The number of valid entries in m_a_rank
         };
 
         struct ecs_t
         {
             DCORE_CLASS_PLACEMENT_NEW_DELETE
-            alloc_t*              m_allocator;    // The allocator
-            component_type_mgr_t  m_cp_type_mgr;  // The component type manager
-            component_group_mgr_t m_cp_group_mgr; // The component group manager
-            entity_mgr_t          m_entity_mgr;   // The entity manager
+            alloc_t*              m_allocator;                      // The allocator
+            component_type_mgr_t  m_cp_type_mgr;                    // The component type manager
+            component_group_mgr_t m_cp_group_mgr;                   // The component group manager
+            entity_mgr_t          m_entity_mgr;                     // The entity manager
+            void*                 m_singletons[ECS_MAX_SINGLETONS]; // The flat table of singletons
         };
 
         // --------------------------------------------------------------------------------------------------------
@@ -197,6 +211,7 @@ namespace ncore
                 component_type_t* cp_type = (component_type_t*)&cps->m_a_cp_type[cp_index];
                 cp_type->cp_name          = cp_name;
                 cp_type->cp_sizeof        = cp_sizeof;
+                cp_type->cp_stride        = s_component_stride(cp_sizeof, cp_alignof);
                 cp_type->cp_alignof       = cp_alignof;
                 cp_type->cp_group_index   = cg_index;
                 cps->m_cp_binmap.set_used(cp_index);
@@ -302,27 +317,51 @@ namespace ncore
             entity_mgr->m_entity_state.init_all_free(cfg, allocator);
             entity_mgr->m_a_entity_ver = g_allocate_array<entity_generation_t>(allocator, max_entities);
             entity_mgr->m_a_entity     = g_allocate_array<entity_instance_t>(allocator, max_entities);
+            entity_mgr->m_num_alive    = 0;
+            entity_mgr->m_a_rank       = g_allocate_array<u32>(allocator, ((max_entities + 511) >> 9) + 1);
+            entity_mgr->m_a_rank[0]    = 0; // There are no alive entities before the first entity
+            entity_mgr->m_rank_valid   = 1;
+        }
+
+        // The number of alive entities before every 512 entities after the one of 'index' is out of date
+        static inline void s_rank_invalidate(entity_mgr_t* entity_mgr, entity_index_t index)
+        {
+            u32 const rank_valid = (index >> 9) + 1;
+            if (rank_valid < entity_mgr->m_rank_valid)
+                entity_mgr->m_rank_valid = rank_valid;
         }
 
         static bool s_create_entity(entity_mgr_t* entity_mgr, entity_index_t& index)
         {
-            index = entity_mgr->m_entity_state.find_free();
-            if (index >= 0)
+            s32 const free_index = entity_mgr->m_entity_state.find_free();
+            if (free_index >= 0)
             {
+                index = (entity_index_t)free_index;
                 entity_mgr->m_entity_state.set_used(index);
+                entity_mgr->m_num_alive += 1;
+                s_rank_invalidate(entity_mgr, index);
                 return true;
             }
             return false;
         }
 
-        static void s_destroy_entity(entity_mgr_t* entity_mgr, entity_index_t index) { entity_mgr->m_entity_state.set_free(index); }
+        static void s_destroy_entity(entity_mgr_t* entity_mgr, entity_index_t index)
+        {
+            if (entity_mgr->m_entity_state.next_used_up(index) != (s32)index)
+                return; // Not alive
+            entity_mgr->m_entity_state.set_free(index);
+            entity_mgr->m_num_alive -= 1;
+            s_rank_invalidate(entity_mgr, index);
+        }
 
         static void s_exit(entity_mgr_t* entity_mgr, alloc_t* allocator)
         {
             allocator->deallocate(entity_mgr->m_a_entity);
             allocator->deallocate(entity_mgr->m_a_entity_ver);
+            allocator->deallocate(entity_mgr->m_a_rank);
             entity_mgr->m_a_entity     = nullptr;
             entity_mgr->m_a_entity_ver = nullptr;
+            entity_mgr->m_a_rank       = nullptr;
             entity_mgr->m_entity_state.release(allocator);
         }
 
@@ -338,6 +377,8 @@ namespace ncore
             s_init(&ecs->m_cp_type_mgr, ECS_MAX_GROUPS, allocator);
             s_init(&ecs->m_cp_group_mgr, ECS_MAX_GROUPS, allocator);
             s_init(&ecs->m_entity_mgr, max_entities, allocator);
+            for (u32 i = 0; i < ECS_MAX_SINGLETONS; ++i)
+                ecs->m_singletons[i] = nullptr;
             return ecs;
         }
 
@@ -345,6 +386,11 @@ namespace ncore
         {
             alloc_t* allocator = ecs->m_allocator;
 
+            for (u32 i = 0; i < ECS_MAX_SINGLETONS; ++i)
+            {
+                if (ecs->m_singletons[i] != nullptr)
+                    allocator->deallocate(ecs->m_singletons[i]);
+            }
             s_exit(&ecs->m_entity_mgr, allocator);
             s_exit(&ecs->m_cp_group_mgr, allocator);
             s_exit(&ecs->m_cp_type_mgr, allocator);
@@ -361,6 +407,18 @@ namespace ncore
         bool g_register_tag(ecs_t* r, u32 cg_index, u32 tg_index, const char* tg_name) { return s_register_tag_type(&r->m_cp_type_mgr, &r->m_cp_group_mgr, cg_index, tg_index, tg_name); }
         void g_unregister_tag(ecs_t* r, u32 cg_index, u32 tg_index) { return s_unregister_tg_type(&r->m_cp_type_mgr, &r->m_cp_group_mgr, cg_index, tg_index); }
 
+        bool g_register_singleton(ecs_t* ecs, u32 sg_index, s32 sg_sizeof, s32 sg_alignof)
+        {
+            ASSERT(sg_index < ECS_MAX_SINGLETONS);
+            if (sg_index >= ECS_MAX_SINGLETONS || ecs->m_singletons[sg_index] != nullptr)
+                return false;
+            ecs->m_singletons[sg_index] = ecs->m_allocator->allocate(sg_sizeof, sg_alignof);
+            g_memclr(ecs->m_singletons[sg_index], sg_sizeof);
+            return true;
+        }
+
+        void* g_get_singleton(ecs_t* ecs, u32 sg_index) { return ecs->m_singletons[sg_index]; }
+
         // --------------------------------------------------------------------------------------------------------
         // entity functionality
 
@@ -404,7 +462,7 @@ namespace ncore
                     component_group_t* group             = &ecs->m_cp_group_mgr.m_cp_groups[cp_group_index];
                     byte*              cp_data           = group->m_a_en_cp_data[cp_group_cp_index];
                     u32 const          cp_group_en_index = entity_instance.m_cp_group_en_index[gi];
-                    return cp_data + cp_group_en_index * cp_type->cp_sizeof;
+                    return cp_data + cp_group_en_index * cp_type->cp_stride;
                 }
             }
             return nullptr;
@@ -439,7 +497,7 @@ namespace ncore
             entity_instance.m_cp_group_en_index[gi] = cp_group_en_index;
 
             byte* cp_data = group->m_a_en_cp_data[cp_group_cp_index];
-            return cp_data + cp_group_en_index * cp_type->cp_sizeof;
+            return cp_data + cp_group_en_index * cp_type->cp_stride;
         }
 
         // Remove/detach component from the entity
@@ -520,10 +578,20 @@ namespace ncore
             m_group_mask       = 0; // The group mask
             for (s16 i = 0; i < 7; ++i)
                 m_group_cp_mask[i] = 0; // An entity cannot be in more than 7 component groups
-            m_num_groups = 0;
+            m_num_groups    = 0;
+            m_sg_read_mask  = 0;
+            m_sg_write_mask = 0;
         }
 
         // Mark the things you want to iterate on
+        void en_iterator_t::set_sg_read(u32 sg_index) { m_sg_read_mask |= ((u32)1 << sg_index); }
+
+        void en_iterator_t::set_sg_write(u32 sg_index)
+        {
+            m_sg_read_mask |= ((u32)1 << sg_index);
+            m_sg_write_mask |= ((u32)1 << sg_index);
+        }
+
         void en_iterator_t::set_cp_type(u32 cp_index)
         {
             const component_type_t* cp_type           = &m_ecs->m_cp_type_mgr.m_a_cp_type[cp_index];
@@ -550,45 +618,45 @@ namespace ncore
 
         static inline s32 s_next_entity(entity_mgr_t* mgr, u32 index) { return mgr->m_entity_state.next_used_up(index + 1); }
 
-        static s32 s_search_matching_entity(en_iterator_t& iter)
+        static bool s_entity_matches(en_iterator_t const& iter, s32 entity_index)
         {
-            while (iter.m_entity_index >= 0)
+            // First match the component groups and then the components/tags
+            entity_instance_t const& entity_instance = iter.m_ecs->m_entity_mgr.m_a_entity[entity_index];
+            if ((entity_instance.m_cp_groups & iter.m_group_mask) != iter.m_group_mask)
+                return false;
+
+            // Groups are matching, do we have the correct components/tags?
+
+            // An entity can have more groups than we are looking for (but not less), this means that
+            // we need to iterate the groups of the entity_instance to lock-step with the groups of the iterator
+
+            u64 entity_group_mask = ~0;
+            u64 iter_group_mask   = ~0;
+            for (s8 i = 0; i < iter.m_num_groups; ++i)
             {
-                // Until we encounter an entity that has all the required components/tags
-                // First match the component groups and then the components/tags
-                entity_instance_t& entity_instance = iter.m_ecs->m_entity_mgr.m_a_entity[iter.m_entity_index];
-                if ((entity_instance.m_cp_groups & iter.m_group_mask) == iter.m_group_mask)
+                s8 const iter_group_index   = math::findFirstBit(iter.m_group_mask & iter_group_mask);
+                s8       entity_group_index = math::findFirstBit(entity_instance.m_cp_groups & entity_group_mask);
+                while (entity_group_index < iter_group_index)
                 {
-                    // Groups are matching, do we have the correct components/tags?
-
-                    // An entity can have more groups than we are looking for (but not less), this means that
-                    // we need to iterate the groups of the entity_instance to lock-step with the groups of the iterator
-
-                    u64 entity_group_mask = ~0;
-                    u64 iter_group_mask   = ~0;
-                    for (s8 i = 0; i < iter.m_num_groups; ++i)
-                    {
-                        s8 const iter_group_index   = math::findFirstBit(iter.m_group_mask & iter_group_mask);
-                        s8       entity_group_index = math::findFirstBit(entity_instance.m_cp_groups & entity_group_mask);
-                        while (entity_group_index < iter_group_index)
-                        {
-                            entity_group_index = math::findFirstBit(entity_instance.m_cp_groups & ~(1 << entity_group_index));
-                            ASSERT(entity_group_index < 0); // This should not be possible!
-                        }
-
-                        if (iter.m_group_cp_mask[i] != (entity_instance.m_cp_group_cp_used[entity_group_index] & iter.m_group_cp_mask[i]))
-                            goto iter_next_entity;
-
-                        entity_group_mask = ~((u64)1 << entity_group_index);
-                        iter_group_mask   = ~((u64)1 << iter_group_index);
-                    }
-
-                    return iter.m_entity_index;
+                    entity_group_index = math::findFirstBit(entity_instance.m_cp_groups & ~(1 << entity_group_index));
+                    ASSERT(entity_group_index < 0); // This should not be possible!
                 }
-            iter_next_entity:
-                iter.m_entity_index = s_next_entity(&iter.m_ecs->m_entity_mgr, iter.m_entity_index);
+
+                if (iter.m_group_cp_mask[i] != (entity_instance.m_cp_group_cp_used[entity_group_index] & iter.m_group_cp_mask[i]))
+                    return false;
+
+                entity_group_mask = ~((u64)1 << entity_group_index);
+                iter_group_mask   = ~((u64)1 << iter_group_index);
             }
-            return -1;
+            return true;
+        }
+
+        static s32 s_search_matching_entity(en_iterator_t& iter)
+        {
+            // Until we encounter an entity that has all the required components/tags
+            while (iter.m_entity_index >= 0 && !s_entity_matches(iter, iter.m_entity_index))
+                iter.m_entity_index = s_next_entity(&iter.m_ecs->m_entity_mgr, iter.m_entity_index);
+            return iter.m_entity_index;
         }
 
         void en_iterator_t::begin()
@@ -604,6 +672,19 @@ namespace ncore
             }
         }
 
+        void en_iterator_t::begin(s32 entity_index)
+        {
+            if (m_ecs != nullptr && m_num_groups > 0 && entity_index < m_entity_index_max)
+            {
+                m_entity_index = m_ecs->m_entity_mgr.m_entity_state.next_used_up(entity_index);
+                m_entity_index = s_search_matching_entity(*this);
+            }
+            else
+            {
+                m_entity_index = -1;
+            }
+        }
+
         entity_t en_iterator_t::entity() const { return s_entity_make(m_ecs->m_entity_mgr.m_a_entity_ver[m_entity_index], m_entity_index); }
 
         void en_iterator_t::next()
@@ -614,5 +695,126 @@ namespace ncore
 
         bool en_iterator_t::end() const { return m_entity_index == -1; }
 
+        u32 g_count(en_iterator_t const& query)
+        {
+            en_iterator_t iter  = query;
+            u32           count = 0;
+            for (iter.begin(); !iter.end(); iter.next())
+                count++;
+            return count;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // rank / select
+
+        // Bring the number of alive entities before every 512 entities up to date until (and including) 'block'
+        static void s_rank_build(entity_mgr_t* entity_mgr, u32 block)
+        {
+            for (u32 b = entity_mgr->m_rank_valid; b <= block; ++b)
+            {
+                u32       count        = entity_mgr->m_a_rank[b - 1];
+                s32 const end          = (s32)(b << 9);
+                s32       entity_index = entity_mgr->m_entity_state.next_used_up((b - 1) << 9);
+                while (entity_index >= 0 && entity_index < end)
+                {
+                    count++;
+                    entity_index = entity_mgr->m_entity_state.next_used_up(entity_index + 1);
+                }
+                entity_mgr->m_a_rank[b] = count;
+            }
+            if (entity_mgr->m_rank_valid <= block)
+                entity_mgr->m_rank_valid = block + 1;
+        }
+
+        // The number of alive entities before 'index'
+        static u32 s_rank(entity_mgr_t* entity_mgr, entity_index_t index)
+        {
+            u32 const block = index >> 9;
+            s_rank_build(entity_mgr, block);
+            u32 rank         = entity_mgr->m_a_rank[block];
+            s32 entity_index = entity_mgr->m_entity_state.next_used_up(block << 9);
+            while (entity_index >= 0 && entity_index < (s32)index)
+            {
+                rank++;
+                entity_index = entity_mgr->m_entity_state.next_used_up(entity_index + 1);
+            }
+            return rank;
+        }
+
+        // The entity index of the k-th alive entity, -1 if there are not that many alive entities
+        static s32 s_select(entity_mgr_t* entity_mgr, u32 k)
+        {
+            if (k >= entity_mgr->m_num_alive)
+                return -1;
+
+            // Only build as far as the block that holds the k-th alive entity
+            u32 const num_blocks = (entity_mgr->m_entity_state.size() + 511) >> 9;
+            while (entity_mgr->m_rank_valid <= num_blocks && entity_mgr->m_a_rank[entity_mgr->m_rank_valid - 1] <= k)
+                s_rank_build(entity_mgr, entity_mgr->m_rank_valid);
+
+            // Binary search for the last block that has less than or equal to k alive entities before it
+            u32 lo = 0;
+            u32 hi = entity_mgr->m_rank_valid - 1;
+            while (lo < hi)
+            {
+                u32 const mid = (lo + hi + 1) >> 1;
+                if (entity_mgr->m_a_rank[mid] <= k)
+                    lo = mid;
+                else
+                    hi = mid - 1;
+            }
+
+            // Then walk the alive entities of that block
+            s32 entity_index = entity_mgr->m_entity_state.next_used_up(lo << 9);
+            for (u32 remaining = k - entity_mgr->m_a_rank[lo]; remaining > 0; --remaining)
+                entity_index = entity_mgr->m_entity_state.next_used_up(entity_index + 1);
+            return entity_index;
+        }
+
+        void g_rank_build(ecs_t* ecs) { s_rank_build(&ecs->m_entity_mgr, (ecs->m_entity_mgr.m_entity_state.size() + 511) >> 9); }
+
+        u32 g_rank(ecs_t* ecs, entity_t e) { return s_rank(&ecs->m_entity_mgr, s_entity_index(e)); }
+
+        entity_t g_select(ecs_t* ecs, u32 k)
+        {
+            s32 const entity_index = s_select(&ecs->m_entity_mgr, k);
+            return entity_index >= 0 ? s_entity_make(ecs->m_entity_mgr.m_a_entity_ver[entity_index], entity_index) : ECS_ENTITY_NULL;
+        }
+
+        s32 g_partition_begin(ecs_t* ecs, u32 part, u32 num_parts)
+        {
+            u32 const k            = (u32)(((u64)ecs->m_entity_mgr.m_num_alive * part) / num_parts);
+            s32 const entity_index = s_select(&ecs->m_entity_mgr, k);
+            return entity_index >= 0 ? entity_index : (s32)ecs->m_entity_mgr.m_entity_state.size();
+        }
+
+        entity_t g_sample(en_iterator_t const& query, u32 random)
+        {
+            entity_mgr_t* entity_mgr = &query.m_ecs->m_entity_mgr;
+            if (query.m_num_groups == 0 || entity_mgr->m_num_alive == 0)
+                return ECS_ENTITY_NULL;
+
+            // Pick uniformly among the alive entities and reject the ones that do not match the query
+            for (s32 attempt = 0; attempt < 16; ++attempt)
+            {
+                s32 const entity_index = s_select(entity_mgr, random % entity_mgr->m_num_alive);
+                if (s_entity_matches(query, entity_index))
+                    return s_entity_make(entity_mgr->m_a_entity_ver[entity_index], entity_index);
+                random = random * 1664525u + 1013904223u; // next value of a linear congruential generator
+            }
+
+            // Matches are rare, pick uniformly among the matching entities
+            u32 const count = g_count(query);
+            if (count == 0)
+                return ECS_ENTITY_NULL;
+            u32           k    = random % count;
+            en_iterator_t iter = query;
+            for (iter.begin(); k > 0; iter.next())
+                k--;
+            return iter.entity();
+        }
+
     } // namespace necs2
 } // namespace ncore
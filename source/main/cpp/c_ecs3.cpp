@@ -15,14 +15,763 @@ namespace ncore
         // type definitions and utility functions
         static inline entity_t s_entity_make(entity_generation_t genid, entity_index_t index) { return ((u32)genid << ECS_ENTITY_GEN_SHIFT) | (index & ECS_ENTITY_INDEX_MASK); }
 
+        // The distance between two components, the size padded to the alignment so that every component is aligned
+        static inline s32 s_component_stride(s32 cp_sizeof, s32 cp_alignof)
+        {
+            s32 const align = math::max(cp_alignof, (s32)1);
+            ASSERT(math::ispo2((u32)align) && align <= ECS3_MAX_ALIGNMENT);
+            return math::alignUp(cp_sizeof, (u32)align);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // shared component pools
+
+        // The unique values of a shared component, found by hash and reference counted by the entities that use them.
+        // A value index does not change while the value is referenced, a released index is reused by a new value.
+        struct shared_pool_t
+        {
+            u32   m_sizeof;      // size of a value
+            u32   m_stride;      // distance between two values
+            u32   m_max_values;  // maximum number of unique values
+            u32   m_count;       // number of values in use
+            u32   m_end;         // value indices are below this
+            u32   m_free_head;   // first released value index, linked through m_next
+            u32   m_bucket_mask; // number of buckets - 1
+            byte* m_values;      // value per index
+            u32*  m_refcounts;   // references per value, 0 = free
+            u32*  m_hashes;      // hash per value
+            u32*  m_next;        // next value in the same bucket, or the next free value
+            u32*  m_buckets;     // first value per bucket
+        };
+
+        static shared_pool_t* s_shared_create(alloc_t* allocator, u32 cp_sizeof, u32 cp_alignof, u32 max_values)
+        {
+            u32 num_buckets = 16;
+            while (num_buckets < max_values)
+                num_buckets <<= 1;
+
+            shared_pool_t* pool = g_construct<shared_pool_t>(allocator);
+            pool->m_sizeof      = cp_sizeof;
+            pool->m_stride      = (u32)s_component_stride((s32)cp_sizeof, (s32)cp_alignof);
+            pool->m_max_values  = max_values;
+            pool->m_count       = 0;
+            pool->m_end         = 0;
+            pool->m_free_head   = ECS3_SHARED_NONE;
+            pool->m_bucket_mask = num_buckets - 1;
+            pool->m_values      = (byte*)allocator->allocate(max_values * pool->m_stride, ECS3_MAX_ALIGNMENT);
+            pool->m_refcounts   = g_allocate_array<u32>(allocator, max_values);
+            pool->m_hashes      = g_allocate_array<u32>(allocator, max_values);
+            pool->m_next        = g_allocate_array<u32>(allocator, max_values);
+            pool->m_buckets     = g_allocate_array_and_memset<u32>(allocator, num_buckets, 0xFFFFFFFF);
+            return pool;
+        }
+
+        static void s_shared_destroy(alloc_t* allocator, shared_pool_t* pool)
+        {
+            g_deallocate_array(allocator, pool->m_buckets);
+            g_deallocate_array(allocator, pool->m_next);
+            g_deallocate_array(allocator, pool->m_hashes);
+            g_deallocate_array(allocator, pool->m_refcounts);
+            g_deallocate_array(allocator, pool->m_values);
+            g_deallocate(allocator, pool);
+        }
+
+        // FNV-1a
+        static inline u32 s_shared_hash(byte const* value, u32 size)
+        {
+            u32 hash = 2166136261u;
+            for (u32 i = 0; i < size; ++i)
+                hash = (hash ^ value[i]) * 16777619u;
+            return hash;
+        }
+
+        static inline bool s_shared_equal(byte const* a, byte const* b, u32 size)
+        {
+            for (u32 i = 0; i < size; ++i)
+            {
+                if (a[i] != b[i])
+                    return false;
+            }
+            return true;
+        }
+
+        static inline byte const* s_shared_value(shared_pool_t const* pool, u32 value_index)
+        {
+            if (value_index >= pool->m_end || pool->m_refcounts[value_index] == 0)
+                return nullptr;
+            return pool->m_values + (u64)value_index * pool->m_stride;
+        }
+
+        // Returns the index of the value with one more reference, ECS3_SHARED_NONE when the pool is full
+        static u32 s_shared_acquire(shared_pool_t* pool, void const* value)
+        {
+            byte const* bytes  = (byte const*)value;
+            u32 const   hash   = s_shared_hash(bytes, pool->m_sizeof);
+            u32&        bucket = pool->m_buckets[hash & pool->m_bucket_mask];
+            for (u32 i = bucket; i != ECS3_SHARED_NONE; i = pool->m_next[i])
+            {
+                if (pool->m_hashes[i] == hash && s_shared_equal(pool->m_values + (u64)i * pool->m_stride, bytes, pool->m_sizeof))
+                {
+                    pool->m_refcounts[i]++;
+                    return i;
+                }
+            }
+
+            u32 value_index;
+            if (pool->m_free_head != ECS3_SHARED_NONE)
+            {
+                value_index       = pool->m_free_head;
+                pool->m_free_head = pool->m_next[value_index];
+            }
+            else if (pool->m_end < pool->m_max_values)
+            {
+                value_index = pool->m_end++;
+            }
+            else
+            {
+                return ECS3_SHARED_NONE;
+            }
+
+            g_memcopy(pool->m_values + (u64)value_index * pool->m_stride, bytes, pool->m_sizeof);
+            pool->m_hashes[value_index]    = hash;
+            pool->m_refcounts[value_index] = 1;
+            pool->m_next[value_index]      = bucket;
+            bucket                         = value_index;
+            pool->m_count++;
+            return value_index;
+        }
+
+        static inline void s_shared_add_refs(shared_pool_t* pool, u32 value_index, u32 count)
+        {
+            if (value_index < pool->m_end)
+                pool->m_refcounts[value_index] += count;
+        }
+
+        // Drop a reference, the last reference returns the value index to the free list
+        static void s_shared_release(shared_pool_t* pool, u32 value_index)
+        {
+            if (value_index >= pool->m_end || pool->m_refcounts[value_index] == 0)
+                return;
+            if (--pool->m_refcounts[value_index] != 0)
+                return;
+
+            u32* link = &pool->m_buckets[pool->m_hashes[value_index] & pool->m_bucket_mask];
+            while (*link != value_index)
+                link = &pool->m_next[*link];
+            *link                     = pool->m_next[value_index];
+            pool->m_next[value_index] = pool->m_free_head;
+            pool->m_free_head         = value_index;
+            pool->m_count--;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // compressed component storage
+
+        // Encode a block of 64 values, the values are split into byte planes (byte 0 of every value, then byte 1, ...)
+        // and every plane is delta coded, similar values turn into runs of zero bytes. A token below 0x80 is followed by
+        // (token + 1) literal bytes, a token of 0x80 or above is a run of (token - 0x7F) zero bytes. The zero bytes at the
+        // end are not stored. A block that does not get smaller is stored as is. Returns the encoded size, at most the
+        // size of the values.
+        static u32 s_block_encode(byte const* values, u32 value_sizeof, byte* out)
+        {
+            u32 const raw_size = value_sizeof * ECS3_COMPRESSED_BLOCK_SIZE;
+            u32       size     = 0;
+            u32       zeros    = 0;
+            u32       literal  = 0xFFFFFFFF; // position of the token of the open literal run
+            for (u32 p = 0; p < value_sizeof; ++p)
+            {
+                byte previous = 0;
+                for (u32 i = 0; i < ECS3_COMPRESSED_BLOCK_SIZE; ++i)
+                {
+                    if (size + 3 >= raw_size)
+                    {
+                        g_memcopy(out, values, raw_size);
+                        return raw_size;
+                    }
+                    byte const b     = values[i * value_sizeof + p];
+                    byte const delta = (byte)(b - previous);
+                    previous         = b;
+                    if (delta == 0)
+                    {
+                        literal = 0xFFFFFFFF;
+                        if (++zeros == 128)
+                        {
+                            out[size++] = 0xFF;
+                            zeros       = 0;
+                        }
+                        continue;
+                    }
+                    if (zeros > 0)
+                    {
+                        out[size++] = (byte)(0x7F + zeros);
+                        zeros       = 0;
+                    }
+                    if (literal == 0xFFFFFFFF || out[literal] == 0x7F)
+                    {
+                        literal     = size;
+                        out[size++] = 0;
+                    }
+                    else
+                    {
+                        out[literal]++;
+                    }
+                    out[size++] = delta;
+                }
+            }
+            return size;
+        }
+
+        static void s_block_decode(byte const* in, u32 in_size, u32 value_sizeof, byte* values)
+        {
+            if (in_size == value_sizeof * ECS3_COMPRESSED_BLOCK_SIZE)
+            {
+                g_memcopy(values, in, in_size);
+                return;
+            }
+            g_memclr(values, (int_t)value_sizeof * ECS3_COMPRESSED_BLOCK_SIZE);
+            u32 k   = 0; // position in the planes
+            u32 pos = 0;
+            while (pos < in_size)
+            {
+                byte const token = in[pos++];
+                if (token >= 0x80)
+                {
+                    k += token - 0x7F;
+                    continue;
+                }
+                for (u32 n = (u32)token + 1; n > 0; --n, ++k)
+                    values[(k & (ECS3_COMPRESSED_BLOCK_SIZE - 1)) * value_sizeof + (k >> 6)] = in[pos++];
+            }
+            for (u32 p = 0; p < value_sizeof; ++p)
+            {
+                for (u32 i = 1; i < ECS3_COMPRESSED_BLOCK_SIZE; ++i)
+                    values[i * value_sizeof + p] += values[(i - 1) * value_sizeof + p];
+            }
+        }
+
+        // A decoded block in the cache
+        struct compressed_line_t
+        {
+            u32   m_block;  // block index, 0xFFFFFFFF when the line is not in use
+            u32   m_stamp;  // last use, the line with the oldest stamp is evicted first
+            bool  m_dirty;  // the values changed after the block was decoded
+            byte* m_values; // decoded values of the block
+        };
+
+        // The values of a compressed component, in blocks of 64 slots. A block that has never been written or that is all
+        // zero has no encoded bytes.
+        struct compressed_store_t
+        {
+            u32               m_sizeof;           // size of a value
+            u32               m_max_blocks;       // number of blocks
+            u32               m_stamp;            // cache use counter
+            u64               m_compressed_bytes; // sum of the encoded block sizes
+            byte**            m_block_data;       // encoded bytes per block
+            u32*              m_block_size;       // encoded size per block
+            byte*             m_encoded;          // encode buffer, the size of the values of a block
+            byte*             m_value;            // a single value, for copies that touch more than one block
+            compressed_line_t m_lines[ECS3_COMPRESSED_CACHE_BLOCKS];
+        };
+
+        static compressed_store_t* s_compressed_create(alloc_t* allocator, u32 cp_sizeof, u32 max_components)
+        {
+            compressed_store_t* store = g_construct<compressed_store_t>(allocator);
+            store->m_sizeof           = cp_sizeof;
+            store->m_max_blocks       = (max_components + ECS3_COMPRESSED_BLOCK_SIZE - 1) / ECS3_COMPRESSED_BLOCK_SIZE;
+            store->m_stamp            = 0;
+            store->m_compressed_bytes = 0;
+            store->m_block_data       = g_allocate_array_and_memset<byte*>(allocator, store->m_max_blocks, 0);
+            store->m_block_size       = g_allocate_array_and_memset<u32>(allocator, store->m_max_blocks, 0);
+            store->m_encoded          = g_allocate_array<byte>(allocator, cp_sizeof * ECS3_COMPRESSED_BLOCK_SIZE);
+            store->m_value            = (byte*)allocator->allocate(cp_sizeof, ECS3_MAX_ALIGNMENT);
+            for (u32 i = 0; i < ECS3_COMPRESSED_CACHE_BLOCKS; ++i)
+            {
+                store->m_lines[i].m_block  = 0xFFFFFFFF;
+                store->m_lines[i].m_stamp  = 0;
+                store->m_lines[i].m_dirty  = false;
+                store->m_lines[i].m_values = (byte*)allocator->allocate(cp_sizeof * ECS3_COMPRESSED_BLOCK_SIZE, ECS3_MAX_ALIGNMENT);
+            }
+            return store;
+        }
+
+        static void s_compressed_destroy(alloc_t* allocator, compressed_store_t* store)
+        {
+            for (u32 b = 0; b < store->m_max_blocks; ++b)
+                g_deallocate_array(allocator, store->m_block_data[b]);
+            for (u32 i = 0; i < ECS3_COMPRESSED_CACHE_BLOCKS; ++i)
+                g_deallocate_array(allocator, store->m_lines[i].m_values);
+            g_deallocate_array(allocator, store->m_value);
+            g_deallocate_array(allocator, store->m_encoded);
+            g_deallocate_array(allocator, store->m_block_size);
+            g_deallocate_array(allocator, store->m_block_data);
+            g_deallocate(allocator, store);
+        }
+
+        // Encode a changed block back into its own allocation
+        static void s_compressed_write_back(alloc_t* allocator, compressed_store_t* store, compressed_line_t* line)
+        {
+            if (!line->m_dirty)
+                return;
+            line->m_dirty   = false;
+            u32 const block = line->m_block;
+            u32 const size  = s_block_encode(line->m_values, store->m_sizeof, store->m_encoded);
+            if (size != store->m_block_size[block])
+            {
+                g_deallocate_array(allocator, store->m_block_data[block]);
+                store->m_block_data[block] = size > 0 ? g_allocate_array<byte>(allocator, size) : nullptr;
+                store->m_compressed_bytes  = store->m_compressed_bytes - store->m_block_size[block] + size;
+                store->m_block_size[block] = size;
+            }
+            if (size > 0)
+                g_memcopy(store->m_block_data[block], store->m_encoded, size);
+        }
+
+        // The value in a slot, the block of the slot is decoded into the cache when it is not there yet
+        static byte* s_compressed_access(alloc_t* allocator, compressed_store_t* store, u32 slot, bool write)
+        {
+            u32 const          block = slot / ECS3_COMPRESSED_BLOCK_SIZE;
+            compressed_line_t* line  = &store->m_lines[0];
+            for (u32 i = 0; i < ECS3_COMPRESSED_CACHE_BLOCKS; ++i)
+            {
+                compressed_line_t* candidate = &store->m_lines[i];
+                if (candidate->m_block == block)
+                {
+                    line = candidate;
+                    break;
+                }
+                if (candidate->m_stamp < line->m_stamp)
+                    line = candidate;
+            }
+            if (line->m_block != block)
+            {
+                if (line->m_block != 0xFFFFFFFF)
+                    s_compressed_write_back(allocator, store, line);
+                s_block_decode(store->m_block_data[block], store->m_block_size[block], store->m_sizeof, line->m_values);
+                line->m_block = block;
+            }
+            line->m_stamp = ++store->m_stamp;
+            line->m_dirty = line->m_dirty || write;
+            return line->m_values + (slot % ECS3_COMPRESSED_BLOCK_SIZE) * store->m_sizeof;
+        }
+
+        // The slots of a block are no longer in use, drop its encoded bytes and its cache line
+        static void s_compressed_release_block(alloc_t* allocator, compressed_store_t* store, u32 block)
+        {
+            for (u32 i = 0; i < ECS3_COMPRESSED_CACHE_BLOCKS; ++i)
+            {
+                if (store->m_lines[i].m_block == block)
+                {
+                    store->m_lines[i].m_block = 0xFFFFFFFF;
+                    store->m_lines[i].m_stamp = 0;
+                    store->m_lines[i].m_dirty = false;
+                }
+            }
+            g_deallocate_array(allocator, store->m_block_data[block]);
+            store->m_compressed_bytes -= store->m_block_size[block];
+            store->m_block_data[block] = nullptr;
+            store->m_block_size[block] = 0;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // split (SoA) component storage
+
+        // The fields of a split component, field f of slot i is at columns + f * column_stride + i * field_sizeof. The
+        // fields of one slot can be gathered into the staging copy, it is scattered back when another slot is staged or
+        // when the columns are used directly.
+        struct soa_store_t
+        {
+            u32   m_num_fields;    // number of fields (columns)
+            u32   m_field_sizeof;  // size of a field
+            u32   m_column_stride; // distance between two columns, a multiple of 64
+            u32   m_staged_slot;   // slot that is in the staging copy, 0xFFFFFFFF when there is none
+            byte* m_columns;       // the columns, 64 byte aligned
+            byte* m_staged;        // staging copy of a component
+            byte* m_value;         // a single component, for copies that touch more than one slot
+        };
+
+        static soa_store_t* s_soa_create(alloc_t* allocator, u32 cp_sizeof, u32 field_sizeof, u32 max_components)
+        {
+            soa_store_t* store     = g_construct<soa_store_t>(allocator);
+            store->m_num_fields    = cp_sizeof / field_sizeof;
+            store->m_field_sizeof  = field_sizeof;
+            store->m_column_stride = math::alignUp(max_components * field_sizeof, (u32)64);
+            store->m_staged_slot   = 0xFFFFFFFF;
+            store->m_columns       = (byte*)allocator->allocate(store->m_num_fields * store->m_column_stride, 64);
+            store->m_staged        = (byte*)allocator->allocate(cp_sizeof, ECS3_MAX_ALIGNMENT);
+            store->m_value         = (byte*)allocator->allocate(cp_sizeof, ECS3_MAX_ALIGNMENT);
+            return store;
+        }
+
+        static void s_soa_destroy(alloc_t* allocator, soa_store_t* store)
+        {
+            allocator->deallocate(store->m_columns);
+            g_deallocate_array(allocator, store->m_staged);
+            g_deallocate_array(allocator, store->m_value);
+            g_deallocate(allocator, store);
+        }
+
+        static void s_soa_gather(soa_store_t const* store, u32 slot, byte* out)
+        {
+            byte const* field = store->m_columns + slot * store->m_field_sizeof;
+            for (u32 f = 0; f < store->m_num_fields; ++f, field += store->m_column_stride, out += store->m_field_sizeof)
+                g_memcopy(out, field, store->m_field_sizeof);
+        }
+
+        static void s_soa_scatter(soa_store_t* store, u32 slot, byte const* in)
+        {
+            byte* field = store->m_columns + slot * store->m_field_sizeof;
+            for (u32 f = 0; f < store->m_num_fields; ++f, field += store->m_column_stride, in += store->m_field_sizeof)
+                g_memcopy(field, in, store->m_field_sizeof);
+        }
+
+        // Write back the staging copy
+        static void s_soa_flush(soa_store_t* store)
+        {
+            if (store->m_staged_slot != 0xFFFFFFFF)
+                s_soa_scatter(store, store->m_staged_slot, store->m_staged);
+            store->m_staged_slot = 0xFFFFFFFF;
+        }
+
+        // The component in a slot, gathered into the staging copy
+        static byte* s_soa_stage(soa_store_t* store, u32 slot)
+        {
+            if (store->m_staged_slot != slot)
+            {
+                s_soa_flush(store);
+                s_soa_gather(store, slot, store->m_staged);
+                store->m_staged_slot = slot;
+            }
+            return store->m_staged;
+        }
+
+        // Copy every field of a slot to another slot
+        static void s_soa_move(soa_store_t* store, u32 dst_slot, u32 src_slot)
+        {
+            byte* column = store->m_columns;
+            for (u32 f = 0; f < store->m_num_fields; ++f, column += store->m_column_stride)
+                g_memcopy(column + dst_slot * store->m_field_sizeof, column + src_slot * store->m_field_sizeof, store->m_field_sizeof);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // hierarchy links
+
+        // The parent/child links of the hierarchy, by entity index. The children of a parent are a doubly linked list, the
+        // roots (entities with children but without a parent) are linked the same way. The links are used for the changes,
+        // the flattened order (rebuilt when the hierarchy has changed) is used for the propagation.
+        struct hierarchy_t
+        {
+            u32       m_first_root;   // first root, linked through m_next_sibling
+            u32       m_num_levels;   // number of levels in the flattened order
+            bool      m_dirty;        // the flattened order needs to be rebuilt
+            u32*      m_parent;       // per entity, the parent or 0xFFFFFFFF
+            u32*      m_first_child;  // per entity, the first child or 0xFFFFFFFF
+            u32*      m_next_sibling; // per entity, the next child of the parent (or the next root)
+            u32*      m_prev_sibling; // per entity, the previous child of the parent (or the previous root)
+            u8*       m_depth;        // per entity, the depth in the hierarchy
+            u32*      m_position;     // per entity, the position in the flattened order
+            entity_t* m_order;        // the flattened order, level by level
+            u32*      m_order_parent; // per position, the position of the parent
+            u32       m_level_begin[ECS3_HIERARCHY_MAX_DEPTH + 1];
+        };
+
+        static hierarchy_t* s_hierarchy_create(alloc_t* allocator, u32 max_entities)
+        {
+            hierarchy_t* h    = g_construct<hierarchy_t>(allocator);
+            h->m_first_root   = 0xFFFFFFFF;
+            h->m_num_levels   = 0;
+            h->m_dirty        = false;
+            h->m_parent       = g_allocate_array_and_memset<u32>(allocator, max_entities, 0xFFFFFFFF);
+            h->m_first_child  = g_allocate_array_and_memset<u32>(allocator, max_entities, 0xFFFFFFFF);
+            h->m_next_sibling = g_allocate_array_and_memset<u32>(allocator, max_entities, 0xFFFFFFFF);
+            h->m_prev_sibling = g_allocate_array_and_memset<u32>(allocator, max_entities, 0xFFFFFFFF);
+            h->m_depth        = g_allocate_array_and_memset<u8>(allocator, max_entities, 0);
+            h->m_position     = g_allocate_array_and_memset<u32>(allocator, max_entities, 0xFFFFFFFF);
+            h->m_order        = g_allocate_array<entity_t>(allocator, max_entities);
+            h->m_order_parent = g_allocate_array<u32>(allocator, max_entities);
+            for (u32 i = 0; i <= ECS3_HIERARCHY_MAX_DEPTH; ++i)
+                h->m_level_begin[i] = 0;
+            return h;
+        }
+
+        static void s_hierarchy_destroy(alloc_t* allocator, hierarchy_t* h)
+        {
+            g_deallocate_array(allocator, h->m_order_parent);
+            g_deallocate_array(allocator, h->m_order);
+            g_deallocate_array(allocator, h->m_position);
+            g_deallocate_array(allocator, h->m_depth);
+            g_deallocate_array(allocator, h->m_prev_sibling);
+            g_deallocate_array(allocator, h->m_next_sibling);
+            g_deallocate_array(allocator, h->m_first_child);
+            g_deallocate_array(allocator, h->m_parent);
+            g_deallocate(allocator, h);
+        }
+
+        static inline bool s_hierarchy_member(hierarchy_t const* h, u32 e) { return h->m_parent[e] != 0xFFFFFFFF || h->m_first_child[e] != 0xFFFFFFFF; }
+
+        // Link 'e' at the front of the children of 'parent', or of the roots when 'parent' is 0xFFFFFFFF
+        static void s_hierarchy_link(hierarchy_t* h, u32 e, u32 parent)
+        {
+            u32& head            = parent != 0xFFFFFFFF ? h->m_first_child[parent] : h->m_first_root;
+            h->m_prev_sibling[e] = 0xFFFFFFFF;
+            h->m_next_sibling[e] = head;
+            if (head != 0xFFFFFFFF)
+                h->m_prev_sibling[head] = e;
+            head = e;
+        }
+
+        static void s_hierarchy_unlink(hierarchy_t* h, u32 e)
+        {
+            u32 const prev = h->m_prev_sibling[e];
+            u32 const next = h->m_next_sibling[e];
+            if (prev != 0xFFFFFFFF)
+                h->m_next_sibling[prev] = next;
+            else if (h->m_parent[e] != 0xFFFFFFFF)
+                h->m_first_child[h->m_parent[e]] = next;
+            else
+                h->m_first_root = next;
+            if (next != 0xFFFFFFFF)
+                h->m_prev_sibling[next] = prev;
+            h->m_prev_sibling[e] = 0xFFFFFFFF;
+            h->m_next_sibling[e] = 0xFFFFFFFF;
+        }
+
+        // Set the depth of 'root' and of all its descendants, a pre-order walk over the links without a stack
+        static void s_hierarchy_set_depth(hierarchy_t* h, u32 root, u32 depth)
+        {
+            ASSERT(depth < ECS3_HIERARCHY_MAX_DEPTH);
+            h->m_depth[root] = (u8)depth;
+            u32 e            = root;
+            while (true)
+            {
+                if (h->m_first_child[e] != 0xFFFFFFFF)
+                {
+                    e = h->m_first_child[e];
+                }
+                else
+                {
+                    while (e != root && h->m_next_sibling[e] == 0xFFFFFFFF)
+                        e = h->m_parent[e];
+                    if (e == root)
+                        break;
+                    e = h->m_next_sibling[e];
+                }
+                ASSERT((u32)h->m_depth[h->m_parent[e]] + 1 < ECS3_HIERARCHY_MAX_DEPTH);
+                h->m_depth[e] = h->m_depth[h->m_parent[e]] + 1;
+            }
+        }
+
+        // The number of levels below 'root', 0 when it has no children
+        static u32 s_hierarchy_height(hierarchy_t const* h, u32 root)
+        {
+            u32 max_depth = h->m_depth[root];
+            u32 e         = root;
+            while (true)
+            {
+                if (h->m_first_child[e] != 0xFFFFFFFF)
+                {
+                    e = h->m_first_child[e];
+                }
+                else
+                {
+                    while (e != root && h->m_next_sibling[e] == 0xFFFFFFFF)
+                        e = h->m_parent[e];
+                    if (e == root)
+                        break;
+                    e = h->m_next_sibling[e];
+                }
+                max_depth = math::max(max_depth, (u32)h->m_depth[e]);
+            }
+            return max_depth - h->m_depth[root];
+        }
+
+        // Remove 'e' from the children of its parent, a parent without a parent and without children leaves the hierarchy
+        // and 'e' becomes a root when it has children
+        static void s_hierarchy_detach(hierarchy_t* h, u32 e)
+        {
+            u32 const parent = h->m_parent[e];
+            if (parent == 0xFFFFFFFF)
+                return;
+            s_hierarchy_unlink(h, e);
+            h->m_parent[e] = 0xFFFFFFFF;
+            if (h->m_first_child[parent] == 0xFFFFFFFF && h->m_parent[parent] == 0xFFFFFFFF)
+                s_hierarchy_unlink(h, parent);
+            if (h->m_first_child[e] != 0xFFFFFFFF)
+                s_hierarchy_link(h, e, 0xFFFFFFFF);
+            s_hierarchy_set_depth(h, e, 0);
+            h->m_dirty = true;
+        }
+
+        // Make 'e' (which has no parent) a child of 'parent'
+        static void s_hierarchy_attach(hierarchy_t* h, u32 e, u32 parent)
+        {
+            if (h->m_first_child[e] != 0xFFFFFFFF)
+                s_hierarchy_unlink(h, e); // no longer a root
+            if (!s_hierarchy_member(h, parent))
+                s_hierarchy_link(h, parent, 0xFFFFFFFF); // a new root
+            h->m_parent[e] = parent;
+            s_hierarchy_link(h, e, parent);
+            s_hierarchy_set_depth(h, e, h->m_depth[parent] + 1);
+            h->m_dirty = true;
+        }
+
+        // Take an entity that is destroyed out of the hierarchy, its children are detached
+        static void s_hierarchy_remove(hierarchy_t* h, u32 e)
+        {
+            while (h->m_first_child[e] != 0xFFFFFFFF)
+                s_hierarchy_detach(h, h->m_first_child[e]);
+            s_hierarchy_detach(h, e);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // relation pairs
+
+        // The pairs of a relation, every pair is in the forward list of its entity and in the reverse list of its target
+        struct relation_t
+        {
+            u32  m_max_pairs; // maximum number of pairs
+            u32  m_count;     // number of pairs in use
+            u32  m_end;       // pair indices are below this
+            u32  m_free_head; // first released pair, linked through m_next_out
+            u32* m_source;    // per pair, the entity
+            u32* m_target;    // per pair, the target
+            u32* m_next_out;  // per pair, the next pair of the same entity
+            u32* m_prev_out;  // per pair, the previous pair of the same entity
+            u32* m_next_in;   // per pair, the next pair with the same target
+            u32* m_prev_in;   // per pair, the previous pair with the same target
+            u32* m_first_out; // per entity, its first pair
+            u32* m_first_in;  // per entity, the first pair that targets it
+        };
+
+        static relation_t* s_relation_create(alloc_t* allocator, u32 max_pairs, u32 max_entities)
+        {
+            relation_t* rl  = g_construct<relation_t>(allocator);
+            rl->m_max_pairs = max_pairs;
+            rl->m_count     = 0;
+            rl->m_end       = 0;
+            rl->m_free_head = 0xFFFFFFFF;
+            rl->m_source    = g_allocate_array<u32>(allocator, max_pairs);
+            rl->m_target    = g_allocate_array<u32>(allocator, max_pairs);
+            rl->m_next_out  = g_allocate_array<u32>(allocator, max_pairs);
+            rl->m_prev_out  = g_allocate_array<u32>(allocator, max_pairs);
+            rl->m_next_in   = g_allocate_array<u32>(allocator, max_pairs);
+            rl->m_prev_in   = g_allocate_array<u32>(allocator, max_pairs);
+            rl->m_first_out = g_allocate_array_and_memset<u32>(allocator, max_entities, 0xFFFFFFFF);
+            rl->m_first_in  = g_allocate_array_and_memset<u32>(allocator, max_entities, 0xFFFFFFFF);
+            return rl;
+        }
+
+        static void s_relation_destroy(alloc_t* allocator, relation_t* rl)
+        {
+            g_deallocate_array(allocator, rl->m_first_in);
+            g_deallocate_array(allocator, rl->m_first_out);
+            g_deallocate_array(allocator, rl->m_prev_in);
+            g_deallocate_array(allocator, rl->m_next_in);
+            g_deallocate_array(allocator, rl->m_prev_out);
+            g_deallocate_array(allocator, rl->m_next_out);
+            g_deallocate_array(allocator, rl->m_target);
+            g_deallocate_array(allocator, rl->m_source);
+            g_deallocate(allocator, rl);
+        }
+
+        // The pair of 'source' with 'target', 0xFFFFFFFF when there is none
+        static u32 s_relation_find(relation_t const* rl, u32 source, u32 target)
+        {
+            for (u32 p = rl->m_first_out[source]; p != 0xFFFFFFFF; p = rl->m_next_out[p])
+            {
+                if (rl->m_target[p] == target)
+                    return p;
+            }
+            return 0xFFFFFFFF;
+        }
+
+        // Returns false when the relation is full
+        static bool s_relation_add(relation_t* rl, u32 source, u32 target)
+        {
+            if (s_relation_find(rl, source, target) != 0xFFFFFFFF)
+                return true;
+
+            u32 p;
+            if (rl->m_free_head != 0xFFFFFFFF)
+            {
+                p               = rl->m_free_head;
+                rl->m_free_head = rl->m_next_out[p];
+            }
+            else if (rl->m_end < rl->m_max_pairs)
+            {
+                p = rl->m_end++;
+            }
+            else
+            {
+                return false;
+            }
+
+            rl->m_source[p]   = source;
+            rl->m_target[p]   = target;
+            rl->m_prev_out[p] = 0xFFFFFFFF;
+            rl->m_next_out[p] = rl->m_first_out[source];
+            if (rl->m_next_out[p] != 0xFFFFFFFF)
+                rl->m_prev_out[rl->m_next_out[p]] = p;
+            rl->m_first_out[source] = p;
+            rl->m_prev_in[p]        = 0xFFFFFFFF;
+            rl->m_next_in[p]        = rl->m_first_in[target];
+            if (rl->m_next_in[p] != 0xFFFFFFFF)
+                rl->m_prev_in[rl->m_next_in[p]] = p;
+            rl->m_first_in[target] = p;
+            rl->m_count++;
+            return true;
+        }
+
+        static void s_relation_remove(relation_t* rl, u32 p)
+        {
+            if (rl->m_prev_out[p] != 0xFFFFFFFF)
+                rl->m_next_out[rl->m_prev_out[p]] = rl->m_next_out[p];
+            else
+                rl->m_first_out[rl->m_source[p]] = rl->m_next_out[p];
+            if (rl->m_next_out[p] != 0xFFFFFFFF)
+                rl->m_prev_out[rl->m_next_out[p]] = rl->m_prev_out[p];
+
+            if (rl->m_prev_in[p] != 0xFFFFFFFF)
+                rl->m_next_in[rl->m_prev_in[p]] = rl->m_next_in[p];
+            else
+                rl->m_first_in[rl->m_target[p]] = rl->m_next_in[p];
+            if (rl->m_next_in[p] != 0xFFFFFFFF)
+                rl->m_prev_in[rl->m_next_in[p]] = rl->m_prev_in[p];
+
+            rl->m_next_out[p] = rl->m_free_head;
+            rl->m_free_head   = p;
+            rl->m_count--;
+        }
+
+        // Remove the pairs of an entity that is destroyed and the pairs that target it
+        static void s_relation_remove_entity(relation_t* rl, u32 e)
+        {
+            while (rl->m_first_out[e] != 0xFFFFFFFF)
+                s_relation_remove(rl, rl->m_first_out[e]);
+            while (rl->m_first_in[e] != 0xFFFFFFFF)
+                s_relation_remove(rl, rl->m_first_in[e]);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // ecs
+
         struct component_container_t
         {
-            u32         m_free_index;
-            u32         m_sizeof_component;
-            byte*       m_component_data;
-            u32*        m_global_to_local;
-            u32*        m_local_to_global;
-            const char* m_name;
+            u32                 m_free_index;
+            u32                 m_max_components;
+            u32                 m_sizeof_component;
+            byte*               m_component_data;
+            u32*                m_global_to_local;
+            u32*                m_local_to_global;
+            shared_pool_t*      m_shared;     // value pool of a shared component, the component data holds the (u32) value indices
+            compressed_store_t* m_compressed; // encoded blocks of a compressed component, there is no component data
+            soa_store_t*        m_soa;        // columns of a split component, there is no component data
+            const char*         m_name;
         };
 
         struct ecs_t
@@ -33,227 +782,2049 @@ namespace ncore
             u32                    m_max_component_types;
             u32                    m_component_words_per_entity;
             u32                    m_tag_words_per_entity;
+            u32                    m_num_alive;
             byte*                  m_per_entity_generation;
             u32*                   m_per_entity_component_occupancy;
             u32*                   m_per_entity_tags;
             component_container_t* m_component_containers;
             duomap_t               m_entity_state;
+            duomap_t               m_awake_state;  // '1' = alive and awake entity, initialized when the first entity is put to sleep
+            u32                    m_num_sleeping; // number of alive entities that are asleep
+            void*                  m_singletons[ECS3_MAX_SINGLETONS];
+            hierarchy_t*           m_hierarchy; // parent/child links, created by the first g_set_parent
+            relation_t*            m_relations[ECS3_MAX_RELATIONS];
         };
 
-        static void s_teardown(alloc_t* allocator, component_container_t* container)
+        static inline bool s_is_alive(ecs_t* ecs, u32 entity_index) { return entity_index < ecs->m_max_entities && ecs->m_entity_state.next_used_up(entity_index) == (s32)entity_index; }
+        static inline bool s_is_alive_entity(ecs_t* ecs, entity_t e) { return s_is_alive(ecs, g_entity_index(e)) && ecs->m_per_entity_generation[g_entity_index(e)] == g_entity_generation(e); }
+        static inline bool s_is_awake(ecs_t* ecs, u32 entity_index) { return ecs->m_num_sleeping == 0 || ecs->m_awake_state.next_used_up(entity_index) == (s32)entity_index; }
+
+        // The entity state to scan, the awake entities when some entities sleep and they are not included
+        static inline duomap_t* s_scan_state(ecs_t* ecs, bool include_sleeping) { return (include_sleeping || ecs->m_num_sleeping == 0) ? &ecs->m_entity_state : &ecs->m_awake_state; }
+
+        // The component in a slot of a container, a compressed container decodes the block of the slot into its cache and
+        // a split container gathers the fields of the slot into its staging copy
+        static inline byte* s_component_at(ecs_t* ecs, component_container_t* container, u32 local_index, bool write)
+        {
+            if (container->m_compressed != nullptr)
+                return s_compressed_access(ecs->m_allocator, container->m_compressed, local_index, write);
+            if (container->m_soa != nullptr)
+                return s_soa_stage(container->m_soa, local_index);
+            return &container->m_component_data[local_index * container->m_sizeof_component];
+        }
+
+        static void s_teardown(alloc_t* allocator, component_container_t* container)
+        {
+            g_deallocate_array(allocator, container->m_component_data);
+            g_deallocate_array(allocator, container->m_global_to_local);
+            g_deallocate_array(allocator, container->m_local_to_global);
+            if (container->m_shared != nullptr)
+                s_shared_destroy(allocator, container->m_shared);
+            if (container->m_compressed != nullptr)
+                s_compressed_destroy(allocator, container->m_compressed);
+            if (container->m_soa != nullptr)
+                s_soa_destroy(allocator, container->m_soa);
+            container->m_shared           = nullptr;
+            container->m_compressed       = nullptr;
+            container->m_soa              = nullptr;
+            container->m_free_index       = 0;
+            container->m_max_components   = 0;
+            container->m_sizeof_component = 0;
+            container->m_name             = "";
+        }
+
+        ecs_t* g_create_ecs(alloc_t* allocator, u32 max_entities, u32 max_component_types, u32 max_tags)
+        {
+            ecs_t* ecs = g_construct<ecs_t>(allocator);
+
+            ecs->m_allocator                  = allocator;
+            ecs->m_max_entities               = max_entities;
+            ecs->m_max_component_types        = max_component_types;
+            ecs->m_component_words_per_entity = (max_component_types + 31) >> 5;
+            ecs->m_tag_words_per_entity       = (max_tags + 31) >> 5;
+            ecs->m_num_alive                  = 0;
+
+            ecs->m_per_entity_generation          = g_allocate_array_and_memset<byte>(allocator, max_entities, 0);
+            ecs->m_per_entity_component_occupancy = g_allocate_array_and_memset<u32>(allocator, max_entities * ecs->m_component_words_per_entity, 0);
+            ecs->m_per_entity_tags                = g_allocate_array_and_memset<u32>(allocator, max_entities * ecs->m_tag_words_per_entity, 0);
+
+            ecs->m_component_containers = g_allocate_array_and_memset<component_container_t>(allocator, max_component_types, 0);
+
+            duomap_t::config_t cfg = duomap_t::config_t::compute(max_entities);
+            ecs->m_entity_state.init_all_free(cfg, allocator);
+            ecs->m_num_sleeping = 0;
+
+            for (u32 i = 0; i < ECS3_MAX_SINGLETONS; ++i)
+                ecs->m_singletons[i] = nullptr;
+            ecs->m_hierarchy = nullptr;
+            for (u32 i = 0; i < ECS3_MAX_RELATIONS; ++i)
+                ecs->m_relations[i] = nullptr;
+
+            return ecs;
+        }
+
+        void g_destroy_ecs(ecs_t* ecs)
+        {
+            alloc_t* allocator = ecs->m_allocator;
+
+            for (u32 i = 0; i < ecs->m_max_component_types; ++i)
+            {
+                component_container_t* container = &ecs->m_component_containers[i];
+                if (container->m_sizeof_component > 0)
+                    s_teardown(allocator, container);
+            }
+
+            g_deallocate_array(allocator, ecs->m_component_containers);
+            g_deallocate_array(allocator, ecs->m_per_entity_tags);
+            g_deallocate_array(allocator, ecs->m_per_entity_component_occupancy);
+            g_deallocate_array(allocator, ecs->m_per_entity_generation);
+
+            ecs->m_entity_state.release(allocator);
+            if (ecs->m_awake_state.size() != 0)
+                ecs->m_awake_state.release(allocator);
+
+            for (u32 i = 0; i < ECS3_MAX_SINGLETONS; ++i)
+            {
+                if (ecs->m_singletons[i] != nullptr)
+                    allocator->deallocate(ecs->m_singletons[i]);
+            }
+            if (ecs->m_hierarchy != nullptr)
+                s_hierarchy_destroy(allocator, ecs->m_hierarchy);
+            for (u32 i = 0; i < ECS3_MAX_RELATIONS; ++i)
+            {
+                if (ecs->m_relations[i] != nullptr)
+                    s_relation_destroy(allocator, ecs->m_relations[i]);
+            }
+
+            g_deallocate(allocator, ecs);
+        }
+
+        entity_t g_create_entity(ecs_t* ecs)
+        {
+            s32 const index = ecs->m_entity_state.find_free_and_set_used();
+            if (index >= 0)
+            {
+                // Clear the component occupancy
+                u32 const offset = index * ecs->m_component_words_per_entity;
+                for (u32 i = 0; i < ecs->m_component_words_per_entity; ++i)
+                    ecs->m_per_entity_component_occupancy[offset + i] = 0;
+
+                // Clear the tag occupancy
+                u32 const tag_offset = index * ecs->m_tag_words_per_entity;
+                for (u32 i = 0; i < ecs->m_tag_words_per_entity; ++i)
+                    ecs->m_per_entity_tags[tag_offset + i] = 0;
+
+                ecs->m_per_entity_generation[index] = 0;
+                if (ecs->m_awake_state.size() != 0)
+                    ecs->m_awake_state.set_used(index);
+                ecs->m_num_alive++;
+                return s_entity_make(0, index);
+            }
+            return ECS_ENTITY_NULL;
+        }
+
+        // Copy 'size' bytes of 'src' to 'n' consecutive elements at 'dst', after the first element the copies double in size
+        static void s_fill_copies(byte* dst, byte const* src, u32 size, u32 n)
+        {
+            g_memcopy(dst, src, size);
+            u32 copied = 1;
+            while (copied < n)
+            {
+                u32 const chunk = math::min(copied, n - copied);
+                g_memcopy(dst + copied * size, dst, (int_t)chunk * size);
+                copied += chunk;
+            }
+        }
+
+        u32 g_instantiate(ecs_t* ecs, entity_t prefab, entity_t* out, u32 count)
+        {
+            u32 const  prefab_index        = g_entity_index(prefab);
+            u32 const* component_occupancy = &ecs->m_per_entity_component_occupancy[prefab_index * ecs->m_component_words_per_entity];
+            u32 const* tag_occupancy       = &ecs->m_per_entity_tags[prefab_index * ecs->m_tag_words_per_entity];
+
+            // Every container of the prefab has to have room for the components of the instances
+            for (u32 w = 0; w < ecs->m_component_words_per_entity; ++w)
+            {
+                for (u32 occupancy = component_occupancy[w]; occupancy != 0; occupancy &= occupancy - 1)
+                {
+                    component_container_t const* container = &ecs->m_component_containers[(w << 5) + math::findFirstBit(occupancy)];
+                    count                                  = math::min(count, container->m_max_components - container->m_free_index);
+                }
+            }
+
+            // Create the instances, the component and tag occupancy are copied from the prefab
+            u32 n = 0;
+            for (; n < count; ++n)
+            {
+                s32 const index = ecs->m_entity_state.find_free_and_set_used();
+                if (index < 0)
+                    break;
+                for (u32 i = 0; i < ecs->m_component_words_per_entity; ++i)
+                    ecs->m_per_entity_component_occupancy[index * ecs->m_component_words_per_entity + i] = component_occupancy[i];
+                for (u32 i = 0; i < ecs->m_tag_words_per_entity; ++i)
+                    ecs->m_per_entity_tags[index * ecs->m_tag_words_per_entity + i] = tag_occupancy[i];
+                ecs->m_per_entity_generation[index] = 0;
+                out[n]                              = s_entity_make(0, index);
+                if (ecs->m_awake_state.size() != 0)
+                    ecs->m_awake_state.set_used(index);
+            }
+            ecs->m_num_alive += n;
+
+            // The components of the instances take the slots at the end of each (dense) container
+            for (u32 w = 0; w < ecs->m_component_words_per_entity; ++w)
+            {
+                for (u32 occupancy = component_occupancy[w]; occupancy != 0; occupancy &= occupancy - 1)
+                {
+                    component_container_t* container = &ecs->m_component_containers[(w << 5) + math::findFirstBit(occupancy)];
+                    u32 const              begin     = container->m_free_index;
+                    for (u32 i = 0; i < n; ++i)
+                    {
+                        u32 const entity_index                     = g_entity_index(out[i]);
+                        container->m_global_to_local[entity_index] = begin + i;
+                        container->m_local_to_global[begin + i]    = entity_index;
+                    }
+                    container->m_free_index += n;
+                    if (container->m_soa != nullptr)
+                    {
+                        soa_store_t* soa = container->m_soa;
+                        s_soa_flush(soa);
+                        s_soa_gather(soa, container->m_global_to_local[prefab_index], soa->m_value);
+                        for (u32 i = 0; i < n; ++i)
+                            s_soa_scatter(soa, begin + i, soa->m_value);
+                    }
+                    else if (container->m_compressed != nullptr)
+                    {
+                        // The value of the prefab is in another block than most of the instances
+                        g_memcopy(container->m_compressed->m_value, s_component_at(ecs, container, container->m_global_to_local[prefab_index], false), container->m_sizeof_component);
+                        for (u32 i = 0; i < n; ++i)
+                            g_memcopy(s_component_at(ecs, container, begin + i, true), container->m_compressed->m_value, container->m_sizeof_component);
+                    }
+                    else if (n > 0)
+                        s_fill_copies(&container->m_component_data[begin * container->m_sizeof_component], &container->m_component_data[container->m_global_to_local[prefab_index] * container->m_sizeof_component], container->m_sizeof_component, n);
+                    if (container->m_shared != nullptr)
+                        s_shared_add_refs(container->m_shared, *(u32 const*)&container->m_component_data[container->m_global_to_local[prefab_index] * container->m_sizeof_component], n);
+                }
+            }
+            return n;
+        }
+
+        static void s_remove_component(ecs_t* ecs, component_container_t* container, u32 entity_index)
+        {
+            u32 const local_index = container->m_global_to_local[entity_index];
+            if (container->m_shared != nullptr)
+                s_shared_release(container->m_shared, *(u32 const*)&container->m_component_data[local_index * container->m_sizeof_component]);
+
+            container->m_global_to_local[entity_index] = 0xFFFFFFFF;
+            container->m_local_to_global[local_index]  = 0xFFFFFFFF;
+            container->m_free_index--;
+
+            // The staging copy of a split component may be one of the two slots
+            if (container->m_soa != nullptr)
+                s_soa_flush(container->m_soa);
+
+            // Move the last element to the current position
+            if (local_index != container->m_free_index)
+            {
+                u32 const last_entity_index                           = container->m_local_to_global[container->m_free_index];
+                container->m_global_to_local[last_entity_index]       = local_index;
+                container->m_local_to_global[local_index]             = last_entity_index;
+                container->m_local_to_global[container->m_free_index] = 0xFFFFFFFF;
+
+                if (container->m_soa != nullptr)
+                {
+                    s_soa_move(container->m_soa, local_index, container->m_free_index);
+                }
+                else
+                {
+                    byte* const last_component_data = s_component_at(ecs, container, container->m_free_index, false);
+                    byte* const cur_component_data  = s_component_at(ecs, container, local_index, true);
+                    g_memcopy(cur_component_data, last_component_data, container->m_sizeof_component);
+                }
+            }
+
+            // The last block of a compressed container is empty
+            if (container->m_compressed != nullptr && (container->m_free_index % ECS3_COMPRESSED_BLOCK_SIZE) == 0)
+                s_compressed_release_block(ecs->m_allocator, container->m_compressed, container->m_free_index / ECS3_COMPRESSED_BLOCK_SIZE);
+        }
+
+        void g_destroy_entity(ecs_t* ecs, entity_t e)
+        {
+            entity_generation_t const gen_id       = g_entity_generation(e);
+            u32 const                 entity_index = g_entity_index(e);
+            entity_generation_t const cur_id       = ecs->m_per_entity_generation[entity_index];
+            if (gen_id == cur_id)
+            {
+                // Remove the components of this entity from their containers, so that the containers stay dense
+                u32* component_occupancy = &ecs->m_per_entity_component_occupancy[entity_index * ecs->m_component_words_per_entity];
+                for (u32 w = 0; w < ecs->m_component_words_per_entity; ++w)
+                {
+                    u32 occupancy = component_occupancy[w];
+                    while (occupancy != 0)
+                    {
+                        s8 const bit = math::findFirstBit(occupancy);
+                        s_remove_component(ecs, &ecs->m_component_containers[(w << 5) + bit], entity_index);
+                        occupancy &= ~((u32)1 << bit);
+                    }
+                    component_occupancy[w] = 0;
+                }
+                if (ecs->m_hierarchy != nullptr)
+                    s_hierarchy_remove(ecs->m_hierarchy, entity_index);
+                for (u32 r = 0; r < ECS3_MAX_RELATIONS; ++r)
+                {
+                    if (ecs->m_relations[r] != nullptr)
+                        s_relation_remove_entity(ecs->m_relations[r], entity_index);
+                }
+                if (!s_is_awake(ecs, entity_index))
+                    ecs->m_num_sleeping--;
+                else if (ecs->m_awake_state.size() != 0)
+                    ecs->m_awake_state.set_free(entity_index);
+                ecs->m_entity_state.set_free(entity_index);
+                ecs->m_num_alive--;
+            }
+        }
+
+        bool g_register_component(ecs_t* ecs, u32 max_components, u32 cp_index, s32 cp_sizeof, s32 cp_alignof, const char* cp_name)
+        {
+            // See if the component container is present, if not we need to initialize it
+            if (ecs->m_component_containers[cp_index].m_sizeof_component == 0)
+            {
+                // The size is padded to the alignment and the array starts on a cache line
+                cp_sizeof                        = s_component_stride(cp_sizeof, cp_alignof);
+                component_container_t* container = &ecs->m_component_containers[cp_index];
+                container->m_free_index          = 0;
+                container->m_max_components      = max_components;
+                container->m_sizeof_component    = cp_sizeof;
+                container->m_component_data      = (byte*)ecs->m_allocator->allocate(cp_sizeof * max_components, ECS3_MAX_ALIGNMENT);
+                container->m_global_to_local     = g_allocate_array_and_memset<u32>(ecs->m_allocator, ecs->m_max_entities, 0xFFFFFFFF);
+                container->m_local_to_global     = g_allocate_array_and_memset<u32>(ecs->m_allocator, max_components, 0xFFFFFFFF);
+                container->m_shared              = nullptr;
+                container->m_compressed          = nullptr;
+                container->m_soa                 = nullptr;
+                container->m_name                = cp_name;
+                return true;
+            }
+            return false;
+        }
+
+        bool g_register_shared_component(ecs_t* ecs, u32 max_components, u32 cp_index, s32 cp_sizeof, s32 cp_alignof, u32 max_values, const char* cp_name)
+        {
+            // The container holds the value index of each entity, the values are in the pool
+            if (!g_register_component(ecs, max_components, cp_index, sizeof(u32), sizeof(u32), cp_name))
+                return false;
+            ecs->m_component_containers[cp_index].m_shared = s_shared_create(ecs->m_allocator, (u32)cp_sizeof, (u32)cp_alignof, max_values);
+            return true;
+        }
+
+        bool g_register_compressed_component(ecs_t* ecs, u32 max_components, u32 cp_index, s32 cp_sizeof, s32 cp_alignof, const char* cp_name)
+        {
+            // The container only maps entities to slots, the values are in the encoded blocks
+            if (ecs->m_component_containers[cp_index].m_sizeof_component != 0)
+                return false;
+            cp_sizeof                        = s_component_stride(cp_sizeof, cp_alignof);
+            component_container_t* container = &ecs->m_component_containers[cp_index];
+            container->m_free_index          = 0;
+            container->m_max_components      = max_components;
+            container->m_sizeof_component    = cp_sizeof;
+            container->m_component_data      = nullptr;
+            container->m_global_to_local     = g_allocate_array_and_memset<u32>(ecs->m_allocator, ecs->m_max_entities, 0xFFFFFFFF);
+            container->m_local_to_global     = g_allocate_array_and_memset<u32>(ecs->m_allocator, max_components, 0xFFFFFFFF);
+            container->m_shared              = nullptr;
+            container->m_compressed          = s_compressed_create(ecs->m_allocator, (u32)cp_sizeof, max_components);
+            container->m_soa                 = nullptr;
+            container->m_name                = cp_name;
+            return true;
+        }
+
+        bool g_register_soa_component(ecs_t* ecs, u32 max_components, u32 cp_index, s32 cp_sizeof, s32 field_sizeof, const char* cp_name)
+        {
+            // The container only maps entities to slots, the fields are in the columns
+            ASSERT(field_sizeof > 0 && (cp_sizeof % field_sizeof) == 0);
+            if (ecs->m_component_containers[cp_index].m_sizeof_component != 0 || field_sizeof <= 0 || (cp_sizeof % field_sizeof) != 0)
+                return false;
+            component_container_t* container = &ecs->m_component_containers[cp_index];
+            container->m_free_index          = 0;
+            container->m_max_components      = max_components;
+            container->m_sizeof_component    = cp_sizeof;
+            container->m_component_data      = nullptr;
+            container->m_global_to_local     = g_allocate_array_and_memset<u32>(ecs->m_allocator, ecs->m_max_entities, 0xFFFFFFFF);
+            container->m_local_to_global     = g_allocate_array_and_memset<u32>(ecs->m_allocator, max_components, 0xFFFFFFFF);
+            container->m_shared              = nullptr;
+            container->m_compressed          = nullptr;
+            container->m_soa                 = s_soa_create(ecs->m_allocator, (u32)cp_sizeof, (u32)field_sizeof, max_components);
+            container->m_name                = cp_name;
+            return true;
+        }
+
+        void* g_get_column(ecs_t* ecs, u32 cp_index, u32 field_index, u32& count)
+        {
+            count = 0;
+            if (cp_index >= ecs->m_max_component_types || ecs->m_component_containers[cp_index].m_soa == nullptr)
+                return nullptr;
+            component_container_t* container = &ecs->m_component_containers[cp_index];
+            soa_store_t*           soa       = container->m_soa;
+            if (field_index >= soa->m_num_fields)
+                return nullptr;
+            s_soa_flush(soa);
+            count = container->m_free_index;
+            return soa->m_columns + field_index * soa->m_column_stride;
+        }
+
+        bool g_compressed_stats(ecs_t* ecs, u32 cp_index, compressed_stats_t& stats)
+        {
+            if (cp_index >= ecs->m_max_component_types || ecs->m_component_containers[cp_index].m_compressed == nullptr)
+                return false;
+
+            component_container_t const* container = &ecs->m_component_containers[cp_index];
+            compressed_store_t*          store     = container->m_compressed;
+            for (u32 i = 0; i < ECS3_COMPRESSED_CACHE_BLOCKS; ++i)
+            {
+                if (store->m_lines[i].m_block != 0xFFFFFFFF)
+                    s_compressed_write_back(ecs->m_allocator, store, &store->m_lines[i]);
+            }
+            stats.m_raw_bytes        = (u64)container->m_free_index * store->m_sizeof;
+            stats.m_compressed_bytes = store->m_compressed_bytes;
+            stats.m_cache_bytes      = (u64)ECS3_COMPRESSED_CACHE_BLOCKS * ECS3_COMPRESSED_BLOCK_SIZE * store->m_sizeof;
+            stats.m_ratio            = store->m_compressed_bytes > 0 ? (f32)((f64)stats.m_raw_bytes / (f64)store->m_compressed_bytes) : 0.0f;
+            return true;
+        }
+
+        void g_unregister_component(ecs_t* ecs, u32 cp_index)
+        {
+            component_container_t* container = &ecs->m_component_containers[cp_index];
+            if (container->m_sizeof_component > 0)
+                s_teardown(ecs->m_allocator, container);
+        }
+
+        bool g_has_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            u32 const* component_occupancy = &ecs->m_per_entity_component_occupancy[g_entity_index(entity) * ecs->m_component_words_per_entity];
+            return (component_occupancy[cp_index >> 5] & (1 << (cp_index & 31))) != 0;
+        }
+
+        void* g_add_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            if (cp_index >= ecs->m_max_component_types)
+                return nullptr;
+
+            component_container_t* container = &ecs->m_component_containers[cp_index];
+            if (container->m_sizeof_component == 0)
+                return nullptr;
+
+            if (container->m_shared != nullptr)
+            {
+                ASSERTS(false, "a shared component is set with g_set_shared_cp");
+                return nullptr;
+            }
+
+            u32 const entity_index = g_entity_index(entity);
+            if (container->m_global_to_local[entity_index] == 0xFFFFFFFF)
+            {
+                if (container->m_free_index >= container->m_max_components)
+                    return nullptr;
+                s32 const local_index                      = container->m_free_index++;
+                container->m_global_to_local[entity_index] = local_index;
+                container->m_local_to_global[local_index]  = entity_index;
+                u32* component_occupancy                   = &ecs->m_per_entity_component_occupancy[entity_index * ecs->m_component_words_per_entity];
+                component_occupancy[cp_index >> 5] |= (1 << (cp_index & 31));
+                return s_component_at(ecs, container, local_index, true);
+            }
+            else
+            {
+                u32 const local_index = container->m_global_to_local[entity_index];
+                return s_component_at(ecs, container, local_index, true);
+            }
+        }
+
+        void g_rem_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            if (cp_index >= ecs->m_max_component_types)
+                return;
+
+            component_container_t* container    = &ecs->m_component_containers[cp_index];
+            u32 const              entity_index = g_entity_index(entity);
+            if (container->m_sizeof_component == 0 || container->m_global_to_local[entity_index] == 0xFFFFFFFF)
+                return;
+
+            s_remove_component(ecs, container, entity_index);
+
+            u32* component_occupancy = &ecs->m_per_entity_component_occupancy[entity_index * ecs->m_component_words_per_entity];
+            component_occupancy[cp_index >> 5] &= ~(1 << (cp_index & 31));
+        }
+
+        void* g_get_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            if (cp_index >= ecs->m_max_component_types)
+                return nullptr;
+
+            component_container_t* container = &ecs->m_component_containers[cp_index];
+            if (container->m_sizeof_component == 0)
+                return nullptr;
+
+            u32 const entity_index = g_entity_index(entity);
+            if (container->m_global_to_local[entity_index] == 0xFFFFFFFF)
+                return nullptr;
+            byte* cp = s_component_at(ecs, container, container->m_global_to_local[entity_index], true);
+            if (container->m_shared != nullptr)
+                return (void*)s_shared_value(container->m_shared, *(u32 const*)cp);
+            return cp;
+        }
+
+        void const* g_set_shared_cp(ecs_t* ecs, entity_t entity, u32 cp_index, void const* value)
+        {
+            if (cp_index >= ecs->m_max_component_types)
+                return nullptr;
+
+            component_container_t* container = &ecs->m_component_containers[cp_index];
+            if (container->m_shared == nullptr)
+                return nullptr;
+
+            u32 const entity_index = g_entity_index(entity);
+            u32       local_index  = container->m_global_to_local[entity_index];
+            if (local_index == 0xFFFFFFFF && container->m_free_index >= container->m_max_components)
+                return nullptr;
+
+            // Acquire the new value before releasing the old one, setting the value that the entity already has must not
+            // free it
+            u32 const value_index = s_shared_acquire(container->m_shared, value);
+            if (value_index == ECS3_SHARED_NONE)
+                return nullptr;
+
+            if (local_index == 0xFFFFFFFF)
+            {
+                local_index                                = container->m_free_index++;
+                container->m_global_to_local[entity_index] = local_index;
+                container->m_local_to_global[local_index]  = entity_index;
+                u32* component_occupancy                   = &ecs->m_per_entity_component_occupancy[entity_index * ecs->m_component_words_per_entity];
+                component_occupancy[cp_index >> 5] |= (1 << (cp_index & 31));
+            }
+            else
+            {
+                s_shared_release(container->m_shared, *(u32 const*)&container->m_component_data[local_index * container->m_sizeof_component]);
+            }
+            *(u32*)&container->m_component_data[local_index * container->m_sizeof_component] = value_index;
+            return s_shared_value(container->m_shared, value_index);
+        }
+
+        u32 g_get_shared_index(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            if (cp_index >= ecs->m_max_component_types)
+                return ECS3_SHARED_NONE;
+
+            component_container_t const* container    = &ecs->m_component_containers[cp_index];
+            u32 const                    entity_index = g_entity_index(entity);
+            if (container->m_shared == nullptr || container->m_global_to_local[entity_index] == 0xFFFFFFFF)
+                return ECS3_SHARED_NONE;
+            return *(u32 const*)&container->m_component_data[container->m_global_to_local[entity_index] * container->m_sizeof_component];
+        }
+
+        void const* g_get_shared_value(ecs_t* ecs, u32 cp_index, u32 value_index)
+        {
+            if (cp_index >= ecs->m_max_component_types || ecs->m_component_containers[cp_index].m_shared == nullptr)
+                return nullptr;
+            return s_shared_value(ecs->m_component_containers[cp_index].m_shared, value_index);
+        }
+
+        u32 g_shared_value_count(ecs_t* ecs, u32 cp_index)
+        {
+            if (cp_index >= ecs->m_max_component_types || ecs->m_component_containers[cp_index].m_shared == nullptr)
+                return 0;
+            return ecs->m_component_containers[cp_index].m_shared->m_count;
+        }
+
+        bool g_register_singleton(ecs_t* ecs, u32 sg_index, s32 sg_sizeof, s32 sg_alignof)
+        {
+            ASSERT(sg_index < ECS3_MAX_SINGLETONS);
+            if (sg_index >= ECS3_MAX_SINGLETONS || ecs->m_singletons[sg_index] != nullptr)
+                return false;
+            ecs->m_singletons[sg_index] = ecs->m_allocator->allocate(sg_sizeof, sg_alignof);
+            g_memclr(ecs->m_singletons[sg_index], sg_sizeof);
+            return true;
+        }
+
+        void* g_get_singleton(ecs_t* ecs, u32 sg_index) { return ecs->m_singletons[sg_index]; }
+
+        bool g_has_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        {
+            if (tg_index >= (ecs->m_tag_words_per_entity << 5))
+                return false;
+
+            u32 const* tag_occupancy = &ecs->m_per_entity_tags[g_entity_index(entity) * ecs->m_tag_words_per_entity];
+            return (tag_occupancy[tg_index >> 5] & (1 << (tg_index & 31))) != 0;
+        }
+
+        void g_add_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        {
+            if (tg_index >= (ecs->m_tag_words_per_entity << 5))
+                return;
+
+            u32* tag_occupancy = &ecs->m_per_entity_tags[g_entity_index(entity) * ecs->m_tag_words_per_entity];
+            tag_occupancy[tg_index >> 5] |= (1 << (tg_index & 31));
+        }
+
+        void g_rem_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        {
+            if (tg_index >= (ecs->m_tag_words_per_entity << 5))
+                return;
+
+            u32* tag_occupancy = &ecs->m_per_entity_tags[g_entity_index(entity) * ecs->m_tag_words_per_entity];
+            tag_occupancy[tg_index >> 5] &= ~(1 << (tg_index & 31));
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // queries
+
+        // Does the entity have all the components and tags that the reference entity has
+        static inline bool s_matches_reference(ecs_t const* ecs, u32 entity_index, u32 const* ref_component_occupancy, u32 const* ref_tag_occupancy)
+        {
+            u32 const* cur_component_occupancy = &ecs->m_per_entity_component_occupancy[entity_index * ecs->m_component_words_per_entity];
+            for (u32 i = 0; i < ecs->m_component_words_per_entity; ++i)
+            {
+                if ((cur_component_occupancy[i] & ref_component_occupancy[i]) != ref_component_occupancy[i])
+                    return false;
+            }
+            u32 const* cur_tag_occupancy = &ecs->m_per_entity_tags[entity_index * ecs->m_tag_words_per_entity];
+            for (u32 i = 0; i < ecs->m_tag_words_per_entity; ++i)
+            {
+                if ((cur_tag_occupancy[i] & ref_tag_occupancy[i]) != ref_tag_occupancy[i])
+                    return false;
+            }
+            return true;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // cardinality
+
+        // The smallest component container that the reference entity has, nullptr when it has no components
+        static component_container_t const* s_smallest_container(ecs_t const* ecs, u32 const* ref_component_occupancy)
+        {
+            component_container_t const* smallest = nullptr;
+            for (u32 w = 0; w < ecs->m_component_words_per_entity; ++w)
+            {
+                u32 occupancy = ref_component_occupancy[w];
+                while (occupancy != 0)
+                {
+                    s8 const                     bit       = math::findFirstBit(occupancy);
+                    component_container_t const* container = &ecs->m_component_containers[(w << 5) + bit];
+                    if (smallest == nullptr || container->m_free_index < smallest->m_free_index)
+                        smallest = container;
+                    occupancy &= occupancy - 1;
+                }
+            }
+            return smallest;
+        }
+
+        // Visit every awake entity that matches the reference entity, the reference entity itself is not visited
+        template <typename V> static u32 s_visit_matches(ecs_t* ecs, entity_t reference, V& visitor)
+        {
+            u32 const  reference_index         = g_entity_index(reference);
+            u32 const* ref_component_occupancy = &ecs->m_per_entity_component_occupancy[reference_index * ecs->m_component_words_per_entity];
+            u32 const* ref_tag_occupancy       = &ecs->m_per_entity_tags[reference_index * ecs->m_tag_words_per_entity];
+
+            // Only the entities in the smallest container can match
+            u32                          count    = 0;
+            component_container_t const* smallest = s_smallest_container(ecs, ref_component_occupancy);
+            if (smallest != nullptr)
+            {
+                for (u32 i = 0; i < smallest->m_free_index; ++i)
+                {
+                    u32 const entity_index = smallest->m_local_to_global[i];
+                    if (entity_index != reference_index && s_matches_reference(ecs, entity_index, ref_component_occupancy, ref_tag_occupancy) && s_is_awake(ecs, entity_index))
+                    {
+                        visitor(entity_index);
+                        count++;
+                    }
+                }
+                return count;
+            }
+
+            // A reference with only tags has to look at every awake entity
+            duomap_t* state        = s_scan_state(ecs, false);
+            s32       entity_index = state->next_used_up(0);
+            while (entity_index >= 0)
+            {
+                if ((u32)entity_index != reference_index && s_matches_reference(ecs, entity_index, ref_component_occupancy, ref_tag_occupancy))
+                {
+                    visitor((u32)entity_index);
+                    count++;
+                }
+                entity_index = state->next_used_up(entity_index + 1);
+            }
+            return count;
+        }
+
+        struct count_visitor_t
+        {
+            inline void operator()(u32) {}
+        };
+
+        u32 g_count(ecs_t* ecs, entity_t reference)
+        {
+            if (reference == ECS_ENTITY_NULL)
+                return ecs->m_num_alive - ecs->m_num_sleeping;
+            count_visitor_t visitor;
+            return s_visit_matches(ecs, reference, visitor);
+        }
+
+        u32 g_count_estimate(ecs_t* ecs, entity_t reference)
+        {
+            if (reference == ECS_ENTITY_NULL)
+                return ecs->m_num_alive;
+
+            u32 const*                   ref_component_occupancy = &ecs->m_per_entity_component_occupancy[g_entity_index(reference) * ecs->m_component_words_per_entity];
+            component_container_t const* smallest                = s_smallest_container(ecs, ref_component_occupancy);
+            return smallest != nullptr ? smallest->m_free_index : ecs->m_num_alive;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // bulk tags
+
+        struct set_tag_visitor_t
+        {
+            u32* m_tags;
+            u32  m_stride;
+            u32  m_mask;
+            inline void operator()(u32 entity_index) { m_tags[entity_index * m_stride] |= m_mask; }
+        };
+
+        u32 g_set_tag_all(ecs_t* ecs, entity_t reference, u16 tg_index)
+        {
+            if (tg_index >= (ecs->m_tag_words_per_entity << 5) || reference == ECS_ENTITY_NULL)
+                return 0;
+            set_tag_visitor_t visitor;
+            visitor.m_tags   = ecs->m_per_entity_tags + (tg_index >> 5);
+            visitor.m_stride = ecs->m_tag_words_per_entity;
+            visitor.m_mask   = (u32)1 << (tg_index & 31);
+            return s_visit_matches(ecs, reference, visitor);
+        }
+
+        void g_clear_tag_all(ecs_t* ecs, u16 tg_index)
+        {
+            if (tg_index >= (ecs->m_tag_words_per_entity << 5))
+                return;
+
+            // The tags of free entities are cleared as well, they are cleared anyway when the entity is created
+            u32 const mask   = ~((u32)1 << (tg_index & 31));
+            u32 const stride = ecs->m_tag_words_per_entity;
+            u32*      tags   = ecs->m_per_entity_tags + (tg_index >> 5);
+            if (stride == 1)
+            {
+                for (u32 i = 0; i < ecs->m_max_entities; ++i)
+                    tags[i] &= mask;
+            }
+            else
+            {
+                for (u32 i = 0; i < ecs->m_max_entities; ++i)
+                    tags[i * stride] &= mask;
+            }
+        }
+
+        void g_add_tag(ecs_t* ecs, entity_t const* entities, u32 count, u16 tg_index)
+        {
+            if (tg_index >= (ecs->m_tag_words_per_entity << 5))
+                return;
+            u32 const mask   = (u32)1 << (tg_index & 31);
+            u32 const stride = ecs->m_tag_words_per_entity;
+            u32*      tags   = ecs->m_per_entity_tags + (tg_index >> 5);
+            for (u32 i = 0; i < count; ++i)
+                tags[g_entity_index(entities[i]) * stride] |= mask;
+        }
+
+        void g_rem_tag(ecs_t* ecs, entity_t const* entities, u32 count, u16 tg_index)
+        {
+            if (tg_index >= (ecs->m_tag_words_per_entity << 5))
+                return;
+            u32 const mask   = ~((u32)1 << (tg_index & 31));
+            u32 const stride = ecs->m_tag_words_per_entity;
+            u32*      tags   = ecs->m_per_entity_tags + (tg_index >> 5);
+            for (u32 i = 0; i < count; ++i)
+                tags[g_entity_index(entities[i]) * stride] &= mask;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // sleeping entities
+
+        // Returns true when the entity changed state, the entity needs to be alive
+        static bool s_set_sleeping(ecs_t* ecs, u32 entity_index, bool sleeping)
+        {
+            if (ecs->m_awake_state.size() == 0)
+            {
+                if (!sleeping)
+                    return false;
+                // Every alive entity is awake, entities that are created later set their own bit
+                duomap_t::config_t cfg = duomap_t::config_t::compute(ecs->m_max_entities);
+                ecs->m_awake_state.init_all_free(cfg, ecs->m_allocator);
+                for (s32 i = ecs->m_entity_state.next_used_up(0); i >= 0; i = ecs->m_entity_state.next_used_up(i + 1))
+                    ecs->m_awake_state.set_used((u32)i);
+            }
+            if (s_is_awake(ecs, entity_index) != sleeping)
+                return false;
+            if (sleeping)
+            {
+                ecs->m_awake_state.set_free(entity_index);
+                ecs->m_num_sleeping++;
+            }
+            else
+            {
+                ecs->m_awake_state.set_used(entity_index);
+                ecs->m_num_sleeping--;
+            }
+            return true;
+        }
+
+        static u32 s_set_sleeping_array(ecs_t* ecs, entity_t const* entities, u32 count, bool sleeping)
+        {
+            u32 changed = 0;
+            for (u32 i = 0; i < count; ++i)
+            {
+                u32 const entity_index = g_entity_index(entities[i]);
+                if (s_is_alive(ecs, entity_index) && s_set_sleeping(ecs, entity_index, sleeping))
+                    changed++;
+            }
+            return changed;
+        }
+
+        void g_sleep(ecs_t* ecs, entity_t e) { s_set_sleeping_array(ecs, &e, 1, true); }
+        void g_wake(ecs_t* ecs, entity_t e) { s_set_sleeping_array(ecs, &e, 1, false); }
+        u32  g_sleep(ecs_t* ecs, entity_t const* entities, u32 count) { return s_set_sleeping_array(ecs, entities, count, true); }
+        u32  g_wake(ecs_t* ecs, entity_t const* entities, u32 count) { return s_set_sleeping_array(ecs, entities, count, false); }
+        bool g_is_awake(ecs_t* ecs, entity_t e) { return s_is_alive(ecs, g_entity_index(e)) && s_is_awake(ecs, g_entity_index(e)); }
+        u32  g_num_sleeping(ecs_t* ecs) { return ecs->m_num_sleeping; }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // relations
+
+        bool g_register_relation(ecs_t* ecs, u32 rl_index, u32 max_pairs)
+        {
+            ASSERT(rl_index < ECS3_MAX_RELATIONS);
+            if (rl_index >= ECS3_MAX_RELATIONS || ecs->m_relations[rl_index] != nullptr)
+                return false;
+            ecs->m_relations[rl_index] = s_relation_create(ecs->m_allocator, max_pairs, ecs->m_max_entities);
+            return true;
+        }
+
+        bool g_add_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target)
+        {
+            ASSERT(rl_index < ECS3_MAX_RELATIONS);
+            relation_t* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_is_alive_entity(ecs, entity) || !s_is_alive_entity(ecs, target))
+                return false;
+            return s_relation_add(rl, g_entity_index(entity), g_entity_index(target));
+        }
+
+        void g_rem_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target)
+        {
+            ASSERT(rl_index < ECS3_MAX_RELATIONS);
+            relation_t* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_is_alive_entity(ecs, entity) || !s_is_alive_entity(ecs, target))
+                return;
+            u32 const p = s_relation_find(rl, g_entity_index(entity), g_entity_index(target));
+            if (p != 0xFFFFFFFF)
+                s_relation_remove(rl, p);
+        }
+
+        bool g_has_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target)
+        {
+            ASSERT(rl_index < ECS3_MAX_RELATIONS);
+            relation_t const* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_is_alive_entity(ecs, entity) || !s_is_alive_entity(ecs, target))
+                return false;
+            return s_relation_find(rl, g_entity_index(entity), g_entity_index(target)) != 0xFFFFFFFF;
+        }
+
+        u32 g_add_pair(ecs_t* ecs, entity_t const* entities, u32 count, u32 rl_index, entity_t target)
+        {
+            ASSERT(rl_index < ECS3_MAX_RELATIONS);
+            relation_t* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_is_alive_entity(ecs, target))
+                return 0;
+            u32 const t = g_entity_index(target);
+            u32       n = 0;
+            for (u32 i = 0; i < count; ++i)
+            {
+                if (!s_is_alive_entity(ecs, entities[i]))
+                    continue;
+                if (!s_relation_add(rl, g_entity_index(entities[i]), t))
+                    break;
+                n++;
+            }
+            return n;
+        }
+
+        void g_rem_pair(ecs_t* ecs, entity_t const* entities, u32 count, u32 rl_index, entity_t target)
+        {
+            ASSERT(rl_index < ECS3_MAX_RELATIONS);
+            relation_t* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_is_alive_entity(ecs, target))
+                return;
+            u32 const t = g_entity_index(target);
+            for (u32 i = 0; i < count; ++i)
+            {
+                if (!s_is_alive_entity(ecs, entities[i]))
+                    continue;
+                u32 const p = s_relation_find(rl, g_entity_index(entities[i]), t);
+                if (p != 0xFFFFFFFF)
+                    s_relation_remove(rl, p);
+            }
+        }
+
+        u32 g_get_targets(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t* out, u32 max_out)
+        {
+            ASSERT(rl_index < ECS3_MAX_RELATIONS);
+            relation_t const* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_is_alive_entity(ecs, entity))
+                return 0;
+            u32 n = 0;
+            for (u32 p = rl->m_first_out[g_entity_index(entity)]; p != 0xFFFFFFFF; p = rl->m_next_out[p], ++n)
+            {
+                if (n < max_out)
+                    out[n] = s_entity_make(ecs->m_per_entity_generation[rl->m_target[p]], rl->m_target[p]);
+            }
+            return n;
+        }
+
+        u32 g_query_pair(ecs_t* ecs, entity_t reference, u32 rl_index, entity_t target, entity_t* out, u32 max_out)
+        {
+            ASSERT(rl_index < ECS3_MAX_RELATIONS);
+            relation_t const* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_is_alive_entity(ecs, target))
+                return 0;
+
+            u32 const* ref_component_occupancy = nullptr;
+            u32 const* ref_tag_occupancy       = nullptr;
+            if (reference != ECS_ENTITY_NULL)
+            {
+                ref_component_occupancy = &ecs->m_per_entity_component_occupancy[g_entity_index(reference) * ecs->m_component_words_per_entity];
+                ref_tag_occupancy       = &ecs->m_per_entity_tags[g_entity_index(reference) * ecs->m_tag_words_per_entity];
+            }
+
+            // Walk the reverse index of the target
+            u32 n = 0;
+            for (u32 p = rl->m_first_in[g_entity_index(target)]; p != 0xFFFFFFFF; p = rl->m_next_in[p])
+            {
+                u32 const source = rl->m_source[p];
+                if (ref_component_occupancy != nullptr && !s_matches_reference(ecs, source, ref_component_occupancy, ref_tag_occupancy))
+                    continue;
+                if (n < max_out)
+                    out[n] = s_entity_make(ecs->m_per_entity_generation[source], source);
+                n++;
+            }
+            return n;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // select / sample
+
+        entity_t g_select(ecs_t* ecs, u32 cp_index, u32 k)
+        {
+            if (cp_index >= ecs->m_max_component_types)
+                return ECS_ENTITY_NULL;
+            component_container_t const* container = &ecs->m_component_containers[cp_index];
+            if (k >= container->m_free_index)
+                return ECS_ENTITY_NULL;
+            u32 const entity_index = container->m_local_to_global[k];
+            return s_entity_make(ecs->m_per_entity_generation[entity_index], entity_index);
+        }
+
+        entity_t g_sample(ecs_t* ecs, entity_t reference, u32 random)
+        {
+            if (reference == ECS_ENTITY_NULL)
+                return ECS_ENTITY_NULL;
+
+            u32 const                    reference_index         = g_entity_index(reference);
+            u32 const*                   ref_component_occupancy = &ecs->m_per_entity_component_occupancy[reference_index * ecs->m_component_words_per_entity];
+            u32 const*                   ref_tag_occupancy       = &ecs->m_per_entity_tags[reference_index * ecs->m_tag_words_per_entity];
+            component_container_t const* smallest                = s_smallest_container(ecs, ref_component_occupancy);
+            if (smallest == nullptr || smallest->m_free_index == 0)
+                return ECS_ENTITY_NULL;
+
+            // Pick uniformly among the entities of the smallest container and reject the ones that do not match or sleep
+            for (s32 attempt = 0; attempt < 16; ++attempt)
+            {
+                u32 const entity_index = smallest->m_local_to_global[random % smallest->m_free_index];
+                if (entity_index != reference_index && s_matches_reference(ecs, entity_index, ref_component_occupancy, ref_tag_occupancy) && s_is_awake(ecs, entity_index))
+                    return s_entity_make(ecs->m_per_entity_generation[entity_index], entity_index);
+                random = random * 1664525u + 1013904223u; // next value of a linear congruential generator
+            }
+
+            // Matches are rare, pick uniformly among the awake matching entities (see g_count)
+            u32 const count = g_count(ecs, reference);
+            if (count == 0)
+                return ECS_ENTITY_NULL;
+            u32 k = random % count;
+            for (u32 i = 0; i < smallest->m_free_index; ++i)
+            {
+                u32 const entity_index = smallest->m_local_to_global[i];
+                if (entity_index != reference_index && s_matches_reference(ecs, entity_index, ref_component_occupancy, ref_tag_occupancy) && s_is_awake(ecs, entity_index) && k-- == 0)
+                    return s_entity_make(ecs->m_per_entity_generation[entity_index], entity_index);
+            }
+            return ECS_ENTITY_NULL;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // storage order
+
+        // Stable sort of 'order' by 'keys', a full merge sort or, when 'max_moves' is given, an insertion sort that stops
+        // after 'max_moves' element moves (cheap for data that is nearly sorted)
+        static void s_sort_order(u32* order, u32* scratch, u64 const* keys, u32 n, u32 max_moves)
+        {
+            if (max_moves != 0xFFFFFFFF)
+            {
+                u32 moves = 0;
+                for (u32 i = 1; i < n && moves < max_moves; ++i)
+                {
+                    u32 const o = order[i];
+                    u32       j = i;
+                    for (; j > 0 && keys[order[j - 1]] > keys[o] && moves < max_moves; --j, ++moves)
+                        order[j] = order[j - 1];
+                    order[j] = o;
+                }
+                return;
+            }
+
+            u32* src = order;
+            u32* dst = scratch;
+            for (u32 width = 1; width < n; width <<= 1)
+            {
+                for (u32 lo = 0; lo < n; lo += (width << 1))
+                {
+                    u32 const mid = math::min(lo + width, n);
+                    u32 const hi  = math::min(lo + (width << 1), n);
+                    u32       a   = lo;
+                    u32       b   = mid;
+                    u32       k   = lo;
+                    while (a < mid && b < hi)
+                        dst[k++] = keys[src[b]] < keys[src[a]] ? src[b++] : src[a++];
+                    while (a < mid)
+                        dst[k++] = src[a++];
+                    while (b < hi)
+                        dst[k++] = src[b++];
+                }
+                u32* swap = src;
+                src       = dst;
+                dst       = swap;
+            }
+            if (src != order)
+                g_memcopy(order, src, (int_t)n * sizeof(u32));
+        }
+
+        u32 g_sort_storage(ecs_t* ecs, u32 cp_index, sort_key_fn key_fn, void* user, u32 max_moves)
+        {
+            if (cp_index >= ecs->m_max_component_types)
+                return 0;
+            component_container_t* container = &ecs->m_component_containers[cp_index];
+            u32 const              n         = container->m_free_index;
+            if (container->m_sizeof_component == 0 || n < 2)
+                return 0;
+
+            u64* keys  = g_allocate_array<u64>(ecs->m_allocator, n);
+            u32* order = g_allocate_array<u32>(ecs->m_allocator, n);
+            u32* temp  = g_allocate_array<u32>(ecs->m_allocator, n);
+            for (u32 i = 0; i < n; ++i)
+            {
+                u32 const entity_index = container->m_local_to_global[i];
+                keys[i]                = key_fn(ecs, s_entity_make(ecs->m_per_entity_generation[entity_index], entity_index), user);
+                order[i]               = i;
+            }
+            s_sort_order(order, temp, keys, n, max_moves);
+
+            // The component that ends up in slot i comes from slot order[i], gather the ones that change slot
+            u32 const stride      = container->m_sizeof_component;
+            u32       num_changed = 0;
+            for (u32 i = 0; i < n; ++i)
+                num_changed += order[i] != i ? 1 : 0;
+
+            if (num_changed > 0)
+            {
+                byte* data     = g_allocate_array<byte>(ecs->m_allocator, num_changed * stride);
+                u32*  entities = g_allocate_array<u32>(ecs->m_allocator, num_changed);
+                u32   m        = 0;
+                for (u32 i = 0; i < n; ++i)
+                {
+                    if (order[i] == i)
+                        continue;
+                    g_memcopy(data + m * stride, s_component_at(ecs, container, order[i], false), stride);
+                    entities[m] = container->m_local_to_global[order[i]];
+                    temp[m++]   = i;
+                }
+                for (m = 0; m < num_changed; ++m)
+                {
+                    u32 const local_index                      = temp[m];
+                    u32 const entity_index                     = entities[m];
+                    container->m_global_to_local[entity_index] = local_index;
+                    container->m_local_to_global[local_index]  = entity_index;
+                    g_memcopy(s_component_at(ecs, container, local_index, true), data + m * stride, stride);
+                }
+                g_deallocate_array(ecs->m_allocator, data);
+                g_deallocate_array(ecs->m_allocator, entities);
+            }
+
+            g_deallocate_array(ecs->m_allocator, keys);
+            g_deallocate_array(ecs->m_allocator, order);
+            g_deallocate_array(ecs->m_allocator, temp);
+            return num_changed;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // hierarchy
+
+        // Flatten the hierarchy level by level, the roots first and then per level the children of the entities of the
+        // level above in their order
+        static void s_hierarchy_flatten(ecs_t* ecs, hierarchy_t* h)
+        {
+            u32 count = 0;
+            for (u32 r = h->m_first_root; r != 0xFFFFFFFF; r = h->m_next_sibling[r])
+            {
+                h->m_order[count]        = s_entity_make(ecs->m_per_entity_generation[r], r);
+                h->m_order_parent[count] = 0xFFFFFFFF;
+                h->m_position[r]         = count++;
+            }
+
+            u32 begin           = 0;
+            u32 end             = count;
+            h->m_num_levels     = 0;
+            h->m_level_begin[0] = 0;
+            while (begin < end)
+            {
+                ASSERT(h->m_num_levels < ECS3_HIERARCHY_MAX_DEPTH);
+                h->m_level_begin[++h->m_num_levels] = end;
+                for (u32 p = begin; p < end; ++p)
+                {
+                    u32 const parent = g_entity_index(h->m_order[p]);
+                    for (u32 c = h->m_first_child[parent]; c != 0xFFFFFFFF; c = h->m_next_sibling[c])
+                    {
+                        h->m_order[count]        = s_entity_make(ecs->m_per_entity_generation[c], c);
+                        h->m_order_parent[count] = p;
+                        h->m_position[c]         = count++;
+                    }
+                }
+                begin = end;
+                end   = count;
+            }
+            h->m_dirty = false;
+        }
+
+        static hierarchy_t* s_hierarchy_flattened(ecs_t* ecs)
+        {
+            hierarchy_t* h = ecs->m_hierarchy;
+            if (h != nullptr && h->m_dirty)
+                s_hierarchy_flatten(ecs, h);
+            return h;
+        }
+
+        bool g_set_parent(ecs_t* ecs, entity_t child, entity_t parent)
+        {
+            if (ecs->m_hierarchy == nullptr)
+            {
+                if (parent == ECS_ENTITY_NULL)
+                    return true;
+                ecs->m_hierarchy = s_hierarchy_create(ecs->m_allocator, ecs->m_max_entities);
+            }
+
+            hierarchy_t* h = ecs->m_hierarchy;
+            u32 const    e = g_entity_index(child);
+            if (parent == ECS_ENTITY_NULL)
+            {
+                s_hierarchy_detach(h, e);
+                return true;
+            }
+
+            // The parent cannot be the entity itself or one of its descendants
+            u32 const p = g_entity_index(parent);
+            for (u32 a = p; a != 0xFFFFFFFF; a = h->m_parent[a])
+            {
+                if (a == e)
+                    return false;
+            }
+            if (h->m_parent[e] == p)
+                return true;
+
+            // The deepest entity of the subtree has to stay within the maximum depth
+            if ((u32)h->m_depth[p] + 1 + s_hierarchy_height(h, e) >= ECS3_HIERARCHY_MAX_DEPTH)
+                return false;
+
+            s_hierarchy_detach(h, e);
+            s_hierarchy_attach(h, e, p);
+            return true;
+        }
+
+        entity_t g_get_parent(ecs_t* ecs, entity_t child)
+        {
+            if (ecs->m_hierarchy == nullptr)
+                return ECS_ENTITY_NULL;
+            u32 const parent = ecs->m_hierarchy->m_parent[g_entity_index(child)];
+            return parent != 0xFFFFFFFF ? s_entity_make(ecs->m_per_entity_generation[parent], parent) : ECS_ENTITY_NULL;
+        }
+
+        u32 g_get_depth(ecs_t* ecs, entity_t e)
+        {
+            if (ecs->m_hierarchy == nullptr)
+                return 0;
+            return ecs->m_hierarchy->m_depth[g_entity_index(e)];
+        }
+
+        u32 g_get_children(ecs_t* ecs, entity_t parent, entity_t* out, u32 max_out)
+        {
+            if (ecs->m_hierarchy == nullptr)
+                return 0;
+            hierarchy_t const* h = ecs->m_hierarchy;
+            u32                n = 0;
+            for (u32 c = h->m_first_child[g_entity_index(parent)]; c != 0xFFFFFFFF; c = h->m_next_sibling[c], ++n)
+            {
+                if (n < max_out)
+                    out[n] = s_entity_make(ecs->m_per_entity_generation[c], c);
+            }
+            return n;
+        }
+
+        u32 g_destroy_subtree(ecs_t* ecs, entity_t root)
+        {
+            hierarchy_t* h = ecs->m_hierarchy;
+            u32          n = 0;
+            if (h != nullptr)
+            {
+                // Destroy the leaves bottom-up, every link is followed once down and once up
+                u32 const r = g_entity_index(root);
+                u32       e = r;
+                while (true)
+                {
+                    while (h->m_first_child[e] != 0xFFFFFFFF)
+                        e = h->m_first_child[e];
+                    if (e == r)
+                        break;
+                    u32 const parent = h->m_parent[e];
+                    g_destroy_entity(ecs, s_entity_make(ecs->m_per_entity_generation[e], e));
+                    e = parent;
+                    n++;
+                }
+            }
+            g_destroy_entity(ecs, root);
+            return n + 1;
+        }
+
+        u32 g_hierarchy_levels(ecs_t* ecs)
+        {
+            hierarchy_t const* h = s_hierarchy_flattened(ecs);
+            return h != nullptr ? h->m_num_levels : 0;
+        }
+
+        bool g_hierarchy_level(ecs_t* ecs, u32 depth, hierarchy_level_t& level)
+        {
+            hierarchy_t const* h = s_hierarchy_flattened(ecs);
+            if (h == nullptr || depth >= h->m_num_levels)
+                return false;
+            level.m_begin    = h->m_level_begin[depth];
+            level.m_count    = h->m_level_begin[depth + 1] - level.m_begin;
+            level.m_entities = h->m_order + level.m_begin;
+            level.m_parents  = h->m_order_parent + level.m_begin;
+            return true;
+        }
+
+        // The position in the flattened order, the entities that are not in the hierarchy go to the end
+        static u64 s_hierarchy_key(ecs_t* ecs, entity_t e, void*)
+        {
+            hierarchy_t const* h = ecs->m_hierarchy;
+            u32 const          i = g_entity_index(e);
+            return s_hierarchy_member(h, i) ? h->m_position[i] : D_U64_MAX;
+        }
+
+        u32 g_sort_by_hierarchy(ecs_t* ecs, u32 cp_index)
+        {
+            if (s_hierarchy_flattened(ecs) == nullptr)
+                return 0;
+            return g_sort_storage(ecs, cp_index, s_hierarchy_key, nullptr);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // spatial locality
+
+        // Spread the lower 21 bits of 'v' so that there are 2 zero bits between every bit
+        static inline u64 s_morton_spread(u64 v)
+        {
+            v &= 0x1FFFFF;
+            v = (v | (v << 32)) & (u64)0x001F00000000FFFF;
+            v = (v | (v << 16)) & (u64)0x001F0000FF0000FF;
+            v = (v | (v << 8)) & (u64)0x100F00F00F00F00F;
+            v = (v | (v << 4)) & (u64)0x10C30C30C30C30C3;
+            v = (v | (v << 2)) & (u64)0x1249249249249249;
+            return v;
+        }
+
+        // Quantize a coordinate to 21 bits, the origin is in the middle of the range
+        static inline u64 s_morton_quantize(f32 v, f32 inv_cell_size)
+        {
+            f32 const q = v * inv_cell_size + (f32)(1 << 20);
+            return q <= 0.0f ? 0 : (q >= (f32)0x1FFFFF ? 0x1FFFFF : (u64)q);
+        }
+
+        struct morton_key_t
+        {
+            u32 m_position_cp_index;
+            f32 m_inv_cell_size;
+        };
+
+        // Entities without a position are sorted to the end
+        static u64 s_morton_key(ecs_t* ecs, entity_t e, void* user)
+        {
+            morton_key_t const* key      = (morton_key_t const*)user;
+            f32 const*          position = (f32 const*)g_get_cp(ecs, e, key->m_position_cp_index);
+            if (position == nullptr)
+                return D_U64_MAX;
+            u64 const x = s_morton_quantize(position[0], key->m_inv_cell_size);
+            u64 const y = s_morton_quantize(position[1], key->m_inv_cell_size);
+            u64 const z = s_morton_quantize(position[2], key->m_inv_cell_size);
+            return s_morton_spread(x) | (s_morton_spread(y) << 1) | (s_morton_spread(z) << 2);
+        }
+
+        u32 g_sort_spatial(ecs_t* ecs, u32 cp_index, u32 position_cp_index, f32 cell_size, u32 max_moves)
+        {
+            ASSERT(cell_size > 0.0f);
+            morton_key_t key;
+            key.m_position_cp_index = position_cp_index;
+            key.m_inv_cell_size     = 1.0f / cell_size;
+            return g_sort_storage(ecs, cp_index, s_morton_key, &key, max_moves);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // spatial grid
+
+        // A node per entity index, a node is linked into the bucket of its cell
+        struct grid_node_t
+        {
+            entity_t m_entity;      // ECS_ENTITY_NULL when the entity is not in the grid
+            u32      m_next;        // next node in the bucket, 0xFFFFFFFF = end
+            u32      m_prev;        // previous node in the bucket, 0xFFFFFFFF = head
+            s32      m_cell[3];     // cell coordinates
+            f32      m_position[3]; // position at the last update
+        };
+
+        struct grid_t
+        {
+            DCORE_CLASS_PLACEMENT_NEW_DELETE
+            ecs_t*       m_ecs;
+            u32          m_position_cp_index;
+            f32          m_inv_cell_size;
+            u32          m_bucket_mask; // number of buckets - 1
+            u32          m_count;       // number of entities in the grid
+            u32*         m_buckets;     // first node per bucket
+            grid_node_t* m_nodes;       // node per entity index
+        };
+
+        struct grid_candidate_t
+        {
+            entity_t m_entity;
+            f32      m_distance2;
+        };
+
+        static inline s32 s_grid_cell(f32 v, f32 inv_cell_size)
+        {
+            f32 c = v * inv_cell_size;
+            c     = c < -1073741824.0f ? -1073741824.0f : (c > 1073741824.0f ? 1073741824.0f : c);
+            s32 i = (s32)c;
+            return ((f32)i > c) ? i - 1 : i;
+        }
+
+        static inline u32 s_grid_bucket(grid_t const* grid, s32 const* cell) { return (((u32)cell[0] * 73856093u) ^ ((u32)cell[1] * 19349663u) ^ ((u32)cell[2] * 83492791u)) & grid->m_bucket_mask; }
+
+        static void s_grid_unlink(grid_t* grid, u32 entity_index)
+        {
+            grid_node_t* node = &grid->m_nodes[entity_index];
+            if (node->m_prev != 0xFFFFFFFF)
+                grid->m_nodes[node->m_prev].m_next = node->m_next;
+            else
+                grid->m_buckets[s_grid_bucket(grid, node->m_cell)] = node->m_next;
+            if (node->m_next != 0xFFFFFFFF)
+                grid->m_nodes[node->m_next].m_prev = node->m_prev;
+            node->m_entity = ECS_ENTITY_NULL;
+            grid->m_count--;
+        }
+
+        static void s_grid_link(grid_t* grid, u32 entity_index, entity_t e, f32 const* position)
+        {
+            grid_node_t* node = &grid->m_nodes[entity_index];
+            for (s32 a = 0; a < 3; ++a)
+            {
+                node->m_position[a] = position[a];
+                node->m_cell[a]     = s_grid_cell(position[a], grid->m_inv_cell_size);
+            }
+            u32& head      = grid->m_buckets[s_grid_bucket(grid, node->m_cell)];
+            node->m_entity = e;
+            node->m_prev   = 0xFFFFFFFF;
+            node->m_next   = head;
+            if (head != 0xFFFFFFFF)
+                grid->m_nodes[head].m_prev = entity_index;
+            head = entity_index;
+            grid->m_count++;
+        }
+
+        // The filter of a query, the occupancy of the reference entity (see en_iterator_t)
+        struct grid_filter_t
+        {
+            u32 const* m_component_occupancy; // nullptr = no filter
+            u32 const* m_tag_occupancy;
+            u32        m_reference_index;
+        };
+
+        static inline grid_filter_t s_grid_filter(ecs_t const* ecs, entity_t reference)
+        {
+            grid_filter_t filter = {nullptr, nullptr, 0xFFFFFFFF};
+            if (reference != ECS_ENTITY_NULL)
+            {
+                filter.m_reference_index     = g_entity_index(reference);
+                filter.m_component_occupancy = &ecs->m_per_entity_component_occupancy[filter.m_reference_index * ecs->m_component_words_per_entity];
+                filter.m_tag_occupancy       = &ecs->m_per_entity_tags[filter.m_reference_index * ecs->m_tag_words_per_entity];
+            }
+            return filter;
+        }
+
+        // A node is a match when its entity still has the position (a destroyed entity does not) and matches the filter
+        static inline bool s_grid_accept(grid_t const* grid, grid_filter_t const& filter, u32 entity_index)
+        {
+            ecs_t const* ecs = grid->m_ecs;
+            if (ecs->m_component_containers[grid->m_position_cp_index].m_global_to_local[entity_index] == 0xFFFFFFFF)
+                return false;
+            if (filter.m_component_occupancy == nullptr)
+                return true;
+            return entity_index != filter.m_reference_index && s_matches_reference(ecs, entity_index, filter.m_component_occupancy, filter.m_tag_occupancy);
+        }
+
+        static inline bool s_grid_inside(grid_node_t const* node, f32 const* min, f32 const* max)
+        {
+            for (s32 a = 0; a < 3; ++a)
+            {
+                if (node->m_position[a] < min[a] || node->m_position[a] > max[a])
+                    return false;
+            }
+            return true;
+        }
+
+        // Visit every node that is inside the box (nullptr = no box), bucket by bucket. The visitor returns false to stop.
+        template <typename V> static void s_grid_visit_all(grid_t const* grid, grid_filter_t const& filter, f32 const* min, f32 const* max, V& visitor)
+        {
+            for (u32 b = 0; b <= grid->m_bucket_mask; ++b)
+            {
+                for (u32 i = grid->m_buckets[b]; i != 0xFFFFFFFF; i = grid->m_nodes[i].m_next)
+                {
+                    grid_node_t const* node = &grid->m_nodes[i];
+                    if ((min == nullptr || s_grid_inside(node, min, max)) && s_grid_accept(grid, filter, i) && !visitor(node))
+                        return;
+                }
+            }
+        }
+
+        // Visit the nodes that are inside the box, only the cells that overlap the box are visited unless the box covers
+        // more cells than there are buckets. A node is only taken from its own cell so that hash collisions between the
+        // cells of the box do not visit a node twice. The visitor returns false to stop.
+        template <typename V> static void s_grid_visit_box(grid_t const* grid, grid_filter_t const& filter, f32 const* min, f32 const* max, V& visitor)
+        {
+            s32 cell_min[3];
+            s32 cell_max[3];
+            u64 num_cells = 1;
+            for (s32 a = 0; a < 3; ++a)
+            {
+                cell_min[a] = s_grid_cell(min[a], grid->m_inv_cell_size);
+                cell_max[a] = s_grid_cell(max[a], grid->m_inv_cell_size);
+                num_cells *= (u64)((s64)cell_max[a] - cell_min[a] + 1);
+            }
+            if (num_cells > grid->m_bucket_mask)
+            {
+                s_grid_visit_all(grid, filter, min, max, visitor);
+                return;
+            }
+
+            s32 cell[3];
+            for (cell[2] = cell_min[2]; cell[2] <= cell_max[2]; ++cell[2])
+            {
+                for (cell[1] = cell_min[1]; cell[1] <= cell_max[1]; ++cell[1])
+                {
+                    for (cell[0] = cell_min[0]; cell[0] <= cell_max[0]; ++cell[0])
+                    {
+                        for (u32 i = grid->m_buckets[s_grid_bucket(grid, cell)]; i != 0xFFFFFFFF; i = grid->m_nodes[i].m_next)
+                        {
+                            grid_node_t const* node = &grid->m_nodes[i];
+                            if (node->m_cell[0] != cell[0] || node->m_cell[1] != cell[1] || node->m_cell[2] != cell[2])
+                                continue;
+                            if (s_grid_inside(node, min, max) && s_grid_accept(grid, filter, i) && !visitor(node))
+                                return;
+                        }
+                    }
+                }
+            }
+        }
+
+        static inline f32 s_grid_distance2(grid_node_t const* node, f32 const* center)
         {
-            g_deallocate_array(allocator, container->m_component_data);
-            g_deallocate_array(allocator, container->m_global_to_local);
-            g_deallocate_array(allocator, container->m_local_to_global);
-            container->m_free_index       = 0;
-            container->m_sizeof_component = 0;
-            container->m_name             = "";
+            f32 const dx = node->m_position[0] - center[0];
+            f32 const dy = node->m_position[1] - center[1];
+            f32 const dz = node->m_position[2] - center[2];
+            return dx * dx + dy * dy + dz * dz;
         }
 
-        ecs_t* g_create_ecs(alloc_t* allocator, u32 max_entities, u32 max_component_types, u32 max_tags)
+        struct grid_collect_t
         {
-            ecs_t* ecs = g_construct<ecs_t>(allocator);
+            entity_t*  m_out;
+            u32        m_max_out;
+            u32        m_count;
+            f32 const* m_center;  // nullptr for a box
+            f32        m_radius2; //
 
-            ecs->m_allocator                  = allocator;
-            ecs->m_max_entities               = max_entities;
-            ecs->m_max_component_types        = max_component_types;
-            ecs->m_component_words_per_entity = (max_component_types + 31) >> 5;
-            ecs->m_tag_words_per_entity       = (max_tags + 31) >> 5;
+            bool operator()(grid_node_t const* node)
+            {
+                if (m_center != nullptr && s_grid_distance2(node, m_center) > m_radius2)
+                    return true;
+                m_out[m_count++] = node->m_entity;
+                return m_count < m_max_out;
+            }
+        };
 
-            ecs->m_per_entity_generation          = g_allocate_array_and_memset<byte>(allocator, max_entities, 0);
-            ecs->m_per_entity_component_occupancy = g_allocate_array_and_memset<u32>(allocator, max_entities * ecs->m_component_words_per_entity, 0);
-            ecs->m_per_entity_tags                = g_allocate_array_and_memset<u32>(allocator, max_entities * ecs->m_tag_words_per_entity, 0);
+        struct grid_gather_t
+        {
+            grid_candidate_t* m_candidates;
+            u32               m_count;
+            f32 const*        m_center;
+            f32               m_radius2; // negative = no limit
 
-            ecs->m_component_containers = g_allocate_array_and_memset<component_container_t>(allocator, max_component_types, 0);
+            bool operator()(grid_node_t const* node)
+            {
+                f32 const distance2 = s_grid_distance2(node, m_center);
+                if (m_radius2 < 0.0f || distance2 <= m_radius2)
+                {
+                    m_candidates[m_count].m_entity    = node->m_entity;
+                    m_candidates[m_count].m_distance2 = distance2;
+                    m_count++;
+                }
+                return true;
+            }
+        };
 
-            duomap_t::config_t cfg = duomap_t::config_t::compute(max_entities);
-            ecs->m_entity_state.init_all_free(cfg, allocator);
+        grid_t* g_create_grid(ecs_t* ecs, u32 position_cp_index, f32 cell_size, u32 num_buckets)
+        {
+            ASSERT(position_cp_index < ecs->m_max_component_types);
+            ASSERT(cell_size > 0.0f);
+            ASSERT(math::ispo2(num_buckets));
 
-            return ecs;
+            grid_t* grid              = g_construct<grid_t>(ecs->m_allocator);
+            grid->m_ecs               = ecs;
+            grid->m_position_cp_index = position_cp_index;
+            grid->m_inv_cell_size     = 1.0f / cell_size;
+            grid->m_bucket_mask       = num_buckets - 1;
+            grid->m_count             = 0;
+            grid->m_buckets           = g_allocate_array_and_memset<u32>(ecs->m_allocator, num_buckets, 0xFFFFFFFF);
+            grid->m_nodes             = g_allocate_array_and_memset<grid_node_t>(ecs->m_allocator, ecs->m_max_entities, 0xFFFFFFFF);
+            return grid;
         }
 
-        void g_destroy_ecs(ecs_t* ecs)
+        void g_destroy_grid(grid_t* grid)
         {
-            alloc_t* allocator = ecs->m_allocator;
+            alloc_t* allocator = grid->m_ecs->m_allocator;
+            g_deallocate_array(allocator, grid->m_buckets);
+            g_deallocate_array(allocator, grid->m_nodes);
+            g_deallocate(allocator, grid);
+        }
 
-            for (u32 i = 0; i < ecs->m_max_component_types; ++i)
+        void g_grid_update(grid_t* grid, entity_t e)
+        {
+            u32 const entity_index = g_entity_index(e);
+            if (grid->m_nodes[entity_index].m_entity != ECS_ENTITY_NULL)
+                s_grid_unlink(grid, entity_index);
+            f32 const* position = (f32 const*)g_get_cp(grid->m_ecs, e, grid->m_position_cp_index);
+            if (position != nullptr)
+                s_grid_link(grid, entity_index, e, position);
+        }
+
+        void g_grid_remove(grid_t* grid, entity_t e)
+        {
+            u32 const entity_index = g_entity_index(e);
+            if (grid->m_nodes[entity_index].m_entity != ECS_ENTITY_NULL)
+                s_grid_unlink(grid, entity_index);
+        }
+
+        void g_grid_update_all(grid_t* grid)
+        {
+            ecs_t* ecs = grid->m_ecs;
+            g_memset(grid->m_buckets, 0xFF, (int_t)(grid->m_bucket_mask + 1) * sizeof(u32));
+            g_memset(grid->m_nodes, 0xFF, (int_t)ecs->m_max_entities * sizeof(grid_node_t));
+            grid->m_count = 0;
+
+            // The position container is dense
+            component_container_t* container = &ecs->m_component_containers[grid->m_position_cp_index];
+            for (u32 i = 0; i < container->m_free_index; ++i)
             {
-                component_container_t* container = &ecs->m_component_containers[i];
-                if (container->m_sizeof_component > 0)
-                    s_teardown(allocator, container);
+                u32 const entity_index = container->m_local_to_global[i];
+                s_grid_link(grid, entity_index, s_entity_make(ecs->m_per_entity_generation[entity_index], entity_index), (f32 const*)s_component_at(ecs, container, i, false));
             }
+        }
 
-            g_deallocate_array(allocator, ecs->m_component_containers);
-            g_deallocate_array(allocator, ecs->m_per_entity_tags);
-            g_deallocate_array(allocator, ecs->m_per_entity_component_occupancy);
-            g_deallocate_array(allocator, ecs->m_per_entity_generation);
+        u32 g_grid_count(grid_t const* grid) { return grid->m_count; }
 
-            ecs->m_entity_state.release(allocator);
+        u32 g_grid_query_box(grid_t* grid, entity_t reference, f32 const* min, f32 const* max, entity_t* out, u32 max_out)
+        {
+            if (max_out == 0)
+                return 0;
+            grid_collect_t collect = {out, max_out, 0, nullptr, 0.0f};
+            s_grid_visit_box(grid, s_grid_filter(grid->m_ecs, reference), min, max, collect);
+            return collect.m_count;
+        }
 
-            g_deallocate(allocator, ecs);
+        u32 g_grid_query_radius(grid_t* grid, entity_t reference, f32 const* center, f32 radius, entity_t* out, u32 max_out)
+        {
+            if (max_out == 0)
+                return 0;
+            f32 const      min[3]  = {center[0] - radius, center[1] - radius, center[2] - radius};
+            f32 const      max[3]  = {center[0] + radius, center[1] + radius, center[2] + radius};
+            grid_collect_t collect = {out, max_out, 0, center, radius * radius};
+            s_grid_visit_box(grid, s_grid_filter(grid->m_ecs, reference), min, max, collect);
+            return collect.m_count;
         }
 
-        entity_t g_create_entity(ecs_t* ecs)
+        u32 g_grid_query_nearest(grid_t* grid, entity_t reference, f32 const* center, u32 k, entity_t* out)
         {
-            s32 const index = ecs->m_entity_state.find_free_and_set_used();
-            if (index >= 0)
+            if (k == 0 || grid->m_count == 0)
+                return 0;
+
+            grid_filter_t const filter     = s_grid_filter(grid->m_ecs, reference);
+            grid_candidate_t*   candidates = g_allocate_array<grid_candidate_t>(grid->m_ecs->m_allocator, grid->m_count);
+
+            // Grow the radius until it holds 'k' entities, once the box covers more cells than there are buckets every
+            // entity is gathered and the search ends
+            grid_gather_t gather = {candidates, 0, center, 0.0f};
+            f32           radius = 1.0f / grid->m_inv_cell_size;
+            while (true)
             {
-                // Clear the component occupancy
-                u32 const offset = index * ecs->m_component_words_per_entity;
-                for (u32 i = 0; i < ecs->m_component_words_per_entity; ++i)
-                    ecs->m_per_entity_component_occupancy[offset + i] = 0;
+                gather.m_count  = 0;
+                f32 const cells = 2.0f * radius * grid->m_inv_cell_size + 1.0f;
+                if (cells * cells * cells > (f32)grid->m_bucket_mask)
+                {
+                    gather.m_radius2 = -1.0f;
+                    s_grid_visit_all(grid, filter, nullptr, nullptr, gather);
+                    break;
+                }
 
-                // Clear the tag occupancy
-                u32 const tag_offset = index * ecs->m_tag_words_per_entity;
-                for (u32 i = 0; i < ecs->m_tag_words_per_entity; ++i)
-                    ecs->m_per_entity_tags[tag_offset + i] = 0;
+                f32 const min[3] = {center[0] - radius, center[1] - radius, center[2] - radius};
+                f32 const max[3] = {center[0] + radius, center[1] + radius, center[2] + radius};
+                gather.m_radius2 = radius * radius;
+                s_grid_visit_box(grid, filter, min, max, gather);
+                if (gather.m_count >= k)
+                    break;
+                radius *= 2.0f;
+            }
 
-                ecs->m_per_entity_generation[index] = 0;
-                return s_entity_make(0, index);
+            // Partial selection sort of the 'k' nearest
+            u32 const n = math::min(k, gather.m_count);
+            for (u32 i = 0; i < n; ++i)
+            {
+                u32 nearest = i;
+                for (u32 j = i + 1; j < gather.m_count; ++j)
+                    nearest = candidates[j].m_distance2 < candidates[nearest].m_distance2 ? j : nearest;
+                grid_candidate_t const swap = candidates[i];
+                candidates[i]               = candidates[nearest];
+                candidates[nearest]         = swap;
+                out[i]                      = candidates[i].m_entity;
             }
-            return ECS_ENTITY_NULL;
+            g_deallocate_array(grid->m_ecs->m_allocator, candidates);
+            return n;
         }
 
-        void g_destroy_entity(ecs_t* ecs, entity_t e)
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // secondary indexes
+
+        // A node per entity index, a node is linked into the bucket of its key
+        struct index_node_t
         {
-            entity_generation_t const gen_id = g_entity_generation(e);
-            entity_generation_t const cur_id = ecs->m_per_entity_generation[g_entity_index(e)];
-            if (gen_id == cur_id)
-                ecs->m_entity_state.set_free(g_entity_index(e));
+            entity_t m_entity; // ECS_ENTITY_NULL when the entity is not in the index
+            u32      m_next;   // next node in the bucket, 0xFFFFFFFF = end
+            u32      m_prev;   // previous node in the bucket, 0xFFFFFFFF = head
+        };
+
+        struct value_index_t
+        {
+            DCORE_CLASS_PLACEMENT_NEW_DELETE
+            ecs_t*        m_ecs;
+            u32           m_cp_index;
+            index_key_fn  m_key_fn;
+            void*         m_user;
+            eindex_t      m_kind;
+            u32           m_bucket_mask; // number of buckets - 1
+            u32           m_count;       // number of entities in the index
+            u32*          m_buckets;     // first node per bucket
+            index_node_t* m_nodes;       // node per entity index
+            u64*          m_keys;        // key per entity index
+            u32*          m_order;       // ordered index, the entity indices sorted by key
+            u32           m_order_count; // number of entity indices in m_order
+            bool          m_dirty;       // ordered index, m_order needs to be rebuilt
+        };
+
+        static inline u32 s_index_bucket(value_index_t const* index, u64 key) { return (u32)((key * 0x9E3779B97F4A7C15ull) >> 32) & index->m_bucket_mask; }
+
+        static void s_index_unlink(value_index_t* index, u32 entity_index)
+        {
+            index_node_t* node = &index->m_nodes[entity_index];
+            if (node->m_prev != 0xFFFFFFFF)
+                index->m_nodes[node->m_prev].m_next = node->m_next;
+            else
+                index->m_buckets[s_index_bucket(index, index->m_keys[entity_index])] = node->m_next;
+            if (node->m_next != 0xFFFFFFFF)
+                index->m_nodes[node->m_next].m_prev = node->m_prev;
+            node->m_entity = ECS_ENTITY_NULL;
+            index->m_count--;
+            index->m_dirty = true;
         }
 
-        bool g_register_component(ecs_t* ecs, u32 max_components, u32 cp_index, s32 cp_sizeof, s32 cp_alignof, const char* cp_name)
+        static void s_index_link(value_index_t* index, u32 entity_index, entity_t e, void const* component)
         {
-            // See if the component container is present, if not we need to initialize it
-            if (ecs->m_component_containers[cp_index].m_sizeof_component == 0)
-            {
-                component_container_t* container = &ecs->m_component_containers[cp_index];
-                container->m_free_index          = 0;
-                container->m_sizeof_component    = cp_sizeof;
-                container->m_component_data      = g_allocate_array<byte>(ecs->m_allocator, cp_sizeof * max_components);
-                container->m_global_to_local     = g_allocate_array_and_memset<u32>(ecs->m_allocator, ecs->m_max_entities, 0xFFFFFFFF);
-                container->m_local_to_global     = g_allocate_array_and_memset<u32>(ecs->m_allocator, max_components, 0xFFFFFFFF);
-                container->m_name                = cp_name;
+            u64 const     key  = index->m_key_fn(component, index->m_user);
+            index_node_t* node = &index->m_nodes[entity_index];
+            u32&          head = index->m_buckets[s_index_bucket(index, key)];
+            index->m_keys[entity_index] = key;
+            node->m_entity              = e;
+            node->m_prev                = 0xFFFFFFFF;
+            node->m_next                = head;
+            if (head != 0xFFFFFFFF)
+                index->m_nodes[head].m_prev = entity_index;
+            head = entity_index;
+            index->m_count++;
+            index->m_dirty = true;
+        }
+
+        // A node is a match when its entity still has the component (a destroyed entity does not) and matches the filter
+        static inline bool s_index_accept(value_index_t const* index, grid_filter_t const& filter, u32 entity_index)
+        {
+            ecs_t const* ecs = index->m_ecs;
+            if (ecs->m_component_containers[index->m_cp_index].m_global_to_local[entity_index] == 0xFFFFFFFF)
+                return false;
+            if (filter.m_component_occupancy == nullptr)
                 return true;
+            return entity_index != filter.m_reference_index && s_matches_reference(ecs, entity_index, filter.m_component_occupancy, filter.m_tag_occupancy);
+        }
+
+        // Gather the entity indices of the nodes and sort them by key, the buckets are walked so that the cost follows
+        // the number of entities in the index
+        static void s_index_build_order(value_index_t* index)
+        {
+            u32 n = 0;
+            for (u32 b = 0; b <= index->m_bucket_mask; ++b)
+            {
+                for (u32 i = index->m_buckets[b]; i != 0xFFFFFFFF; i = index->m_nodes[i].m_next)
+                    index->m_order[n++] = i;
             }
-            return false;
+            u32* scratch = g_allocate_array<u32>(index->m_ecs->m_allocator, n);
+            s_sort_order(index->m_order, scratch, index->m_keys, n, 0xFFFFFFFF);
+            g_deallocate_array(index->m_ecs->m_allocator, scratch);
+            index->m_order_count = n;
+            index->m_dirty       = false;
         }
 
-        void g_unregister_component(ecs_t* ecs, u32 cp_index)
+        value_index_t* g_create_index(ecs_t* ecs, u32 cp_index, index_key_fn key_fn, void* user, eindex_t kind, u32 num_buckets)
         {
-            component_container_t* container = &ecs->m_component_containers[cp_index];
-            if (container->m_sizeof_component > 0)
-                s_teardown(ecs->m_allocator, container);
+            ASSERT(cp_index < ecs->m_max_component_types);
+            ASSERT(key_fn != nullptr);
+            ASSERT(math::ispo2(num_buckets));
+
+            value_index_t* index = g_construct<value_index_t>(ecs->m_allocator);
+            index->m_ecs         = ecs;
+            index->m_cp_index    = cp_index;
+            index->m_key_fn      = key_fn;
+            index->m_user        = user;
+            index->m_kind        = kind;
+            index->m_bucket_mask = num_buckets - 1;
+            index->m_count       = 0;
+            index->m_buckets     = g_allocate_array_and_memset<u32>(ecs->m_allocator, num_buckets, 0xFFFFFFFF);
+            index->m_nodes       = g_allocate_array_and_memset<index_node_t>(ecs->m_allocator, ecs->m_max_entities, 0xFFFFFFFF);
+            index->m_keys        = g_allocate_array<u64>(ecs->m_allocator, ecs->m_max_entities);
+            index->m_order       = kind == INDEX_ORDERED ? g_allocate_array<u32>(ecs->m_allocator, ecs->m_max_entities) : nullptr;
+            index->m_order_count = 0;
+            index->m_dirty       = false;
+            return index;
         }
 
-        bool g_has_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        void g_destroy_index(value_index_t* index)
         {
-            u32 const* component_occupancy = &ecs->m_per_entity_component_occupancy[g_entity_index(entity) * ecs->m_component_words_per_entity];
-            return (component_occupancy[cp_index >> 5] & (1 << (cp_index & 31))) != 0;
+            alloc_t* allocator = index->m_ecs->m_allocator;
+            g_deallocate_array(allocator, index->m_buckets);
+            g_deallocate_array(allocator, index->m_nodes);
+            g_deallocate_array(allocator, index->m_keys);
+            g_deallocate_array(allocator, index->m_order);
+            g_deallocate(allocator, index);
         }
 
-        void* g_add_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        void g_index_update(value_index_t* index, entity_t e)
         {
-            if (cp_index >= ecs->m_max_component_types)
-                return nullptr;
+            u32 const entity_index = g_entity_index(e);
+            if (index->m_nodes[entity_index].m_entity != ECS_ENTITY_NULL)
+                s_index_unlink(index, entity_index);
+            void const* component = g_get_cp(index->m_ecs, e, index->m_cp_index);
+            if (component != nullptr)
+                s_index_link(index, entity_index, e, component);
+        }
 
-            component_container_t* container = &ecs->m_component_containers[cp_index];
-            if (container->m_sizeof_component == 0)
-                return nullptr;
+        void g_index_remove(value_index_t* index, entity_t e)
+        {
+            u32 const entity_index = g_entity_index(e);
+            if (index->m_nodes[entity_index].m_entity != ECS_ENTITY_NULL)
+                s_index_unlink(index, entity_index);
+        }
 
-            u32 const entity_index = g_entity_index(entity);
-            if (container->m_global_to_local[entity_index] == 0xFFFFFFFF)
+        void g_index_update_all(value_index_t* index)
+        {
+            ecs_t* ecs = index->m_ecs;
+            g_memset(index->m_buckets, 0xFF, (int_t)(index->m_bucket_mask + 1) * sizeof(u32));
+            g_memset(index->m_nodes, 0xFF, (int_t)ecs->m_max_entities * sizeof(index_node_t));
+            index->m_count = 0;
+
+            // The component container is dense
+            component_container_t* container = &ecs->m_component_containers[index->m_cp_index];
+            for (u32 i = 0; i < container->m_free_index; ++i)
             {
-                s32 const local_index                      = container->m_free_index++;
-                container->m_global_to_local[entity_index] = local_index;
-                container->m_local_to_global[local_index]  = entity_index;
-                u32* component_occupancy                   = &ecs->m_per_entity_component_occupancy[entity_index * ecs->m_component_words_per_entity];
-                component_occupancy[cp_index >> 5] |= (1 << (cp_index & 31));
-                return &container->m_component_data[local_index * container->m_sizeof_component];
+                u32 const entity_index = container->m_local_to_global[i];
+                s_index_link(index, entity_index, s_entity_make(ecs->m_per_entity_generation[entity_index], entity_index), s_component_at(ecs, container, i, false));
             }
-            else
+            index->m_dirty = true;
+        }
+
+        u32 g_index_count(value_index_t const* index) { return index->m_count; }
+
+        u32 g_index_find(value_index_t* index, entity_t reference, u64 key, entity_t* out, u32 max_out)
+        {
+            grid_filter_t const filter = s_grid_filter(index->m_ecs, reference);
+            u32                 count  = 0;
+            for (u32 i = index->m_buckets[s_index_bucket(index, key)]; i != 0xFFFFFFFF; i = index->m_nodes[i].m_next)
             {
-                u32 const local_index = container->m_global_to_local[entity_index];
-                return &container->m_component_data[local_index * container->m_sizeof_component];
+                if (index->m_keys[i] != key || !s_index_accept(index, filter, i))
+                    continue;
+                if (count < max_out)
+                    out[count] = index->m_nodes[i].m_entity;
+                count++;
             }
+            return count;
         }
 
-        void g_rem_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        u32 g_index_range(value_index_t* index, entity_t reference, u64 min_key, u64 max_key, entity_t* out, u32 max_out)
         {
-            component_container_t* container = &ecs->m_component_containers[cp_index];
-            if (container->m_sizeof_component == 0 || cp_index >= container->m_free_index)
-                return;
+            ASSERTS(index->m_kind == INDEX_ORDERED, "a range probe needs an ordered index");
+            if (index->m_kind != INDEX_ORDERED || min_key > max_key)
+                return 0;
+            if (index->m_dirty)
+                s_index_build_order(index);
 
-            u32 const entity_index = g_entity_index(entity);
-            ASSERT(container->m_global_to_local[entity_index] != 0xFFFFFFFF);
-
-            u32 const local_index                      = container->m_global_to_local[entity_index];
-            container->m_global_to_local[entity_index] = 0xFFFFFFFF;
-            container->m_local_to_global[local_index]  = 0xFFFFFFFF;
-            container->m_free_index--;
+            // Lower bound of 'min_key' in the sorted order
+            u64 const* keys = index->m_keys;
+            u32        lo   = 0;
+            u32        hi   = index->m_order_count;
+            while (lo < hi)
+            {
+                u32 const mid = (lo + hi) >> 1;
+                if (keys[index->m_order[mid]] < min_key)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
 
-            // Move the last element to the current position
-            if (local_index != container->m_free_index)
+            grid_filter_t const filter = s_grid_filter(index->m_ecs, reference);
+            u32                 count  = 0;
+            for (u32 o = lo; o < index->m_order_count && keys[index->m_order[o]] <= max_key; ++o)
             {
-                u32 const last_entity_index                     = container->m_local_to_global[container->m_free_index];
-                container->m_global_to_local[last_entity_index] = local_index;
-                container->m_local_to_global[local_index]       = last_entity_index;
+                u32 const i = index->m_order[o];
+                if (!s_index_accept(index, filter, i))
+                    continue;
+                if (count < max_out)
+                    out[count] = index->m_nodes[i].m_entity;
+                count++;
+            }
+            return count;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // reductions
+
+        static inline void s_reduce_identity(ereduce_t op, f32* lanes, u32 num_lanes)
+        {
+            f32 const identity = op == REDUCE_SUM ? 0.0f : (op == REDUCE_MIN ? 3.402823466e+38f : -3.402823466e+38f);
+            for (u32 l = 0; l < num_lanes; ++l)
+                lanes[l] = identity;
+        }
+
+        static inline void s_reduce_identity(ereduce_t op, s32* lanes, u32 num_lanes)
+        {
+            s32 const identity = op == REDUCE_SUM ? 0 : (op == REDUCE_MIN ? 0x7FFFFFFF : (s32)0x80000000);
+            for (u32 l = 0; l < num_lanes; ++l)
+                lanes[l] = identity;
+        }
 
-                byte* const last_component_data = &container->m_component_data[container->m_free_index * container->m_sizeof_component];
-                byte* const cur_component_data  = &container->m_component_data[local_index * container->m_sizeof_component];
-                g_memcopy(cur_component_data, last_component_data, container->m_sizeof_component);
+        // Reduce 'count' components that are 'stride' bytes apart, the switch is outside of the loops so that the
+        // inner loops are branch free and can be vectorized by the compiler.
+        template <typename T> static void s_reduce_kernel(byte const* data, u32 stride, u32 count, ereduce_t op, T* lanes, u32 num_lanes)
+        {
+            switch (op)
+            {
+                case REDUCE_SUM:
+                    for (u32 i = 0; i < count; ++i, data += stride)
+                        for (u32 l = 0; l < num_lanes; ++l)
+                            lanes[l] += ((T const*)data)[l];
+                    break;
+                case REDUCE_MIN:
+                    for (u32 i = 0; i < count; ++i, data += stride)
+                        for (u32 l = 0; l < num_lanes; ++l)
+                            lanes[l] = ((T const*)data)[l] < lanes[l] ? ((T const*)data)[l] : lanes[l];
+                    break;
+                case REDUCE_MAX:
+                    for (u32 i = 0; i < count; ++i, data += stride)
+                        for (u32 l = 0; l < num_lanes; ++l)
+                            lanes[l] = ((T const*)data)[l] > lanes[l] ? ((T const*)data)[l] : lanes[l];
+                    break;
             }
+        }
 
-            u32* component_occupancy = &ecs->m_per_entity_component_occupancy[entity_index * ecs->m_component_words_per_entity];
-            component_occupancy[cp_index >> 5] &= ~(1 << (cp_index & 31));
+        template <typename T> static void s_reduce_combine(ereduce_t op, T* inout_lanes, T const* partial_lanes, u32 num_lanes) { s_reduce_kernel<T>((byte const*)partial_lanes, 0, 1, op, inout_lanes, num_lanes); }
+
+        // Reduce the components in the slots [begin, end), a compressed container is reduced one block at a time and a split
+        // container one column at a time
+        template <typename T> static void s_reduce_run(ecs_t* ecs, component_container_t* container, u32 begin, u32 end, ereduce_t op, T* out_lanes, u32 num_lanes)
+        {
+            u32 const stride = container->m_sizeof_component;
+            if (container->m_soa != nullptr)
+            {
+                // Every lane is a column
+                soa_store_t* soa = container->m_soa;
+                ASSERT(soa->m_field_sizeof == sizeof(T));
+                s_soa_flush(soa);
+                for (u32 l = 0; l < num_lanes; ++l)
+                    s_reduce_kernel<T>(soa->m_columns + l * soa->m_column_stride + begin * sizeof(T), sizeof(T), end - begin, op, &out_lanes[l], 1);
+                return;
+            }
+            if (container->m_compressed == nullptr)
+            {
+                s_reduce_kernel<T>(container->m_component_data + begin * stride, stride, end - begin, op, out_lanes, num_lanes);
+                return;
+            }
+            while (begin < end)
+            {
+                u32 const block_end = math::min((begin / ECS3_COMPRESSED_BLOCK_SIZE + 1) * ECS3_COMPRESSED_BLOCK_SIZE, end);
+                s_reduce_kernel<T>(s_component_at(ecs, container, begin, false), stride, block_end - begin, op, out_lanes, num_lanes);
+                begin = block_end;
+            }
         }
 
-        void* g_get_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        // Reduce a chunk of the component container, runs of matching components are handed to the kernel in one go
+        template <typename T> static u32 s_reduce_chunk(ecs_t* ecs, entity_t reference, u32 cp_index, u32 chunk_index, ereduce_t op, T* out_lanes, u32 num_lanes)
         {
+            s_reduce_identity(op, out_lanes, num_lanes);
             if (cp_index >= ecs->m_max_component_types)
-                return nullptr;
+                return 0;
 
             component_container_t* container = &ecs->m_component_containers[cp_index];
             if (container->m_sizeof_component == 0)
-                return nullptr;
+                return 0;
+            ASSERT(num_lanes * sizeof(T) <= container->m_sizeof_component);
 
-            u32 const entity_index = g_entity_index(entity);
-            if (container->m_global_to_local[entity_index] >= 0)
-                return &container->m_component_data[container->m_global_to_local[entity_index] * container->m_sizeof_component];
-            return nullptr;
+            u32 const begin = chunk_index * ECS3_REDUCE_CHUNK_SIZE;
+            u32 const end   = math::min(begin + ECS3_REDUCE_CHUNK_SIZE, container->m_free_index);
+            if (begin >= end)
+                return 0;
+
+            if (reference == ECS_ENTITY_NULL)
+            {
+                s_reduce_run<T>(ecs, container, begin, end, op, out_lanes, num_lanes);
+                return end - begin;
+            }
+
+            u32 const* ref_component_occupancy = &ecs->m_per_entity_component_occupancy[g_entity_index(reference) * ecs->m_component_words_per_entity];
+            u32 const* ref_tag_occupancy       = &ecs->m_per_entity_tags[g_entity_index(reference) * ecs->m_tag_words_per_entity];
+
+            u32 count     = 0;
+            u32 run_begin = begin;
+            for (u32 i = begin; i < end; ++i)
+            {
+                u32 const entity_index = container->m_local_to_global[i];
+                if (entity_index == g_entity_index(reference) || !s_matches_reference(ecs, entity_index, ref_component_occupancy, ref_tag_occupancy))
+                {
+                    s_reduce_run<T>(ecs, container, run_begin, i, op, out_lanes, num_lanes);
+                    count += i - run_begin;
+                    run_begin = i + 1;
+                }
+            }
+            s_reduce_run<T>(ecs, container, run_begin, end, op, out_lanes, num_lanes);
+            count += end - run_begin;
+            return count;
         }
 
-        bool g_has_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        template <typename T> static u32 s_reduce(ecs_t* ecs, entity_t reference, u32 cp_index, ereduce_t op, T* out_lanes, u32 num_lanes)
         {
-            if (tg_index >= ecs->m_max_component_types)
-                return false;
+            T partial_lanes[64];
+            ASSERT(num_lanes <= 64);
 
-            u32 const* tag_occupancy = &ecs->m_per_entity_tags[g_entity_index(entity) * ecs->m_tag_words_per_entity];
-            return (tag_occupancy[tg_index >> 5] & (1 << (tg_index & 31))) != 0;
+            s_reduce_identity(op, out_lanes, num_lanes);
+            u32       count      = 0;
+            u32 const num_chunks = g_reduce_num_chunks(ecs, cp_index);
+            for (u32 c = 0; c < num_chunks; ++c)
+            {
+                count += s_reduce_chunk<T>(ecs, reference, cp_index, c, op, partial_lanes, num_lanes);
+                s_reduce_combine<T>(op, out_lanes, partial_lanes, num_lanes);
+            }
+            return count;
         }
 
-        void g_add_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        u32 g_reduce_num_chunks(ecs_t* ecs, u32 cp_index)
         {
-            if (tg_index >= ecs->m_max_component_types)
-                return;
-
-            u32* tag_occupancy = &ecs->m_per_entity_tags[g_entity_index(entity) * ecs->m_tag_words_per_entity];
-            tag_occupancy[tg_index >> 5] |= (1 << (tg_index & 31));
+            if (cp_index >= ecs->m_max_component_types)
+                return 0;
+            return (ecs->m_component_containers[cp_index].m_free_index + ECS3_REDUCE_CHUNK_SIZE - 1) / ECS3_REDUCE_CHUNK_SIZE;
         }
 
-        void g_rem_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        u32  g_reduce_f32(ecs_t* ecs, entity_t reference, u32 cp_index, ereduce_t op, f32* out_lanes, u32 num_lanes) { return s_reduce<f32>(ecs, reference, cp_index, op, out_lanes, num_lanes); }
+        u32  g_reduce_s32(ecs_t* ecs, entity_t reference, u32 cp_index, ereduce_t op, s32* out_lanes, u32 num_lanes) { return s_reduce<s32>(ecs, reference, cp_index, op, out_lanes, num_lanes); }
+        u32  g_reduce_chunk_f32(ecs_t* ecs, entity_t reference, u32 cp_index, u32 chunk_index, ereduce_t op, f32* out_lanes, u32 num_lanes) { return s_reduce_chunk<f32>(ecs, reference, cp_index, chunk_index, op, out_lanes, num_lanes); }
+        u32  g_reduce_chunk_s32(ecs_t* ecs, entity_t reference, u32 cp_index, u32 chunk_index, ereduce_t op, s32* out_lanes, u32 num_lanes) { return s_reduce_chunk<s32>(ecs, reference, cp_index, chunk_index, op, out_lanes, num_lanes); }
+        void g_reduce_combine_f32(ereduce_t op, f32* inout_lanes, f32 const* partial_lanes, u32 num_lanes) { s_reduce_combine<f32>(op, inout_lanes, partial_lanes, num_lanes); }
+        void g_reduce_combine_s32(ereduce_t op, s32* inout_lanes, s32 const* partial_lanes, u32 num_lanes) { s_reduce_combine<s32>(op, inout_lanes, partial_lanes, num_lanes); }
+
+        u32 g_fold(ecs_t* ecs, entity_t reference, u32 cp_index, fold_fn fn, void* accumulator, void* user)
         {
-            if (tg_index >= ecs->m_max_component_types)
-                return;
+            if (cp_index >= ecs->m_max_component_types)
+                return 0;
+            component_container_t* container = &ecs->m_component_containers[cp_index];
+            if (container->m_sizeof_component == 0)
+                return 0;
 
-            u32* tag_occupancy = &ecs->m_per_entity_tags[g_entity_index(entity) * ecs->m_tag_words_per_entity];
-            tag_occupancy[tg_index >> 5] &= ~(1 << (tg_index & 31));
+            u32 const* ref_component_occupancy = reference != ECS_ENTITY_NULL ? &ecs->m_per_entity_component_occupancy[g_entity_index(reference) * ecs->m_component_words_per_entity] : nullptr;
+            u32 const* ref_tag_occupancy       = reference != ECS_ENTITY_NULL ? &ecs->m_per_entity_tags[g_entity_index(reference) * ecs->m_tag_words_per_entity] : nullptr;
+
+            u32 count = 0;
+            for (u32 i = 0; i < container->m_free_index; ++i)
+            {
+                if (ref_component_occupancy != nullptr)
+                {
+                    u32 const entity_index = container->m_local_to_global[i];
+                    if (entity_index == g_entity_index(reference) || !s_matches_reference(ecs, entity_index, ref_component_occupancy, ref_tag_occupancy))
+                        continue;
+                }
+                fn(accumulator, s_component_at(ecs, container, i, false), user);
+                count++;
+            }
+            return count;
         }
 
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // iterator
+
         en_iterator_t::en_iterator_t(ecs_t* ecs)
             : m_ecs(ecs)
             , m_entity_reference(-1)
             , m_entity_index(-1)
+            , m_sg_read_mask(0)
+            , m_sg_write_mask(0)
+            , m_sleeping(false)
         {
         }
 
@@ -261,18 +2832,31 @@ namespace ncore
             : m_ecs(ecs)
             , m_entity_reference(entity_reference == ECS_ENTITY_NULL ? -1 : g_entity_index(entity_reference))
             , m_entity_index(-1)
+            , m_sg_read_mask(0)
+            , m_sg_write_mask(0)
+            , m_sleeping(false)
         {
         }
 
+        void en_iterator_t::read_singleton(u32 sg_index) { m_sg_read_mask |= ((u32)1 << sg_index); }
+
+        void en_iterator_t::write_singleton(u32 sg_index)
+        {
+            m_sg_read_mask |= ((u32)1 << sg_index);
+            m_sg_write_mask |= ((u32)1 << sg_index);
+        }
+
         entity_t en_iterator_t::entity() const { return m_entity_index >= 0 ? s_entity_make(m_ecs->m_per_entity_generation[m_entity_index], m_entity_index) : ECS_ENTITY_NULL; }
 
-        // TODO, optimize this, we can determine the 'words' that have bits set in the reference entity, same for the tags
+        void en_iterator_t::begin(s32 entity_index) { m_entity_index = entity_index < (s32)m_ecs->m_max_entities ? find(entity_index) : -1; }
 
         s32 en_iterator_t::find(s32 entity_index) const
         {
+            // Only the awake entities are scanned, unless the sleeping entities are included
+            duomap_t* state = s_scan_state(m_ecs, m_sleeping);
             if (m_entity_reference < 0)
             {
-                return entity_index >= 0 ? m_ecs->m_entity_state.next_used_up(entity_index) : -1;
+                return entity_index >= 0 ? state->next_used_up(entity_index) : -1;
             }
 
             // See if this entity has all the components and tags that we are looking for by taking the
@@ -280,43 +2864,63 @@ namespace ncore
             u32 const* ref_component_occupancy = &m_ecs->m_per_entity_component_occupancy[g_entity_index(m_entity_reference) * m_ecs->m_component_words_per_entity];
             u32 const* ref_tag_occupancy       = &m_ecs->m_per_entity_tags[g_entity_index(m_entity_reference) * m_ecs->m_tag_words_per_entity];
 
-            entity_index = m_ecs->m_entity_state.next_used_up(entity_index);
+            entity_index = state->next_used_up(entity_index);
             while (entity_index >= 0)
             {
-                if (entity_index != m_entity_reference)
-                {
-                    u32 const* cur_component_occupancy = &m_ecs->m_per_entity_component_occupancy[entity_index * m_ecs->m_component_words_per_entity];
-                    bool       has_all_components      = true;
-                    for (u32 i = 0; i < m_ecs->m_component_words_per_entity; ++i)
-                    {
-                        if ((cur_component_occupancy[i] & ref_component_occupancy[i]) != ref_component_occupancy[i])
-                        {
-                            has_all_components = false;
-                            break;
-                        }
-                    }
-
-                    if (has_all_components)
-                    {
-                        u32 const* cur_tag_occupancy = &m_ecs->m_per_entity_tags[entity_index * m_ecs->m_tag_words_per_entity];
-                        bool       has_all_tags      = true;
-                        for (u32 i = 0; i < m_ecs->m_tag_words_per_entity; ++i)
-                        {
-                            if ((cur_tag_occupancy[i] & ref_tag_occupancy[i]) != ref_tag_occupancy[i])
-                            {
-                                has_all_tags = false;
-                                break;
-                            }
-                        }
-                        if (has_all_tags)
-                            break;
-                    }
-                }
-                entity_index = m_ecs->m_entity_state.next_used_up(entity_index + 1);
+                if (entity_index != m_entity_reference && s_matches_reference(m_ecs, entity_index, ref_component_occupancy, ref_tag_occupancy))
+                    break;
+                entity_index = state->next_used_up(entity_index + 1);
             }
 
             return entity_index;
         }
 
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // cursor
+
+        en_cursor_t::en_cursor_t(ecs_t* ecs, entity_t reference)
+            : m_ecs(ecs)
+            , m_iter(ecs, reference)
+            , m_position(0)
+            , m_laps(0)
+        {
+        }
+
+        u32 en_cursor_t::run(cursor_fn fn, void* user, u32 max_entities, clock_fn clock, u64 deadline)
+        {
+            // After wrapping around the step stops at the entity index where it started
+            s32 const start = m_position;
+            s32       limit = -1;
+            u32       count = 0;
+
+            m_iter.begin(m_position);
+            while (count < max_entities)
+            {
+                if (m_iter.end())
+                {
+                    m_laps++;
+                    m_position = 0;
+                    if (limit >= 0 || start == 0)
+                        break;
+                    limit = start;
+                    m_iter.begin(0);
+                    continue;
+                }
+
+                s32 const entity_index = m_iter.index();
+                if (limit >= 0 && entity_index >= limit)
+                    break;
+                if (clock != nullptr && (count & 15) == 0 && clock(user) >= deadline)
+                    break;
+
+                fn(m_ecs, m_iter.entity(), user);
+                count++;
+                m_position = entity_index + 1;
+                m_iter.next();
+            }
+            return count;
+        }
+
     } // namespace necs3
 } // namespace ncore
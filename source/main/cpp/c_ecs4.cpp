@@ -22,7 +22,7 @@ namespace ncore
         //     - Uses ncore::arena_t for managing entity data
         // Limitations:
         //     - Maximum archetypes: 256
-        //     - Maximum entities: 65536
+        //     - Maximum entities: 65536 per archetype, or 16M for a 'wide' archetype
         //     - Maximum component types: 64
         //     - Per entity maximum components: 64
         //     - Per entity maximum tags: 32
@@ -80,513 +80,4836 @@ namespace ncore
         // --------------------------------------------------------------------------------------------------------
         // --------------------------------------------------------------------------------------------------------
         // type definitions and utility functions
-        typedef u8  entity_generation_t;
         typedef u32 entity_index_t;
 
-        const u32 ECS_ENTITY_NULL            = (0xFFFFFFFF); // Null entity
-        const u32 ECS_ENTITY_INDEX_MASK      = (0x0000FFFF); // Mask to use to get the entity index from an entity identifier
+        // Entity identifier {index-high(8) + archetype(8) + index-low(16)}
+        // Note: The upper 8 bits extend the entity index for archetypes that hold more than 65536 entities, for
+        //       the default archetype size they are always 0.
+        const u32 ECS_ENTITY_INDEX_MASK      = (0x0000FFFF); // Mask to use to get the (low) entity index from an entity identifier
         const u32 ECS_ENTITY_ARCHETYPE_MASK  = (0x00FF0000); // Mask to use to get the archetype index from an entity identifier
         const s8  ECS_ENTITY_ARCHETYPE_SHIFT = (16);         // Shift to get the archetype index
-        const u32 ECS_ENTITY_GEN_ID_MASK     = (0xFF000000); // Mask to use to get the generation id from an entity identifier
-        const s8  ECS_ENTITY_GEN_ID_SHIFT    = (24);         // Shift to get the generation id
+        const u32 ECS_ENTITY_INDEX_HI_MASK   = (0xFF000000); // Mask to use to get the high part of the entity index
+        const s8  ECS_ENTITY_INDEX_HI_SHIFT  = (8);          // Shift to move the high part of the entity index in place
 
-        inline bool                g_entity_is_null(entity_t e) { return e == ECS_ENTITY_NULL; }
-        inline entity_generation_t g_entity_generation(entity_t e) { return ((u32)e & ECS_ENTITY_GEN_ID_MASK) >> ECS_ENTITY_GEN_ID_SHIFT; }
-        inline entity_index_t      g_entity_index(entity_t e) { return (entity_index_t)e & ECS_ENTITY_INDEX_MASK; }
-        inline u8                  g_entity_archetype_index(entity_t e) { return (u8)((e & ECS_ENTITY_ARCHETYPE_MASK) >> ECS_ENTITY_ARCHETYPE_SHIFT); }
+        inline bool           g_entity_is_null(entity_t e) { return e == ECS_ENTITY_NULL; }
+        inline entity_index_t g_entity_index(entity_t e) { return ((entity_index_t)e & ECS_ENTITY_INDEX_MASK) | (((entity_index_t)e & ECS_ENTITY_INDEX_HI_MASK) >> ECS_ENTITY_INDEX_HI_SHIFT); }
+        inline u8             g_entity_archetype_index(entity_t e) { return (u8)((e & ECS_ENTITY_ARCHETYPE_MASK) >> ECS_ENTITY_ARCHETYPE_SHIFT); }
 
-        static inline entity_t s_entity_make(entity_generation_t genid, u8 archetype_index, entity_index_t entity_index)
+        static inline entity_t s_entity_make(u8 archetype_index, entity_index_t entity_index)
         {
-            // Combine generation ID, archetype index, and entity index into a single entity identifier
-            return ((u32)genid << ECS_ENTITY_GEN_ID_SHIFT) | ((u32)archetype_index << ECS_ENTITY_ARCHETYPE_SHIFT) | ((u32)entity_index & ECS_ENTITY_INDEX_MASK);
+            // Combine archetype index and entity index into a single entity identifier
+            return (((u32)entity_index << ECS_ENTITY_INDEX_HI_SHIFT) & ECS_ENTITY_INDEX_HI_MASK) | ((u32)archetype_index << ECS_ENTITY_ARCHETYPE_SHIFT) | ((u32)entity_index & ECS_ENTITY_INDEX_MASK);
         }
 
+        // The distance between two components, the size padded to the alignment so that every component is aligned. The
+        // bins and arenas are reserved virtual memory, their base is page aligned.
+        static inline u32 s_component_stride(u32 cp_sizeof, u32 cp_alignof)
+        {
+            const u32 align = math::max(cp_alignof, (u32)1);
+            ASSERT(math::ispo2(align) && align <= ECS4_MAX_ALIGNMENT);
+            return math::alignUp(cp_sizeof, align);
+        }
+
+        // Memory from an arena that starts on a cache line, the arena needs ECS4_MAX_ALIGNMENT bytes extra
+        static inline byte* s_allocate_aligned(arena_t* arena, u32 size) { return (byte*)math::alignUp((u64)g_allocate<byte>(arena, size + ECS4_MAX_ALIGNMENT), ECS4_MAX_ALIGNMENT); }
+
         // --------------------------------------------------------------------------------------------------------
         // --------------------------------------------------------------------------------------------------------
+        // shared component pools
+#define ECS_MAX_SHARED_TYPES 32
+
+        // The unique values of a shared component type, found by hash and reference counted by the entities that use
+        // them. A value index does not change while the value is referenced, a released index is reused by a new value.
+        struct shared_pool_t
+        {
+            arena_t* m_arena;       // arena that holds the pool
+            u16      m_cp_index;    // global component type index
+            u32      m_sizeof;      // size of a value
+            u32      m_stride;      // distance between two values
+            u32      m_max_values;  // maximum number of unique values
+            u32      m_count;       // number of values in use
+            u32      m_end;         // value indices are below this
+            u32      m_free_head;   // first released value index, linked through m_next
+            u32      m_bucket_mask; // number of buckets - 1
+            byte*    m_values;      // value per index
+            u32*     m_refcounts;   // references per value, 0 = free
+            u32*     m_hashes;      // hash per value
+            u32*     m_next;        // next value in the same bucket, or the next free value
+            u32*     m_buckets;     // first value per bucket
+        };
+
+        static shared_pool_t* s_shared_create(u16 cp_index, u32 cp_sizeof, u32 cp_alignof, u32 max_values)
+        {
+            u32 num_buckets = 16;
+            while (num_buckets < max_values)
+                num_buckets <<= 1;
+
+            const u32   stride    = s_component_stride(cp_sizeof, math::max(cp_alignof, (u32)8));
+            const int_t pool_size = (int_t)(sizeof(shared_pool_t) + (int_t)max_values * (stride + 3 * sizeof(u32)) + num_buckets * sizeof(u32) + 64 + ECS4_MAX_ALIGNMENT);
+            arena_t*    arena     = narena::new_arena(pool_size, pool_size);
+
+            shared_pool_t* pool = g_allocate<shared_pool_t>(arena);
+            pool->m_arena       = arena;
+            pool->m_cp_index    = cp_index;
+            pool->m_sizeof      = cp_sizeof;
+            pool->m_stride      = stride;
+            pool->m_max_values  = max_values;
+            pool->m_count       = 0;
+            pool->m_end         = 0;
+            pool->m_free_head   = ECS4_SHARED_NONE;
+            pool->m_bucket_mask = num_buckets - 1;
+            pool->m_values      = s_allocate_aligned(arena, max_values * stride);
+            pool->m_refcounts   = g_allocate<u32>(arena, max_values);
+            pool->m_hashes      = g_allocate<u32>(arena, max_values);
+            pool->m_next        = g_allocate<u32>(arena, max_values);
+            pool->m_buckets     = g_allocate<u32>(arena, num_buckets);
+            g_memset(pool->m_buckets, 0xFF, (int_t)num_buckets * sizeof(u32));
+            return pool;
+        }
+
+        // FNV-1a
+        static inline u32 s_shared_hash(byte const* value, u32 size)
+        {
+            u32 hash = 2166136261u;
+            for (u32 i = 0; i < size; ++i)
+                hash = (hash ^ value[i]) * 16777619u;
+            return hash;
+        }
+
+        static inline bool s_shared_equal(byte const* a, byte const* b, u32 size)
+        {
+            for (u32 i = 0; i < size; ++i)
+            {
+                if (a[i] != b[i])
+                    return false;
+            }
+            return true;
+        }
+
+        static inline byte const* s_shared_value(shared_pool_t const* pool, u32 value_index)
+        {
+            if (value_index >= pool->m_end || pool->m_refcounts[value_index] == 0)
+                return nullptr;
+            return pool->m_values + (u64)value_index * pool->m_stride;
+        }
+
+        // Returns the index of the value with one more reference, ECS4_SHARED_NONE when the pool is full
+        static u32 s_shared_acquire(shared_pool_t* pool, void const* value)
+        {
+            byte const* bytes  = (byte const*)value;
+            const u32   stride = pool->m_stride;
+            const u32   hash   = s_shared_hash(bytes, pool->m_sizeof);
+            u32&        bucket = pool->m_buckets[hash & pool->m_bucket_mask];
+            for (u32 i = bucket; i != ECS4_SHARED_NONE; i = pool->m_next[i])
+            {
+                if (pool->m_hashes[i] == hash && s_shared_equal(pool->m_values + (u64)i * stride, bytes, pool->m_sizeof))
+                {
+                    pool->m_refcounts[i]++;
+                    return i;
+                }
+            }
+
+            u32 value_index;
+            if (pool->m_free_head != ECS4_SHARED_NONE)
+            {
+                value_index       = pool->m_free_head;
+                pool->m_free_head = pool->m_next[value_index];
+            }
+            else if (pool->m_end < pool->m_max_values)
+            {
+                value_index = pool->m_end++;
+            }
+            else
+            {
+                return ECS4_SHARED_NONE;
+            }
+
+            g_memcopy(pool->m_values + (u64)value_index * stride, bytes, pool->m_sizeof);
+            pool->m_hashes[value_index]    = hash;
+            pool->m_refcounts[value_index] = 1;
+            pool->m_next[value_index]      = bucket;
+            bucket                         = value_index;
+            pool->m_count++;
+            return value_index;
+        }
+
+        static inline void s_shared_add_refs(shared_pool_t* pool, u32 value_index, u32 count)
+        {
+            if (value_index < pool->m_end)
+                pool->m_refcounts[value_index] += count;
+        }
+
+        // Drop a reference, the last reference returns the value index to the free list
+        static void s_shared_release(shared_pool_t* pool, u32 value_index)
+        {
+            if (value_index >= pool->m_end || pool->m_refcounts[value_index] == 0)
+                return;
+            if (--pool->m_refcounts[value_index] != 0)
+                return;
+
+            u32* link = &pool->m_buckets[pool->m_hashes[value_index] & pool->m_bucket_mask];
+            while (*link != value_index)
+                link = &pool->m_next[*link];
+            *link                     = pool->m_next[value_index];
+            pool->m_next[value_index] = pool->m_free_head;
+            pool->m_free_head         = value_index;
+            pool->m_count--;
+        }
+
         // --------------------------------------------------------------------------------------------------------
-        // ecs archetype (224 bytes), maximum of 65536 entities per archetype
         // --------------------------------------------------------------------------------------------------------
-#define ECS_ARCHETYPE_MAX_ENTITIES 65536
+        // hierarchy links
 
-        struct archetype_t
+        // The parent/child links of the hierarchy of an archetype, by entity index. The children of a parent are a doubly
+        // linked list, the roots (entities with children but without a parent) are linked the same way. The links are used
+        // for the changes, the flattened order (rebuilt when the hierarchy has changed) is used for the propagation.
+        struct hierarchy_t
         {
-            arena_t* m_archetype_arena;          // arena for allocating member data from
-            u16*     m_global_to_local_cp_type;  // map global component type index to local component type index
-            u8*      m_global_to_local_tag_type; // map global tag type index to local tag type index
-            bin16_t* m_cp_bins;                  // array of component bins (max 64)
-            arena_t* m_cp_occupancy;             // component occupancy bits per entity (u64)
-            arena_t* m_cp_reference;             // component reference array (u16[])
-            arena_t* m_tags;                     // tag bits array (u8, u16 or u32)
-            u16      m_max_global_cp_types;      // maximum number of global component types
-            u16      m_max_global_tag_types;     // maximum number of global tag types
-            u16      m_num_cps;                  // current number of component bins
-            u8       m_num_tags;                 // current number of tags
-            u16      m_per_entity_cps;           // number of components per entity
-            u16      m_per_entity_tags;          // number of tags per entity
-            u32      m_free_index;               // first free entity index
-            u32      m_alive_count;              // number of alive entities
-            u64      m_free_bin0;                // 16 * 64 * 64 = 65536 entities
-            u64      m_alive_bin0;               // 16 * 64 * 64 = 65536 entities
-            u64*     m_free_bin1;                // track the 0 bits in m_entity_bin2 (16 * sizeof(u64) = 128 bytes)
-            u64*     m_alive_bin1;               // track the 1 bits in m_entity_bin2 (16 * sizeof(u64) = 128 bytes)
-            arena_t* m_bin2;                     // '1' bit = alive entity, '0' bit = free entity (65536 bits = 8 KB)
+            arena_t*  m_arena;           // hierarchy and its arrays
+            u8        m_archetype_index; //
+            u32       m_first_root;      // first root, linked through m_next_sibling
+            u32       m_num_levels;      // number of levels in the flattened order
+            bool      m_dirty;           // the flattened order needs to be rebuilt
+            u32*      m_parent;          // per entity, the parent or 0xFFFFFFFF
+            u32*      m_first_child;     // per entity, the first child or 0xFFFFFFFF
+            u32*      m_next_sibling;    // per entity, the next child of the parent (or the next root)
+            u32*      m_prev_sibling;    // per entity, the previous child of the parent (or the previous root)
+            u8*       m_depth;           // per entity, the depth in the hierarchy
+            u32*      m_position;        // per entity, the position in the flattened order
+            entity_t* m_order;           // the flattened order, level by level
+            u32*      m_order_parent;    // per position, the position of the parent
+            u32       m_level_begin[ECS4_HIERARCHY_MAX_DEPTH + 1];
         };
 
-        static void s_initialize_archetype(archetype_t* archetype, u8 max_cps_per_entity, u16 max_global_cp_types, u8 max_tags_per_entity, u16 max_global_tag_types)
+        static hierarchy_t* s_hierarchy_create(u8 archetype_index, u32 max_entities)
         {
-            ASSERT(max_global_cp_types < 2048);  // sanity
-            ASSERT(max_global_tag_types <= 255); // u8 is used for mapping
-            ASSERT(max_cps_per_entity <= 64);    //
-            ASSERT(max_tags_per_entity <= 32);   // sanity check
+            const int_t hierarchy_size = (int_t)(sizeof(hierarchy_t) + max_entities * (6 * sizeof(u32) + sizeof(u8) + sizeof(entity_t)) + 64);
+            arena_t*    arena          = narena::new_arena(hierarchy_size, 0);
 
-            max_tags_per_entity = math::alignUp(max_tags_per_entity, 8);
+            hierarchy_t* h       = g_allocate<hierarchy_t>(arena);
+            h->m_arena           = arena;
+            h->m_archetype_index = archetype_index;
+            h->m_first_root      = 0xFFFFFFFF;
+            h->m_num_levels      = 0;
+            h->m_dirty           = false;
+            h->m_parent          = g_allocate<u32>(arena, max_entities);
+            h->m_first_child     = g_allocate<u32>(arena, max_entities);
+            h->m_next_sibling    = g_allocate<u32>(arena, max_entities);
+            h->m_prev_sibling    = g_allocate<u32>(arena, max_entities);
+            h->m_depth           = g_allocate<u8>(arena, max_entities);
+            h->m_position        = g_allocate<u32>(arena, max_entities);
+            h->m_order           = g_allocate<entity_t>(arena, max_entities);
+            h->m_order_parent    = g_allocate<u32>(arena, max_entities);
+            g_memset(h->m_parent, 0xFF, (int_t)max_entities * sizeof(u32));
+            g_memset(h->m_first_child, 0xFF, (int_t)max_entities * sizeof(u32));
+            g_memset(h->m_next_sibling, 0xFF, (int_t)max_entities * sizeof(u32));
+            g_memset(h->m_prev_sibling, 0xFF, (int_t)max_entities * sizeof(u32));
+            g_memclr(h->m_depth, (int_t)max_entities);
+            g_memset(h->m_position, 0xFF, (int_t)max_entities * sizeof(u32));
+            for (u32 i = 0; i <= ECS4_HIERARCHY_MAX_DEPTH; ++i)
+                h->m_level_begin[i] = 0;
+            return h;
+        }
 
-            archetype->m_archetype_arena          = narena::new_arena(16 * cKB, 12 * cKB);
-            archetype->m_global_to_local_cp_type  = g_allocate_and_clear<u16>(archetype->m_archetype_arena, max_global_cp_types);
-            archetype->m_global_to_local_tag_type = g_allocate_and_clear<u8>(archetype->m_archetype_arena, max_global_tag_types);
-            archetype->m_cp_occupancy             = narena::new_arena((int_t)sizeof(u64) * ECS_ARCHETYPE_MAX_ENTITIES, 0);
-            archetype->m_cp_reference             = narena::new_arena((int_t)sizeof(u16) * max_cps_per_entity * ECS_ARCHETYPE_MAX_ENTITIES, 0);
-            archetype->m_tags                     = narena::new_arena((int_t)((max_tags_per_entity * ECS_ARCHETYPE_MAX_ENTITIES) >> 3), 0);
-            archetype->m_cp_bins                  = g_allocate_and_clear<bin16_t>(archetype->m_archetype_arena, 64);
-            archetype->m_max_global_cp_types      = (u16)max_global_cp_types;
-            archetype->m_max_global_tag_types     = (u16)max_global_tag_types;
-            archetype->m_per_entity_cps           = (u16)max_cps_per_entity;
-            archetype->m_per_entity_tags          = (u16)max_tags_per_entity;
-            archetype->m_free_index               = 0;
-            archetype->m_alive_count              = 0;
+        static inline bool s_hierarchy_member(hierarchy_t const* h, u32 e) { return h->m_parent[e] != 0xFFFFFFFF || h->m_first_child[e] != 0xFFFFFFFF; }
 
-            archetype->m_free_bin0  = D_U64_MAX;
-            archetype->m_alive_bin0 = D_U64_MAX;
-            archetype->m_free_bin1  = g_allocate<u64>(archetype->m_archetype_arena, 16);                            // track the 0 bits in m_entity_bin2 (16 * sizeof(u64) = 128 bytes)
-            archetype->m_alive_bin1 = g_allocate<u64>(archetype->m_archetype_arena, 16);                            // track the 1 bits in m_entity_bin2 (16 * sizeof(u64) = 128 bytes)
-            archetype->m_bin2       = narena::new_arena((int_t)(ECS_ARCHETYPE_MAX_ENTITIES >> 6) * sizeof(u64), 0); // '1' bit = alive entity, '0' bit = free entity (65536 bits = 8 KB)
+        // Link 'e' at the front of the children of 'parent', or of the roots when 'parent' is 0xFFFFFFFF
+        static void s_hierarchy_link(hierarchy_t* h, u32 e, u32 parent)
+        {
+            u32& head            = parent != 0xFFFFFFFF ? h->m_first_child[parent] : h->m_first_root;
+            h->m_prev_sibling[e] = 0xFFFFFFFF;
+            h->m_next_sibling[e] = head;
+            if (head != 0xFFFFFFFF)
+                h->m_prev_sibling[head] = e;
+            head = e;
         }
 
-        static void s_destroy(archetype_t* archetype)
+        static void s_hierarchy_unlink(hierarchy_t* h, u32 e)
         {
-            narena::destroy(archetype->m_cp_occupancy);
-            narena::destroy(archetype->m_cp_reference);
-            narena::destroy(archetype->m_tags);
-            narena::destroy(archetype->m_bin2);
+            const u32 prev = h->m_prev_sibling[e];
+            const u32 next = h->m_next_sibling[e];
+            if (prev != 0xFFFFFFFF)
+                h->m_next_sibling[prev] = next;
+            else if (h->m_parent[e] != 0xFFFFFFFF)
+                h->m_first_child[h->m_parent[e]] = next;
+            else
+                h->m_first_root = next;
+            if (next != 0xFFFFFFFF)
+                h->m_prev_sibling[next] = prev;
+            h->m_prev_sibling[e] = 0xFFFFFFFF;
+            h->m_next_sibling[e] = 0xFFFFFFFF;
+        }
 
-            narena::destroy(archetype->m_archetype_arena);
+        // The next entity of a pre-order walk over the subtree of 'root', 0xFFFFFFFF at the end
+        static inline u32 s_hierarchy_next(hierarchy_t const* h, u32 root, u32 e)
+        {
+            if (h->m_first_child[e] != 0xFFFFFFFF)
+                return h->m_first_child[e];
+            while (e != root && h->m_next_sibling[e] == 0xFFFFFFFF)
+                e = h->m_parent[e];
+            return e != root ? h->m_next_sibling[e] : 0xFFFFFFFF;
         }
 
-        static void s_register_component_type(archetype_t* archetype, u16 global_cp_type_index, u32 sizeof_component)
+        // Set the depth of 'root' and of all its descendants, the walk over the links needs no stack
+        static void s_hierarchy_set_depth(hierarchy_t* h, u32 root, u32 depth)
         {
-            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
-            if (archetype->m_global_to_local_cp_type[global_cp_type_index] != 0xFFFF)
-                return;
-            archetype->m_global_to_local_cp_type[global_cp_type_index] = (u16)archetype->m_num_cps;
-            bin16_t& bin                                               = archetype->m_cp_bins[archetype->m_num_cps];
-            bin_setup(&bin, sizeof_component, 65535);
-            archetype->m_num_cps++;
+            ASSERT(depth < ECS4_HIERARCHY_MAX_DEPTH);
+            h->m_depth[root] = (u8)depth;
+            for (u32 e = s_hierarchy_next(h, root, root); e != 0xFFFFFFFF; e = s_hierarchy_next(h, root, e))
+            {
+                ASSERT((u32)h->m_depth[h->m_parent[e]] + 1 < ECS4_HIERARCHY_MAX_DEPTH);
+                h->m_depth[e] = h->m_depth[h->m_parent[e]] + 1;
+            }
+        }
+
+        // The number of levels below 'root', 0 when it has no children
+        static u32 s_hierarchy_height(hierarchy_t const* h, u32 root)
+        {
+            u32 max_depth = h->m_depth[root];
+            for (u32 e = s_hierarchy_next(h, root, root); e != 0xFFFFFFFF; e = s_hierarchy_next(h, root, e))
+                max_depth = math::max(max_depth, (u32)h->m_depth[e]);
+            return max_depth - h->m_depth[root];
         }
 
-        static void s_register_tag_type(archetype_t* archetype, u16 global_tag_type_index)
+        // Remove 'e' from the children of its parent, a parent without a parent and without children leaves the hierarchy
+        // and 'e' becomes a root when it has children
+        static void s_hierarchy_detach(hierarchy_t* h, u32 e)
         {
-            ASSERT(archetype->m_num_tags < archetype->m_per_entity_tags);
-            if (archetype->m_global_to_local_tag_type[global_tag_type_index] != 0xFF)
+            const u32 parent = h->m_parent[e];
+            if (parent == 0xFFFFFFFF)
                 return;
-            archetype->m_global_to_local_tag_type[global_tag_type_index] = archetype->m_num_tags;
-            archetype->m_num_tags++;
+            s_hierarchy_unlink(h, e);
+            h->m_parent[e] = 0xFFFFFFFF;
+            if (h->m_first_child[parent] == 0xFFFFFFFF && h->m_parent[parent] == 0xFFFFFFFF)
+                s_hierarchy_unlink(h, parent);
+            if (h->m_first_child[e] != 0xFFFFFFFF)
+                s_hierarchy_link(h, e, 0xFFFFFFFF);
+            s_hierarchy_set_depth(h, e, 0);
+            h->m_dirty = true;
         }
 
-        static byte* s_alloc_component(archetype_t* archetype, u32 entity_index, u16 global_cp_type_index)
+        // Make 'e' (which has no parent) a child of 'parent'
+        static void s_hierarchy_attach(hierarchy_t* h, u32 e, u32 parent)
         {
-            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
-            ASSERT(entity_index < archetype->m_free_index);
+            if (h->m_first_child[e] != 0xFFFFFFFF)
+                s_hierarchy_unlink(h, e); // no longer a root
+            if (!s_hierarchy_member(h, parent))
+                s_hierarchy_link(h, parent, 0xFFFFFFFF); // a new root
+            h->m_parent[e] = parent;
+            s_hierarchy_link(h, e, parent);
+            s_hierarchy_set_depth(h, e, h->m_depth[parent] + 1);
+            h->m_dirty = true;
+        }
 
-            const u16 component_type_index = archetype->m_global_to_local_cp_type[global_cp_type_index];
+        // Take an entity that is destroyed out of the hierarchy, its children are detached
+        static void s_hierarchy_remove(hierarchy_t* h, u32 e)
+        {
+            while (h->m_first_child[e] != 0xFFFFFFFF)
+                s_hierarchy_detach(h, h->m_first_child[e]);
+            s_hierarchy_detach(h, e);
+        }
 
-            u64* occupancy_array = narena::base_ptr_as<u64>(archetype->m_cp_occupancy);
-            u64& occupancy       = occupancy_array[entity_index];
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // ecs archetype, by default a maximum of 65536 entities per archetype, a 'wide' archetype can hold up to
+        // 16M entities at the cost of 32-bit component references.
+        // --------------------------------------------------------------------------------------------------------
+#define ECS_ARCHETYPE_MAX_ENTITIES      65536
+#define ECS_ARCHETYPE_MAX_WIDE_ENTITIES (1 << 24)
+#define ECS_STATE_PAGE_SHIFT            18
+#define ECS_STATE_PAGE_ENTITIES         (1 << ECS_STATE_PAGE_SHIFT)
 
-            const u64 bit_mask = ((u64)1 << component_type_index);
+        // A page of the entity alive/free state, a nstatevec18 can track 64 * 64 * 64 = 262144 entities. Archetypes
+        // that hold more entities use multiple pages, and the archetype tracks which pages have free (hole) entries.
+        struct state_page_t
+        {
+            u64  m_free_bin0;   // track the 0 bits in m_free_bin1
+            u64  m_alive_bin0;  // track the 1 bits in m_alive_bin1
+            u64* m_free_bin1;   // track the 0 bits in m_bin2 (max 64 * sizeof(u64) = 512 bytes)
+            u64* m_alive_bin1;  // track the 1 bits in m_bin2 (max 64 * sizeof(u64) = 512 bytes)
+            u64* m_bin2;        // points into archetype->m_bin2, '1' bit = alive entity, '0' bit = free entity
+            u32  m_alive_count; // number of alive entities in this page
+        };
 
-            bin16_t* cp_bin = &archetype->m_cp_bins[component_type_index];
-            ASSERT(cp_bin->m_bin != nullptr);
+        struct query_t
+        {
+            u64      m_cp_mask;  // local components that the query requires
+            u32      m_tag_mask; // local tags that the query requires
+            u32      m_count;    // number of members
+            arena_t* m_members;  // '1' bit = entity is a member, aligned with m_bin2
+        };
 
-            if (occupancy & bit_mask)
+        // Compressed component storage, the values of a cold store can be kept in blocks of 64 slots that are encoded. The
+        // values of a block are split into byte planes (byte 0 of every value, then byte 1, ...) and every plane is delta
+        // coded, similar values turn into runs of zero bytes. A token below 0x80 is followed by (token + 1) literal bytes,
+        // a token of 0x80 or above is a run of (token - 0x7F) zero bytes, the zero bytes at the end are not stored. A
+        // block that does not get smaller is stored as is.
+        static u32 s_block_encode(byte const* values, u32 value_sizeof, byte* out)
+        {
+            const u32 raw_size = value_sizeof * ECS4_COMPRESSED_BLOCK_SIZE;
+            u32       size     = 0;
+            u32       zeros    = 0;
+            u32       literal  = 0xFFFFFFFF; // position of the token of the open literal run
+            for (u32 p = 0; p < value_sizeof; ++p)
             {
-                // count the bits that are before 'bit_index' to find the local index (popcount)
-                const s32 cp_index = (s32)math::countBits(occupancy & (bit_mask - 1));
+                byte previous = 0;
+                for (u32 i = 0; i < ECS4_COMPRESSED_BLOCK_SIZE; ++i)
+                {
+                    if (size + 3 >= raw_size)
+                    {
+                        g_memcopy(out, values, raw_size);
+                        return raw_size;
+                    }
+                    const byte b     = values[i * value_sizeof + p];
+                    const byte delta = (byte)(b - previous);
+                    previous         = b;
+                    if (delta == 0)
+                    {
+                        literal = 0xFFFFFFFF;
+                        if (++zeros == 128)
+                        {
+                            out[size++] = 0xFF;
+                            zeros       = 0;
+                        }
+                        continue;
+                    }
+                    if (zeros > 0)
+                    {
+                        out[size++] = (byte)(0x7F + zeros);
+                        zeros       = 0;
+                    }
+                    if (literal == 0xFFFFFFFF || out[literal] == 0x7F)
+                    {
+                        literal     = size;
+                        out[size++] = 0;
+                    }
+                    else
+                    {
+                        out[literal]++;
+                    }
+                    out[size++] = delta;
+                }
+            }
+            return size;
+        }
 
-                const u16* cp_reference_array = narena::base_ptr_as<const u16>(archetype->m_cp_reference);
-                const u16* cp_references      = cp_reference_array + (entity_index * archetype->m_per_entity_cps);
-                const u16  cp_reference       = cp_references[cp_index];
-                return (byte*)bin_idx2ptr(cp_bin, cp_reference);
+        static void s_block_decode(byte const* in, u32 in_size, u32 value_sizeof, byte* values)
+        {
+            if (in_size == value_sizeof * ECS4_COMPRESSED_BLOCK_SIZE)
+            {
+                g_memcopy(values, in, in_size);
+                return;
             }
-            else
+            g_memclr(values, (int_t)value_sizeof * ECS4_COMPRESSED_BLOCK_SIZE);
+            u32 k   = 0; // position in the planes
+            u32 pos = 0;
+            while (pos < in_size)
             {
-                void* cp_ptr = bin_alloc(cp_bin);
-                if (cp_ptr != nullptr)
+                const byte token = in[pos++];
+                if (token >= 0x80)
                 {
-                    // calculate the number of components currently in the reference array
-                    u16 num_components = (u16)math::countBits(occupancy);
-                    // mark component as allocated
-                    occupancy = occupancy | bit_mask;
+                    k += token - 0x7F;
+                    continue;
+                }
+                for (u32 n = (u32)token + 1; n > 0; --n, ++k)
+                    values[(k & (ECS4_COMPRESSED_BLOCK_SIZE - 1)) * value_sizeof + (k >> 6)] = in[pos++];
+            }
+            for (u32 p = 0; p < value_sizeof; ++p)
+            {
+                for (u32 i = 1; i < ECS4_COMPRESSED_BLOCK_SIZE; ++i)
+                    values[i * value_sizeof + p] += values[(i - 1) * value_sizeof + p];
+            }
+        }
 
-                    // find local component index by counting bits before 'bit_index'
-                    const u16 cp_index = (u16)math::countBits(occupancy & (bit_mask - 1));
+        // A decoded block in the cache
+        struct compressed_line_t
+        {
+            u32   m_block;  // block index, 0xFFFFFFFF when the line is not in use
+            u32   m_stamp;  // last use, the line with the oldest stamp is evicted first
+            bool  m_dirty;  // the values changed after the block was decoded
+            byte* m_values; // decoded values of the block
+        };
 
-                    // store component reference
-                    u16* cp_reference_array = narena::base_ptr_as<u16>(archetype->m_cp_reference);
-                    u16* cp_references      = cp_reference_array + (entity_index * archetype->m_per_entity_cps);
-                    u16  cp_reference       = (u16)bin_ptr2idx(cp_bin, cp_ptr);
-                    g_array_insert(cp_references, archetype->m_per_entity_cps, num_components, cp_index, cp_reference);
+        // The encoded blocks are appended to a heap arena, a block that grows moves to the end of the heap. When the heap
+        // is full the blocks are copied to a new heap without the holes.
+        struct compressed_store_t
+        {
+            arena_t*          m_arena;            // the store, the block arrays and the cache
+            arena_t*          m_heap;             // encoded bytes
+            int_t             m_heap_end;         // end of the used part of the heap
+            int_t             m_heap_reserved;    // size of the heap
+            u32               m_sizeof;           // size of a value
+            u32               m_max_blocks;       // number of blocks
+            u32               m_stamp;            // cache use counter
+            u64               m_compressed_bytes; // sum of the encoded block sizes
+            byte**            m_block_data;       // encoded bytes per block, nullptr when the block is all zero
+            u32*              m_block_size;       // encoded size per block
+            byte*             m_encoded;          // encode buffer, the size of the values of a block
+            compressed_line_t m_lines[ECS4_COMPRESSED_CACHE_BLOCKS];
+        };
+
+        static compressed_store_t* s_compressed_create(u32 cp_sizeof, u32 max_entities)
+        {
+            const u32   max_blocks = (max_entities + ECS4_COMPRESSED_BLOCK_SIZE - 1) / ECS4_COMPRESSED_BLOCK_SIZE;
+            const int_t block_size = (int_t)cp_sizeof * ECS4_COMPRESSED_BLOCK_SIZE;
+            const int_t size       = (int_t)sizeof(compressed_store_t) + (int_t)max_blocks * (sizeof(byte*) + sizeof(u32)) + (1 + ECS4_COMPRESSED_CACHE_BLOCKS) * (block_size + ECS4_MAX_ALIGNMENT) + 256;
+            arena_t*    arena      = narena::new_arena(size, size);
+
+            compressed_store_t* store = g_allocate_and_clear<compressed_store_t>(arena);
+            store->m_arena            = arena;
+            store->m_heap_reserved    = 2 * block_size * max_blocks;
+            store->m_heap             = narena::new_arena(store->m_heap_reserved, 0);
+            store->m_heap_end         = 0;
+            store->m_sizeof           = cp_sizeof;
+            store->m_max_blocks       = max_blocks;
+            store->m_block_data       = g_allocate_and_clear<byte*>(arena, max_blocks);
+            store->m_block_size       = g_allocate_and_clear<u32>(arena, max_blocks);
+            store->m_encoded          = g_allocate<byte>(arena, (u32)block_size);
+            for (u32 i = 0; i < ECS4_COMPRESSED_CACHE_BLOCKS; ++i)
+            {
+                store->m_lines[i].m_block  = 0xFFFFFFFF;
+                store->m_lines[i].m_values = s_allocate_aligned(arena, cp_sizeof * ECS4_COMPRESSED_BLOCK_SIZE);
+            }
+            return store;
+        }
+
+        static void s_compressed_destroy(compressed_store_t* store)
+        {
+            narena::destroy(store->m_heap);
+            narena::destroy(store->m_arena);
+        }
+
+        // Copy the encoded blocks to a new heap without the holes
+        static void s_compressed_compact(compressed_store_t* store)
+        {
+            arena_t* heap = narena::new_arena(store->m_heap_reserved, 0);
+            byte*    base = narena::base_ptr_as<byte>(heap);
+            int_t    end  = 0;
+            for (u32 b = 0; b < store->m_max_blocks; ++b)
+            {
+                if (store->m_block_data[b] == nullptr)
+                    continue;
+                g_memcopy(base + end, store->m_block_data[b], store->m_block_size[b]);
+                store->m_block_data[b] = base + end;
+                end += store->m_block_size[b];
+            }
+            narena::destroy(store->m_heap);
+            store->m_heap     = heap;
+            store->m_heap_end = end;
+        }
+
+        // Encode a changed block, in place when it did not grow
+        static void s_compressed_write_back(compressed_store_t* store, compressed_line_t* line)
+        {
+            if (!line->m_dirty)
+                return;
+            line->m_dirty   = false;
+            const u32 block = line->m_block;
+            const u32 size  = s_block_encode(line->m_values, store->m_sizeof, store->m_encoded);
+            if (size > store->m_block_size[block] || (size > 0 && store->m_block_data[block] == nullptr))
+            {
+                store->m_block_data[block] = nullptr;
+                if (store->m_heap_end + size > store->m_heap_reserved)
+                    s_compressed_compact(store);
+                store->m_block_data[block] = narena::base_ptr_as<byte>(store->m_heap) + store->m_heap_end;
+                store->m_heap_end += size;
+            }
+            else if (size == 0)
+            {
+                store->m_block_data[block] = nullptr;
+            }
+            store->m_compressed_bytes  = store->m_compressed_bytes - store->m_block_size[block] + size;
+            store->m_block_size[block] = size;
+            if (size > 0)
+                g_memcopy(store->m_block_data[block], store->m_encoded, size);
+        }
 
-                    return (byte*)cp_ptr;
+        // The value in a slot, the block of the slot is decoded into the cache when it is not there yet
+        static byte* s_compressed_access(compressed_store_t* store, u32 slot, bool write)
+        {
+            const u32          block = slot / ECS4_COMPRESSED_BLOCK_SIZE;
+            compressed_line_t* line  = &store->m_lines[0];
+            for (u32 i = 0; i < ECS4_COMPRESSED_CACHE_BLOCKS; ++i)
+            {
+                compressed_line_t* candidate = &store->m_lines[i];
+                if (candidate->m_block == block)
+                {
+                    line = candidate;
+                    break;
                 }
+                if (candidate->m_stamp < line->m_stamp)
+                    line = candidate;
             }
-            return nullptr;
+            if (line->m_block != block)
+            {
+                if (line->m_block != 0xFFFFFFFF)
+                    s_compressed_write_back(store, line);
+                s_block_decode(store->m_block_data[block], store->m_block_size[block], store->m_sizeof, line->m_values);
+                line->m_block = block;
+            }
+            line->m_stamp = ++store->m_stamp;
+            line->m_dirty = line->m_dirty || write;
+            return line->m_values + (slot % ECS4_COMPRESSED_BLOCK_SIZE) * store->m_sizeof;
+        }
+
+        // The slots of a block are no longer in use, drop its encoded bytes and its cache line
+        static void s_compressed_release_block(compressed_store_t* store, u32 block)
+        {
+            for (u32 i = 0; i < ECS4_COMPRESSED_CACHE_BLOCKS; ++i)
+            {
+                if (store->m_lines[i].m_block == block)
+                {
+                    store->m_lines[i].m_block = 0xFFFFFFFF;
+                    store->m_lines[i].m_stamp = 0;
+                    store->m_lines[i].m_dirty = false;
+                }
+            }
+            store->m_compressed_bytes -= store->m_block_size[block];
+            store->m_block_data[block] = nullptr;
+            store->m_block_size[block] = 0;
+        }
+
+        // A cold component store, the components that are rarely accessed are kept out of the occupancy, the reference
+        // rows and the bins of the archetype. The store is a sparse set, the data is dense (swap remove) and indexed by
+        // slot, 'sparse' maps an entity to its slot and 'dense' maps a slot back to the entity. Every array lives in its
+        // own reserved memory that is only committed as the store grows. The data of a compressed store is kept in
+        // encoded blocks of 64 slots instead.
+#define ECS_ARCHETYPE_MAX_COLD_TYPES 16
+
+        struct cold_store_t
+        {
+            u16                 m_cp_index;   // global component type index
+            u32                 m_sizeof;     // size of the component
+            u32                 m_count;      // number of entities that have the component
+            arena_t*            m_sparse;     // u32 per entity, the slot of the entity (only valid when dense[slot] == entity)
+            arena_t*            m_dense;      // u32 per slot, the entity index
+            arena_t*            m_data;       // component data per slot, nullptr for a compressed store
+            compressed_store_t* m_compressed; // encoded blocks of a compressed store
+        };
+
+        static void s_cold_create(cold_store_t* store, u16 cp_index, u32 cp_sizeof, u32 max_entities, bool compressed)
+        {
+            store->m_cp_index   = cp_index;
+            store->m_sizeof     = cp_sizeof;
+            store->m_count      = 0;
+            store->m_sparse     = narena::new_arena((int_t)max_entities * sizeof(u32), 0);
+            store->m_dense      = narena::new_arena((int_t)max_entities * sizeof(u32), 0);
+            store->m_data       = compressed ? nullptr : narena::new_arena((int_t)max_entities * cp_sizeof, 0);
+            store->m_compressed = compressed ? s_compressed_create(cp_sizeof, max_entities) : nullptr;
+        }
+
+        static void s_cold_destroy(cold_store_t* store)
+        {
+            narena::destroy(store->m_sparse);
+            narena::destroy(store->m_dense);
+            if (store->m_data != nullptr)
+                narena::destroy(store->m_data);
+            if (store->m_compressed != nullptr)
+                s_compressed_destroy(store->m_compressed);
+        }
+
+        // The data of a slot, a compressed store decodes the block of the slot into its cache
+        static inline byte* s_cold_data(cold_store_t* store, u32 slot, bool write)
+        {
+            if (store->m_compressed != nullptr)
+                return s_compressed_access(store->m_compressed, slot, write);
+            return narena::base_ptr_as<byte>(store->m_data) + (u64)slot * store->m_sizeof;
+        }
+
+        // The slot of an entity, 0xFFFFFFFF if the entity does not have the component
+        static inline u32 s_cold_slot(cold_store_t const* store, u32 entity_index)
+        {
+            const u32 slot = narena::base_ptr_as<const u32>(store->m_sparse)[entity_index];
+            if (slot < store->m_count && narena::base_ptr_as<const u32>(store->m_dense)[slot] == entity_index)
+                return slot;
+            return 0xFFFFFFFF;
+        }
+
+        static inline byte* s_cold_get(cold_store_t* store, u32 entity_index, bool write)
+        {
+            const u32 slot = s_cold_slot(store, entity_index);
+            return slot != 0xFFFFFFFF ? s_cold_data(store, slot, write) : nullptr;
+        }
+
+        static byte* s_cold_alloc(cold_store_t* store, u32 entity_index)
+        {
+            u32 slot = s_cold_slot(store, entity_index);
+            if (slot == 0xFFFFFFFF)
+            {
+                slot                                                    = store->m_count++;
+                narena::base_ptr_as<u32>(store->m_sparse)[entity_index] = slot;
+                narena::base_ptr_as<u32>(store->m_dense)[slot]          = entity_index;
+            }
+            return s_cold_data(store, slot, true);
+        }
+
+        // Remove the component of an entity, the last slot moves into the hole
+        static void s_cold_free(cold_store_t* store, u32 entity_index)
+        {
+            const u32 slot = s_cold_slot(store, entity_index);
+            if (slot == 0xFFFFFFFF)
+                return;
+            const u32 last = --store->m_count;
+            if (slot != last)
+            {
+                u32*        dense     = narena::base_ptr_as<u32>(store->m_dense);
+                byte const* last_data = s_cold_data(store, last, false);
+                g_memcopy(s_cold_data(store, slot, true), last_data, store->m_sizeof);
+                dense[slot]                                            = dense[last];
+                narena::base_ptr_as<u32>(store->m_sparse)[dense[slot]] = slot;
+            }
+
+            // The last block of a compressed store is empty
+            if (store->m_compressed != nullptr && (last % ECS4_COMPRESSED_BLOCK_SIZE) == 0)
+                s_compressed_release_block(store->m_compressed, last / ECS4_COMPRESSED_BLOCK_SIZE);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // split (SoA) component storage
+
+        // The fields of a split component, field f of slot i is at columns + f * column_stride + i * field_sizeof. The
+        // slot is the reference that the bin of the component hands out, the bin itself only holds its free list. The
+        // fields of one slot can be gathered into the staging copy, it is scattered back when another slot is staged or
+        // when the columns are used directly.
+        struct soa_store_t
+        {
+            arena_t* m_arena;         // store, staging copy and value
+            arena_t* m_columns;       // the columns, reserved memory that is committed as the slots are used
+            u32      m_num_fields;    // number of fields (columns)
+            u32      m_field_sizeof;  // size of a field
+            u32      m_column_stride; // distance between two columns, a multiple of 64
+            u32      m_end;           // the slots that have been handed out are below this
+            u32      m_staged_slot;   // slot that is in the staging copy, 0xFFFFFFFF when there is none
+            byte*    m_staged;        // staging copy of a component
+            byte*    m_value;         // a single component, for copies that touch more than one slot
+        };
+
+        static soa_store_t* s_soa_create(u32 cp_sizeof, u32 field_sizeof, u32 max_slots)
+        {
+            const int_t size  = (int_t)(sizeof(soa_store_t) + 2 * (cp_sizeof + ECS4_MAX_ALIGNMENT) + 64);
+            arena_t*    arena = narena::new_arena(size, size);
+
+            soa_store_t* store     = g_allocate<soa_store_t>(arena);
+            store->m_arena         = arena;
+            store->m_num_fields    = cp_sizeof / field_sizeof;
+            store->m_field_sizeof  = field_sizeof;
+            store->m_column_stride = math::alignUp(max_slots * field_sizeof, (u32)64);
+            store->m_columns       = narena::new_arena((int_t)store->m_num_fields * store->m_column_stride, 0);
+            store->m_end           = 0;
+            store->m_staged_slot   = 0xFFFFFFFF;
+            store->m_staged        = s_allocate_aligned(arena, cp_sizeof);
+            store->m_value         = s_allocate_aligned(arena, cp_sizeof);
+            return store;
+        }
+
+        static void s_soa_destroy(soa_store_t* store)
+        {
+            narena::destroy(store->m_columns);
+            narena::destroy(store->m_arena);
+        }
+
+        static inline byte* s_soa_column(soa_store_t const* store, u32 field_index) { return store->m_columns->m_base + field_index * store->m_column_stride; }
+
+        static void s_soa_gather(soa_store_t const* store, u32 slot, byte* out)
+        {
+            byte const* field = s_soa_column(store, 0) + slot * store->m_field_sizeof;
+            for (u32 f = 0; f < store->m_num_fields; ++f, field += store->m_column_stride, out += store->m_field_sizeof)
+                g_memcopy(out, field, store->m_field_sizeof);
+        }
+
+        static void s_soa_scatter(soa_store_t* store, u32 slot, byte const* in)
+        {
+            byte* field = s_soa_column(store, 0) + slot * store->m_field_sizeof;
+            for (u32 f = 0; f < store->m_num_fields; ++f, field += store->m_column_stride, in += store->m_field_sizeof)
+                g_memcopy(field, in, store->m_field_sizeof);
+        }
+
+        // Write back the staging copy
+        static void s_soa_flush(soa_store_t* store)
+        {
+            if (store->m_staged_slot != 0xFFFFFFFF)
+                s_soa_scatter(store, store->m_staged_slot, store->m_staged);
+            store->m_staged_slot = 0xFFFFFFFF;
+        }
+
+        // The component in a slot, gathered into the staging copy
+        static byte* s_soa_stage(soa_store_t* store, u32 slot)
+        {
+            if (store->m_staged_slot != slot)
+            {
+                s_soa_flush(store);
+                s_soa_gather(store, slot, store->m_staged);
+                store->m_staged_slot = slot;
+            }
+            return store->m_staged;
+        }
+
+        struct archetype_t
+        {
+            arena_t*        m_archetype_arena;          // arena for allocating member data from
+            u16*            m_global_to_local_cp_type;  // map global component type index to local component type index
+            u8*             m_global_to_local_tag_type; // map global tag type index to local tag type index
+            u16*            m_local_to_global_cp_type;  // map local component type index to global component type index (max 64)
+            u8*             m_local_to_global_tag_type; // map local tag type index to global tag type index (max 32)
+            u32*            m_cp_sizeof;                // size of the component, per local component
+            bin16_t*        m_cp_bins;                  // array of component bins (max 64), default archetype
+            bin32_t*        m_cp_bins32;                // array of component bins (max 64), wide archetype
+            u32*            m_cp_counts;                // number of entities that have the component, per local component
+            shared_pool_t** m_cp_shared;                // per local component, the value pool of a shared component, nullptr if not shared
+            soa_store_t**   m_cp_soa;                   // per local component, the columns of a split component, nullptr if not split
+            u8*             m_global_to_cold_cp_type;   // map global component type index to cold store index, 0xFF if not cold
+            cold_store_t*   m_cold_stores;              // cold component stores (max 16)
+            u8              m_num_cold;                 // current number of cold component stores
+            arena_t*        m_cp_occupancy;             // component occupancy bits per entity (u64)
+            arena_t*        m_cp_summary;               // component occupancy summary per 64 entities (u64), '1' bit = some entity in the block has the component
+            arena_t*        m_cp_reference;             // component reference array (u16[] or u32[] for a wide archetype)
+            arena_t*        m_tags;                     // tag bits array (u8, u16 or u32)
+            arena_t**       m_tag_columns;              // optional tag columns (max 32), '1' bit = entity has the tag, aligned with m_bin2
+            u32             m_tag_column_mask;          // '1' bit = local tag has a tag column
+            u16             m_max_global_cp_types;      // maximum number of global component types
+            u16             m_max_global_tag_types;     // maximum number of global tag types
+            u16             m_num_cps;                  // current number of component bins
+            u8              m_num_tags;                 // current number of tags
+            bool            m_wide;                     // wide archetype (more than 65536 entities)
+            u16             m_per_entity_cps;           // number of components per entity
+            u16             m_per_entity_tags;          // number of tags per entity
+            u32             m_max_entities;             // maximum number of entities
+            u32             m_free_index;               // first free entity index
+            u32             m_alive_count;              // number of alive entities
+            u32             m_num_pages;                // number of state pages
+            u64             m_pages_with_holes;         // '1' bit = state page has free entities below m_free_index
+            state_page_t*   m_pages;                    // state pages, 1 for a default archetype
+            arena_t*        m_bin2;                     // '1' bit = alive entity, '0' bit = free entity (65536 bits = 8 KB per 65536 entities)
+            arena_t*        m_rank;                     // u32 prefix popcount of m_bin2 per 512 entities, built lazily
+            arena_t*        m_moved_to;                 // entity_t per entity, where the entity has moved to (see g_move_entity), allocated on first move
+            arena_t*        m_timers;                   // u32 per entity, the first scheduled action of the entity, allocated on first schedule
+            arena_t*        m_awake;                    // '1' bit = awake entity, aligned with m_bin2, allocated when the first entity is put to sleep
+            u32             m_num_sleeping;             // number of alive entities that are asleep
+            hierarchy_t*    m_hierarchy;                // parent/child links, created by the first g_set_parent
+            arena_t*        m_pairs;                    // u32 per entity and relation, the heads of its pair lists, allocated on first pair
+            query_t*        m_queries;                  // registered queries (max 64)
+            u64             m_query_mask;               // '1' bit = query is registered
+            u64             m_unfiltered_queries;       // '1' bit = query that has every alive entity as a member
+            u64*            m_cp_queries;               // per local component, the queries that require the component
+            u64*            m_tag_queries;              // per local tag, the queries that require the tag
+            u32             m_rank_valid;               // number of valid entries in m_rank
+        };
+
+        // Per entity and relation the heads of the pair lists, {its first pair, the first pair that targets it}
+        const u32 ECS_PAIR_HEADS = 2 * ECS4_MAX_RELATIONS;
+
+        // The prefix popcount of every 512 entities after the one of 'entity_index' is out of date
+        static inline void s_rank_invalidate(archetype_t* archetype, u32 entity_index)
+        {
+            const u32 rank_valid = (entity_index >> 9) + 1;
+            if (rank_valid < archetype->m_rank_valid)
+                archetype->m_rank_valid = rank_valid;
+        }
+
+        static inline u32 s_page_size(archetype_t const* archetype, u32 page_index)
+        {
+            // number of entity indices in use (alive or free) for this page
+            const u32 page_base = page_index << ECS_STATE_PAGE_SHIFT;
+            if (archetype->m_free_index <= page_base)
+                return 0;
+            const u32 size = archetype->m_free_index - page_base;
+            return size < ECS_STATE_PAGE_ENTITIES ? size : ECS_STATE_PAGE_ENTITIES;
+        }
+
+        static s32 s_state_alloc(archetype_t* archetype)
+        {
+            const u32     page_index = (u32)math::findFirstBit(archetype->m_pages_with_holes);
+            state_page_t* page       = &archetype->m_pages[page_index];
+            const u32     page_size  = s_page_size(archetype, page_index);
+            const s32     index      = nstatevec18::alloc(&page->m_free_bin0, page->m_free_bin1, &page->m_alive_bin0, page->m_alive_bin1, page->m_bin2, page_size);
+            if (++page->m_alive_count == page_size)
+                archetype->m_pages_with_holes &= ~((u64)1 << page_index);
+            s_rank_invalidate(archetype, (page_index << ECS_STATE_PAGE_SHIFT) + index);
+            return (s32)(page_index << ECS_STATE_PAGE_SHIFT) + index;
+        }
+
+        static void s_state_tick_used(archetype_t* archetype, u32 entity_index)
+        {
+            const u32     page_index = entity_index >> ECS_STATE_PAGE_SHIFT;
+            state_page_t* page       = &archetype->m_pages[page_index];
+            nstatevec18::tick_used_lazy(&page->m_free_bin0, page->m_free_bin1, &page->m_alive_bin0, page->m_alive_bin1, page->m_bin2, s_page_size(archetype, page_index), entity_index & (ECS_STATE_PAGE_ENTITIES - 1));
+            page->m_alive_count++;
+            s_rank_invalidate(archetype, entity_index);
+        }
+
+        static void s_state_set_free(archetype_t* archetype, u32 entity_index)
+        {
+            const u32     page_index = entity_index >> ECS_STATE_PAGE_SHIFT;
+            state_page_t* page       = &archetype->m_pages[page_index];
+            nstatevec18::set_free(&page->m_free_bin0, page->m_free_bin1, &page->m_alive_bin0, page->m_alive_bin1, page->m_bin2, s_page_size(archetype, page_index), entity_index & (ECS_STATE_PAGE_ENTITIES - 1));
+            page->m_alive_count--;
+            archetype->m_pages_with_holes |= ((u64)1 << page_index);
+            s_rank_invalidate(archetype, entity_index);
+        }
+
+        // Find the first alive entity at or after 'entity_index', -1 if there is none
+        static s32 s_state_find_used_after(archetype_t const* archetype, s32 entity_index)
+        {
+            u32 page_index = (u32)entity_index >> ECS_STATE_PAGE_SHIFT;
+            u32 local      = (u32)entity_index & (ECS_STATE_PAGE_ENTITIES - 1);
+            while (page_index < archetype->m_num_pages)
+            {
+                const u32 page_size = s_page_size(archetype, page_index);
+                if (local >= page_size)
+                    break;
+                state_page_t const* page  = &archetype->m_pages[page_index];
+                const s32           index = nstatevec18::find_used_after(&page->m_free_bin0, page->m_free_bin1, &page->m_alive_bin0, page->m_alive_bin1, page->m_bin2, page_size, (s32)local);
+                if (index >= 0)
+                    return (s32)(page_index << ECS_STATE_PAGE_SHIFT) + index;
+                page_index++;
+                local = 0;
+            }
+            return -1;
+        }
+
+        static void s_initialize_archetype(archetype_t* archetype, u8 max_cps_per_entity, u16 max_global_cp_types, u8 max_tags_per_entity, u16 max_global_tag_types, u32 max_entities)
+        {
+            ASSERT(max_global_cp_types < 2048);                         // sanity
+            ASSERT(max_global_tag_types <= 255);                        // u8 is used for mapping
+            ASSERT(max_cps_per_entity <= 64);                           //
+            ASSERT(max_tags_per_entity <= 32);                          // sanity check
+            ASSERT(max_entities <= ECS_ARCHETYPE_MAX_WIDE_ENTITIES);    // limited by the entity identifier
+            ASSERT(max_entities > 0);
+
+            max_tags_per_entity = math::alignUp(max_tags_per_entity, 8);
+
+            const bool  wide              = max_entities > ECS_ARCHETYPE_MAX_ENTITIES;
+            const u32   num_pages         = (max_entities + ECS_STATE_PAGE_ENTITIES - 1) >> ECS_STATE_PAGE_SHIFT;
+            const int_t sizeof_reference  = wide ? sizeof(u32) : sizeof(u16);
+            const int_t sizeof_page_state = (int_t)(sizeof(state_page_t) + 2 * 64 * sizeof(u64));
+
+            archetype->m_archetype_arena          = narena::new_arena(16 * cKB + num_pages * sizeof_page_state, 12 * cKB);
+            archetype->m_global_to_local_cp_type  = g_allocate<u16>(archetype->m_archetype_arena, max_global_cp_types);
+            archetype->m_global_to_local_tag_type = g_allocate<u8>(archetype->m_archetype_arena, max_global_tag_types);
+            archetype->m_cp_occupancy             = narena::new_arena((int_t)sizeof(u64) * max_entities, 0);
+            archetype->m_cp_summary               = narena::new_arena((int_t)sizeof(u64) * ((max_entities + 63) >> 6), 0);
+            archetype->m_cp_reference             = narena::new_arena(sizeof_reference * max_cps_per_entity * max_entities, 0);
+            archetype->m_tags                     = narena::new_arena((int_t)((max_tags_per_entity * (int_t)max_entities) >> 3), 0);
+            archetype->m_cp_bins                  = wide ? nullptr : g_allocate_and_clear<bin16_t>(archetype->m_archetype_arena, 64);
+            archetype->m_cp_bins32                = wide ? g_allocate_and_clear<bin32_t>(archetype->m_archetype_arena, 64) : nullptr;
+            archetype->m_cp_counts                = g_allocate_and_clear<u32>(archetype->m_archetype_arena, 64);
+            archetype->m_cp_shared                = g_allocate_and_clear<shared_pool_t*>(archetype->m_archetype_arena, 64);
+            archetype->m_cp_soa                   = g_allocate_and_clear<soa_store_t*>(archetype->m_archetype_arena, 64);
+            archetype->m_global_to_cold_cp_type   = g_allocate<u8>(archetype->m_archetype_arena, max_global_cp_types);
+            archetype->m_cold_stores              = g_allocate_and_clear<cold_store_t>(archetype->m_archetype_arena, ECS_ARCHETYPE_MAX_COLD_TYPES);
+            archetype->m_num_cold                 = 0;
+            archetype->m_local_to_global_cp_type  = g_allocate_and_clear<u16>(archetype->m_archetype_arena, 64);
+            archetype->m_local_to_global_tag_type = g_allocate_and_clear<u8>(archetype->m_archetype_arena, 32);
+            archetype->m_cp_sizeof                = g_allocate_and_clear<u32>(archetype->m_archetype_arena, 64);
+            archetype->m_queries                  = g_allocate_and_clear<query_t>(archetype->m_archetype_arena, 64);
+            archetype->m_cp_queries               = g_allocate_and_clear<u64>(archetype->m_archetype_arena, 64);
+            archetype->m_tag_queries              = g_allocate_and_clear<u64>(archetype->m_archetype_arena, 32);
+            archetype->m_query_mask               = 0;
+            archetype->m_unfiltered_queries       = 0;
+            archetype->m_tag_columns              = g_allocate_and_clear<arena_t*>(archetype->m_archetype_arena, 32);
+            archetype->m_tag_column_mask          = 0;
+            archetype->m_max_global_cp_types      = (u16)max_global_cp_types;
+            archetype->m_max_global_tag_types     = (u16)max_global_tag_types;
+            archetype->m_num_cps                  = 0;
+            archetype->m_num_tags                 = 0;
+            archetype->m_wide                     = wide;
+            archetype->m_per_entity_cps           = (u16)max_cps_per_entity;
+            archetype->m_per_entity_tags          = (u16)max_tags_per_entity;
+            archetype->m_max_entities             = max_entities;
+            archetype->m_free_index               = 0;
+            archetype->m_alive_count              = 0;
+
+            // 0xFF.. marks a global component/tag type as 'not registered' with this archetype
+            g_memset(archetype->m_global_to_local_cp_type, 0xFF, max_global_cp_types * sizeof(u16));
+            g_memset(archetype->m_global_to_local_tag_type, 0xFF, max_global_tag_types * sizeof(u8));
+            g_memset(archetype->m_global_to_cold_cp_type, 0xFF, max_global_cp_types * sizeof(u8));
+
+            archetype->m_bin2             = narena::new_arena((int_t)((max_entities + 63) >> 6) * sizeof(u64), 0); // '1' bit = alive entity, '0' bit = free entity (65536 bits = 8 KB)
+            archetype->m_rank             = narena::new_arena((int_t)(((max_entities + 511) >> 9) + 1) * sizeof(u32), 0);
+            archetype->m_rank_valid       = 1; // the prefix popcount of the first block is always 0
+            archetype->m_moved_to         = nullptr;
+            archetype->m_timers           = nullptr;
+            archetype->m_awake            = nullptr;
+            archetype->m_num_sleeping     = 0;
+            archetype->m_hierarchy        = nullptr;
+            archetype->m_pairs            = nullptr;
+            archetype->m_num_pages        = num_pages;
+            archetype->m_pages_with_holes = 0;
+            archetype->m_pages            = g_allocate<state_page_t>(archetype->m_archetype_arena, num_pages);
+            for (u32 p = 0; p < num_pages; ++p)
+            {
+                const u32     page_entities = math::min(max_entities - (p << ECS_STATE_PAGE_SHIFT), (u32)ECS_STATE_PAGE_ENTITIES);
+                const u32     bin1_words    = (page_entities + 4095) >> 12;
+                state_page_t* page          = &archetype->m_pages[p];
+                page->m_free_bin0           = D_U64_MAX;
+                page->m_alive_bin0          = D_U64_MAX;
+                page->m_free_bin1           = g_allocate<u64>(archetype->m_archetype_arena, bin1_words); // track the 0 bits in m_bin2
+                page->m_alive_bin1          = g_allocate<u64>(archetype->m_archetype_arena, bin1_words); // track the 1 bits in m_bin2
+                page->m_bin2                = narena::base_ptr_as<u64>(archetype->m_bin2) + (p << (ECS_STATE_PAGE_SHIFT - 6));
+                page->m_alive_count         = 0;
+            }
+            narena::base_ptr_as<u32>(archetype->m_rank)[0] = 0;
+        }
+
+        static void s_destroy(archetype_t* archetype)
+        {
+            for (u32 i = 0; i < archetype->m_num_cps; ++i)
+            {
+                if (archetype->m_wide)
+                    bin_release(&archetype->m_cp_bins32[i]);
+                else
+                    bin_release(&archetype->m_cp_bins[i]);
+                if (archetype->m_cp_soa[i] != nullptr)
+                    s_soa_destroy(archetype->m_cp_soa[i]);
+            }
+
+            for (u8 c = 0; c < archetype->m_num_cold; ++c)
+                s_cold_destroy(&archetype->m_cold_stores[c]);
+
+            narena::destroy(archetype->m_cp_occupancy);
+            narena::destroy(archetype->m_cp_summary);
+            narena::destroy(archetype->m_cp_reference);
+            narena::destroy(archetype->m_tags);
+            for (u32 i = 0; i < 32; ++i)
+            {
+                if (archetype->m_tag_columns[i] != nullptr)
+                    narena::destroy(archetype->m_tag_columns[i]);
+            }
+            narena::destroy(archetype->m_bin2);
+            narena::destroy(archetype->m_rank);
+            if (archetype->m_moved_to != nullptr)
+                narena::destroy(archetype->m_moved_to);
+            if (archetype->m_timers != nullptr)
+                narena::destroy(archetype->m_timers);
+            if (archetype->m_awake != nullptr)
+                narena::destroy(archetype->m_awake);
+            if (archetype->m_hierarchy != nullptr)
+                narena::destroy(archetype->m_hierarchy->m_arena);
+            if (archetype->m_pairs != nullptr)
+                narena::destroy(archetype->m_pairs);
+            for (u32 q = 0; q < 64; ++q)
+            {
+                if (archetype->m_queries[q].m_members != nullptr)
+                    narena::destroy(archetype->m_queries[q].m_members);
+            }
+
+            narena::destroy(archetype->m_archetype_arena);
+        }
+
+        static void s_register_component_type(archetype_t* archetype, u16 global_cp_type_index, u32 sizeof_component)
+        {
+            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
+            if (archetype->m_global_to_local_cp_type[global_cp_type_index] != 0xFFFF || archetype->m_global_to_cold_cp_type[global_cp_type_index] != 0xFF)
+                return;
+            ASSERT(archetype->m_num_cps < 64);
+            archetype->m_global_to_local_cp_type[global_cp_type_index] = (u16)archetype->m_num_cps;
+            archetype->m_local_to_global_cp_type[archetype->m_num_cps] = global_cp_type_index;
+            archetype->m_cp_sizeof[archetype->m_num_cps]               = sizeof_component;
+            if (archetype->m_wide)
+                bin_setup(&archetype->m_cp_bins32[archetype->m_num_cps], sizeof_component, archetype->m_max_entities);
+            else
+                bin_setup(&archetype->m_cp_bins[archetype->m_num_cps], sizeof_component, 65535);
+            archetype->m_num_cps++;
+        }
+
+        static void s_register_cold_component_type(archetype_t* archetype, u16 global_cp_type_index, u32 sizeof_component, bool compressed)
+        {
+            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
+            ASSERTS(archetype->m_global_to_local_cp_type[global_cp_type_index] == 0xFFFF, "a component is either hot or cold");
+            if (archetype->m_global_to_cold_cp_type[global_cp_type_index] != 0xFF || archetype->m_global_to_local_cp_type[global_cp_type_index] != 0xFFFF)
+                return;
+            ASSERT(archetype->m_num_cold < ECS_ARCHETYPE_MAX_COLD_TYPES);
+            if (archetype->m_num_cold >= ECS_ARCHETYPE_MAX_COLD_TYPES)
+                return;
+            s_cold_create(&archetype->m_cold_stores[archetype->m_num_cold], global_cp_type_index, sizeof_component, archetype->m_max_entities, compressed);
+            archetype->m_global_to_cold_cp_type[global_cp_type_index] = archetype->m_num_cold++;
+        }
+
+        // The cold store of a global component type, nullptr if the component is not cold in this archetype
+        static inline cold_store_t* s_cold_store(archetype_t const* archetype, u16 global_cp_type_index)
+        {
+            const u8 cold = archetype->m_global_to_cold_cp_type[global_cp_type_index];
+            return cold != 0xFF ? &archetype->m_cold_stores[cold] : nullptr;
+        }
+
+        // Read the tag bits of an entity as a single word
+        static inline u32 s_get_tags(archetype_t const* archetype, s32 entity_index)
+        {
+            u32 tags = 0;
+            switch (archetype->m_per_entity_tags)
+            {
+                case 8: tags = ((u8*)archetype->m_tags->m_base)[entity_index]; break;
+                case 16: tags = ((u16*)archetype->m_tags->m_base)[entity_index]; break;
+                case 24:
+                    tags = archetype->m_tags->m_base[entity_index * 3 + 2];
+                    tags = (tags << 8) | archetype->m_tags->m_base[entity_index * 3 + 1];
+                    tags = (tags << 8) | archetype->m_tags->m_base[entity_index * 3];
+                    break;
+                case 32: tags = ((u32*)archetype->m_tags->m_base)[entity_index]; break;
+            }
+            return tags;
+        }
+
+        // Write the tag bits of an entity as a single word
+        static inline void s_set_tags(archetype_t* archetype, s32 entity_index, u32 tags)
+        {
+            switch (archetype->m_per_entity_tags)
+            {
+                case 8: ((u8*)archetype->m_tags->m_base)[entity_index] = (u8)tags; break;
+                case 16: ((u16*)archetype->m_tags->m_base)[entity_index] = (u16)tags; break;
+                case 24:
+                    archetype->m_tags->m_base[entity_index * 3]     = (u8)tags;
+                    archetype->m_tags->m_base[entity_index * 3 + 1] = (u8)(tags >> 8);
+                    archetype->m_tags->m_base[entity_index * 3 + 2] = (u8)(tags >> 16);
+                    break;
+                case 32: ((u32*)archetype->m_tags->m_base)[entity_index] = tags; break;
+            }
+        }
+
+        // Build a tag column from the tag bits of the entities
+        static void s_build_tag_column(archetype_t* archetype, u8 local_tag_type_index)
+        {
+            u64*      words     = narena::base_ptr_as<u64>(archetype->m_tag_columns[local_tag_type_index]);
+            const u32 num_words = (archetype->m_free_index + 63) >> 6;
+            g_memclr(words, (int_t)num_words * sizeof(u64));
+            for (u32 i = 0; i < archetype->m_free_index; ++i)
+            {
+                if ((s_get_tags(archetype, (s32)i) & ((u32)1 << local_tag_type_index)) != 0)
+                    words[i >> 6] |= (u64)1 << (i & 63);
+            }
+        }
+
+        static void s_register_tag_type(archetype_t* archetype, u16 global_tag_type_index, bool tag_column)
+        {
+            ASSERT(global_tag_type_index < archetype->m_max_global_tag_types);
+            u8 local_tag_type_index = archetype->m_global_to_local_tag_type[global_tag_type_index];
+            if (local_tag_type_index == 0xFF)
+            {
+                ASSERT(archetype->m_num_tags < archetype->m_per_entity_tags);
+                local_tag_type_index                                         = archetype->m_num_tags++;
+                archetype->m_global_to_local_tag_type[global_tag_type_index] = local_tag_type_index;
+                archetype->m_local_to_global_tag_type[local_tag_type_index]  = (u8)global_tag_type_index;
+            }
+
+            if (tag_column && archetype->m_tag_columns[local_tag_type_index] == nullptr)
+            {
+                archetype->m_tag_columns[local_tag_type_index] = narena::new_arena((int_t)((archetype->m_max_entities + 63) >> 6) * sizeof(u64), 0);
+                archetype->m_tag_column_mask |= (u32)1 << local_tag_type_index;
+                s_build_tag_column(archetype, local_tag_type_index);
+            }
+        }
+
+        // AND of the tag columns in 'column_mask' for 64 entities
+        static inline u64 s_tag_columns_word(archetype_t const* archetype, u32 column_mask, u32 word_index)
+        {
+            u64 word = D_U64_MAX;
+            while (column_mask != 0)
+            {
+                const s8 bit = math::findFirstBit(column_mask);
+                word &= narena::base_ptr_as<const u64>(archetype->m_tag_columns[bit])[word_index];
+                column_mask &= column_mask - 1;
+            }
+            return word;
+        }
+
+        // Component references are u16 for a default archetype and u32 for a wide archetype
+        static inline u32 s_get_cp_reference(archetype_t const* archetype, u32 entity_index, s32 cp_index)
+        {
+            if (archetype->m_wide)
+                return narena::base_ptr_as<const u32>(archetype->m_cp_reference)[(entity_index * archetype->m_per_entity_cps) + cp_index];
+            return narena::base_ptr_as<const u16>(archetype->m_cp_reference)[(entity_index * archetype->m_per_entity_cps) + cp_index];
+        }
+
+        static inline void s_set_cp_reference(archetype_t* archetype, u32 entity_index, s32 cp_index, u32 cp_reference)
+        {
+            if (archetype->m_wide)
+                narena::base_ptr_as<u32>(archetype->m_cp_reference)[(entity_index * archetype->m_per_entity_cps) + cp_index] = cp_reference;
+            else
+                narena::base_ptr_as<u16>(archetype->m_cp_reference)[(entity_index * archetype->m_per_entity_cps) + cp_index] = (u16)cp_reference;
+        }
+
+        static inline void s_insert_cp_reference(archetype_t* archetype, u32 entity_index, u16 num_components, u16 cp_index, u32 cp_reference)
+        {
+            if (archetype->m_wide)
+            {
+                u32* cp_references = narena::base_ptr_as<u32>(archetype->m_cp_reference) + (entity_index * archetype->m_per_entity_cps);
+                g_array_insert(cp_references, archetype->m_per_entity_cps, num_components, cp_index, cp_reference);
+            }
+            else
+            {
+                u16* cp_references = narena::base_ptr_as<u16>(archetype->m_cp_reference) + (entity_index * archetype->m_per_entity_cps);
+                g_array_insert(cp_references, archetype->m_per_entity_cps, num_components, cp_index, (u16)cp_reference);
+            }
+        }
+
+        static inline void s_remove_cp_reference(archetype_t* archetype, u32 entity_index, u16 num_components, u16 cp_index)
+        {
+            if (archetype->m_wide)
+                g_remove(narena::base_ptr_as<u32>(archetype->m_cp_reference) + (entity_index * archetype->m_per_entity_cps), archetype->m_per_entity_cps, num_components, cp_index);
+            else
+                g_remove(narena::base_ptr_as<u16>(archetype->m_cp_reference) + (entity_index * archetype->m_per_entity_cps), archetype->m_per_entity_cps, num_components, cp_index);
+        }
+
+        static inline byte* s_cp_idx2ptr(archetype_t* archetype, u16 component_type_index, u32 cp_reference)
+        {
+            if (archetype->m_cp_soa[component_type_index] != nullptr)
+                return s_soa_stage(archetype->m_cp_soa[component_type_index], cp_reference);
+            if (archetype->m_wide)
+                return (byte*)bin_idx2ptr(&archetype->m_cp_bins32[component_type_index], cp_reference);
+            return (byte*)bin_idx2ptr(&archetype->m_cp_bins[component_type_index], cp_reference);
+        }
+
+        static inline byte* s_cp_bin_alloc(archetype_t* archetype, u16 component_type_index, u32& cp_reference)
+        {
+            void* cp_ptr;
+            if (archetype->m_wide)
+            {
+                bin32_t* cp_bin = &archetype->m_cp_bins32[component_type_index];
+                ASSERT(cp_bin->m_bin != nullptr);
+                cp_ptr = bin_alloc(cp_bin);
+                if (cp_ptr != nullptr)
+                    cp_reference = (u32)bin_ptr2idx(cp_bin, cp_ptr);
+            }
+            else
+            {
+                bin16_t* cp_bin = &archetype->m_cp_bins[component_type_index];
+                ASSERT(cp_bin->m_bin != nullptr);
+                cp_ptr = bin_alloc(cp_bin);
+                if (cp_ptr != nullptr)
+                    cp_reference = (u32)bin_ptr2idx(cp_bin, cp_ptr);
+            }
+
+            // The bin of a split component only hands out the slot
+            soa_store_t* soa = archetype->m_cp_soa[component_type_index];
+            if (cp_ptr != nullptr && soa != nullptr)
+            {
+                soa->m_end = math::max(soa->m_end, cp_reference + 1);
+                return s_soa_stage(soa, cp_reference);
+            }
+            return (byte*)cp_ptr;
+        }
+
+        static inline void s_cp_bin_free(archetype_t* archetype, u16 component_type_index, u32 cp_reference)
+        {
+            soa_store_t* soa = archetype->m_cp_soa[component_type_index];
+            if (soa != nullptr && soa->m_staged_slot == cp_reference)
+                soa->m_staged_slot = 0xFFFFFFFF;
+            if (archetype->m_wide)
+                bin_free(&archetype->m_cp_bins32[component_type_index], bin_idx2ptr(&archetype->m_cp_bins32[component_type_index], cp_reference));
+            else
+                bin_free(&archetype->m_cp_bins[component_type_index], bin_idx2ptr(&archetype->m_cp_bins[component_type_index], cp_reference));
+        }
+
+        // Recompute the component summary of a block of 64 entities, free entities have no components
+        static void s_update_cp_summary(archetype_t* archetype, u32 block_index)
+        {
+            const u64* occupancy_array = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy);
+            const u32  begin           = block_index << 6;
+            const u32  end             = math::min(begin + 64, archetype->m_free_index);
+            u64        summary         = 0;
+            for (u32 i = begin; i < end; ++i)
+                summary |= occupancy_array[i];
+            narena::base_ptr_as<u64>(archetype->m_cp_summary)[block_index] = summary;
+        }
+
+        // The alive entities of block 'block_index' (64 entities) that have the tags in 'column_mask', nothing when the
+        // summary shows that no entity in the block has all the components of 'cp_mask'
+        static inline u64 s_candidates_word(archetype_t const* archetype, u32 block_index, u64 cp_mask, u32 column_mask)
+        {
+            if ((narena::base_ptr_as<const u64>(archetype->m_cp_summary)[block_index] & cp_mask) != cp_mask)
+                return 0;
+            u64 candidates = narena::base_ptr_as<const u64>(archetype->m_bin2)[block_index];
+            if (column_mask != 0 && candidates != 0)
+                candidates &= s_tag_columns_word(archetype, column_mask, block_index);
+            return candidates;
+        }
+
+        // The awake entities of word 'word_index' (64 entities), every bit is set while no entity of the archetype sleeps
+        static inline u64 s_awake_word(archetype_t const* archetype, u32 word_index) { return archetype->m_num_sleeping != 0 ? narena::base_ptr_as<const u64>(archetype->m_awake)[word_index] : D_U64_MAX; }
+
+        static inline bool s_is_awake(archetype_t const* archetype, u32 entity_index) { return archetype->m_awake == nullptr || (narena::base_ptr_as<const u64>(archetype->m_awake)[entity_index >> 6] & ((u64)1 << (entity_index & 63))) != 0; }
+
+        // Returns true when the entity changed state, the entity needs to be alive
+        static bool s_set_sleeping(archetype_t* archetype, u32 entity_index, bool sleeping)
+        {
+            if (archetype->m_awake == nullptr)
+            {
+                if (!sleeping)
+                    return false;
+                // Entities that are created later set their own bit
+                archetype->m_awake = narena::new_arena((int_t)((archetype->m_max_entities + 63) >> 6) * sizeof(u64), 0);
+                g_memset(narena::base_ptr_as<u64>(archetype->m_awake), 0xFF, (int_t)((archetype->m_free_index + 63) >> 6) * sizeof(u64));
+            }
+            u64&      word = narena::base_ptr_as<u64>(archetype->m_awake)[entity_index >> 6];
+            const u64 bit  = (u64)1 << (entity_index & 63);
+            if (((word & bit) == 0) == sleeping)
+                return false;
+            if (sleeping)
+            {
+                word &= ~bit;
+                archetype->m_num_sleeping++;
+            }
+            else
+            {
+                word |= bit;
+                archetype->m_num_sleeping--;
+            }
+            return true;
+        }
+
+        // The entities of word 'word_index' (64 entities) that are alive and have the components and tags of the masks
+        static u64 s_match_word(archetype_t const* archetype, u32 word_index, u64 cp_mask, u32 tag_mask)
+        {
+            const u32 column_mask = tag_mask & archetype->m_tag_column_mask;
+            u64       candidates  = s_candidates_word(archetype, word_index, cp_mask, column_mask);
+
+            // Only tags that have a tag column, the candidates are the matches
+            if (cp_mask == 0 && tag_mask == column_mask)
+                return candidates;
+
+            const u64* occupancy_array = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy);
+            u64        match           = 0;
+            while (candidates != 0)
+            {
+                const s8  bit          = math::findFirstBit(candidates);
+                const s32 entity_index = (s32)(word_index << 6) + bit;
+                const u64 matches      = ((occupancy_array[entity_index] & cp_mask) == cp_mask) && ((s_get_tags(archetype, entity_index) & tag_mask) == tag_mask);
+                match |= matches << bit;
+                candidates &= candidates - 1;
+            }
+            return match;
+        }
+
+        // Registered queries keep a membership bitset that is aligned with the alive bitmap, per local component and tag
+        // the archetype knows which queries depend on it so that a mutation only touches the queries that are affected.
+        static inline bool s_query_matches(archetype_t const* archetype, query_t const* query, u32 entity_index)
+        {
+            const u64 occupancy = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy)[entity_index];
+            return (occupancy & query->m_cp_mask) == query->m_cp_mask && (s_get_tags(archetype, (s32)entity_index) & query->m_tag_mask) == query->m_tag_mask;
+        }
+
+        static void s_query_update(archetype_t* archetype, u64 queries, u32 entity_index, bool alive)
+        {
+            const u64 bit = (u64)1 << (entity_index & 63);
+            while (queries != 0)
+            {
+                const s8 q       = math::findFirstBit(queries);
+                query_t* query   = &archetype->m_queries[q];
+                u64&     members = narena::base_ptr_as<u64>(query->m_members)[entity_index >> 6];
+                if (alive && s_query_matches(archetype, query, entity_index))
+                {
+                    query->m_count += (members & bit) == 0 ? 1 : 0;
+                    members |= bit;
+                }
+                else
+                {
+                    query->m_count -= (members & bit) != 0 ? 1 : 0;
+                    members &= ~bit;
+                }
+                queries &= queries - 1;
+            }
+        }
+
+        static void s_query_rebuild(archetype_t* archetype, u64 queries)
+        {
+            const u32 num_words = (archetype->m_free_index + 63) >> 6;
+            while (queries != 0)
+            {
+                const s8 q       = math::findFirstBit(queries);
+                query_t* query   = &archetype->m_queries[q];
+                u64*     members = narena::base_ptr_as<u64>(query->m_members);
+                query->m_count   = 0;
+                for (u32 w = 0; w < num_words; ++w)
+                {
+                    members[w] = s_match_word(archetype, w, query->m_cp_mask, query->m_tag_mask);
+                    query->m_count += (u32)math::countBits(members[w]);
+                }
+                queries &= queries - 1;
+            }
+        }
+
+        static byte* s_alloc_component(archetype_t* archetype, u32 entity_index, u16 global_cp_type_index)
+        {
+            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
+            ASSERT(entity_index < archetype->m_free_index);
+
+            cold_store_t* cold = s_cold_store(archetype, global_cp_type_index);
+            if (cold != nullptr)
+                return s_cold_alloc(cold, entity_index);
+
+            const u16 component_type_index = archetype->m_global_to_local_cp_type[global_cp_type_index];
+
+            u64* occupancy_array = narena::base_ptr_as<u64>(archetype->m_cp_occupancy);
+            u64& occupancy       = occupancy_array[entity_index];
+
+            const u64 bit_mask = ((u64)1 << component_type_index);
+
+            if (occupancy & bit_mask)
+            {
+                // count the bits that are before 'bit_index' to find the local index (popcount)
+                const s32 cp_index     = (s32)math::countBits(occupancy & (bit_mask - 1));
+                const u32 cp_reference = s_get_cp_reference(archetype, entity_index, cp_index);
+                return s_cp_idx2ptr(archetype, component_type_index, cp_reference);
+            }
+            else
+            {
+                u32   cp_reference = 0;
+                byte* cp_ptr       = s_cp_bin_alloc(archetype, component_type_index, cp_reference);
+                if (cp_ptr != nullptr)
+                {
+                    // calculate the number of components currently in the reference array
+                    u16 num_components = (u16)math::countBits(occupancy);
+                    // mark component as allocated
+                    occupancy = occupancy | bit_mask;
+
+                    // find local component index by counting bits before 'bit_index'
+                    const u16 cp_index = (u16)math::countBits(occupancy & (bit_mask - 1));
+
+                    // store component reference
+                    s_insert_cp_reference(archetype, entity_index, num_components, cp_index, cp_reference);
+                    archetype->m_cp_counts[component_type_index]++;
+                    narena::base_ptr_as<u64>(archetype->m_cp_summary)[entity_index >> 6] |= bit_mask;
+                    s_query_update(archetype, archetype->m_cp_queries[component_type_index], entity_index, true);
+
+                    return cp_ptr;
+                }
+            }
+            return nullptr;
+        }
+
+        static void s_free_local_component(archetype_t* archetype, u32 entity_index, u16 component_type_index)
+        {
+            const u64 bit_mask        = ((u64)1 << component_type_index);
+            u64*      occupancy_array = narena::base_ptr_as<u64>(archetype->m_cp_occupancy);
+            u64&      occupancy       = occupancy_array[entity_index];
+            if (occupancy & bit_mask)
+            {
+                u16 num_components = (u16)math::countBits(occupancy);
+                occupancy          = occupancy & (~bit_mask);
+
+                // find local component index by counting bits before 'bit_index'
+                const u16 cp_index = (u16)math::countBits(occupancy & (bit_mask - 1));
+
+                const u32 cp_reference = s_get_cp_reference(archetype, entity_index, cp_index);
+                if (archetype->m_cp_shared[component_type_index] != nullptr)
+                    s_shared_release(archetype->m_cp_shared[component_type_index], *(u32 const*)s_cp_idx2ptr(archetype, component_type_index, cp_reference));
+                s_cp_bin_free(archetype, component_type_index, cp_reference);
+
+                // remove component reference from the array
+                s_remove_cp_reference(archetype, entity_index, num_components, cp_index);
+                archetype->m_cp_counts[component_type_index]--;
+                s_update_cp_summary(archetype, entity_index >> 6);
+                s_query_update(archetype, archetype->m_cp_queries[component_type_index], entity_index, true);
+            }
+        }
+
+        static void s_free_component(archetype_t* archetype, u32 entity_index, u16 global_cp_type_index)
+        {
+            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
+            ASSERT(entity_index < archetype->m_free_index);
+            cold_store_t* cold = s_cold_store(archetype, global_cp_type_index);
+            if (cold != nullptr)
+            {
+                s_cold_free(cold, entity_index);
+                return;
+            }
+            const u16 component_type_index = archetype->m_global_to_local_cp_type[global_cp_type_index];
+            if (component_type_index != 0xFFFF)
+                s_free_local_component(archetype, entity_index, component_type_index);
+        }
+
+        static bool s_has_component(archetype_t* archetype, u32 entity_index, u16 global_cp_type_index)
+        {
+            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
+            ASSERT(entity_index < archetype->m_free_index);
+            cold_store_t const* cold = s_cold_store(archetype, global_cp_type_index);
+            if (cold != nullptr)
+                return s_cold_slot(cold, entity_index) != 0xFFFFFFFF;
+            const u16 component_type_index = archetype->m_global_to_local_cp_type[global_cp_type_index];
+            if (component_type_index == 0xFFFF)
+                return false;
+            const u64* occupancy_array = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy);
+            const u64  occupancy       = occupancy_array[entity_index];
+            const u64  bit_mask        = ((u64)1 << component_type_index);
+            return (occupancy & bit_mask) != 0;
+        }
+
+        static byte* s_get_component(archetype_t* archetype, u32 entity_index, u16 global_cp_type_index)
+        {
+            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
+            ASSERT(entity_index < archetype->m_free_index);
+
+            cold_store_t* cold = s_cold_store(archetype, global_cp_type_index);
+            if (cold != nullptr)
+                return s_cold_get(cold, entity_index, true);
+
+            const u16 component_type_index = archetype->m_global_to_local_cp_type[global_cp_type_index];
+            if (component_type_index == 0xFFFF)
+                return nullptr;
+            const u64 bit_mask = ((u64)1 << component_type_index);
+
+            const u64* occupancy_array = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy);
+            const u64  occupancy       = occupancy_array[entity_index];
+
+            if (occupancy & bit_mask)
+            {
+                // count the bits that are before 'bit_index' to find the local index (popcount)
+                const s32 cp_index     = (s32)math::countBits(occupancy & (bit_mask - 1));
+                const u32 cp_reference = s_get_cp_reference(archetype, entity_index, cp_index);
+                return s_cp_idx2ptr(archetype, component_type_index, cp_reference);
+            }
+            return nullptr;
+        }
+
+        // Tag bits are stored at the local tag index, the same as the iterator uses, 0xFF if the tag is not registered
+        static inline u8 s_local_tag_index(archetype_t const* archetype, u16 tg_index) { return tg_index < archetype->m_max_global_tag_types ? archetype->m_global_to_local_tag_type[tg_index] : (u8)0xFF; }
+
+        static bool s_has_tag(archetype_t* archetype, entity_t entity, u16 tg_index)
+        {
+            const u8 local = s_local_tag_index(archetype, tg_index);
+            if (local == 0xFF)
+                return false;
+            byte const* tag_occupancy = archetype->m_tags->m_base + (g_entity_index(entity) * (math::alignUp(archetype->m_per_entity_tags, 8) >> 3));
+            return (tag_occupancy[local >> 3] & ((u8)1 << (local & 7))) != 0;
+        }
+
+        static void s_add_tag(archetype_t* archetype, entity_t entity, u16 tg_index)
+        {
+            // A tag that is not registered yet is registered on first use
+            if (s_local_tag_index(archetype, tg_index) == 0xFF && tg_index < archetype->m_max_global_tag_types && archetype->m_num_tags < archetype->m_per_entity_tags)
+                s_register_tag_type(archetype, tg_index, false);
+            const u8 local = s_local_tag_index(archetype, tg_index);
+            if (local == 0xFF)
+                return;
+            const u32 entity_index  = g_entity_index(entity);
+            byte*     tag_occupancy = archetype->m_tags->m_base + (entity_index * (math::alignUp(archetype->m_per_entity_tags, 8) >> 3));
+            tag_occupancy[local >> 3] |= ((u8)1 << (local & 7));
+            if (archetype->m_tag_columns[local] != nullptr)
+                narena::base_ptr_as<u64>(archetype->m_tag_columns[local])[entity_index >> 6] |= ((u64)1 << (entity_index & 63));
+            s_query_update(archetype, archetype->m_tag_queries[local], entity_index, true);
+        }
+
+        static void s_rem_tag(archetype_t* archetype, entity_t entity, u16 tg_index)
+        {
+            const u8 local = s_local_tag_index(archetype, tg_index);
+            if (local == 0xFF)
+                return;
+            const u32 entity_index  = g_entity_index(entity);
+            byte*     tag_occupancy = archetype->m_tags->m_base + (entity_index * (math::alignUp(archetype->m_per_entity_tags, 8) >> 3));
+            tag_occupancy[local >> 3] &= ~((u8)1 << (local & 7));
+            if (archetype->m_tag_columns[local] != nullptr)
+                narena::base_ptr_as<u64>(archetype->m_tag_columns[local])[entity_index >> 6] &= ~((u64)1 << (entity_index & 63));
+            s_query_update(archetype, archetype->m_tag_queries[local], entity_index, true);
+        }
+
+        static s32 s_create_entity(archetype_t* archetype)
+        {
+            s32 entity_index = -1;
+            if (archetype->m_alive_count < archetype->m_free_index)
+            {
+                // The hierarchical state pages can be used to find a free entity index
+                entity_index = s_state_alloc(archetype);
+            }
+            else
+            {
+                if (archetype->m_free_index >= archetype->m_max_entities)
+                    return -1;
+                entity_index = archetype->m_free_index++;
+                s_state_tick_used(archetype, entity_index);
+                if ((entity_index & 63) == 0)
+                    narena::base_ptr_as<u64>(archetype->m_cp_summary)[entity_index >> 6] = 0;
+            }
+
+            u64* occupancy_array = narena::base_ptr_as<u64>(archetype->m_cp_occupancy);
+            u8*  tags_array      = narena::base_ptr_as<u8>(archetype->m_tags);
+
+            occupancy_array[entity_index] = 0;
+            g_memclr(tags_array + (entity_index * (math::alignUp(archetype->m_per_entity_tags, 8) >> 3)), math::alignUp(archetype->m_per_entity_tags, 8) >> 3);
+
+            u32 column_mask = archetype->m_tag_column_mask;
+            while (column_mask != 0)
+            {
+                const s8 bit = math::findFirstBit(column_mask);
+                narena::base_ptr_as<u64>(archetype->m_tag_columns[bit])[entity_index >> 6] &= ~((u64)1 << (entity_index & 63));
+                column_mask &= column_mask - 1;
+            }
+
+            if (archetype->m_moved_to != nullptr)
+                narena::base_ptr_as<entity_t>(archetype->m_moved_to)[entity_index] = ECS_ENTITY_NULL;
+            if (archetype->m_timers != nullptr)
+                narena::base_ptr_as<u32>(archetype->m_timers)[entity_index] = 0xFFFFFFFF;
+            if (archetype->m_pairs != nullptr)
+                g_memset(narena::base_ptr_as<u32>(archetype->m_pairs) + entity_index * ECS_PAIR_HEADS, 0xFF, ECS_PAIR_HEADS * sizeof(u32));
+            if (archetype->m_awake != nullptr)
+                narena::base_ptr_as<u64>(archetype->m_awake)[entity_index >> 6] |= (u64)1 << (entity_index & 63);
+
+            archetype->m_alive_count++;
+            s_query_update(archetype, archetype->m_unfiltered_queries, entity_index, true);
+
+            return entity_index;
+        }
+
+        static void s_destroy_entity(archetype_t* archetype, u32 entity_index)
+        {
+            if (archetype->m_moved_to != nullptr)
+                narena::base_ptr_as<entity_t>(archetype->m_moved_to)[entity_index] = ECS_ENTITY_NULL;
+
+            // Free all components associated with this entity
+            u64* occupancy_array = (u64*)archetype->m_cp_occupancy->m_base;
+            u64  occupancy       = occupancy_array[entity_index];
+            while (occupancy != 0)
+            {
+                const u8 bin_index = (u8)math::findFirstBit(occupancy);
+                s_free_local_component(archetype, entity_index, bin_index);
+                occupancy = occupancy & (~((u64)1 << bin_index));
+            }
+            for (u8 c = 0; c < archetype->m_num_cold; ++c)
+                s_cold_free(&archetype->m_cold_stores[c], entity_index);
+
+            s_state_set_free(archetype, entity_index);
+            s_query_update(archetype, archetype->m_query_mask, entity_index, false);
+            if (!s_is_awake(archetype, entity_index))
+                archetype->m_num_sleeping--;
+            if (archetype->m_hierarchy != nullptr)
+                s_hierarchy_remove(archetype->m_hierarchy, entity_index);
+
+            archetype->m_alive_count--;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // timing wheel
+
+        // A scheduled action is linked into a slot of the wheel and into the list of actions of its entity. A level has
+        // 64 slots of 64^level ticks, an action is filed in the level of the highest 6 bits in which its tick differs from
+        // the current tick, so it moves down one level at a time as the current tick gets closer. An action that is more
+        // than 64^4 ticks away is filed again each time its slot in the last level comes around.
+        const u32 ECS_TIMER_LEVELS    = 4;
+        const u32 ECS_TIMER_SLOT_BITS = 6;
+        const u32 ECS_TIMER_SLOTS     = 1 << ECS_TIMER_SLOT_BITS;
+
+        enum etimer_action_t
+        {
+            TIMER_ADD_TAG = 0,
+            TIMER_REM_TAG = 1,
+            TIMER_REM_CP  = 2,
+            TIMER_DESTROY = 3, // the last action of a batch
+        };
+
+        struct timer_node_t
+        {
+            u64      m_at;          // tick at which the action is due
+            entity_t m_entity;      //
+            u32      m_next;        // next node in the slot or the next free node, 0xFFFFFFFF = end
+            u32      m_prev;        // previous node in the slot, 0xFFFFFFFF = head
+            u32      m_entity_next; // next action of the entity, 0xFFFFFFFF = end
+            u32      m_entity_prev; // previous action of the entity, 0xFFFFFFFF = head
+            u16      m_index;       // tag or component type index
+            u8       m_action;      // etimer_action_t
+            u8       m_level;       // level of the slot
+        };
+
+        struct timers_t
+        {
+            arena_t*      m_arena;                                     // timers, nodes and the due batch
+            timer_node_t* m_nodes;                                     // node pool
+            u32           m_max_timers;                                //
+            u32           m_end;                                       // node indices are below this
+            u32           m_free_head;                                 // first released node, linked through m_next
+            u32           m_count;                                     // number of scheduled actions
+            u64           m_tick;                                      // current tick
+            u64*          m_due_keys;                                  // the due batch, {action, index, archetype, entity index}
+            u32*          m_due_order;                                 //
+            u32*          m_due_scratch;                               //
+            entity_t*     m_due_entities;                              // a run of the batch with the same action and index
+            u32           m_slots[ECS_TIMER_LEVELS * ECS_TIMER_SLOTS]; // first node per slot
+        };
+
+        static inline u32* s_timer_heads(archetype_t* archetype)
+        {
+            if (archetype->m_timers == nullptr)
+            {
+                // Entities that are created later initialize their own entry
+                archetype->m_timers = narena::new_arena((int_t)archetype->m_max_entities * sizeof(u32), 0);
+                g_memset(narena::base_ptr_as<u32>(archetype->m_timers), 0xFF, (int_t)archetype->m_free_index * sizeof(u32));
+            }
+            return narena::base_ptr_as<u32>(archetype->m_timers);
+        }
+
+        static inline u32& s_timers_slot(timers_t* timers, timer_node_t const* node) { return timers->m_slots[node->m_level * ECS_TIMER_SLOTS + (u32)((node->m_at >> (node->m_level * ECS_TIMER_SLOT_BITS)) & (ECS_TIMER_SLOTS - 1))]; }
+
+        static void s_timers_file(timers_t* timers, u32 node_index)
+        {
+            timer_node_t* node  = &timers->m_nodes[node_index];
+            const u64     diff  = node->m_at ^ timers->m_tick;
+            u32           level = 0;
+            while (level < (ECS_TIMER_LEVELS - 1) && (diff >> ((level + 1) * ECS_TIMER_SLOT_BITS)) != 0)
+                level++;
+            node->m_level = (u8)level;
+
+            u32& head    = s_timers_slot(timers, node);
+            node->m_prev = 0xFFFFFFFF;
+            node->m_next = head;
+            if (head != 0xFFFFFFFF)
+                timers->m_nodes[head].m_prev = node_index;
+            head = node_index;
+        }
+
+        static void s_timers_unfile(timers_t* timers, u32 node_index)
+        {
+            timer_node_t* node = &timers->m_nodes[node_index];
+            if (node->m_prev != 0xFFFFFFFF)
+                timers->m_nodes[node->m_prev].m_next = node->m_next;
+            else
+                s_timers_slot(timers, node) = node->m_next;
+            if (node->m_next != 0xFFFFFFFF)
+                timers->m_nodes[node->m_next].m_prev = node->m_prev;
+        }
+
+        static void s_timers_unlink_entity(timers_t* timers, u32* heads, u32 entity_index, u32 node_index)
+        {
+            timer_node_t* node = &timers->m_nodes[node_index];
+            if (node->m_entity_prev != 0xFFFFFFFF)
+                timers->m_nodes[node->m_entity_prev].m_entity_next = node->m_entity_next;
+            else
+                heads[entity_index] = node->m_entity_next;
+            if (node->m_entity_next != 0xFFFFFFFF)
+                timers->m_nodes[node->m_entity_next].m_entity_prev = node->m_entity_prev;
+        }
+
+        static inline void s_timers_free(timers_t* timers, u32 node_index)
+        {
+            timers->m_nodes[node_index].m_next = timers->m_free_head;
+            timers->m_free_head                = node_index;
+            timers->m_count--;
+        }
+
+        static u32 s_timers_cancel_entity(timers_t* timers, archetype_t* archetype, u32 entity_index)
+        {
+            u32* heads = narena::base_ptr_as<u32>(archetype->m_timers);
+            u32  count = 0;
+            for (u32 i = heads[entity_index]; i != 0xFFFFFFFF;)
+            {
+                const u32 next = timers->m_nodes[i].m_entity_next;
+                s_timers_unfile(timers, i);
+                s_timers_free(timers, i);
+                i = next;
+                count++;
+            }
+            heads[entity_index] = 0xFFFFFFFF;
+            return count;
+        }
+
+        // The actions of a moved entity are handed over to the entity in the destination archetype
+        static void s_timers_move_entity(timers_t* timers, archetype_t* src, u32 src_entity_index, archetype_t* dst, entity_t moved)
+        {
+            u32*      src_heads = narena::base_ptr_as<u32>(src->m_timers);
+            const u32 first     = src_heads[src_entity_index];
+            if (first == 0xFFFFFFFF)
+                return;
+            for (u32 i = first; i != 0xFFFFFFFF; i = timers->m_nodes[i].m_entity_next)
+                timers->m_nodes[i].m_entity = moved;
+            s_timer_heads(dst)[g_entity_index(moved)] = first;
+            src_heads[src_entity_index]               = 0xFFFFFFFF;
+        }
+
+        // The actions follow the rows of a sorted archetype, the entity at alive[temp[m]] comes from alive[order[temp[m]]]
+        static void s_timers_remap(timers_t* timers, archetype_t* archetype, u8 archetype_index, u32 const* alive, u32 const* order, u32 const* temp, u32 num_changed, u32* firsts)
+        {
+            u32* heads = narena::base_ptr_as<u32>(archetype->m_timers);
+            for (u32 m = 0; m < num_changed; ++m)
+                firsts[m] = heads[alive[order[temp[m]]]];
+            for (u32 m = 0; m < num_changed; ++m)
+            {
+                const u32 dst = alive[temp[m]];
+                heads[dst]    = firsts[m];
+                for (u32 i = firsts[m]; i != 0xFFFFFFFF; i = timers->m_nodes[i].m_entity_next)
+                    timers->m_nodes[i].m_entity = s_entity_make(archetype_index, dst);
+            }
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // relation pairs
+
+        // The pairs of a relation are a pool that belongs to the ECS, the entity and the target of a pair can be in any
+        // archetype. Every pair is in the list of pairs of its entity and in the list of pairs that target its target, the
+        // heads of both lists are kept by the archetype of the entity, so that they follow it when it is moved or sorted.
+        struct relation_t
+        {
+            arena_t*  m_arena;     // relation and its arrays
+            u32       m_max_pairs; // maximum number of pairs
+            u32       m_count;     // number of pairs in use
+            u32       m_end;       // pair indices are below this
+            u32       m_free_head; // first released pair, linked through m_next_out
+            entity_t* m_source;    // per pair, the entity
+            entity_t* m_target;    // per pair, the target
+            u32*      m_next_out;  // per pair, the next pair of the same entity
+            u32*      m_prev_out;  // per pair, the previous pair of the same entity
+            u32*      m_next_in;   // per pair, the next pair with the same target
+            u32*      m_prev_in;   // per pair, the previous pair with the same target
+        };
+
+        static inline u32* s_pair_heads(archetype_t* archetype, u32 entity_index)
+        {
+            if (archetype->m_pairs == nullptr)
+            {
+                // Entities that are created later initialize their own entry
+                archetype->m_pairs = narena::new_arena((int_t)archetype->m_max_entities * ECS_PAIR_HEADS * sizeof(u32), 0);
+                g_memset(narena::base_ptr_as<u32>(archetype->m_pairs), 0xFF, (int_t)archetype->m_free_index * ECS_PAIR_HEADS * sizeof(u32));
+            }
+            return narena::base_ptr_as<u32>(archetype->m_pairs) + entity_index * ECS_PAIR_HEADS;
+        }
+
+        // The heads of an entity that has (or is the target of) a pair
+        static inline u32* s_pair_heads_of(archetype_t* archetypes, entity_t e) { return narena::base_ptr_as<u32>(archetypes[g_entity_archetype_index(e)].m_pairs) + g_entity_index(e) * ECS_PAIR_HEADS; }
+
+        // The pair of an entity with 'target', 0xFFFFFFFF when there is none
+        static u32 s_relation_find(relation_t const* rl, u32 rl_index, u32 const* heads, entity_t target)
+        {
+            for (u32 p = heads[2 * rl_index]; p != 0xFFFFFFFF; p = rl->m_next_out[p])
+            {
+                if (rl->m_target[p] == target)
+                    return p;
+            }
+            return 0xFFFFFFFF;
+        }
+
+        // Returns false when the relation is full
+        static bool s_relation_add(relation_t* rl, u32 rl_index, u32* source_heads, entity_t source, u32* target_heads, entity_t target)
+        {
+            if (s_relation_find(rl, rl_index, source_heads, target) != 0xFFFFFFFF)
+                return true;
+
+            u32 p;
+            if (rl->m_free_head != 0xFFFFFFFF)
+            {
+                p               = rl->m_free_head;
+                rl->m_free_head = rl->m_next_out[p];
+            }
+            else if (rl->m_end < rl->m_max_pairs)
+            {
+                p = rl->m_end++;
+            }
+            else
+            {
+                return false;
+            }
+
+            rl->m_source[p]   = source;
+            rl->m_target[p]   = target;
+            rl->m_prev_out[p] = 0xFFFFFFFF;
+            rl->m_next_out[p] = source_heads[2 * rl_index];
+            if (rl->m_next_out[p] != 0xFFFFFFFF)
+                rl->m_prev_out[rl->m_next_out[p]] = p;
+            source_heads[2 * rl_index] = p;
+            rl->m_prev_in[p]           = 0xFFFFFFFF;
+            rl->m_next_in[p]           = target_heads[2 * rl_index + 1];
+            if (rl->m_next_in[p] != 0xFFFFFFFF)
+                rl->m_prev_in[rl->m_next_in[p]] = p;
+            target_heads[2 * rl_index + 1] = p;
+            rl->m_count++;
+            return true;
+        }
+
+        static void s_relation_remove(relation_t* rl, u32 rl_index, archetype_t* archetypes, u32 p)
+        {
+            if (rl->m_prev_out[p] != 0xFFFFFFFF)
+                rl->m_next_out[rl->m_prev_out[p]] = rl->m_next_out[p];
+            else
+                s_pair_heads_of(archetypes, rl->m_source[p])[2 * rl_index] = rl->m_next_out[p];
+            if (rl->m_next_out[p] != 0xFFFFFFFF)
+                rl->m_prev_out[rl->m_next_out[p]] = rl->m_prev_out[p];
+
+            if (rl->m_prev_in[p] != 0xFFFFFFFF)
+                rl->m_next_in[rl->m_prev_in[p]] = rl->m_next_in[p];
+            else
+                s_pair_heads_of(archetypes, rl->m_target[p])[2 * rl_index + 1] = rl->m_next_in[p];
+            if (rl->m_next_in[p] != 0xFFFFFFFF)
+                rl->m_prev_in[rl->m_next_in[p]] = rl->m_prev_in[p];
+
+            rl->m_next_out[p] = rl->m_free_head;
+            rl->m_free_head   = p;
+            rl->m_count--;
+        }
+
+        // Remove the pairs of an entity that is destroyed and the pairs that target it
+        static void s_relations_remove_entity(relation_t* const* relations, archetype_t* archetypes, archetype_t* archetype, u32 entity_index)
+        {
+            u32* heads = narena::base_ptr_as<u32>(archetype->m_pairs) + entity_index * ECS_PAIR_HEADS;
+            for (u32 r = 0; r < ECS4_MAX_RELATIONS; ++r)
+            {
+                if (relations[r] == nullptr)
+                    continue;
+                while (heads[2 * r] != 0xFFFFFFFF)
+                    s_relation_remove(relations[r], r, archetypes, heads[2 * r]);
+                while (heads[2 * r + 1] != 0xFFFFFFFF)
+                    s_relation_remove(relations[r], r, archetypes, heads[2 * r + 1]);
+            }
+        }
+
+        // The pairs of an entity that got a new handle, 'heads' are already the heads of the new handle
+        static void s_relations_rename(relation_t* const* relations, u32 const* heads, entity_t e)
+        {
+            for (u32 r = 0; r < ECS4_MAX_RELATIONS; ++r)
+            {
+                relation_t* rl = relations[r];
+                if (rl == nullptr)
+                    continue;
+                for (u32 p = heads[2 * r]; p != 0xFFFFFFFF; p = rl->m_next_out[p])
+                    rl->m_source[p] = e;
+                for (u32 p = heads[2 * r + 1]; p != 0xFFFFFFFF; p = rl->m_next_in[p])
+                    rl->m_target[p] = e;
+            }
+        }
+
+        // The pairs of a moved entity are handed over to the entity in the destination archetype
+        static void s_relations_move_entity(relation_t* const* relations, archetype_t* src, u32 src_entity_index, archetype_t* dst, entity_t moved)
+        {
+            u32* src_heads = narena::base_ptr_as<u32>(src->m_pairs) + src_entity_index * ECS_PAIR_HEADS;
+            u32  empty     = 0xFFFFFFFF;
+            for (u32 i = 0; i < ECS_PAIR_HEADS; ++i)
+                empty &= src_heads[i];
+            if (empty == 0xFFFFFFFF)
+                return;
+            u32* dst_heads = s_pair_heads(dst, g_entity_index(moved));
+            g_memcopy(dst_heads, src_heads, ECS_PAIR_HEADS * sizeof(u32));
+            g_memset(src_heads, 0xFF, ECS_PAIR_HEADS * sizeof(u32));
+            s_relations_rename(relations, dst_heads, moved);
+        }
+
+        // The pairs follow the rows of a sorted archetype, the entity at alive[temp[m]] comes from alive[order[temp[m]]]
+        static void s_relations_remap(relation_t* const* relations, archetype_t* archetype, u8 archetype_index, u32 const* alive, u32 const* order, u32 const* temp, u32 num_changed, u32* heads)
+        {
+            u32* pairs = narena::base_ptr_as<u32>(archetype->m_pairs);
+            for (u32 m = 0; m < num_changed; ++m)
+                g_memcopy(heads + m * ECS_PAIR_HEADS, pairs + alive[order[temp[m]]] * ECS_PAIR_HEADS, ECS_PAIR_HEADS * sizeof(u32));
+            for (u32 m = 0; m < num_changed; ++m)
+            {
+                const u32 dst = alive[temp[m]];
+                g_memcopy(pairs + dst * ECS_PAIR_HEADS, heads + m * ECS_PAIR_HEADS, ECS_PAIR_HEADS * sizeof(u32));
+                s_relations_rename(relations, pairs + dst * ECS_PAIR_HEADS, s_entity_make(archetype_index, dst));
+            }
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        struct ecs_t
+        {
+            DCORE_CLASS_PLACEMENT_NEW_DELETE
+            arena_t*       m_arena;
+            u32            m_archetypes_capacity;
+            archetype_t*   m_archetypes;                            // array of archetype pointers
+            u32            m_num_shared_pools;                      // number of shared component types
+            shared_pool_t* m_shared_pools[ECS_MAX_SHARED_TYPES];    // value pools of the shared component types, shared by all archetypes
+            void*          m_singletons[ECS4_MAX_SINGLETONS];       // the flat table of singletons
+            arena_t*       m_singleton_arenas[ECS4_MAX_SINGLETONS]; // the memory of each singleton
+            timers_t*      m_timers;                                // the scheduled actions, created by g_register_timers
+            relation_t*    m_relations[ECS4_MAX_RELATIONS];         // the pairs of each relation, created by g_register_relation
+        };
+
+        static shared_pool_t* s_find_shared_pool(ecs_t* ecs, u32 cp_index)
+        {
+            for (u32 i = 0; i < ecs->m_num_shared_pools; ++i)
+            {
+                if (ecs->m_shared_pools[i]->m_cp_index == cp_index)
+                    return ecs->m_shared_pools[i];
+            }
+            return nullptr;
+        }
+
+        void g_register_archetype(ecs_t* ecs, u8 archetype_index, u8 components_per_entity, u16 max_global_component_types, u8 tags_per_entity, u16 max_global_tag_types, u32 max_entities)
+        {
+            ASSERT(archetype_index < ecs->m_archetypes_capacity);
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena != nullptr)
+                return;
+            s_initialize_archetype(archetype, components_per_entity, max_global_component_types, tags_per_entity, max_global_tag_types, max_entities);
+        }
+
+        ecs_t* g_create_ecs(u8 max_archetypes)
+        {
+            const int_t ecs_size = (sizeof(ecs_t) + (sizeof(archetype_t) * max_archetypes));
+            arena_t*    arena    = narena::new_arena(ecs_size, ecs_size);
+
+            ecs_t* ecs                 = g_allocate<ecs_t>(arena);
+            ecs->m_arena               = arena;
+            ecs->m_archetypes_capacity = max_archetypes;
+            ecs->m_archetypes          = g_allocate_and_clear<archetype_t>(arena, max_archetypes);
+            ecs->m_num_shared_pools    = 0;
+            ecs->m_timers              = nullptr;
+            for (u32 i = 0; i < ECS4_MAX_SINGLETONS; ++i)
+            {
+                ecs->m_singletons[i]       = nullptr;
+                ecs->m_singleton_arenas[i] = nullptr;
+            }
+            for (u32 i = 0; i < ECS4_MAX_RELATIONS; ++i)
+                ecs->m_relations[i] = nullptr;
+
+            return ecs;
+        }
+
+        void g_destroy_ecs(ecs_t* ecs)
+        {
+            for (u32 i = 0; i < ecs->m_archetypes_capacity; i++)
+            {
+                archetype_t* archetype = &ecs->m_archetypes[i];
+                if (archetype->m_archetype_arena != nullptr)
+                    s_destroy(archetype);
+            }
+            for (u32 i = 0; i < ecs->m_num_shared_pools; i++)
+                narena::destroy(ecs->m_shared_pools[i]->m_arena);
+            for (u32 i = 0; i < ECS4_MAX_SINGLETONS; i++)
+            {
+                if (ecs->m_singleton_arenas[i] != nullptr)
+                    narena::destroy(ecs->m_singleton_arenas[i]);
+            }
+            if (ecs->m_timers != nullptr)
+                narena::destroy(ecs->m_timers->m_arena);
+            for (u32 i = 0; i < ECS4_MAX_RELATIONS; i++)
+            {
+                if (ecs->m_relations[i] != nullptr)
+                    narena::destroy(ecs->m_relations[i]->m_arena);
+            }
+            narena::destroy(ecs->m_arena);
+        }
+
+        entity_t g_create_entity(ecs_t* ecs, u8 archetype_index)
+        {
+            archetype_t* archetype    = &ecs->m_archetypes[archetype_index];
+            const s32    entity_index = s_create_entity(archetype);
+            if (entity_index < 0)
+                return ECS_ENTITY_NULL;
+            return s_entity_make(archetype_index, (entity_index_t)entity_index);
+        }
+
+        void g_destroy_entity(ecs_t* ecs, entity_t e)
+        {
+            const u8     archetype_index = g_entity_archetype_index(e);
+            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_timers != nullptr)
+                s_timers_cancel_entity(ecs->m_timers, archetype, g_entity_index(e));
+            if (archetype->m_pairs != nullptr)
+                s_relations_remove_entity(ecs->m_relations, ecs->m_archetypes, archetype, g_entity_index(e));
+            s_destroy_entity(archetype, g_entity_index(e));
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // migration
+
+        static inline bool s_is_alive(archetype_t const* archetype, u32 entity_index)
+        {
+            if (entity_index >= archetype->m_free_index)
+                return false;
+            return (narena::base_ptr_as<const u64>(archetype->m_bin2)[entity_index >> 6] & ((u64)1 << (entity_index & 63))) != 0;
+        }
+
+        static void s_set_moved_to(archetype_t* archetype, u32 entity_index, entity_t moved_to)
+        {
+            if (archetype->m_moved_to == nullptr)
+            {
+                // Entities that are created later initialize their own entry
+                archetype->m_moved_to = narena::new_arena((int_t)archetype->m_max_entities * sizeof(entity_t), 0);
+                g_memset(narena::base_ptr_as<entity_t>(archetype->m_moved_to), 0xFF, (int_t)archetype->m_free_index * sizeof(entity_t));
+            }
+            narena::base_ptr_as<entity_t>(archetype->m_moved_to)[entity_index] = moved_to;
+        }
+
+        // Copy a component between archetypes, a shared component is copied by reference. When only one of the two
+        // archetypes registered the component as shared the value is looked up or added to the pool.
+        static void s_copy_component(archetype_t const* src, u16 src_local, byte const* src_cp, archetype_t const* dst, u16 dst_local, byte* dst_cp)
+        {
+            shared_pool_t* src_pool = src->m_cp_shared[src_local];
+            shared_pool_t* dst_pool = dst->m_cp_shared[dst_local];
+            if (src_pool != nullptr && dst_pool != nullptr)
+            {
+                *(u32*)dst_cp = *(u32 const*)src_cp;
+                s_shared_add_refs(dst_pool, *(u32 const*)src_cp, 1);
+            }
+            else if (dst_pool != nullptr)
+            {
+                ASSERT(src->m_cp_sizeof[src_local] >= dst_pool->m_sizeof);
+                *(u32*)dst_cp = s_shared_acquire(dst_pool, src_cp);
+            }
+            else if (src_pool != nullptr)
+            {
+                byte const* value = s_shared_value(src_pool, *(u32 const*)src_cp);
+                if (value != nullptr)
+                    g_memcopy(dst_cp, value, math::min(src_pool->m_sizeof, dst->m_cp_sizeof[dst_local]));
+            }
+            else
+            {
+                g_memcopy(dst_cp, src_cp, math::min(src->m_cp_sizeof[src_local], dst->m_cp_sizeof[dst_local]));
+            }
+        }
+
+        // Copy the components of an entity that are cold in either archetype, value by value
+        static void s_copy_cold_components(archetype_t* src, u32 src_entity_index, archetype_t* dst, u32 dst_entity_index)
+        {
+            for (u8 c = 0; c < src->m_num_cold; ++c)
+            {
+                cold_store_t* store  = &src->m_cold_stores[c];
+                const u16     global = store->m_cp_index;
+                byte const*   cp     = s_cold_get(store, src_entity_index, false);
+                if (cp == nullptr || global >= dst->m_max_global_cp_types)
+                    continue;
+                const u16 local = dst->m_global_to_local_cp_type[global];
+                if (local == 0xFFFF && dst->m_global_to_cold_cp_type[global] == 0xFF)
+                    continue;
+                byte* dst_cp = s_alloc_component(dst, dst_entity_index, global);
+                if (dst_cp == nullptr)
+                    continue;
+                if (local != 0xFFFF && dst->m_cp_shared[local] != nullptr)
+                    *(u32*)dst_cp = s_shared_acquire(dst->m_cp_shared[local], cp);
+                else
+                    g_memcopy(dst_cp, cp, math::min(store->m_sizeof, local != 0xFFFF ? dst->m_cp_sizeof[local] : s_cold_store(dst, global)->m_sizeof));
+            }
+
+            for (u8 c = 0; c < dst->m_num_cold; ++c)
+            {
+                cold_store_t* store  = &dst->m_cold_stores[c];
+                const u16     global = store->m_cp_index;
+                const u16     local  = global < src->m_max_global_cp_types ? src->m_global_to_local_cp_type[global] : (u16)0xFFFF;
+                if (local == 0xFFFF)
+                    continue;
+                byte const* cp   = s_get_component(src, src_entity_index, global);
+                u32         size = src->m_cp_sizeof[local];
+                if (cp != nullptr && src->m_cp_shared[local] != nullptr)
+                {
+                    size = src->m_cp_shared[local]->m_sizeof;
+                    cp   = s_shared_value(src->m_cp_shared[local], *(u32 const*)cp);
+                }
+                if (cp != nullptr)
+                    g_memcopy(s_cold_alloc(store, dst_entity_index), cp, math::min(size, store->m_sizeof));
+            }
+        }
+
+        entity_t g_move_entity(ecs_t* ecs, entity_t e, u8 dst_archetype_index)
+        {
+            const u8     src_archetype_index = g_entity_archetype_index(e);
+            const u32    src_entity_index    = g_entity_index(e);
+            archetype_t* src                 = &ecs->m_archetypes[src_archetype_index];
+            archetype_t* dst                 = &ecs->m_archetypes[dst_archetype_index];
+            if (src->m_archetype_arena == nullptr || dst->m_archetype_arena == nullptr || !s_is_alive(src, src_entity_index))
+                return ECS_ENTITY_NULL;
+            if (src_archetype_index == dst_archetype_index)
+                return e;
+
+            const s32 dst_entity_index = s_create_entity(dst);
+            if (dst_entity_index < 0)
+                return ECS_ENTITY_NULL;
+            const entity_t moved = s_entity_make(dst_archetype_index, (entity_index_t)dst_entity_index);
+
+            // Copy the components that the destination archetype has registered, bin to bin
+            u64 occupancy = narena::base_ptr_as<const u64>(src->m_cp_occupancy)[src_entity_index];
+            while (occupancy != 0)
+            {
+                const u16 local  = (u16)math::findFirstBit(occupancy);
+                const u16 global = src->m_local_to_global_cp_type[local];
+                if (global < dst->m_max_global_cp_types && dst->m_global_to_local_cp_type[global] != 0xFFFF)
+                {
+                    byte* dst_cp = s_alloc_component(dst, (u32)dst_entity_index, global);
+                    if (dst_cp != nullptr)
+                        s_copy_component(src, local, s_get_component(src, src_entity_index, global), dst, dst->m_global_to_local_cp_type[global], dst_cp);
+                }
+                occupancy &= occupancy - 1;
+            }
+            s_copy_cold_components(src, src_entity_index, dst, (u32)dst_entity_index);
+
+            // Copy the tags, a tag that the destination archetype does not know yet is registered on first use
+            u32 tags = s_get_tags(src, (s32)src_entity_index);
+            while (tags != 0)
+            {
+                const s8 local = math::findFirstBit(tags);
+                s_add_tag(dst, moved, src->m_local_to_global_tag_type[local]);
+                tags &= tags - 1;
+            }
+
+            // The scheduled actions, the pairs and the sleep state follow the entity, the remaining components are freed
+            // together with the source entity
+            if (src->m_timers != nullptr)
+                s_timers_move_entity(ecs->m_timers, src, src_entity_index, dst, moved);
+            if (src->m_pairs != nullptr)
+                s_relations_move_entity(ecs->m_relations, src, src_entity_index, dst, moved);
+            if (!s_is_awake(src, src_entity_index))
+                s_set_sleeping(dst, (u32)dst_entity_index, true);
+            s_destroy_entity(src, src_entity_index);
+            s_set_moved_to(src, src_entity_index, moved);
+            return moved;
+        }
+
+        u32 g_move_entities(ecs_t* ecs, entity_t* entities, u32 count, u8 dst_archetype_index)
+        {
+            u32 moved = 0;
+            for (u32 i = 0; i < count; ++i)
+            {
+                const entity_t e = g_move_entity(ecs, entities[i], dst_archetype_index);
+                if (e != ECS_ENTITY_NULL)
+                {
+                    entities[i] = e;
+                    moved++;
+                }
+            }
+            return moved;
+        }
+
+        entity_t g_remap_entity(ecs_t* ecs, entity_t e)
+        {
+            // Follow the chain of moves until an alive entity is found, the number of hops is bounded as a safety net
+            for (s32 hop = 0; hop < 256 && e != ECS_ENTITY_NULL; ++hop)
+            {
+                archetype_t const* archetype    = &ecs->m_archetypes[g_entity_archetype_index(e)];
+                const u32          entity_index = g_entity_index(e);
+                if (archetype->m_archetype_arena == nullptr)
+                    return ECS_ENTITY_NULL;
+                if (s_is_alive(archetype, entity_index))
+                    return e;
+                if (archetype->m_moved_to == nullptr || entity_index >= archetype->m_free_index)
+                    return ECS_ENTITY_NULL;
+                e = narena::base_ptr_as<const entity_t>(archetype->m_moved_to)[entity_index];
+            }
+            return e;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // prefabs
+
+        // Copy 'size' bytes of 'src' to 'n' consecutive elements of 'stride' bytes at 'dst', after the first element the
+        // copies double in size
+        static void s_fill_copies(byte* dst, byte const* src, u32 size, u32 stride, u32 n)
+        {
+            g_memcopy(dst, src, size);
+            u32 copied = 1;
+            while (copied < n)
+            {
+                const u32 chunk = math::min(copied, n - copied);
+                g_memcopy(dst + copied * stride, dst, (int_t)chunk * stride);
+                copied += chunk;
+            }
+        }
+
+        u32 g_instantiate(ecs_t* ecs, entity_t prefab, u8 archetype_index, entity_t* out, u32 count)
+        {
+            archetype_t* src = &ecs->m_archetypes[g_entity_archetype_index(prefab)];
+            archetype_t* dst = &ecs->m_archetypes[archetype_index];
+            if (dst->m_archetype_arena == nullptr || count == 0)
+                return 0;
+            const u32 prefab_index = g_entity_index(prefab);
+            ASSERT(s_is_alive(src, prefab_index));
+
+            // The occupancy and tag word of an instance, the components that the archetype does not have are skipped and
+            // a tag that it does not know yet is registered on first use. A shared component is copied as its value index,
+            // a value that is not in the pool yet holds one extra reference until the instances have been created.
+            byte const* templates[64];
+            u32         shared_values[64];
+            u64         occupancy = 0;
+            u64         acquired  = 0;
+            for (u64 bits = narena::base_ptr_as<const u64>(src->m_cp_occupancy)[prefab_index]; bits != 0; bits &= bits - 1)
+            {
+                const u16 src_local = (u16)math::findFirstBit(bits);
+                const u16 global    = src->m_local_to_global_cp_type[src_local];
+                const u16 local     = global < dst->m_max_global_cp_types ? dst->m_global_to_local_cp_type[global] : (u16)0xFFFF;
+                if (local == 0xFFFF)
+                    continue;
+                byte const*    cp       = s_get_component(src, prefab_index, global);
+                shared_pool_t* src_pool = src->m_cp_shared[src_local];
+                shared_pool_t* dst_pool = dst->m_cp_shared[local];
+                if (dst_pool != nullptr)
+                {
+                    if (src_pool != nullptr)
+                    {
+                        shared_values[local] = *(u32 const*)cp;
+                    }
+                    else
+                    {
+                        shared_values[local] = s_shared_acquire(dst_pool, cp);
+                        acquired |= (u64)1 << local;
+                    }
+                    cp = (byte const*)&shared_values[local];
+                }
+                else if (src_pool != nullptr)
+                {
+                    cp = s_shared_value(src_pool, *(u32 const*)cp);
+                    if (cp == nullptr)
+                        continue;
+                }
+                else if (src->m_cp_soa[src_local] != nullptr)
+                {
+                    // Filling the instances stages other slots, the template is copied out of the staging copy
+                    soa_store_t* soa = src->m_cp_soa[src_local];
+                    g_memcopy(soa->m_value, cp, src->m_cp_sizeof[src_local]);
+                    cp = soa->m_value;
+                }
+                occupancy |= (u64)1 << local;
+                templates[local] = cp;
+            }
+            ASSERT(math::countBits(occupancy) <= dst->m_per_entity_cps);
+
+            u32 tags = 0;
+            for (u32 bits = s_get_tags(src, (s32)prefab_index); bits != 0; bits &= bits - 1)
+            {
+                const u16 global = src->m_local_to_global_tag_type[math::findFirstBit(bits)];
+                if (s_local_tag_index(dst, global) == 0xFF && global < dst->m_max_global_tag_types && dst->m_num_tags < dst->m_per_entity_tags)
+                    s_register_tag_type(dst, global, false);
+                const u8 local = s_local_tag_index(dst, global);
+                if (local != 0xFF)
+                    tags |= (u32)1 << local;
+            }
+
+            // Create the instances, one store for the occupancy and one for the tags per instance
+            u64* occupancy_array = narena::base_ptr_as<u64>(dst->m_cp_occupancy);
+            u64* summary_array   = narena::base_ptr_as<u64>(dst->m_cp_summary);
+            u32  n               = 0;
+            for (; n < count; ++n)
+            {
+                const s32 entity_index = s_create_entity(dst);
+                if (entity_index < 0)
+                    break;
+                occupancy_array[entity_index] = occupancy;
+                summary_array[entity_index >> 6] |= occupancy;
+                s_set_tags(dst, entity_index, tags);
+                out[n] = s_entity_make(archetype_index, (u32)entity_index);
+            }
+            for (u32 columns = tags & dst->m_tag_column_mask; columns != 0; columns &= columns - 1)
+            {
+                u64* column = narena::base_ptr_as<u64>(dst->m_tag_columns[math::findFirstBit(columns)]);
+                for (u32 i = 0; i < n; ++i)
+                {
+                    const u32 entity_index = g_entity_index(out[i]);
+                    column[entity_index >> 6] |= (u64)1 << (entity_index & 63);
+                }
+            }
+
+            // Allocate the components bin by bin, every run of consecutive slots is filled with a few large copies
+            arena_t* scratch = narena::new_arena((int_t)n * sizeof(u32) + 64, (int_t)n * sizeof(u32) + 64);
+            u32*     slots   = g_allocate<u32>(scratch, n);
+            for (u64 bits = occupancy; bits != 0; bits &= bits - 1)
+            {
+                const u16 local     = (u16)math::findFirstBit(bits);
+                const u32 size      = dst->m_cp_sizeof[local];
+                const u64 bit_mask  = (u64)1 << local;
+                u32       allocated = 0;
+                for (; allocated < n; ++allocated)
+                {
+                    const u32 entity_index = g_entity_index(out[allocated]);
+                    if (s_cp_bin_alloc(dst, local, slots[allocated]) == nullptr)
+                        break;
+                    s_set_cp_reference(dst, entity_index, (s32)math::countBits(occupancy_array[entity_index] & (bit_mask - 1)), slots[allocated]);
+                }
+                dst->m_cp_counts[local] += allocated;
+                if (dst->m_cp_shared[local] != nullptr)
+                    s_shared_add_refs(dst->m_cp_shared[local], shared_values[local], allocated);
+
+                // The bin is full, the remaining instances do not get the component
+                for (u32 i = allocated; i < n; ++i)
+                {
+                    const u32 entity_index = g_entity_index(out[i]);
+                    occupancy_array[entity_index] &= ~bit_mask;
+                    s_update_cp_summary(dst, entity_index >> 6);
+                }
+
+                // The slots of a split component are filled one at a time
+                u32 run = 0;
+                for (u32 i = 1; i <= allocated; ++i)
+                {
+                    if (i < allocated && slots[i] == slots[i - 1] + 1 && dst->m_cp_soa[local] == nullptr)
+                        continue;
+                    byte*     base   = s_cp_idx2ptr(dst, local, slots[run]);
+                    const u32 stride = (i - run) > 1 ? (u32)(s_cp_idx2ptr(dst, local, slots[run] + 1) - base) : size;
+                    s_fill_copies(base, templates[local], size, stride, i - run);
+                    run = i;
+                }
+            }
+            narena::destroy(scratch);
+            for (; acquired != 0; acquired &= acquired - 1)
+            {
+                const u16 local = (u16)math::findFirstBit(acquired);
+                s_shared_release(dst->m_cp_shared[local], shared_values[local]);
+            }
+
+            // A component that is cold in either archetype is copied per instance
+            if (src->m_num_cold != 0 || dst->m_num_cold != 0)
+            {
+                for (u32 i = 0; i < n; ++i)
+                    s_copy_cold_components(src, prefab_index, dst, g_entity_index(out[i]));
+            }
+
+            for (u32 i = 0; i < n; ++i)
+                s_query_update(dst, dst->m_query_mask, g_entity_index(out[i]), true);
+            return n;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // storage order
+
+        // Stable sort of 'order' by 'keys', a full merge sort or, when 'max_moves' is given, an insertion sort that stops
+        // after 'max_moves' element moves (cheap for data that is nearly sorted)
+        static void s_sort_order(u32* order, u32* scratch, u64 const* keys, u32 n, u32 max_moves)
+        {
+            if (max_moves != 0xFFFFFFFF)
+            {
+                u32 moves = 0;
+                for (u32 i = 1; i < n && moves < max_moves; ++i)
+                {
+                    const u32 o = order[i];
+                    u32       j = i;
+                    for (; j > 0 && keys[order[j - 1]] > keys[o] && moves < max_moves; --j, ++moves)
+                        order[j] = order[j - 1];
+                    order[j] = o;
+                }
+                return;
+            }
+
+            u32* src = order;
+            u32* dst = scratch;
+            for (u32 width = 1; width < n; width <<= 1)
+            {
+                for (u32 lo = 0; lo < n; lo += (width << 1))
+                {
+                    const u32 mid = math::min(lo + width, n);
+                    const u32 hi  = math::min(lo + (width << 1), n);
+                    u32       a   = lo;
+                    u32       b   = mid;
+                    u32       k   = lo;
+                    while (a < mid && b < hi)
+                        dst[k++] = keys[src[b]] < keys[src[a]] ? src[b++] : src[a++];
+                    while (a < mid)
+                        dst[k++] = src[a++];
+                    while (b < hi)
+                        dst[k++] = src[b++];
+                }
+                u32* swap = src;
+                src       = dst;
+                dst       = swap;
+            }
+            if (src != order)
+                g_memcopy(order, src, (int_t)n * sizeof(u32));
+        }
+
+        // Lay out every component bin in entity order, the slots that a component uses stay the same but the k-th entity
+        // that has the component gets the k-th lowest slot. Only the components that change slot are copied.
+        static void s_layout_components(archetype_t* archetype, u32 const* alive, u32 n, arena_t* scratch)
+        {
+            const u32  capacity        = archetype->m_wide ? archetype->m_max_entities : ECS_ARCHETYPE_MAX_ENTITIES;
+            const u32  num_slot_words  = (capacity + 63) >> 6;
+            const u64* occupancy_array = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy);
+
+            u32 max_sizeof = 0;
+            for (u16 c = 0; c < archetype->m_num_cps; ++c)
+                max_sizeof = math::max(max_sizeof, archetype->m_cp_sizeof[c]);
+
+            u32*  owners = g_allocate<u32>(scratch, n);
+            u32*  refs   = g_allocate<u32>(scratch, n);
+            u32*  slots  = g_allocate<u32>(scratch, n);
+            u64*  used   = g_allocate<u64>(scratch, num_slot_words);
+            byte* data   = g_allocate<byte>(scratch, n * max_sizeof);
+
+            for (u16 c = 0; c < archetype->m_num_cps; ++c)
+            {
+                const u64 bit_mask = (u64)1 << c;
+                const u32 size     = archetype->m_cp_sizeof[c];
+                u32       count    = 0;
+                g_memclr(used, (int_t)num_slot_words * sizeof(u64));
+                for (u32 j = 0; j < n; ++j)
+                {
+                    const u64 occupancy = occupancy_array[alive[j]];
+                    if ((occupancy & bit_mask) == 0)
+                        continue;
+                    const u32 cp_reference = s_get_cp_reference(archetype, alive[j], (s32)math::countBits(occupancy & (bit_mask - 1)));
+                    owners[count]          = alive[j];
+                    refs[count++]          = cp_reference;
+                    used[cp_reference >> 6] |= (u64)1 << (cp_reference & 63);
+                }
+
+                u32 k = 0;
+                for (u32 w = 0; w < num_slot_words && k < count; ++w)
+                {
+                    u64 word = used[w];
+                    for (; word != 0; word &= word - 1)
+                        slots[k++] = (w << 6) + math::findFirstBit(word);
+                }
+
+                // The components that change slot are gathered first, their old slots are exactly their new slots
+                u32 num_moved = 0;
+                for (k = 0; k < count; ++k)
+                {
+                    if (refs[k] == slots[k])
+                        continue;
+                    g_memcopy(data + num_moved * size, s_cp_idx2ptr(archetype, c, refs[k]), size);
+                    refs[num_moved++] = k;
+                }
+                for (u32 m = 0; m < num_moved; ++m)
+                {
+                    const u32 e         = owners[refs[m]];
+                    const u64 occupancy = occupancy_array[e];
+                    g_memcopy(s_cp_idx2ptr(archetype, c, slots[refs[m]]), data + m * size, size);
+                    s_set_cp_reference(archetype, e, (s32)math::countBits(occupancy & (bit_mask - 1)), slots[refs[m]]);
+                }
+            }
+        }
+
+        // The entities of a cold store follow the rows, the entity at alive[temp[m]] comes from alive[order[temp[m]]]. The
+        // data stays in its slot, only the mapping between slots and entities changes.
+        static void s_remap_cold_store(cold_store_t* store, u32 const* alive, u32 const* order, u32 const* temp, u32 num_changed, u32* slots)
+        {
+            for (u32 m = 0; m < num_changed; ++m)
+                slots[m] = s_cold_slot(store, alive[order[temp[m]]]);
+            u32* sparse = narena::base_ptr_as<u32>(store->m_sparse);
+            u32* dense  = narena::base_ptr_as<u32>(store->m_dense);
+            for (u32 m = 0; m < num_changed; ++m)
+            {
+                if (slots[m] == 0xFFFFFFFF)
+                    continue;
+                const u32 dst   = alive[temp[m]];
+                dense[slots[m]] = dst;
+                sparse[dst]     = slots[m];
+            }
+        }
+
+        // The awake bits follow the rows, the entity at alive[temp[m]] comes from alive[order[temp[m]]]
+        static void s_remap_awake(archetype_t* archetype, u32 const* alive, u32 const* order, u32 const* temp, u32 num_changed, u32* awake)
+        {
+            for (u32 m = 0; m < num_changed; ++m)
+                awake[m] = s_is_awake(archetype, alive[order[temp[m]]]) ? 1 : 0;
+            u64* words = narena::base_ptr_as<u64>(archetype->m_awake);
+            for (u32 m = 0; m < num_changed; ++m)
+            {
+                const u32 dst = alive[temp[m]];
+                const u64 bit = (u64)1 << (dst & 63);
+                if (awake[m] != 0)
+                    words[dst >> 6] |= bit;
+                else
+                    words[dst >> 6] &= ~bit;
+            }
+        }
+
+        // The links follow the rows, the entity at alive[temp[m]] comes from alive[order[temp[m]]]. Every link is renamed
+        // through 'map' first, then the links of the rows that changed are moved.
+        static void s_remap_hierarchy(hierarchy_t* h, u32 end, u32 const* alive, u32 const* order, u32 const* temp, u32 num_changed, u32* map, u32* links)
+        {
+            for (u32 i = 0; i < end; ++i)
+                map[i] = i;
+            for (u32 m = 0; m < num_changed; ++m)
+                map[alive[order[temp[m]]]] = alive[temp[m]];
+
+            u32* arrays[4] = {h->m_parent, h->m_first_child, h->m_next_sibling, h->m_prev_sibling};
+            for (u32 a = 0; a < 4; ++a)
+            {
+                u32* array = arrays[a];
+                for (u32 i = 0; i < end; ++i)
+                {
+                    if (array[i] != 0xFFFFFFFF)
+                        array[i] = map[array[i]];
+                }
+                for (u32 m = 0; m < num_changed; ++m)
+                    links[m] = array[alive[order[temp[m]]]];
+                for (u32 m = 0; m < num_changed; ++m)
+                    array[alive[temp[m]]] = links[m];
+            }
+            for (u32 m = 0; m < num_changed; ++m)
+                links[m] = h->m_depth[alive[order[temp[m]]]];
+            for (u32 m = 0; m < num_changed; ++m)
+                h->m_depth[alive[temp[m]]] = (u8)links[m];
+
+            if (h->m_first_root != 0xFFFFFFFF)
+                h->m_first_root = map[h->m_first_root];
+            h->m_dirty = true;
+        }
+
+        static u32 s_sort_storage(ecs_t* ecs, u8 archetype_index, sort_key_fn key_fn, void* key_user, sort_moved_fn moved_fn, void* moved_user, u32 max_moves)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr || archetype->m_alive_count == 0)
+                return 0;
+
+            u32 max_sizeof = 0;
+            for (u16 c = 0; c < archetype->m_num_cps; ++c)
+                max_sizeof = math::max(max_sizeof, archetype->m_cp_sizeof[c]);
+
+            // Scratch memory for the keys, the order, the rows that move and the components that move
+            const u32   n            = archetype->m_alive_count;
+            const int_t sizeof_refs  = (int_t)archetype->m_per_entity_cps * (archetype->m_wide ? sizeof(u32) : sizeof(u16));
+            const int_t sizeof_tags  = archetype->m_per_entity_tags >> 3;
+            const int_t sizeof_row   = (int_t)sizeof(u64) + sizeof_refs + sizeof_tags;
+            const int_t sizeof_map   = archetype->m_hierarchy != nullptr ? (int_t)archetype->m_free_index * sizeof(u32) : 0;
+            const int_t sizeof_heads = archetype->m_pairs != nullptr ? (int_t)ECS_PAIR_HEADS * sizeof(u32) : 0;
+            const int_t scratch_size = (int_t)n * (7 * sizeof(u32) + sizeof(u64) + sizeof_row + max_sizeof + sizeof_heads) + sizeof_map + (int_t)(((archetype->m_max_entities + 63) >> 6) + 1024) * sizeof(u64) + 1024;
+            arena_t*    scratch      = narena::new_arena(scratch_size, scratch_size);
+
+            // The alive entities in index order, these are the slots that the sorted entities are going to occupy
+            u32* alive = g_allocate<u32>(scratch, n);
+            u32  count = 0;
+            for (s32 i = s_state_find_used_after(archetype, 0); i >= 0; i = s_state_find_used_after(archetype, i + 1))
+                alive[count++] = (u32)i;
+            ASSERT(count == n);
+
+            u32 num_changed = 0;
+            if (key_fn != nullptr)
+            {
+                u64* keys  = g_allocate<u64>(scratch, n);
+                u32* order = g_allocate<u32>(scratch, n);
+                u32* temp  = g_allocate<u32>(scratch, n);
+                for (u32 j = 0; j < n; ++j)
+                {
+                    keys[j]  = key_fn(ecs, s_entity_make(archetype_index, alive[j]), key_user);
+                    order[j] = j;
+                }
+                s_sort_order(order, temp, keys, n, max_moves);
+
+                // The entity that ends up at alive[j] comes from alive[order[j]], gather the rows that change
+                byte* rows       = g_allocate<byte>(scratch, (u32)(n * sizeof_row));
+                u64*  occupancy  = narena::base_ptr_as<u64>(archetype->m_cp_occupancy);
+                byte* references = narena::base_ptr_as<byte>(archetype->m_cp_reference);
+                byte* tags       = archetype->m_tags->m_base;
+                for (u32 j = 0; j < n; ++j)
+                {
+                    if (order[j] == j)
+                        continue;
+                    const u32 src = alive[order[j]];
+                    byte*     row = rows + num_changed * sizeof_row;
+                    g_memcopy(row, &occupancy[src], sizeof(u64));
+                    g_memcopy(row + sizeof(u64), references + src * sizeof_refs, sizeof_refs);
+                    g_memcopy(row + sizeof(u64) + sizeof_refs, tags + src * sizeof_tags, sizeof_tags);
+                    temp[num_changed++] = j;
+                }
+                for (u32 m = 0; m < num_changed; ++m)
+                {
+                    const u32   dst = alive[temp[m]];
+                    byte const* row = rows + m * sizeof_row;
+                    g_memcopy(&occupancy[dst], row, sizeof(u64));
+                    g_memcopy(references + dst * sizeof_refs, row + sizeof(u64), sizeof_refs);
+                    g_memcopy(tags + dst * sizeof_tags, row + sizeof(u64) + sizeof_refs, sizeof_tags);
+                }
+
+                if (num_changed > 0)
+                {
+                    // The per block and per entity bitsets follow the rows
+                    const u32 num_blocks = (archetype->m_free_index + 63) >> 6;
+                    for (u32 b = 0; b < num_blocks; ++b)
+                        s_update_cp_summary(archetype, b);
+                    for (u32 columns = archetype->m_tag_column_mask; columns != 0; columns &= columns - 1)
+                        s_build_tag_column(archetype, (u8)math::findFirstBit(columns));
+                    s_query_rebuild(archetype, archetype->m_query_mask);
+
+                    if (archetype->m_num_cold != 0 || archetype->m_timers != nullptr || archetype->m_num_sleeping != 0 || archetype->m_hierarchy != nullptr || archetype->m_pairs != nullptr)
+                    {
+                        u32* slots = g_allocate<u32>(scratch, num_changed);
+                        for (u8 c = 0; c < archetype->m_num_cold; ++c)
+                            s_remap_cold_store(&archetype->m_cold_stores[c], alive, order, temp, num_changed, slots);
+                        if (archetype->m_timers != nullptr)
+                            s_timers_remap(ecs->m_timers, archetype, archetype_index, alive, order, temp, num_changed, slots);
+                        if (archetype->m_num_sleeping != 0)
+                            s_remap_awake(archetype, alive, order, temp, num_changed, slots);
+                        if (archetype->m_hierarchy != nullptr)
+                            s_remap_hierarchy(archetype->m_hierarchy, archetype->m_free_index, alive, order, temp, num_changed, g_allocate<u32>(scratch, archetype->m_free_index), slots);
+                        if (archetype->m_pairs != nullptr)
+                            s_relations_remap(ecs->m_relations, archetype, archetype_index, alive, order, temp, num_changed, g_allocate<u32>(scratch, num_changed * ECS_PAIR_HEADS));
+                    }
+                }
+
+                s_layout_components(archetype, alive, n, scratch);
+
+                if (moved_fn != nullptr)
+                {
+                    for (u32 m = 0; m < num_changed; ++m)
+                        moved_fn(s_entity_make(archetype_index, alive[order[temp[m]]]), s_entity_make(archetype_index, alive[temp[m]]), moved_user);
+                }
+            }
+            else
+            {
+                s_layout_components(archetype, alive, n, scratch);
+            }
+
+            narena::destroy(scratch);
+            return num_changed;
+        }
+
+        u32 g_sort_storage(ecs_t* ecs, u8 archetype_index, sort_key_fn key_fn, sort_moved_fn moved_fn, void* user, u32 max_moves) { return s_sort_storage(ecs, archetype_index, key_fn, user, moved_fn, user, max_moves); }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // hierarchy
+
+        // Flatten the hierarchy level by level, the roots first and then per level the children of the entities of the
+        // level above in their order
+        static void s_hierarchy_flatten(hierarchy_t* h)
+        {
+            u32 count = 0;
+            for (u32 r = h->m_first_root; r != 0xFFFFFFFF; r = h->m_next_sibling[r])
+            {
+                h->m_order[count]        = s_entity_make(h->m_archetype_index, r);
+                h->m_order_parent[count] = 0xFFFFFFFF;
+                h->m_position[r]         = count++;
+            }
+
+            u32 begin           = 0;
+            u32 end             = count;
+            h->m_num_levels     = 0;
+            h->m_level_begin[0] = 0;
+            while (begin < end)
+            {
+                ASSERT(h->m_num_levels < ECS4_HIERARCHY_MAX_DEPTH);
+                h->m_level_begin[++h->m_num_levels] = end;
+                for (u32 p = begin; p < end; ++p)
+                {
+                    const u32 parent = g_entity_index(h->m_order[p]);
+                    for (u32 c = h->m_first_child[parent]; c != 0xFFFFFFFF; c = h->m_next_sibling[c])
+                    {
+                        h->m_order[count]        = s_entity_make(h->m_archetype_index, c);
+                        h->m_order_parent[count] = p;
+                        h->m_position[c]         = count++;
+                    }
+                }
+                begin = end;
+                end   = count;
+            }
+            h->m_dirty = false;
+        }
+
+        static hierarchy_t* s_hierarchy_flattened(ecs_t* ecs, u8 archetype_index)
+        {
+            hierarchy_t* h = ecs->m_archetypes[archetype_index].m_hierarchy;
+            if (h != nullptr && h->m_dirty)
+                s_hierarchy_flatten(h);
+            return h;
+        }
+
+        bool g_set_parent(ecs_t* ecs, entity_t child, entity_t parent)
+        {
+            const u8     archetype_index = g_entity_archetype_index(child);
+            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+            const u32    e               = g_entity_index(child);
+            if (archetype->m_archetype_arena == nullptr || !s_is_alive(archetype, e))
+                return false;
+
+            // The parent has to be in the same archetype
+            if (parent != ECS_ENTITY_NULL && (g_entity_archetype_index(parent) != archetype_index || !s_is_alive(archetype, g_entity_index(parent))))
+                return false;
+
+            if (archetype->m_hierarchy == nullptr)
+            {
+                if (parent == ECS_ENTITY_NULL)
+                    return true;
+                archetype->m_hierarchy = s_hierarchy_create(archetype_index, archetype->m_max_entities);
+            }
+
+            hierarchy_t* h = archetype->m_hierarchy;
+            if (parent == ECS_ENTITY_NULL)
+            {
+                s_hierarchy_detach(h, e);
+                return true;
+            }
+
+            // The parent cannot be the entity itself or one of its descendants
+            const u32 p = g_entity_index(parent);
+            for (u32 a = p; a != 0xFFFFFFFF; a = h->m_parent[a])
+            {
+                if (a == e)
+                    return false;
+            }
+            if (h->m_parent[e] == p)
+                return true;
+
+            // The deepest entity of the subtree has to stay within the maximum depth
+            if ((u32)h->m_depth[p] + 1 + s_hierarchy_height(h, e) >= ECS4_HIERARCHY_MAX_DEPTH)
+                return false;
+
+            s_hierarchy_detach(h, e);
+            s_hierarchy_attach(h, e, p);
+            return true;
+        }
+
+        entity_t g_get_parent(ecs_t* ecs, entity_t child)
+        {
+            const u8           archetype_index = g_entity_archetype_index(child);
+            hierarchy_t const* h               = ecs->m_archetypes[archetype_index].m_hierarchy;
+            if (h == nullptr)
+                return ECS_ENTITY_NULL;
+            const u32 parent = h->m_parent[g_entity_index(child)];
+            return parent != 0xFFFFFFFF ? s_entity_make(archetype_index, parent) : ECS_ENTITY_NULL;
+        }
+
+        u32 g_get_depth(ecs_t* ecs, entity_t e)
+        {
+            hierarchy_t const* h = ecs->m_archetypes[g_entity_archetype_index(e)].m_hierarchy;
+            return h != nullptr ? h->m_depth[g_entity_index(e)] : 0;
+        }
+
+        u32 g_get_children(ecs_t* ecs, entity_t parent, entity_t* out, u32 max_out)
+        {
+            const u8           archetype_index = g_entity_archetype_index(parent);
+            hierarchy_t const* h               = ecs->m_archetypes[archetype_index].m_hierarchy;
+            if (h == nullptr)
+                return 0;
+            u32 n = 0;
+            for (u32 c = h->m_first_child[g_entity_index(parent)]; c != 0xFFFFFFFF; c = h->m_next_sibling[c], ++n)
+            {
+                if (n < max_out)
+                    out[n] = s_entity_make(archetype_index, c);
+            }
+            return n;
+        }
+
+        u32 g_destroy_subtree(ecs_t* ecs, entity_t root)
+        {
+            const u8     archetype_index = g_entity_archetype_index(root);
+            hierarchy_t* h               = ecs->m_archetypes[archetype_index].m_hierarchy;
+            u32          n               = 0;
+            if (h != nullptr)
+            {
+                // Destroy the leaves bottom-up, every link is followed once down and once up
+                const u32 r = g_entity_index(root);
+                u32       e = r;
+                while (true)
+                {
+                    while (h->m_first_child[e] != 0xFFFFFFFF)
+                        e = h->m_first_child[e];
+                    if (e == r)
+                        break;
+                    const u32 parent = h->m_parent[e];
+                    g_destroy_entity(ecs, s_entity_make(archetype_index, e));
+                    e = parent;
+                    n++;
+                }
+            }
+            g_destroy_entity(ecs, root);
+            return n + 1;
+        }
+
+        u32 g_hierarchy_levels(ecs_t* ecs, u8 archetype_index)
+        {
+            hierarchy_t const* h = s_hierarchy_flattened(ecs, archetype_index);
+            return h != nullptr ? h->m_num_levels : 0;
+        }
+
+        bool g_hierarchy_level(ecs_t* ecs, u8 archetype_index, u32 depth, hierarchy_level_t& level)
+        {
+            hierarchy_t const* h = s_hierarchy_flattened(ecs, archetype_index);
+            if (h == nullptr || depth >= h->m_num_levels)
+                return false;
+            level.m_begin    = h->m_level_begin[depth];
+            level.m_count    = h->m_level_begin[depth + 1] - level.m_begin;
+            level.m_entities = h->m_order + level.m_begin;
+            level.m_parents  = h->m_order_parent + level.m_begin;
+            level.m_order    = h->m_order;
+            return true;
+        }
+
+        // The position in the flattened order, the entities that are not in the hierarchy go to the end
+        static u64 s_hierarchy_key(ecs_t*, entity_t e, void* user)
+        {
+            hierarchy_t const* h = (hierarchy_t const*)user;
+            const u32          i = g_entity_index(e);
+            return s_hierarchy_member(h, i) ? h->m_position[i] : D_U64_MAX;
+        }
+
+        u32 g_sort_by_hierarchy(ecs_t* ecs, u8 archetype_index, sort_moved_fn moved_fn, void* user, u32 max_moves)
+        {
+            hierarchy_t* h = s_hierarchy_flattened(ecs, archetype_index);
+            if (h == nullptr)
+                return 0;
+            return s_sort_storage(ecs, archetype_index, s_hierarchy_key, h, moved_fn, user, max_moves);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // spatial locality
+
+        // Spread the lower 21 bits of 'v' so that there are 2 zero bits between every bit
+        static inline u64 s_morton_spread(u64 v)
+        {
+            v &= 0x1FFFFF;
+            v = (v | (v << 32)) & (u64)0x001F00000000FFFF;
+            v = (v | (v << 16)) & (u64)0x001F0000FF0000FF;
+            v = (v | (v << 8)) & (u64)0x100F00F00F00F00F;
+            v = (v | (v << 4)) & (u64)0x10C30C30C30C30C3;
+            v = (v | (v << 2)) & (u64)0x1249249249249249;
+            return v;
+        }
+
+        // Quantize a coordinate to 21 bits, the origin is in the middle of the range
+        static inline u64 s_morton_quantize(f32 v, f32 inv_cell_size)
+        {
+            const f32 q = v * inv_cell_size + (f32)(1 << 20);
+            return q <= 0.0f ? 0 : (q >= (f32)0x1FFFFF ? 0x1FFFFF : (u64)q);
+        }
+
+        struct morton_key_t
+        {
+            u32 m_position_cp_index;
+            f32 m_inv_cell_size;
+        };
+
+        // Entities without a position are sorted to the end
+        static u64 s_morton_key(ecs_t* ecs, entity_t e, void* user)
+        {
+            morton_key_t const* key      = (morton_key_t const*)user;
+            f32 const*          position = (f32 const*)g_get_cp(ecs, e, key->m_position_cp_index);
+            if (position == nullptr)
+                return D_U64_MAX;
+            const u64 x = s_morton_quantize(position[0], key->m_inv_cell_size);
+            const u64 y = s_morton_quantize(position[1], key->m_inv_cell_size);
+            const u64 z = s_morton_quantize(position[2], key->m_inv_cell_size);
+            return s_morton_spread(x) | (s_morton_spread(y) << 1) | (s_morton_spread(z) << 2);
+        }
+
+        u32 g_sort_spatial(ecs_t* ecs, u8 archetype_index, u32 position_cp_index, f32 cell_size, sort_moved_fn moved_fn, void* user, u32 max_moves)
+        {
+            ASSERT(cell_size > 0.0f);
+            morton_key_t key;
+            key.m_position_cp_index = position_cp_index;
+            key.m_inv_cell_size     = 1.0f / cell_size;
+            return s_sort_storage(ecs, archetype_index, s_morton_key, &key, moved_fn, user, max_moves);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // spatial grid
+
+        // A node per entity index of the archetype, a node is linked into the bucket of its cell
+        struct grid_node_t
+        {
+            entity_t m_entity;      // ECS_ENTITY_NULL when the entity is not in the grid
+            u32      m_next;        // next node in the bucket, 0xFFFFFFFF = end
+            u32      m_prev;        // previous node in the bucket, 0xFFFFFFFF = head
+            s32      m_cell[3];     // cell coordinates
+            f32      m_position[3]; // position at the last update
+        };
+
+        struct grid_t
+        {
+            archetype_t* m_archetype;         // the archetype of the entities
+            u8           m_archetype_index;   //
+            u16          m_position_cp_index; // global component type index of the position
+            f32          m_inv_cell_size;     //
+            u32          m_bucket_mask;       // number of buckets - 1
+            u32          m_count;             // number of entities in the grid
+            u32*         m_buckets;           // first node per bucket
+            grid_node_t* m_nodes;             // node per entity index
+            arena_t*     m_arena;             // grid, buckets and nodes
+            arena_t*     m_candidates;        // k-nearest candidates, allocated on first use
+        };
+
+        struct grid_candidate_t
+        {
+            entity_t m_entity;
+            f32      m_distance2;
+        };
+
+        static inline s32 s_grid_cell(f32 v, f32 inv_cell_size)
+        {
+            f32 c = v * inv_cell_size;
+            c     = c < -1073741824.0f ? -1073741824.0f : (c > 1073741824.0f ? 1073741824.0f : c);
+            s32 i = (s32)c;
+            return ((f32)i > c) ? i - 1 : i;
+        }
+
+        static inline u32 s_grid_bucket(grid_t const* grid, s32 const* cell) { return (((u32)cell[0] * 73856093u) ^ ((u32)cell[1] * 19349663u) ^ ((u32)cell[2] * 83492791u)) & grid->m_bucket_mask; }
+
+        static void s_grid_unlink(grid_t* grid, u32 entity_index)
+        {
+            grid_node_t* node = &grid->m_nodes[entity_index];
+            if (node->m_prev != 0xFFFFFFFF)
+                grid->m_nodes[node->m_prev].m_next = node->m_next;
+            else
+                grid->m_buckets[s_grid_bucket(grid, node->m_cell)] = node->m_next;
+            if (node->m_next != 0xFFFFFFFF)
+                grid->m_nodes[node->m_next].m_prev = node->m_prev;
+            node->m_entity = ECS_ENTITY_NULL;
+            grid->m_count--;
+        }
+
+        static void s_grid_link(grid_t* grid, u32 entity_index, entity_t e, f32 const* position)
+        {
+            grid_node_t* node = &grid->m_nodes[entity_index];
+            for (s32 a = 0; a < 3; ++a)
+            {
+                node->m_position[a] = position[a];
+                node->m_cell[a]     = s_grid_cell(position[a], grid->m_inv_cell_size);
+            }
+            u32& head      = grid->m_buckets[s_grid_bucket(grid, node->m_cell)];
+            node->m_entity = e;
+            node->m_prev   = 0xFFFFFFFF;
+            node->m_next   = head;
+            if (head != 0xFFFFFFFF)
+                grid->m_nodes[head].m_prev = entity_index;
+            head = entity_index;
+            grid->m_count++;
+        }
+
+        // A node is a match when its entity is still alive and matches the filter
+        static inline bool s_grid_accept(grid_t const* grid, u32 entity_index, u64 cp_mask, u32 tag_mask)
+        {
+            archetype_t const* archetype = grid->m_archetype;
+            if (!s_is_alive(archetype, entity_index))
+                return false;
+            const u64 occupancy = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy)[entity_index];
+            return (occupancy & cp_mask) == cp_mask && (s_get_tags(archetype, (s32)entity_index) & tag_mask) == tag_mask;
+        }
+
+        static inline bool s_grid_inside(grid_node_t const* node, f32 const* min, f32 const* max)
+        {
+            for (s32 a = 0; a < 3; ++a)
+            {
+                if (node->m_position[a] < min[a] || node->m_position[a] > max[a])
+                    return false;
+            }
+            return true;
+        }
+
+        // Visit every node that is inside the box (nullptr = no box), bucket by bucket. The visitor returns false to stop.
+        template <typename V> static void s_grid_visit_all(grid_t const* grid, en_iterator_t const* filter, f32 const* min, f32 const* max, V& visitor)
+        {
+            const u64 cp_mask  = filter != nullptr ? filter->cp_mask() : 0;
+            const u32 tag_mask = filter != nullptr ? filter->tag_mask() : 0;
+            for (u32 b = 0; b <= grid->m_bucket_mask; ++b)
+            {
+                for (u32 i = grid->m_buckets[b]; i != 0xFFFFFFFF; i = grid->m_nodes[i].m_next)
+                {
+                    grid_node_t const* node = &grid->m_nodes[i];
+                    if ((min == nullptr || s_grid_inside(node, min, max)) && s_grid_accept(grid, i, cp_mask, tag_mask) && !visitor(node))
+                        return;
+                }
+            }
+        }
+
+        // Visit the nodes that are inside the box, only the cells that overlap the box are visited unless the box covers
+        // more cells than there are buckets. A node is only taken from its own cell so that hash collisions between the
+        // cells of the box do not visit a node twice. The visitor returns false to stop.
+        template <typename V> static void s_grid_visit_box(grid_t const* grid, en_iterator_t const* filter, f32 const* min, f32 const* max, V& visitor)
+        {
+            ASSERT(filter == nullptr || filter->archetype_index() == grid->m_archetype_index);
+
+            s32 cell_min[3];
+            s32 cell_max[3];
+            u64 num_cells = 1;
+            for (s32 a = 0; a < 3; ++a)
+            {
+                cell_min[a] = s_grid_cell(min[a], grid->m_inv_cell_size);
+                cell_max[a] = s_grid_cell(max[a], grid->m_inv_cell_size);
+                num_cells *= (u64)((s64)cell_max[a] - cell_min[a] + 1);
+            }
+            if (num_cells > grid->m_bucket_mask)
+            {
+                s_grid_visit_all(grid, filter, min, max, visitor);
+                return;
+            }
+
+            const u64 cp_mask  = filter != nullptr ? filter->cp_mask() : 0;
+            const u32 tag_mask = filter != nullptr ? filter->tag_mask() : 0;
+            s32       cell[3];
+            for (cell[2] = cell_min[2]; cell[2] <= cell_max[2]; ++cell[2])
+            {
+                for (cell[1] = cell_min[1]; cell[1] <= cell_max[1]; ++cell[1])
+                {
+                    for (cell[0] = cell_min[0]; cell[0] <= cell_max[0]; ++cell[0])
+                    {
+                        for (u32 i = grid->m_buckets[s_grid_bucket(grid, cell)]; i != 0xFFFFFFFF; i = grid->m_nodes[i].m_next)
+                        {
+                            grid_node_t const* node = &grid->m_nodes[i];
+                            if (node->m_cell[0] != cell[0] || node->m_cell[1] != cell[1] || node->m_cell[2] != cell[2])
+                                continue;
+                            if (s_grid_inside(node, min, max) && s_grid_accept(grid, i, cp_mask, tag_mask) && !visitor(node))
+                                return;
+                        }
+                    }
+                }
+            }
+        }
+
+        static inline f32 s_grid_distance2(grid_node_t const* node, f32 const* center)
+        {
+            const f32 dx = node->m_position[0] - center[0];
+            const f32 dy = node->m_position[1] - center[1];
+            const f32 dz = node->m_position[2] - center[2];
+            return dx * dx + dy * dy + dz * dz;
+        }
+
+        struct grid_collect_t
+        {
+            entity_t*  m_out;
+            u32        m_max_out;
+            u32        m_count;
+            f32 const* m_center;  // nullptr for a box
+            f32        m_radius2; //
+
+            bool operator()(grid_node_t const* node)
+            {
+                if (m_center != nullptr && s_grid_distance2(node, m_center) > m_radius2)
+                    return true;
+                m_out[m_count++] = node->m_entity;
+                return m_count < m_max_out;
+            }
+        };
+
+        struct grid_gather_t
+        {
+            grid_candidate_t* m_candidates;
+            u32               m_count;
+            f32 const*        m_center;
+            f32               m_radius2; // negative = no limit
+
+            bool operator()(grid_node_t const* node)
+            {
+                const f32 distance2 = s_grid_distance2(node, m_center);
+                if (m_radius2 < 0.0f || distance2 <= m_radius2)
+                {
+                    m_candidates[m_count].m_entity    = node->m_entity;
+                    m_candidates[m_count].m_distance2 = distance2;
+                    m_count++;
+                }
+                return true;
+            }
+        };
+
+        grid_t* g_create_grid(ecs_t* ecs, u8 archetype_index, u32 position_cp_index, f32 cell_size, u32 num_buckets)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr)
+                return nullptr;
+            ASSERT(cell_size > 0.0f);
+            ASSERT(math::ispo2(num_buckets));
+
+            const int_t grid_size = (int_t)(sizeof(grid_t) + num_buckets * sizeof(u32) + archetype->m_max_entities * sizeof(grid_node_t) + 64);
+            arena_t*    arena     = narena::new_arena(grid_size, 0);
+
+            grid_t* grid              = g_allocate<grid_t>(arena);
+            grid->m_archetype         = archetype;
+            grid->m_archetype_index   = archetype_index;
+            grid->m_position_cp_index = (u16)position_cp_index;
+            grid->m_inv_cell_size     = 1.0f / cell_size;
+            grid->m_bucket_mask       = num_buckets - 1;
+            grid->m_count             = 0;
+            grid->m_buckets           = g_allocate<u32>(arena, num_buckets);
+            grid->m_nodes             = g_allocate<grid_node_t>(arena, archetype->m_max_entities);
+            grid->m_arena             = arena;
+            grid->m_candidates        = nullptr;
+            g_memset(grid->m_buckets, 0xFF, (int_t)num_buckets * sizeof(u32));
+            for (u32 i = 0; i < archetype->m_max_entities; ++i)
+                grid->m_nodes[i].m_entity = ECS_ENTITY_NULL;
+            return grid;
+        }
+
+        void g_destroy_grid(grid_t* grid)
+        {
+            if (grid->m_candidates != nullptr)
+                narena::destroy(grid->m_candidates);
+            narena::destroy(grid->m_arena);
+        }
+
+        void g_grid_update(grid_t* grid, entity_t e)
+        {
+            ASSERT(g_entity_archetype_index(e) == grid->m_archetype_index);
+            const u32 entity_index = g_entity_index(e);
+            if (grid->m_nodes[entity_index].m_entity != ECS_ENTITY_NULL)
+                s_grid_unlink(grid, entity_index);
+            f32 const* position = s_is_alive(grid->m_archetype, entity_index) ? (f32 const*)s_get_component(grid->m_archetype, entity_index, grid->m_position_cp_index) : nullptr;
+            if (position != nullptr)
+                s_grid_link(grid, entity_index, e, position);
+        }
+
+        void g_grid_remove(grid_t* grid, entity_t e)
+        {
+            ASSERT(g_entity_archetype_index(e) == grid->m_archetype_index);
+            const u32 entity_index = g_entity_index(e);
+            if (grid->m_nodes[entity_index].m_entity != ECS_ENTITY_NULL)
+                s_grid_unlink(grid, entity_index);
+        }
+
+        void g_grid_update_all(grid_t* grid)
+        {
+            archetype_t* archetype = grid->m_archetype;
+            g_memset(grid->m_buckets, 0xFF, (int_t)(grid->m_bucket_mask + 1) * sizeof(u32));
+            for (u32 i = 0; i < archetype->m_free_index; ++i)
+                grid->m_nodes[i].m_entity = ECS_ENTITY_NULL;
+            grid->m_count = 0;
+
+            for (s32 i = s_state_find_used_after(archetype, 0); i >= 0; i = s_state_find_used_after(archetype, i + 1))
+            {
+                f32 const* position = (f32 const*)s_get_component(archetype, (u32)i, grid->m_position_cp_index);
+                if (position != nullptr)
+                    s_grid_link(grid, (u32)i, s_entity_make(grid->m_archetype_index, (u32)i), position);
+            }
+        }
+
+        u32 g_grid_count(grid_t const* grid) { return grid->m_count; }
+
+        u32 g_grid_query_box(grid_t* grid, en_iterator_t const* filter, f32 const* min, f32 const* max, entity_t* out, u32 max_out)
+        {
+            if (max_out == 0)
+                return 0;
+            grid_collect_t collect = {out, max_out, 0, nullptr, 0.0f};
+            s_grid_visit_box(grid, filter, min, max, collect);
+            return collect.m_count;
+        }
+
+        u32 g_grid_query_radius(grid_t* grid, en_iterator_t const* filter, f32 const* center, f32 radius, entity_t* out, u32 max_out)
+        {
+            if (max_out == 0)
+                return 0;
+            const f32      min[3]  = {center[0] - radius, center[1] - radius, center[2] - radius};
+            const f32      max[3]  = {center[0] + radius, center[1] + radius, center[2] + radius};
+            grid_collect_t collect = {out, max_out, 0, center, radius * radius};
+            s_grid_visit_box(grid, filter, min, max, collect);
+            return collect.m_count;
+        }
+
+        u32 g_grid_query_nearest(grid_t* grid, en_iterator_t const* filter, f32 const* center, u32 k, entity_t* out)
+        {
+            if (k == 0 || grid->m_count == 0)
+                return 0;
+            if (grid->m_candidates == nullptr)
+                grid->m_candidates = narena::new_arena((int_t)grid->m_archetype->m_max_entities * sizeof(grid_candidate_t), 0);
+
+            // Grow the radius until it holds 'k' entities, once the box covers more cells than there are buckets every
+            // entity is gathered and the search ends
+            grid_gather_t gather = {narena::base_ptr_as<grid_candidate_t>(grid->m_candidates), 0, center, 0.0f};
+            f32           radius = 1.0f / grid->m_inv_cell_size;
+            while (true)
+            {
+                gather.m_count  = 0;
+                const f32 cells = 2.0f * radius * grid->m_inv_cell_size + 1.0f;
+                if (cells * cells * cells > (f32)grid->m_bucket_mask)
+                {
+                    gather.m_radius2 = -1.0f;
+                    s_grid_visit_all(grid, filter, nullptr, nullptr, gather);
+                    break;
+                }
+
+                const f32 min[3] = {center[0] - radius, center[1] - radius, center[2] - radius};
+                const f32 max[3] = {center[0] + radius, center[1] + radius, center[2] + radius};
+                gather.m_radius2 = radius * radius;
+                s_grid_visit_box(grid, filter, min, max, gather);
+                if (gather.m_count >= k)
+                    break;
+                radius *= 2.0f;
+            }
+
+            // Partial selection sort of the 'k' nearest
+            grid_candidate_t* candidates = gather.m_candidates;
+            const u32         n          = math::min(k, gather.m_count);
+            for (u32 i = 0; i < n; ++i)
+            {
+                u32 nearest = i;
+                for (u32 j = i + 1; j < gather.m_count; ++j)
+                    nearest = candidates[j].m_distance2 < candidates[nearest].m_distance2 ? j : nearest;
+                const grid_candidate_t swap = candidates[i];
+                candidates[i]               = candidates[nearest];
+                candidates[nearest]         = swap;
+                out[i]                      = candidates[i].m_entity;
+            }
+            return n;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // secondary indexes
+
+        // A node per entity index of the archetype, a node is linked into the bucket of its key
+        struct index_node_t
+        {
+            entity_t m_entity; // ECS_ENTITY_NULL when the entity is not in the index
+            u32      m_next;   // next node in the bucket, 0xFFFFFFFF = end
+            u32      m_prev;   // previous node in the bucket, 0xFFFFFFFF = head
+        };
+
+        struct value_index_t
+        {
+            archetype_t*  m_archetype;       // the archetype of the entities
+            u8            m_archetype_index; //
+            eindex_t      m_kind;            //
+            u16           m_cp_index;        // global component type index of the indexed component
+            index_key_fn  m_key_fn;          //
+            void*         m_user;            //
+            u32           m_bucket_mask;     // number of buckets - 1
+            u32           m_count;           // number of entities in the index
+            u32*          m_buckets;         // first node per bucket
+            index_node_t* m_nodes;           // node per entity index
+            u64*          m_keys;            // key per entity index
+            u32*          m_order;           // ordered index, the entity indices sorted by key
+            u32*          m_scratch;         // ordered index, merge sort scratch
+            u32           m_order_count;     // number of entity indices in m_order
+            bool          m_dirty;           // ordered index, m_order needs to be rebuilt
+            arena_t*      m_arena;           // index, buckets, nodes, keys and order
+        };
+
+        static inline u32 s_index_bucket(value_index_t const* index, u64 key) { return (u32)((key * 0x9E3779B97F4A7C15ull) >> 32) & index->m_bucket_mask; }
+
+        static void s_index_unlink(value_index_t* index, u32 entity_index)
+        {
+            index_node_t* node = &index->m_nodes[entity_index];
+            if (node->m_prev != 0xFFFFFFFF)
+                index->m_nodes[node->m_prev].m_next = node->m_next;
+            else
+                index->m_buckets[s_index_bucket(index, index->m_keys[entity_index])] = node->m_next;
+            if (node->m_next != 0xFFFFFFFF)
+                index->m_nodes[node->m_next].m_prev = node->m_prev;
+            node->m_entity = ECS_ENTITY_NULL;
+            index->m_count--;
+            index->m_dirty = true;
+        }
+
+        static void s_index_link(value_index_t* index, u32 entity_index, entity_t e, void const* component)
+        {
+            const u64     key  = index->m_key_fn(component, index->m_user);
+            index_node_t* node = &index->m_nodes[entity_index];
+            u32&          head = index->m_buckets[s_index_bucket(index, key)];
+            index->m_keys[entity_index] = key;
+            node->m_entity              = e;
+            node->m_prev                = 0xFFFFFFFF;
+            node->m_next                = head;
+            if (head != 0xFFFFFFFF)
+                index->m_nodes[head].m_prev = entity_index;
+            head = entity_index;
+            index->m_count++;
+            index->m_dirty = true;
+        }
+
+        // A node is a match when its entity is still alive, still has the component and matches the filter
+        static inline bool s_index_accept(value_index_t const* index, u32 entity_index, u64 cp_mask, u32 tag_mask)
+        {
+            archetype_t* archetype = index->m_archetype;
+            if (!s_is_alive(archetype, entity_index) || !s_has_component(archetype, entity_index, index->m_cp_index))
+                return false;
+            const u64 occupancy = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy)[entity_index];
+            return (occupancy & cp_mask) == cp_mask && (s_get_tags(archetype, (s32)entity_index) & tag_mask) == tag_mask;
+        }
+
+        // Gather the entity indices of the nodes and sort them by key, the buckets are walked so that the cost follows
+        // the number of entities in the index
+        static void s_index_build_order(value_index_t* index)
+        {
+            u32 n = 0;
+            for (u32 b = 0; b <= index->m_bucket_mask; ++b)
+            {
+                for (u32 i = index->m_buckets[b]; i != 0xFFFFFFFF; i = index->m_nodes[i].m_next)
+                    index->m_order[n++] = i;
+            }
+            s_sort_order(index->m_order, index->m_scratch, index->m_keys, n, 0xFFFFFFFF);
+            index->m_order_count = n;
+            index->m_dirty       = false;
+        }
+
+        value_index_t* g_create_index(ecs_t* ecs, u8 archetype_index, u32 cp_index, index_key_fn key_fn, void* user, eindex_t kind, u32 num_buckets)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr)
+                return nullptr;
+            ASSERT(key_fn != nullptr);
+            ASSERT(math::ispo2(num_buckets));
+
+            const u32   max_entities = archetype->m_max_entities;
+            const u32   max_order    = kind == INDEX_ORDERED ? max_entities : 0;
+            const int_t index_size   = (int_t)(sizeof(value_index_t) + num_buckets * sizeof(u32) + max_entities * (sizeof(index_node_t) + sizeof(u64)) + max_order * 2 * sizeof(u32) + 64);
+            arena_t*    arena        = narena::new_arena(index_size, 0);
+
+            value_index_t* index     = g_allocate<value_index_t>(arena);
+            index->m_archetype       = archetype;
+            index->m_archetype_index = archetype_index;
+            index->m_kind            = kind;
+            index->m_cp_index        = (u16)cp_index;
+            index->m_key_fn          = key_fn;
+            index->m_user            = user;
+            index->m_bucket_mask     = num_buckets - 1;
+            index->m_count           = 0;
+            index->m_buckets         = g_allocate<u32>(arena, num_buckets);
+            index->m_nodes           = g_allocate<index_node_t>(arena, max_entities);
+            index->m_keys            = g_allocate<u64>(arena, max_entities);
+            index->m_order           = max_order > 0 ? g_allocate<u32>(arena, max_order) : nullptr;
+            index->m_scratch         = max_order > 0 ? g_allocate<u32>(arena, max_order) : nullptr;
+            index->m_order_count     = 0;
+            index->m_dirty           = false;
+            index->m_arena           = arena;
+            g_memset(index->m_buckets, 0xFF, (int_t)num_buckets * sizeof(u32));
+            for (u32 i = 0; i < max_entities; ++i)
+                index->m_nodes[i].m_entity = ECS_ENTITY_NULL;
+            return index;
+        }
+
+        void g_destroy_index(value_index_t* index) { narena::destroy(index->m_arena); }
+
+        void g_index_update(value_index_t* index, entity_t e)
+        {
+            ASSERT(g_entity_archetype_index(e) == index->m_archetype_index);
+            const u32 entity_index = g_entity_index(e);
+            if (index->m_nodes[entity_index].m_entity != ECS_ENTITY_NULL)
+                s_index_unlink(index, entity_index);
+            void const* component = s_is_alive(index->m_archetype, entity_index) ? s_get_component(index->m_archetype, entity_index, index->m_cp_index) : nullptr;
+            if (component != nullptr)
+                s_index_link(index, entity_index, e, component);
+        }
+
+        void g_index_remove(value_index_t* index, entity_t e)
+        {
+            ASSERT(g_entity_archetype_index(e) == index->m_archetype_index);
+            const u32 entity_index = g_entity_index(e);
+            if (index->m_nodes[entity_index].m_entity != ECS_ENTITY_NULL)
+                s_index_unlink(index, entity_index);
+        }
+
+        void g_index_update_all(value_index_t* index)
+        {
+            archetype_t* archetype = index->m_archetype;
+            g_memset(index->m_buckets, 0xFF, (int_t)(index->m_bucket_mask + 1) * sizeof(u32));
+            for (u32 i = 0; i < archetype->m_free_index; ++i)
+                index->m_nodes[i].m_entity = ECS_ENTITY_NULL;
+            index->m_count = 0;
+
+            for (s32 i = s_state_find_used_after(archetype, 0); i >= 0; i = s_state_find_used_after(archetype, i + 1))
+            {
+                void const* component = s_get_component(archetype, (u32)i, index->m_cp_index);
+                if (component != nullptr)
+                    s_index_link(index, (u32)i, s_entity_make(index->m_archetype_index, (u32)i), component);
+            }
+            index->m_dirty = true;
+        }
+
+        u32 g_index_count(value_index_t const* index) { return index->m_count; }
+
+        u32 g_index_find(value_index_t* index, en_iterator_t const* filter, u64 key, entity_t* out, u32 max_out)
+        {
+            const u64 cp_mask  = filter != nullptr ? filter->cp_mask() : 0;
+            const u32 tag_mask = filter != nullptr ? filter->tag_mask() : 0;
+            u32       count    = 0;
+            for (u32 i = index->m_buckets[s_index_bucket(index, key)]; i != 0xFFFFFFFF; i = index->m_nodes[i].m_next)
+            {
+                if (index->m_keys[i] != key || !s_index_accept(index, i, cp_mask, tag_mask))
+                    continue;
+                if (count < max_out)
+                    out[count] = index->m_nodes[i].m_entity;
+                count++;
+            }
+            return count;
+        }
+
+        u32 g_index_range(value_index_t* index, en_iterator_t const* filter, u64 min_key, u64 max_key, entity_t* out, u32 max_out)
+        {
+            ASSERTS(index->m_kind == INDEX_ORDERED, "a range probe needs an ordered index");
+            if (index->m_kind != INDEX_ORDERED || min_key > max_key)
+                return 0;
+            if (index->m_dirty)
+                s_index_build_order(index);
+
+            // Lower bound of 'min_key' in the sorted order
+            u64 const* keys = index->m_keys;
+            u32        lo   = 0;
+            u32        hi   = index->m_order_count;
+            while (lo < hi)
+            {
+                const u32 mid = (lo + hi) >> 1;
+                if (keys[index->m_order[mid]] < min_key)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            const u64 cp_mask  = filter != nullptr ? filter->cp_mask() : 0;
+            const u32 tag_mask = filter != nullptr ? filter->tag_mask() : 0;
+            u32       count    = 0;
+            for (u32 o = lo; o < index->m_order_count && keys[index->m_order[o]] <= max_key; ++o)
+            {
+                const u32 i = index->m_order[o];
+                if (!s_index_accept(index, i, cp_mask, tag_mask))
+                    continue;
+                if (count < max_out)
+                    out[count] = index->m_nodes[i].m_entity;
+                count++;
+            }
+            return count;
+        }
+
+        void g_register_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 cp_alignof)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype == nullptr)
+                return;
+            s_register_component_type(archetype, cp_index, s_component_stride(cp_sizeof, cp_alignof));
+        }
+
+        void g_register_cold_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 cp_alignof)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr)
+                return;
+            s_register_cold_component_type(archetype, cp_index, s_component_stride(cp_sizeof, cp_alignof), false);
+        }
+
+        void g_register_compressed_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 cp_alignof)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr)
+                return;
+            s_register_cold_component_type(archetype, cp_index, s_component_stride(cp_sizeof, cp_alignof), true);
+        }
+
+        void g_register_soa_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 field_sizeof)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            ASSERT(field_sizeof > 0 && (cp_sizeof % field_sizeof) == 0);
+            if (archetype->m_archetype_arena == nullptr || field_sizeof == 0 || (cp_sizeof % field_sizeof) != 0)
+                return;
+            if (cp_index >= archetype->m_max_global_cp_types || archetype->m_global_to_local_cp_type[cp_index] != 0xFFFF)
+                return;
+
+            // The bin of a split component only holds its free list, the fields are in the columns
+            s_register_component_type(archetype, cp_index, sizeof(u32));
+            const u16 local = archetype->m_global_to_local_cp_type[cp_index];
+            if (local == 0xFFFF)
+                return;
+            archetype->m_cp_sizeof[local] = cp_sizeof;
+            archetype->m_cp_soa[local]    = s_soa_create(cp_sizeof, field_sizeof, archetype->m_wide ? archetype->m_max_entities : ECS_ARCHETYPE_MAX_ENTITIES);
+        }
+
+        void* g_get_column(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 field_index, u32& count)
+        {
+            count                  = 0;
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr || cp_index >= archetype->m_max_global_cp_types)
+                return nullptr;
+            const u16 local = archetype->m_global_to_local_cp_type[cp_index];
+            if (local == 0xFFFF || archetype->m_cp_soa[local] == nullptr || field_index >= archetype->m_cp_soa[local]->m_num_fields)
+                return nullptr;
+            soa_store_t* soa = archetype->m_cp_soa[local];
+            s_soa_flush(soa);
+            count = soa->m_end;
+            return s_soa_column(soa, field_index);
+        }
+
+        bool g_compressed_stats(ecs_t* ecs, u8 archetype_index, u16 cp_index, compressed_stats_t& stats)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr || cp_index >= archetype->m_max_global_cp_types)
+                return false;
+            cold_store_t* cold = s_cold_store(archetype, cp_index);
+            if (cold == nullptr || cold->m_compressed == nullptr)
+                return false;
+
+            compressed_store_t* store = cold->m_compressed;
+            for (u32 i = 0; i < ECS4_COMPRESSED_CACHE_BLOCKS; ++i)
+            {
+                if (store->m_lines[i].m_block != 0xFFFFFFFF)
+                    s_compressed_write_back(store, &store->m_lines[i]);
+            }
+            stats.m_raw_bytes        = (u64)cold->m_count * store->m_sizeof;
+            stats.m_compressed_bytes = store->m_compressed_bytes;
+            stats.m_cache_bytes      = (u64)ECS4_COMPRESSED_CACHE_BLOCKS * ECS4_COMPRESSED_BLOCK_SIZE * store->m_sizeof;
+            stats.m_ratio            = store->m_compressed_bytes > 0 ? (f32)((f64)stats.m_raw_bytes / (f64)store->m_compressed_bytes) : 0.0f;
+            return true;
+        }
+
+        u32 g_cold_count(ecs_t* ecs, u8 archetype_index, u16 cp_index)
+        {
+            archetype_t const* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr || cp_index >= archetype->m_max_global_cp_types)
+                return 0;
+            cold_store_t const* store = s_cold_store(archetype, cp_index);
+            return store != nullptr ? store->m_count : 0;
+        }
+
+        void g_register_tag_type(ecs_t* ecs, u8 archetype_index, u16 tg_index, bool tag_column)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype == nullptr)
+                return;
+            s_register_tag_type(archetype, tg_index, tag_column);
+        }
+
+        bool g_has_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            const u8     archetype_index = g_entity_archetype_index(entity);
+            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+            return s_has_component(archetype, g_entity_index(entity), (u16)cp_index);
+        }
+        void* g_add_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            const u8     archetype_index = g_entity_archetype_index(entity);
+            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+            const u16    local           = cp_index < archetype->m_max_global_cp_types ? archetype->m_global_to_local_cp_type[cp_index] : (u16)0xFFFF;
+            if (local != 0xFFFF && archetype->m_cp_shared[local] != nullptr)
+            {
+                ASSERTS(false, "a shared component is set with g_set_shared_cp");
+                return nullptr;
+            }
+            return s_alloc_component(archetype, g_entity_index(entity), (u16)cp_index);
+        }
+        void g_rem_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            const u8     archetype_index = g_entity_archetype_index(entity);
+            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+            s_free_component(archetype, g_entity_index(entity), (u16)cp_index);
+        }
+        void* g_get_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            const u8     archetype_index = g_entity_archetype_index(entity);
+            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+            byte*        cp              = s_get_component(archetype, g_entity_index(entity), (u16)cp_index);
+            if (cp != nullptr && archetype->m_global_to_local_cp_type[cp_index] != 0xFFFF)
+            {
+                shared_pool_t const* pool = archetype->m_cp_shared[archetype->m_global_to_local_cp_type[cp_index]];
+                if (pool != nullptr)
+                    return (void*)s_shared_value(pool, *(u32 const*)cp);
+            }
+            return cp;
+        }
+
+        // Shared components
+        void g_register_shared_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 cp_alignof, u32 max_values)
+        {
+            archetype_t*   archetype = &ecs->m_archetypes[archetype_index];
+            shared_pool_t* pool      = s_find_shared_pool(ecs, cp_index);
+            if (pool == nullptr)
+            {
+                ASSERT(ecs->m_num_shared_pools < ECS_MAX_SHARED_TYPES);
+                if (ecs->m_num_shared_pools >= ECS_MAX_SHARED_TYPES)
+                    return;
+                pool                                           = s_shared_create(cp_index, cp_sizeof, cp_alignof, max_values);
+                ecs->m_shared_pools[ecs->m_num_shared_pools++] = pool;
+            }
+            ASSERT(pool->m_sizeof == cp_sizeof);
+
+            // The component bin of a shared component holds the value index
+            s_register_component_type(archetype, cp_index, sizeof(u32));
+            const u16 local = archetype->m_global_to_local_cp_type[cp_index];
+            ASSERT(archetype->m_cp_sizeof[local] == sizeof(u32));
+            archetype->m_cp_shared[local] = pool;
+        }
+
+        void const* g_set_shared_cp(ecs_t* ecs, entity_t entity, u32 cp_index, void const* value)
+        {
+            archetype_t* archetype    = &ecs->m_archetypes[g_entity_archetype_index(entity)];
+            const u32    entity_index = g_entity_index(entity);
+            const u16    local        = cp_index < archetype->m_max_global_cp_types ? archetype->m_global_to_local_cp_type[cp_index] : (u16)0xFFFF;
+            if (local == 0xFFFF || archetype->m_cp_shared[local] == nullptr)
+                return nullptr;
+
+            // Acquire the new value before releasing the old one, setting the value that the entity already has must not
+            // free it
+            shared_pool_t* pool        = archetype->m_cp_shared[local];
+            const u32      value_index = s_shared_acquire(pool, value);
+            if (value_index == ECS4_SHARED_NONE)
+                return nullptr;
+            const bool had_value = s_has_component(archetype, entity_index, (u16)cp_index);
+            u32*       slot      = (u32*)s_alloc_component(archetype, entity_index, (u16)cp_index);
+            if (slot == nullptr)
+            {
+                s_shared_release(pool, value_index);
+                return nullptr;
+            }
+            if (had_value)
+                s_shared_release(pool, *slot);
+            *slot = value_index;
+            return s_shared_value(pool, value_index);
+        }
+
+        u32 g_get_shared_index(ecs_t* ecs, entity_t entity, u32 cp_index)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[g_entity_archetype_index(entity)];
+            byte const*  cp        = s_get_component(archetype, g_entity_index(entity), (u16)cp_index);
+            if (cp == nullptr || archetype->m_global_to_local_cp_type[cp_index] == 0xFFFF || archetype->m_cp_shared[archetype->m_global_to_local_cp_type[cp_index]] == nullptr)
+                return ECS4_SHARED_NONE;
+            return *(u32 const*)cp;
+        }
+
+        void const* g_get_shared_value(ecs_t* ecs, u32 cp_index, u32 value_index)
+        {
+            shared_pool_t const* pool = s_find_shared_pool(ecs, cp_index);
+            return pool != nullptr ? s_shared_value(pool, value_index) : nullptr;
+        }
+
+        u32 g_shared_value_count(ecs_t* ecs, u32 cp_index)
+        {
+            shared_pool_t const* pool = s_find_shared_pool(ecs, cp_index);
+            return pool != nullptr ? pool->m_count : 0;
+        }
+
+        u32 g_shared_value_end(ecs_t* ecs, u32 cp_index)
+        {
+            shared_pool_t const* pool = s_find_shared_pool(ecs, cp_index);
+            return pool != nullptr ? pool->m_end : 0;
+        }
+
+        // Singletons
+        bool g_register_singleton(ecs_t* ecs, u32 sg_index, u32 sg_sizeof)
+        {
+            ASSERT(sg_index < ECS4_MAX_SINGLETONS);
+            if (sg_index >= ECS4_MAX_SINGLETONS || ecs->m_singletons[sg_index] != nullptr)
+                return false;
+            // A singleton has an arena of its own, the memory of a new arena is zero
+            ecs->m_singleton_arenas[sg_index] = narena::new_arena((int_t)sg_sizeof, (int_t)sg_sizeof);
+            ecs->m_singletons[sg_index]       = narena::base_ptr_as<void>(ecs->m_singleton_arenas[sg_index]);
+            return true;
+        }
+
+        void* g_get_singleton(ecs_t* ecs, u32 sg_index) { return ecs->m_singletons[sg_index]; }
+
+        // Tags
+        bool g_has_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        {
+            const u8     archetype_index = g_entity_archetype_index(entity);
+            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+            return s_has_tag(archetype, entity, tg_index);
+        }
+
+        void g_add_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        {
+            const u8     archetype_index = g_entity_archetype_index(entity);
+            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+            s_add_tag(archetype, entity, tg_index);
+        }
+
+        void g_rem_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        {
+            const u8     archetype_index = g_entity_archetype_index(entity);
+            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+            s_rem_tag(archetype, entity, tg_index);
+        }
+
+        // The value filter of en_iterator_t::mark_shared
+        static inline bool s_shared_match(archetype_t* archetype, u32 entity_index, u16 local, u32 value_index)
+        {
+            const u64 occupancy = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy)[entity_index];
+            const u64 bit_mask  = (u64)1 << local;
+            if ((occupancy & bit_mask) == 0)
+                return false;
+            const u32 cp_reference = s_get_cp_reference(archetype, entity_index, (s32)math::countBits(occupancy & (bit_mask - 1)));
+            return *(u32 const*)s_cp_idx2ptr(archetype, local, cp_reference) == value_index;
+        }
+
+        en_iterator_t::en_iterator_t(ecs_t* ecs, u8 archetype_index)
+            : m_archetype(nullptr)
+            , m_ref_cp_occupancy(0)
+            , m_ref_tag_occupancy(0)
+            , m_entity_index(-1)
+            , m_members(nullptr)
+            , m_shared_local(0xFFFF)
+            , m_shared_value(ECS4_SHARED_NONE)
+            , m_sg_read_mask(0)
+            , m_sg_write_mask(0)
+            , m_sleeping(false)
+        {
+            m_archetype_index   = archetype_index;
+            m_archetype         = &ecs->m_archetypes[m_archetype_index];
+        }
+
+        entity_t en_iterator_t::entity() const { return m_entity_index >= 0 ? s_entity_make(m_archetype_index, m_entity_index) : ECS_ENTITY_NULL; }
+
+        void en_iterator_t::mark_cp(u32 cp_index)
+        {
+            if (m_archetype == nullptr)
+                return;
+            ASSERT(cp_index < m_archetype->m_max_global_cp_types);
+            const u16 component_type_index = m_archetype->m_global_to_local_cp_type[cp_index];
+            ASSERT(component_type_index != 0xFFFF);
+            m_ref_cp_occupancy |= ((u64)1 << component_type_index);
+        }
+
+        void en_iterator_t::mark_tag(u16 tg_index)
+        {
+            if (m_archetype == nullptr)
+                return;
+            ASSERT(tg_index < m_archetype->m_max_global_tag_types);
+            const u8 tag_type_index = m_archetype->m_global_to_local_tag_type[tg_index];
+            ASSERT(tag_type_index != 0xFF);
+            m_ref_tag_occupancy |= ((u32)1 << tag_type_index);
+        }
+
+        void en_iterator_t::mark_shared(u32 cp_index, u32 value_index)
+        {
+            if (m_archetype == nullptr)
+                return;
+            mark_cp(cp_index);
+            m_shared_local = m_archetype->m_global_to_local_cp_type[cp_index];
+            m_shared_value = value_index;
+            ASSERT(m_archetype->m_cp_shared[m_shared_local] != nullptr);
+        }
+
+        void en_iterator_t::read_singleton(u32 sg_index) { m_sg_read_mask |= ((u32)1 << sg_index); }
+
+        void en_iterator_t::write_singleton(u32 sg_index)
+        {
+            m_sg_read_mask |= ((u32)1 << sg_index);
+            m_sg_write_mask |= ((u32)1 << sg_index);
+        }
+
+        void en_iterator_t::use_query(s32 query_index)
+        {
+            if (m_archetype == nullptr || query_index < 0 || query_index >= 64 || (m_archetype->m_query_mask & ((u64)1 << query_index)) == 0)
+                return;
+            query_t const* query = &m_archetype->m_queries[query_index];
+            m_ref_cp_occupancy   = query->m_cp_mask;
+            m_ref_tag_occupancy  = query->m_tag_mask;
+            m_members            = narena::base_ptr_as<const u64>(query->m_members);
+        }
+
+        void en_iterator_t::begin()
+        {
+            // Start from the first alive entity
+            m_entity_index = find(s_state_find_used_after(m_archetype, 0));
+        }
+
+        void en_iterator_t::begin(s32 entity_index) { m_entity_index = find(s_state_find_used_after(m_archetype, entity_index)); }
+
+        s32 en_iterator_t::find(s32 entity_index) const
+        {
+            // Without a filter and without sleeping entities every alive entity matches
+            if (m_ref_cp_occupancy == 0 && m_ref_tag_occupancy == 0 && (m_sleeping || m_archetype->m_num_sleeping == 0))
+            {
+                if (entity_index >= 0)
+                    entity_index = s_state_find_used_after(m_archetype, entity_index);
+                return entity_index;
+            }
+
+            if (entity_index < 0)
+                return -1;
+
+            if (m_members != nullptr)
+            {
+                // A registered query, the membership bitmap is kept up to date
+                const u32 num_member_words = (m_archetype->m_free_index + 63) >> 6;
+                for (u32 w = (u32)entity_index >> 6; w < num_member_words; ++w)
+                {
+                    u64 members = m_members[w];
+                    if (!m_sleeping)
+                        members &= s_awake_word(m_archetype, w);
+                    if (w == ((u32)entity_index >> 6))
+                        members &= D_U64_MAX << (entity_index & 63);
+                    while (members != 0)
+                    {
+                        const s32 index = (s32)(w << 6) + math::findFirstBit(members);
+                        if (m_shared_local == 0xFFFF || s_shared_match(m_archetype, (u32)index, m_shared_local, m_shared_value))
+                            return index;
+                        members &= members - 1;
+                    }
+                }
+                return -1;
+            }
+
+            // Per block of 64 entities, blocks that miss a component (summary) or a tag (tag columns) are skipped, as well as
+            // the sleeping entities
+            const u64* occupancy_array = narena::base_ptr_as<const u64>(m_archetype->m_cp_occupancy);
+            const u32  num_words       = (m_archetype->m_free_index + 63) >> 6;
+            const u32  column_mask     = m_ref_tag_occupancy & m_archetype->m_tag_column_mask;
+            const u32  tag_mask        = m_ref_tag_occupancy & ~column_mask;
+            for (u32 w = (u32)entity_index >> 6; w < num_words; ++w)
+            {
+                u64 candidates = s_candidates_word(m_archetype, w, m_ref_cp_occupancy, column_mask);
+                if (!m_sleeping)
+                    candidates &= s_awake_word(m_archetype, w);
+                if (w == ((u32)entity_index >> 6))
+                    candidates &= D_U64_MAX << (entity_index & 63);
+                while (candidates != 0)
+                {
+                    const s32 index = (s32)(w << 6) + math::findFirstBit(candidates);
+                    if ((occupancy_array[index] & m_ref_cp_occupancy) == m_ref_cp_occupancy && (s_get_tags(m_archetype, index) & tag_mask) == tag_mask)
+                    {
+                        if (m_shared_local == 0xFFFF || s_shared_match(m_archetype, (u32)index, m_shared_local, m_shared_value))
+                            return index;
+                    }
+                    candidates &= candidates - 1;
+                }
+            }
+            return -1;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // registered queries
+
+        s32 g_register_query(ecs_t* ecs, en_iterator_t const& query)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[query.archetype_index()];
+            if (archetype->m_archetype_arena == nullptr || archetype->m_query_mask == D_U64_MAX)
+                return -1;
+
+            const s8 q             = math::findFirstBit(~archetype->m_query_mask);
+            query_t* registered    = &archetype->m_queries[q];
+            registered->m_cp_mask  = query.cp_mask();
+            registered->m_tag_mask = query.tag_mask();
+            registered->m_count    = 0;
+            registered->m_members  = narena::new_arena((int_t)((archetype->m_max_entities + 63) >> 6) * sizeof(u64), 0);
+
+            // Per component and tag, remember that this query depends on it
+            const u64 bit = (u64)1 << q;
+            archetype->m_query_mask |= bit;
+            if (registered->m_cp_mask == 0 && registered->m_tag_mask == 0)
+                archetype->m_unfiltered_queries |= bit;
+            for (u32 c = 0; c < 64; ++c)
+                archetype->m_cp_queries[c] |= ((registered->m_cp_mask >> c) & 1) != 0 ? bit : 0;
+            for (u32 t = 0; t < 32; ++t)
+                archetype->m_tag_queries[t] |= ((registered->m_tag_mask >> t) & 1) != 0 ? bit : 0;
+
+            s_query_rebuild(archetype, bit);
+            return q;
+        }
+
+        void g_unregister_query(ecs_t* ecs, u8 archetype_index, s32 query_index)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr || query_index < 0 || query_index >= 64)
+                return;
+            const u64 bit = (u64)1 << query_index;
+            if ((archetype->m_query_mask & bit) == 0)
+                return;
+
+            archetype->m_query_mask &= ~bit;
+            archetype->m_unfiltered_queries &= ~bit;
+            for (u32 c = 0; c < 64; ++c)
+                archetype->m_cp_queries[c] &= ~bit;
+            for (u32 t = 0; t < 32; ++t)
+                archetype->m_tag_queries[t] &= ~bit;
+
+            query_t* registered = &archetype->m_queries[query_index];
+            narena::destroy(registered->m_members);
+            registered->m_members = nullptr;
+        }
+
+        u32 g_query_count(ecs_t* ecs, u8 archetype_index, s32 query_index)
+        {
+            archetype_t const* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr || query_index < 0 || query_index >= 64 || (archetype->m_query_mask & ((u64)1 << query_index)) == 0)
+                return 0;
+            return archetype->m_queries[query_index].m_count;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // cardinality
+
+        u32 g_count(ecs_t* ecs, en_iterator_t const& query)
+        {
+            archetype_t const* archetype = &ecs->m_archetypes[query.archetype_index()];
+            if (archetype->m_archetype_arena == nullptr)
+                return 0;
+
+            const u64 cp_mask  = query.cp_mask();
+            const u32 tag_mask = query.tag_mask();
+            if (cp_mask == 0 && tag_mask == 0)
+                return query.sleeping() ? archetype->m_alive_count : archetype->m_alive_count - archetype->m_num_sleeping;
+
+            // Per word of 64 entities, AND the alive (and awake) bits with the entities that match the masks and popcount the result
+            const bool awake_only = !query.sleeping();
+            const u32  num_words  = (archetype->m_free_index + 63) >> 6;
+            u32        count      = 0;
+            for (u32 w = 0; w < num_words; ++w)
+            {
+                u64 match = s_match_word(archetype, w, cp_mask, tag_mask);
+                if (awake_only)
+                    match &= s_awake_word(archetype, w);
+                count += (u32)math::countBits(match);
+            }
+            return count;
+        }
+
+        u32 g_count_estimate(ecs_t* ecs, en_iterator_t const& query)
+        {
+            archetype_t const* archetype = &ecs->m_archetypes[query.archetype_index()];
+            if (archetype->m_archetype_arena == nullptr)
+                return 0;
+
+            // The number of entities that have the least used component is an upper bound
+            u32 estimate = archetype->m_alive_count;
+            u64 cp_mask  = query.cp_mask();
+            while (cp_mask != 0)
+            {
+                const s8 bit = math::findFirstBit(cp_mask);
+                estimate     = math::min(estimate, archetype->m_cp_counts[bit]);
+                cp_mask &= cp_mask - 1;
+            }
+            return estimate;
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // bulk tags
+
+        // Replicate the bit of a local tag over the tag bytes of the entities in a u64 (8, 16 or 32 tags per entity)
+        static inline u64 s_tag_word_mask(u32 bytes_per_entity, u8 local)
+        {
+            u64 mask = 0;
+            for (u32 b = local >> 3; b < 8; b += bytes_per_entity)
+                mask |= (u64)((u8)1 << (local & 7)) << (b << 3);
+            return mask;
+        }
+
+        u32 g_set_tag_all(ecs_t* ecs, en_iterator_t const& query, u16 tg_index)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[query.archetype_index()];
+            if (archetype->m_archetype_arena == nullptr)
+                return 0;
+            if (s_local_tag_index(archetype, tg_index) == 0xFF && tg_index < archetype->m_max_global_tag_types && archetype->m_num_tags < archetype->m_per_entity_tags)
+                s_register_tag_type(archetype, tg_index, false);
+            const u8 local = s_local_tag_index(archetype, tg_index);
+            if (local == 0xFF)
+                return 0;
+
+            const u32 bytes_per_entity = archetype->m_per_entity_tags >> 3;
+            const u8  bit              = (u8)1 << (local & 7);
+            byte*     tags             = archetype->m_tags->m_base + (local >> 3);
+            u64*      column           = archetype->m_tag_columns[local] != nullptr ? narena::base_ptr_as<u64>(archetype->m_tag_columns[local]) : nullptr;
+            const u32 num_words        = (archetype->m_free_index + 63) >> 6;
+
+            u32 count = 0;
+            for (u32 w = 0; w < num_words; ++w)
+            {
+                u64 match = s_match_word(archetype, w, query.cp_mask(), query.tag_mask());
+                if (!query.sleeping())
+                    match &= s_awake_word(archetype, w);
+                if (match == 0)
+                    continue;
+                if (column != nullptr)
+                    column[w] |= match;
+                count += (u32)math::countBits(match);
+                while (match != 0)
+                {
+                    tags[((w << 6) + math::findFirstBit(match)) * bytes_per_entity] |= bit;
+                    match &= match - 1;
+                }
+            }
+            s_query_rebuild(archetype, archetype->m_tag_queries[local]);
+            return count;
+        }
+
+        void g_clear_tag_all(ecs_t* ecs, u8 archetype_index, u16 tg_index)
+        {
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena == nullptr)
+                return;
+            const u8 local = s_local_tag_index(archetype, tg_index);
+            if (local == 0xFF)
+                return;
+
+            const u32 bytes_per_entity = archetype->m_per_entity_tags >> 3;
+            const u8  bit              = (u8)1 << (local & 7);
+            byte*     tags             = archetype->m_tags->m_base + (local >> 3);
+            const u32 num_words        = (archetype->m_free_index + 63) >> 6;
+
+            // With a tag column only the entities that have the tag are touched
+            if (archetype->m_tag_columns[local] != nullptr)
+            {
+                u64* column = narena::base_ptr_as<u64>(archetype->m_tag_columns[local]);
+                for (u32 w = 0; w < num_words; ++w)
+                {
+                    u64 word = column[w];
+                    while (word != 0)
+                    {
+                        tags[((w << 6) + math::findFirstBit(word)) * bytes_per_entity] &= ~bit;
+                        word &= word - 1;
+                    }
+                    column[w] = 0;
+                }
+                s_query_rebuild(archetype, archetype->m_tag_queries[local]);
+                return;
+            }
+
+            // Otherwise a masked store of 8 bytes at a time, the tags of free entities are cleared as well since they are
+            // cleared anyway when an entity is created
+            const u32 num_bytes = archetype->m_free_index * bytes_per_entity;
+            u32       i         = 0;
+            if (bytes_per_entity != 3)
+            {
+                const u64 mask  = ~s_tag_word_mask(bytes_per_entity, local);
+                u64*      words = (u64*)archetype->m_tags->m_base;
+                for (; (i + 8) <= num_bytes; i += 8)
+                    words[i >> 3] &= mask;
+            }
+            for (i += (local >> 3); i < num_bytes; i += bytes_per_entity)
+                archetype->m_tags->m_base[i] &= ~bit;
+            s_query_rebuild(archetype, archetype->m_tag_queries[local]);
+        }
+
+        template <bool SET> static void s_set_tag_array(ecs_t* ecs, entity_t const* entities, u32 count, u16 tg_index)
+        {
+            // The archetype, tag index and mask are only looked up again when the archetype changes
+            s32          current_archetype = -1;
+            archetype_t* archetype         = nullptr;
+            u8           local             = 0xFF;
+            for (u32 i = 0; i < count; ++i)
+            {
+                const u8 archetype_index = g_entity_archetype_index(entities[i]);
+                if ((s32)archetype_index != current_archetype)
+                {
+                    current_archetype = archetype_index;
+                    archetype         = &ecs->m_archetypes[archetype_index];
+                    if (SET && s_local_tag_index(archetype, tg_index) == 0xFF && tg_index < archetype->m_max_global_tag_types && archetype->m_num_tags < archetype->m_per_entity_tags)
+                        s_register_tag_type(archetype, tg_index, false);
+                    local = archetype->m_archetype_arena != nullptr ? s_local_tag_index(archetype, tg_index) : (u8)0xFF;
+                }
+                if (local == 0xFF)
+                    continue;
+
+                const u32 entity_index = g_entity_index(entities[i]);
+                byte*     tag_byte     = archetype->m_tags->m_base + (entity_index * (archetype->m_per_entity_tags >> 3)) + (local >> 3);
+                u64*      column       = archetype->m_tag_columns[local] != nullptr ? narena::base_ptr_as<u64>(archetype->m_tag_columns[local]) + (entity_index >> 6) : nullptr;
+                if (SET)
+                {
+                    *tag_byte |= (u8)1 << (local & 7);
+                    if (column != nullptr)
+                        *column |= (u64)1 << (entity_index & 63);
+                }
+                else
+                {
+                    *tag_byte &= ~((u8)1 << (local & 7));
+                    if (column != nullptr)
+                        *column &= ~((u64)1 << (entity_index & 63));
+                }
+                s_query_update(archetype, archetype->m_tag_queries[local], entity_index, true);
+            }
+        }
+
+        void g_add_tag(ecs_t* ecs, entity_t const* entities, u32 count, u16 tg_index) { s_set_tag_array<true>(ecs, entities, count, tg_index); }
+        void g_rem_tag(ecs_t* ecs, entity_t const* entities, u32 count, u16 tg_index) { s_set_tag_array<false>(ecs, entities, count, tg_index); }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // sleeping entities
+
+        template <bool SLEEP> static u32 s_set_sleeping_array(ecs_t* ecs, entity_t const* entities, u32 count)
+        {
+            // The archetype is only looked up again when the archetype changes
+            s32          current_archetype = -1;
+            archetype_t* archetype         = nullptr;
+            u32          changed           = 0;
+            for (u32 i = 0; i < count; ++i)
+            {
+                const u8 archetype_index = g_entity_archetype_index(entities[i]);
+                if ((s32)archetype_index != current_archetype)
+                {
+                    current_archetype = archetype_index;
+                    archetype         = &ecs->m_archetypes[archetype_index];
+                }
+                const u32 entity_index = g_entity_index(entities[i]);
+                if (archetype->m_archetype_arena == nullptr || !s_is_alive(archetype, entity_index))
+                    continue;
+                if (s_set_sleeping(archetype, entity_index, SLEEP))
+                    changed++;
+            }
+            return changed;
+        }
+
+        void g_sleep(ecs_t* ecs, entity_t e) { s_set_sleeping_array<true>(ecs, &e, 1); }
+        void g_wake(ecs_t* ecs, entity_t e) { s_set_sleeping_array<false>(ecs, &e, 1); }
+        u32  g_sleep(ecs_t* ecs, entity_t const* entities, u32 count) { return s_set_sleeping_array<true>(ecs, entities, count); }
+        u32  g_wake(ecs_t* ecs, entity_t const* entities, u32 count) { return s_set_sleeping_array<false>(ecs, entities, count); }
+
+        bool g_is_awake(ecs_t* ecs, entity_t e)
+        {
+            archetype_t const* archetype    = &ecs->m_archetypes[g_entity_archetype_index(e)];
+            const u32          entity_index = g_entity_index(e);
+            return archetype->m_archetype_arena != nullptr && s_is_alive(archetype, entity_index) && s_is_awake(archetype, entity_index);
+        }
+
+        u32 g_num_sleeping(ecs_t* ecs, u8 archetype_index) { return ecs->m_archetypes[archetype_index].m_num_sleeping; }
+
+        // The awake entities first, the sort is stable so both groups keep their order
+        static u64 s_sleeping_key(ecs_t* ecs, entity_t e, void*) { return g_is_awake(ecs, e) ? 0 : 1; }
+
+        u32 g_sort_awake_first(ecs_t* ecs, u8 archetype_index, sort_moved_fn moved_fn, void* user, u32 max_moves)
+        {
+            if (ecs->m_archetypes[archetype_index].m_num_sleeping == 0)
+                return 0;
+            return s_sort_storage(ecs, archetype_index, s_sleeping_key, nullptr, moved_fn, user, max_moves);
+        }
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // scheduled actions
+
+        void g_register_timers(ecs_t* ecs, u32 max_timers)
+        {
+            if (ecs->m_timers != nullptr)
+                return;
+
+            const int_t timers_size = (int_t)(sizeof(timers_t) + max_timers * (sizeof(timer_node_t) + sizeof(u64) + 2 * sizeof(u32) + sizeof(entity_t)) + 64);
+            arena_t*    arena       = narena::new_arena(timers_size, 0);
+
+            timers_t* timers       = g_allocate<timers_t>(arena);
+            timers->m_arena        = arena;
+            timers->m_nodes        = g_allocate<timer_node_t>(arena, max_timers);
+            timers->m_max_timers   = max_timers;
+            timers->m_end          = 0;
+            timers->m_free_head    = 0xFFFFFFFF;
+            timers->m_count        = 0;
+            timers->m_tick         = 0;
+            timers->m_due_keys     = g_allocate<u64>(arena, max_timers);
+            timers->m_due_order    = g_allocate<u32>(arena, max_timers);
+            timers->m_due_scratch  = g_allocate<u32>(arena, max_timers);
+            timers->m_due_entities = g_allocate<entity_t>(arena, max_timers);
+            g_memset(timers->m_slots, 0xFF, (int_t)sizeof(timers->m_slots));
+            ecs->m_timers = timers;
         }
 
-        static void s_free_local_component(archetype_t* archetype, u32 entity_index, u16 component_type_index)
+        static bool s_schedule(ecs_t* ecs, entity_t e, etimer_action_t action, u16 index, u64 at_tick)
         {
-            const u64 bit_mask        = ((u64)1 << component_type_index);
-            u64*      occupancy_array = narena::base_ptr_as<u64>(archetype->m_cp_occupancy);
-            u64&      occupancy       = occupancy_array[entity_index];
-            if (occupancy & bit_mask)
-            {
-                u16 num_components = (u16)math::countBits(occupancy);
-                occupancy          = occupancy & (~bit_mask);
-
-                // find local component index by counting bits before 'bit_index'
-                const u16 cp_index = (u16)math::countBits(occupancy & (bit_mask - 1));
+            timers_t* timers = ecs->m_timers;
+            if (timers == nullptr)
+                return false;
+            archetype_t* archetype    = &ecs->m_archetypes[g_entity_archetype_index(e)];
+            const u32    entity_index = g_entity_index(e);
+            if (archetype->m_archetype_arena == nullptr || !s_is_alive(archetype, entity_index))
+                return false;
 
-                bin16_t* cp_bin = &archetype->m_cp_bins[component_type_index];
-                ASSERT(cp_bin->m_bin != nullptr);
+            u32 node_index = timers->m_free_head;
+            if (node_index != 0xFFFFFFFF)
+                timers->m_free_head = timers->m_nodes[node_index].m_next;
+            else if (timers->m_end < timers->m_max_timers)
+                node_index = timers->m_end++;
+            else
+                return false;
+            timers->m_count++;
 
-                u16*  cp_reference_array = narena::base_ptr_as<u16>(archetype->m_cp_reference);
-                u16*  cp_references      = cp_reference_array + (entity_index * archetype->m_per_entity_cps);
-                u16   cp_reference       = cp_references[cp_index];
-                void* cp_ptr             = bin_idx2ptr(cp_bin, cp_reference);
-                bin_free(cp_bin, cp_ptr);
+            timer_node_t* node = &timers->m_nodes[node_index];
+            node->m_at         = math::max(at_tick, timers->m_tick + 1);
+            node->m_entity     = e;
+            node->m_index      = index;
+            node->m_action     = (u8)action;
+            s_timers_file(timers, node_index);
 
-                // remove component reference from the array
-                g_remove(cp_references, archetype->m_per_entity_cps, num_components, cp_index);
-            }
+            u32* heads          = s_timer_heads(archetype);
+            node->m_entity_prev = 0xFFFFFFFF;
+            node->m_entity_next = heads[entity_index];
+            if (heads[entity_index] != 0xFFFFFFFF)
+                timers->m_nodes[heads[entity_index]].m_entity_prev = node_index;
+            heads[entity_index] = node_index;
+            return true;
         }
 
-        static void s_free_component(archetype_t* archetype, u32 entity_index, u16 global_cp_type_index)
+        bool g_schedule_add_tag(ecs_t* ecs, entity_t e, u16 tg_index, u64 at_tick) { return s_schedule(ecs, e, TIMER_ADD_TAG, tg_index, at_tick); }
+        bool g_schedule_rem_tag(ecs_t* ecs, entity_t e, u16 tg_index, u64 at_tick) { return s_schedule(ecs, e, TIMER_REM_TAG, tg_index, at_tick); }
+        bool g_schedule_rem_cp(ecs_t* ecs, entity_t e, u32 cp_index, u64 at_tick) { return s_schedule(ecs, e, TIMER_REM_CP, (u16)cp_index, at_tick); }
+        bool g_schedule_destroy(ecs_t* ecs, entity_t e, u64 at_tick) { return s_schedule(ecs, e, TIMER_DESTROY, 0, at_tick); }
+
+        u32 g_cancel_schedule(ecs_t* ecs, entity_t e)
         {
-            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
-            ASSERT(entity_index < archetype->m_free_index);
-            const u16 component_type_index = archetype->m_global_to_local_cp_type[global_cp_type_index];
-            s_free_local_component(archetype, entity_index, component_type_index);
+            archetype_t* archetype = &ecs->m_archetypes[g_entity_archetype_index(e)];
+            if (archetype->m_timers == nullptr)
+                return 0;
+            return s_timers_cancel_entity(ecs->m_timers, archetype, g_entity_index(e));
         }
 
-        static bool s_has_component(archetype_t* archetype, u32 entity_index, u16 global_cp_type_index)
+        u32 g_num_scheduled(ecs_t* ecs) { return ecs->m_timers != nullptr ? ecs->m_timers->m_count : 0; }
+        u64 g_current_tick(ecs_t* ecs) { return ecs->m_timers != nullptr ? ecs->m_timers->m_tick : 0; }
+
+        // The actions of a slot move down to the levels below (or to the same slot when they are far away)
+        static void s_timers_cascade(timers_t* timers, u32 level, u32 slot)
         {
-            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
-            ASSERT(entity_index < archetype->m_free_index);
-            const u16  component_type_index = archetype->m_global_to_local_cp_type[global_cp_type_index];
-            const u64* occupancy_array      = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy);
-            const u64  occupancy            = occupancy_array[entity_index];
-            const u64  bit_mask             = ((u64)1 << component_type_index);
-            return (occupancy & bit_mask) != 0;
+            u32& head = timers->m_slots[level * ECS_TIMER_SLOTS + slot];
+            u32  i    = head;
+            head      = 0xFFFFFFFF;
+            while (i != 0xFFFFFFFF)
+            {
+                const u32 next = timers->m_nodes[i].m_next;
+                s_timers_file(timers, i);
+                i = next;
+            }
         }
 
-        static byte* s_get_component(archetype_t* archetype, u32 entity_index, u16 global_cp_type_index)
+        // Apply the due batch sorted by {action, index, archetype, entity index}, a run with the same action and index is
+        // applied with one call for the tags. Destroying comes last so that the other actions of an entity that is
+        // destroyed in the same tick are still applied.
+        static u32 s_timers_apply(ecs_t* ecs, timers_t* timers, u32 n)
         {
-            ASSERT(global_cp_type_index < archetype->m_max_global_cp_types);
-            ASSERT(entity_index < archetype->m_free_index);
+            u64 const* keys  = timers->m_due_keys;
+            u32*       order = timers->m_due_order;
+            for (u32 j = 0; j < n; ++j)
+                order[j] = j;
+            s_sort_order(order, timers->m_due_scratch, keys, n, 0xFFFFFFFF);
 
-            const u16 component_type_index = archetype->m_global_to_local_cp_type[global_cp_type_index];
-            const u64 bit_mask             = ((u64)1 << component_type_index);
+            u32 applied = 0;
+            for (u32 begin = 0; begin < n;)
+            {
+                const u64 run = keys[order[begin]] >> 32;
+                u32       end = begin;
+                u32       m   = 0;
+                for (; end < n && (keys[order[end]] >> 32) == run; ++end)
+                {
+                    if (end > begin && keys[order[end]] == keys[order[end - 1]])
+                        continue;
+                    const u64 key               = keys[order[end]];
+                    timers->m_due_entities[m++] = s_entity_make((u8)(key >> 24), (u32)(key & 0xFFFFFF));
+                }
 
-            const u64* occupancy_array = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy);
-            const u64  occupancy       = occupancy_array[entity_index];
+                const u16 index = (u16)(run & 0xFFFF);
+                switch ((etimer_action_t)(run >> 16))
+                {
+                    case TIMER_ADD_TAG: g_add_tag(ecs, timers->m_due_entities, m, index); break;
+                    case TIMER_REM_TAG: g_rem_tag(ecs, timers->m_due_entities, m, index); break;
+                    case TIMER_REM_CP:
+                        for (u32 k = 0; k < m; ++k)
+                            g_rem_cp(ecs, timers->m_due_entities[k], index);
+                        break;
+                    case TIMER_DESTROY:
+                        for (u32 k = 0; k < m; ++k)
+                            g_destroy_entity(ecs, timers->m_due_entities[k]);
+                        break;
+                }
+                applied += m;
+                begin = end;
+            }
+            return applied;
+        }
 
-            if (occupancy & bit_mask)
-            {
-                // count the bits that are before 'bit_index' to find the local index (popcount)
-                const s32 cp_index = (s32)math::countBits(occupancy & (bit_mask - 1));
+        u32 g_advance_ticks(ecs_t* ecs, u32 num_ticks)
+        {
+            timers_t* timers = ecs->m_timers;
+            if (timers == nullptr)
+                return 0;
 
-                const u16* cp_reference_array = narena::base_ptr_as<const u16>(archetype->m_cp_reference);
-                const u16* cp_references      = cp_reference_array + (entity_index * archetype->m_per_entity_cps);
-                const u16  cp_reference       = cp_references[cp_index];
+            u32 applied = 0;
+            for (u32 t = 0; t < num_ticks; ++t)
+            {
+                if (timers->m_count == 0)
+                {
+                    timers->m_tick += num_ticks - t;
+                    break;
+                }
+                const u64 tick = ++timers->m_tick;
 
-                bin16_t* cp_bin = &archetype->m_cp_bins[component_type_index];
-                ASSERT(cp_bin->m_bin != nullptr);
+                // Every 64^level ticks a slot of that level comes around, the higher levels first
+                for (u32 level = ECS_TIMER_LEVELS - 1; level > 0; --level)
+                {
+                    const u32 shift = level * ECS_TIMER_SLOT_BITS;
+                    if ((tick & (((u64)1 << shift) - 1)) == 0)
+                        s_timers_cascade(timers, level, (u32)((tick >> shift) & (ECS_TIMER_SLOTS - 1)));
+                }
 
-                return (byte*)bin_idx2ptr(cp_bin, cp_reference);
+                // The slot of this tick holds the actions that are due, they leave the wheel before they are applied
+                u32& head = timers->m_slots[tick & (ECS_TIMER_SLOTS - 1)];
+                u32  n    = 0;
+                for (u32 i = head; i != 0xFFFFFFFF;)
+                {
+                    timer_node_t* node = &timers->m_nodes[i];
+                    const u32     next = node->m_next;
+                    ASSERT(node->m_at == tick);
+                    const u8     archetype_index = g_entity_archetype_index(node->m_entity);
+                    const u32    entity_index    = g_entity_index(node->m_entity);
+                    archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
+                    s_timers_unlink_entity(timers, narena::base_ptr_as<u32>(archetype->m_timers), entity_index, i);
+                    timers->m_due_keys[n++] = ((u64)node->m_action << 48) | ((u64)node->m_index << 32) | ((u64)archetype_index << 24) | entity_index;
+                    s_timers_free(timers, i);
+                    i = next;
+                }
+                head = 0xFFFFFFFF;
+                if (n > 0)
+                    applied += s_timers_apply(ecs, timers, n);
             }
-            return nullptr;
+            return applied;
         }
 
-        static bool s_has_tag(archetype_t* archetype, entity_t entity, u16 tg_index)
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // relations
+
+        bool g_register_relation(ecs_t* ecs, u32 rl_index, u32 max_pairs)
         {
-            if (tg_index >= (archetype->m_per_entity_tags))
+            ASSERT(rl_index < ECS4_MAX_RELATIONS);
+            if (rl_index >= ECS4_MAX_RELATIONS || ecs->m_relations[rl_index] != nullptr)
                 return false;
-            byte const* tag_occupancy = archetype->m_tags->m_base + (g_entity_index(entity) * (math::alignUp(archetype->m_per_entity_tags, 8) >> 3));
-            return (tag_occupancy[tg_index >> 3] & ((u8)1 << (tg_index & 7))) != 0;
+
+            const int_t relation_size = (int_t)(sizeof(relation_t) + max_pairs * (2 * sizeof(entity_t) + 4 * sizeof(u32)) + 64);
+            arena_t*    arena         = narena::new_arena(relation_size, 0);
+
+            relation_t* rl  = g_allocate<relation_t>(arena);
+            rl->m_arena     = arena;
+            rl->m_max_pairs = max_pairs;
+            rl->m_count     = 0;
+            rl->m_end       = 0;
+            rl->m_free_head = 0xFFFFFFFF;
+            rl->m_source    = g_allocate<entity_t>(arena, max_pairs);
+            rl->m_target    = g_allocate<entity_t>(arena, max_pairs);
+            rl->m_next_out  = g_allocate<u32>(arena, max_pairs);
+            rl->m_prev_out  = g_allocate<u32>(arena, max_pairs);
+            rl->m_next_in   = g_allocate<u32>(arena, max_pairs);
+            rl->m_prev_in   = g_allocate<u32>(arena, max_pairs);
+            ecs->m_relations[rl_index] = rl;
+            return true;
         }
 
-        static void s_add_tag(archetype_t* archetype, entity_t entity, u16 tg_index)
+        static inline bool s_pair_alive(ecs_t* ecs, entity_t e)
         {
-            if (tg_index >= (archetype->m_per_entity_tags))
-                return;
-            byte* tag_occupancy = archetype->m_tags->m_base + (g_entity_index(entity) * (math::alignUp(archetype->m_per_entity_tags, 8) >> 3));
-            tag_occupancy[tg_index >> 3] |= ((u8)1 << (tg_index & 7));
+            const u8 archetype_index = g_entity_archetype_index(e);
+            if (archetype_index >= ecs->m_archetypes_capacity)
+                return false;
+            archetype_t const* archetype = &ecs->m_archetypes[archetype_index];
+            return archetype->m_archetype_arena != nullptr && s_is_alive(archetype, g_entity_index(e));
         }
 
-        static void s_rem_tag(archetype_t* archetype, entity_t entity, u16 tg_index)
+        // The pair of 'entity' with 'target', 0xFFFFFFFF when there is none
+        static u32 s_pair_find(ecs_t* ecs, relation_t const* rl, u32 rl_index, entity_t entity, entity_t target)
+        {
+            archetype_t const* archetype = &ecs->m_archetypes[g_entity_archetype_index(entity)];
+            if (archetype->m_pairs == nullptr)
+                return 0xFFFFFFFF;
+            return s_relation_find(rl, rl_index, narena::base_ptr_as<const u32>(archetype->m_pairs) + g_entity_index(entity) * ECS_PAIR_HEADS, target);
+        }
+
+        bool g_add_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target)
+        {
+            ASSERT(rl_index < ECS4_MAX_RELATIONS);
+            relation_t* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_pair_alive(ecs, entity) || !s_pair_alive(ecs, target))
+                return false;
+            u32* source_heads = s_pair_heads(&ecs->m_archetypes[g_entity_archetype_index(entity)], g_entity_index(entity));
+            u32* target_heads = s_pair_heads(&ecs->m_archetypes[g_entity_archetype_index(target)], g_entity_index(target));
+            return s_relation_add(rl, rl_index, source_heads, entity, target_heads, target);
+        }
+
+        void g_rem_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target)
         {
-            if (tg_index >= (archetype->m_per_entity_tags))
+            ASSERT(rl_index < ECS4_MAX_RELATIONS);
+            relation_t* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_pair_alive(ecs, entity) || !s_pair_alive(ecs, target))
                 return;
-            byte* tag_occupancy = archetype->m_tags->m_base + (g_entity_index(entity) * (math::alignUp(archetype->m_per_entity_tags, 8) >> 3));
-            tag_occupancy[tg_index >> 3] &= ~((u8)1 << (tg_index & 7));
+            const u32 p = s_pair_find(ecs, rl, rl_index, entity, target);
+            if (p != 0xFFFFFFFF)
+                s_relation_remove(rl, rl_index, ecs->m_archetypes, p);
         }
 
-        static s32 s_create_entity(archetype_t* archetype)
+        bool g_has_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target)
         {
-            s32 entity_index = -1;
+            ASSERT(rl_index < ECS4_MAX_RELATIONS);
+            relation_t const* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_pair_alive(ecs, entity) || !s_pair_alive(ecs, target))
+                return false;
+            return s_pair_find(ecs, rl, rl_index, entity, target) != 0xFFFFFFFF;
+        }
 
-            u64* occupancy_array;
-            u16* reference_array;
-            u8*  tags_array;
-            if (archetype->m_alive_count < archetype->m_free_index)
+        u32 g_add_pair(ecs_t* ecs, entity_t const* entities, u32 count, u32 rl_index, entity_t target)
+        {
+            ASSERT(rl_index < ECS4_MAX_RELATIONS);
+            relation_t* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_pair_alive(ecs, target))
+                return 0;
+            u32* target_heads = s_pair_heads(&ecs->m_archetypes[g_entity_archetype_index(target)], g_entity_index(target));
+            u32  n            = 0;
+            for (u32 i = 0; i < count; ++i)
             {
-                // The hierarchical duomap can be used to find a free entity index
-                entity_index = nstatevec18::alloc(&archetype->m_free_bin0, archetype->m_free_bin1, &archetype->m_alive_bin0, archetype->m_alive_bin1, narena::base_ptr_as<u64>(archetype->m_bin2), archetype->m_free_index);
-
-                occupancy_array = narena::base_ptr_as<u64>(archetype->m_cp_occupancy);
-                reference_array = narena::base_ptr_as<u16>(archetype->m_cp_reference);
-                tags_array      = narena::base_ptr_as<u8>(archetype->m_tags);
-                occupancy_array = occupancy_array + (entity_index);
-                reference_array = reference_array + (entity_index * archetype->m_per_entity_cps);
-                tags_array      = tags_array + (entity_index * (math::alignUp(archetype->m_per_entity_tags, 8) >> 3));
+                const entity_t e = entities[i];
+                if (!s_pair_alive(ecs, e))
+                    continue;
+                if (!s_relation_add(rl, rl_index, s_pair_heads(&ecs->m_archetypes[g_entity_archetype_index(e)], g_entity_index(e)), e, target_heads, target))
+                    break;
+                n++;
             }
-            else
-            {
-                entity_index = archetype->m_free_index++;
-
-                occupancy_array = narena::base_ptr_as<u64>(archetype->m_cp_occupancy);
-                reference_array = narena::base_ptr_as<u16>(archetype->m_cp_reference);
-                tags_array      = narena::base_ptr_as<u8>(archetype->m_tags);
+            return n;
+        }
 
-                nstatevec18::tick_used_lazy(&archetype->m_free_bin0, archetype->m_free_bin1, &archetype->m_alive_bin0, archetype->m_alive_bin1, narena::base_ptr_as<u64>(archetype->m_bin2), archetype->m_free_index, entity_index);
+        void g_rem_pair(ecs_t* ecs, entity_t const* entities, u32 count, u32 rl_index, entity_t target)
+        {
+            ASSERT(rl_index < ECS4_MAX_RELATIONS);
+            relation_t* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_pair_alive(ecs, target))
+                return;
+            for (u32 i = 0; i < count; ++i)
+            {
+                if (!s_pair_alive(ecs, entities[i]))
+                    continue;
+                const u32 p = s_pair_find(ecs, rl, rl_index, entities[i], target);
+                if (p != 0xFFFFFFFF)
+                    s_relation_remove(rl, rl_index, ecs->m_archetypes, p);
             }
-
-            *occupancy_array = 0;
-            g_memclr(tags_array, math::alignUp(archetype->m_per_entity_tags, 8) >> 3);
-
-            archetype->m_alive_count++;
-
-            return entity_index;
         }
 
-        static void s_destroy_entity(archetype_t* archetype, u32 entity_index)
+        u32 g_get_targets(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t* out, u32 max_out)
         {
-            // Free all components associated with this entity
-            // TODO, just scan for '1' bits in occupancy instead of checking all component types
-            u64* occupancy_array = (u64*)archetype->m_cp_occupancy->m_base;
-            u64  occupancy       = occupancy_array[entity_index];
-            while (occupancy != 0)
+            ASSERT(rl_index < ECS4_MAX_RELATIONS);
+            relation_t const* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_pair_alive(ecs, entity))
+                return 0;
+            archetype_t const* archetype = &ecs->m_archetypes[g_entity_archetype_index(entity)];
+            if (archetype->m_pairs == nullptr)
+                return 0;
+            u32 const* heads = narena::base_ptr_as<const u32>(archetype->m_pairs) + g_entity_index(entity) * ECS_PAIR_HEADS;
+            u32        n     = 0;
+            for (u32 p = heads[2 * rl_index]; p != 0xFFFFFFFF; p = rl->m_next_out[p], ++n)
             {
-                const u8 bin_index = (u8)math::findFirstBit(occupancy);
-                s_free_local_component(archetype, entity_index, bin_index);
-                occupancy = occupancy & (~((u64)1 << bin_index));
+                if (n < max_out)
+                    out[n] = rl->m_target[p];
             }
+            return n;
+        }
 
-            nstatevec18::set_free(&archetype->m_free_bin0, archetype->m_free_bin1, &archetype->m_alive_bin0, archetype->m_alive_bin1, narena::base_ptr_as<u64>(archetype->m_bin2), archetype->m_free_index, entity_index);
+        u32 g_query_pair(ecs_t* ecs, en_iterator_t const* filter, u32 rl_index, entity_t target, entity_t* out, u32 max_out)
+        {
+            ASSERT(rl_index < ECS4_MAX_RELATIONS);
+            relation_t const* rl = ecs->m_relations[rl_index];
+            if (rl == nullptr || !s_pair_alive(ecs, target))
+                return 0;
+            archetype_t const* target_archetype = &ecs->m_archetypes[g_entity_archetype_index(target)];
+            if (target_archetype->m_pairs == nullptr)
+                return 0;
 
-            archetype->m_alive_count--;
+            // Walk the pairs that target 'target', the filter only accepts the entities of its archetype
+            u32 const* heads = narena::base_ptr_as<const u32>(target_archetype->m_pairs) + g_entity_index(target) * ECS_PAIR_HEADS;
+            u32        n     = 0;
+            for (u32 p = heads[2 * rl_index + 1]; p != 0xFFFFFFFF; p = rl->m_next_in[p])
+            {
+                const entity_t source = rl->m_source[p];
+                if (filter != nullptr)
+                {
+                    if (g_entity_archetype_index(source) != filter->archetype_index())
+                        continue;
+                    archetype_t const* archetype = &ecs->m_archetypes[filter->archetype_index()];
+                    const u32          index     = g_entity_index(source);
+                    const u64          occupancy = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy)[index];
+                    if ((occupancy & filter->cp_mask()) != filter->cp_mask() || (s_get_tags(archetype, (s32)index) & filter->tag_mask()) != filter->tag_mask())
+                        continue;
+                }
+                if (n < max_out)
+                    out[n] = source;
+                n++;
+            }
+            return n;
         }
 
         // --------------------------------------------------------------------------------------------------------
         // --------------------------------------------------------------------------------------------------------
-        // --------------------------------------------------------------------------------------------------------
-        struct ecs_t
-        {
-            DCORE_CLASS_PLACEMENT_NEW_DELETE
-            arena_t*     m_arena;
-            u32          m_archetypes_capacity;
-            archetype_t* m_archetypes; // array of archetype pointers
-        };
+        // rank / select
 
-        void g_register_archetype(ecs_t* ecs, u8 archetype_index, u8 components_per_entity, u16 max_global_component_types, u8 tags_per_entity, u16 max_global_tag_types)
+        // Bring the prefix popcounts up to date for all blocks of 512 entities below m_free_index
+        static void s_rank_build(archetype_t* archetype)
         {
-            ASSERT(archetype_index < ecs->m_archetypes_capacity);
-            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
-            if (archetype->m_archetype_arena != nullptr)
-                return;
-            s_initialize_archetype(archetype, components_per_entity, max_global_component_types, tags_per_entity, max_global_tag_types);
+            const u64* alive_array = narena::base_ptr_as<const u64>(archetype->m_bin2);
+            u32*       rank_array  = narena::base_ptr_as<u32>(archetype->m_rank);
+            const u32  num_words   = (archetype->m_free_index + 63) >> 6;
+            const u32  num_blocks  = (num_words + 7) >> 3;
+            for (u32 b = archetype->m_rank_valid; b <= num_blocks; ++b)
+            {
+                u32       count = rank_array[b - 1];
+                const u32 end   = math::min(b << 3, num_words);
+                for (u32 w = (b - 1) << 3; w < end; ++w)
+                    count += (u32)math::countBits(alive_array[w]);
+                rank_array[b] = count;
+            }
+            if (archetype->m_rank_valid <= num_blocks)
+                archetype->m_rank_valid = num_blocks + 1;
         }
 
-        ecs_t* g_create_ecs(u8 max_archetypes)
+        // Number of alive entities below 'entity_index'
+        static u32 s_rank(archetype_t* archetype, u32 entity_index)
         {
-            const int_t ecs_size = (sizeof(ecs_t) + (sizeof(archetype_t) * max_archetypes));
-            arena_t*    arena    = narena::new_arena(ecs_size, ecs_size);
-
-            ecs_t* ecs                 = g_allocate<ecs_t>(arena);
-            ecs->m_archetypes_capacity = max_archetypes;
-            ecs->m_archetypes          = g_allocate_and_clear<archetype_t>(arena, max_archetypes);
+            s_rank_build(archetype);
+            if (entity_index >= archetype->m_free_index)
+                return archetype->m_alive_count;
 
-            return ecs;
+            const u64* alive_array = narena::base_ptr_as<const u64>(archetype->m_bin2);
+            const u32  word_index  = entity_index >> 6;
+            u32        rank        = narena::base_ptr_as<const u32>(archetype->m_rank)[entity_index >> 9];
+            for (u32 w = word_index & ~7u; w < word_index; ++w)
+                rank += (u32)math::countBits(alive_array[w]);
+            return rank + (u32)math::countBits(alive_array[word_index] & (((u64)1 << (entity_index & 63)) - 1));
         }
 
-        void g_destroy_ecs(ecs_t* ecs)
+        // Entity index of the k-th alive entity, -1 if there are not that many alive entities
+        static s32 s_select(archetype_t* archetype, u32 k)
         {
-            for (u32 i = 0; i < ecs->m_archetypes_capacity; i++)
+            if (k >= archetype->m_alive_count)
+                return -1;
+            s_rank_build(archetype);
+
+            // Binary search for the last block that has a prefix popcount <= k
+            const u32* rank_array = narena::base_ptr_as<const u32>(archetype->m_rank);
+            u32        lo         = 0;
+            u32        hi         = archetype->m_rank_valid - 1;
+            while (lo < hi)
             {
-                archetype_t* archetype = &ecs->m_archetypes[i];
-                if (archetype != nullptr)
-                    s_destroy(archetype);
+                const u32 mid = (lo + hi + 1) >> 1;
+                if (rank_array[mid] <= k)
+                    lo = mid;
+                else
+                    hi = mid - 1;
             }
-            narena::destroy(ecs->m_arena);
+
+            // Then scan the (max 8) words of the block and finally the bits of the word
+            const u64* alive_array = narena::base_ptr_as<const u64>(archetype->m_bin2);
+            u32        remaining   = k - rank_array[lo];
+            u32        w           = lo << 3;
+            u32        bits        = (u32)math::countBits(alive_array[w]);
+            while (remaining >= bits)
+            {
+                remaining -= bits;
+                bits = (u32)math::countBits(alive_array[++w]);
+            }
+            u64 word = alive_array[w];
+            for (; remaining > 0; --remaining)
+                word &= word - 1;
+            return (s32)(w << 6) + math::findFirstBit(word);
         }
 
-        entity_t g_create_entity(ecs_t* ecs, u8 archetype_index)
+        void g_rank_build(ecs_t* ecs, u8 archetype_index)
         {
-            archetype_t* archetype    = &ecs->m_archetypes[archetype_index];
-            const s32    entity_index = s_create_entity(archetype);
-            return s_entity_make(0, archetype_index, (entity_index_t)entity_index);
+            archetype_t* archetype = &ecs->m_archetypes[archetype_index];
+            if (archetype->m_archetype_arena != nullptr)
+                s_rank_build(archetype);
         }
 
-        void g_destroy_entity(ecs_t* ecs, entity_t e)
+        u32 g_rank(ecs_t* ecs, entity_t e)
         {
-            const u8     archetype_index = g_entity_archetype_index(e);
-            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
-            s_destroy_entity(archetype, g_entity_index(e));
+            archetype_t* archetype = &ecs->m_archetypes[g_entity_archetype_index(e)];
+            return archetype->m_archetype_arena != nullptr ? s_rank(archetype, g_entity_index(e)) : 0;
         }
 
-        void g_register_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof)
+        entity_t g_select(ecs_t* ecs, u8 archetype_index, u32 k)
         {
             archetype_t* archetype = &ecs->m_archetypes[archetype_index];
-            if (archetype == nullptr)
-                return;
-            s_register_component_type(archetype, cp_index, cp_sizeof);
+            if (archetype->m_archetype_arena == nullptr)
+                return ECS_ENTITY_NULL;
+            const s32 entity_index = s_select(archetype, k);
+            return entity_index >= 0 ? s_entity_make(archetype_index, (entity_index_t)entity_index) : ECS_ENTITY_NULL;
         }
 
-        void g_register_tag_type(ecs_t* ecs, u8 archetype_index, u16 tg_index)
+        s32 g_partition_begin(ecs_t* ecs, u8 archetype_index, u32 part, u32 num_parts)
         {
             archetype_t* archetype = &ecs->m_archetypes[archetype_index];
-            if (archetype == nullptr)
-                return;
-            s_register_tag_type(archetype, tg_index);
+            if (archetype->m_archetype_arena == nullptr)
+                return 0;
+            const u32 k            = (u32)(((u64)archetype->m_alive_count * part) / num_parts);
+            const s32 entity_index = s_select(archetype, k);
+            return entity_index >= 0 ? entity_index : (s32)archetype->m_free_index;
         }
 
-        bool g_has_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+        entity_t g_sample(ecs_t* ecs, en_iterator_t const& query, u32 random)
         {
-            const u8     archetype_index = g_entity_archetype_index(entity);
-            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
-            return s_has_component(archetype, g_entity_index(entity), (u16)cp_index);
+            archetype_t* archetype = &ecs->m_archetypes[query.archetype_index()];
+            if (archetype->m_archetype_arena == nullptr || archetype->m_alive_count == 0)
+                return ECS_ENTITY_NULL;
+
+            const u64  cp_mask         = query.cp_mask();
+            const u32  tag_mask        = query.tag_mask();
+            const u64* occupancy_array = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy);
+
+            // Pick uniformly among the alive entities and reject the ones that do not match the query
+            for (s32 attempt = 0; attempt < 16; ++attempt)
+            {
+                const s32 entity_index = s_select(archetype, random % archetype->m_alive_count);
+                if ((occupancy_array[entity_index] & cp_mask) == cp_mask && (s_get_tags(archetype, entity_index) & tag_mask) == tag_mask && (query.sleeping() || s_is_awake(archetype, (u32)entity_index)))
+                    return s_entity_make(query.archetype_index(), (entity_index_t)entity_index);
+                random = random * 1664525u + 1013904223u; // next value of a linear congruential generator
+            }
+
+            // Matches are rare, pick uniformly among the matching entities
+            const u32 count = g_count(ecs, query);
+            if (count == 0)
+                return ECS_ENTITY_NULL;
+            u32           k    = random % count;
+            en_iterator_t iter = query;
+            for (iter.begin(); k > 0; iter.next())
+                k--;
+            return iter.entity();
         }
-        void* g_add_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // reductions
+
+        static inline void s_reduce_identity(ereduce_t op, f32* lanes, u32 num_lanes)
         {
-            const u8     archetype_index = g_entity_archetype_index(entity);
-            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
-            return s_alloc_component(archetype, g_entity_index(entity), (u16)cp_index);
+            f32 const identity = op == REDUCE_SUM ? 0.0f : (op == REDUCE_MIN ? 3.402823466e+38f : -3.402823466e+38f);
+            for (u32 l = 0; l < num_lanes; ++l)
+                lanes[l] = identity;
         }
-        void g_rem_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+
+        static inline void s_reduce_identity(ereduce_t op, s32* lanes, u32 num_lanes)
         {
-            const u8     archetype_index = g_entity_archetype_index(entity);
-            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
-            s_free_component(archetype, g_entity_index(entity), (u16)cp_index);
+            s32 const identity = op == REDUCE_SUM ? 0 : (op == REDUCE_MIN ? 0x7FFFFFFF : (s32)0x80000000);
+            for (u32 l = 0; l < num_lanes; ++l)
+                lanes[l] = identity;
         }
-        void* g_get_cp(ecs_t* ecs, entity_t entity, u32 cp_index)
+
+        // Reduce 'count' components that are 'stride' bytes apart, the switch is outside of the loops so that the
+        // inner loops are branch free and can be vectorized by the compiler.
+        template <typename T> static void s_reduce_kernel(byte const* data, u32 stride, u32 count, ereduce_t op, T* lanes, u32 num_lanes)
         {
-            const u8     archetype_index = g_entity_archetype_index(entity);
-            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
-            return s_get_component(archetype, g_entity_index(entity), (u16)cp_index);
+            switch (op)
+            {
+                case REDUCE_SUM:
+                    for (u32 i = 0; i < count; ++i, data += stride)
+                        for (u32 l = 0; l < num_lanes; ++l)
+                            lanes[l] += ((T const*)data)[l];
+                    break;
+                case REDUCE_MIN:
+                    for (u32 i = 0; i < count; ++i, data += stride)
+                        for (u32 l = 0; l < num_lanes; ++l)
+                            lanes[l] = ((T const*)data)[l] < lanes[l] ? ((T const*)data)[l] : lanes[l];
+                    break;
+                case REDUCE_MAX:
+                    for (u32 i = 0; i < count; ++i, data += stride)
+                        for (u32 l = 0; l < num_lanes; ++l)
+                            lanes[l] = ((T const*)data)[l] > lanes[l] ? ((T const*)data)[l] : lanes[l];
+                    break;
+            }
         }
 
-        // Tags
-        bool g_has_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        template <typename T> static void s_reduce_combine(ereduce_t op, T* inout_lanes, T const* partial_lanes, u32 num_lanes) { s_reduce_kernel<T>((byte const*)partial_lanes, 0, 1, op, inout_lanes, num_lanes); }
+
+        // Reduce a run of components, the run of a split component points into its first column and every lane is a column
+        template <typename T> static void s_reduce_run(soa_store_t const* soa, byte const* run, u32 stride, u32 run_length, ereduce_t op, T* out_lanes, u32 num_lanes)
         {
-            const u8     archetype_index = g_entity_archetype_index(entity);
-            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
-            return s_has_tag(archetype, entity, tg_index);
+            if (soa == nullptr)
+            {
+                s_reduce_kernel<T>(run, stride, run_length, op, out_lanes, num_lanes);
+                return;
+            }
+            if (run_length == 0)
+                return;
+            for (u32 l = 0; l < num_lanes; ++l)
+                s_reduce_kernel<T>(run + l * soa->m_column_stride, stride, run_length, op, &out_lanes[l], 1);
         }
 
-        void g_add_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        // Reduce the matching entities in a chunk, components that are adjacent in the bin are handed to the kernel as one run
+        template <typename T> static u32 s_reduce_chunk(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, u32 chunk_index, ereduce_t op, T* out_lanes, u32 num_lanes)
         {
-            const u8     archetype_index = g_entity_archetype_index(entity);
-            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
-            s_add_tag(archetype, entity, tg_index);
+            s_reduce_identity(op, out_lanes, num_lanes);
+
+            archetype_t* archetype = &ecs->m_archetypes[query.archetype_index()];
+            if (archetype->m_archetype_arena == nullptr || cp_index >= archetype->m_max_global_cp_types)
+                return 0;
+            const u16 component_type_index = archetype->m_global_to_local_cp_type[cp_index];
+            if (component_type_index == 0xFFFF)
+                return 0;
+
+            soa_store_t* soa = archetype->m_cp_soa[component_type_index];
+            if (soa != nullptr)
+            {
+                ASSERT(soa->m_field_sizeof == sizeof(T));
+                s_soa_flush(soa);
+            }
+
+            const u64   bit_mask        = ((u64)1 << component_type_index);
+            const u64*  occupancy_array = narena::base_ptr_as<const u64>(archetype->m_cp_occupancy);
+            const u32   stride          = soa != nullptr ? (u32)sizeof(T) : (u32)(s_cp_idx2ptr(archetype, component_type_index, 1) - s_cp_idx2ptr(archetype, component_type_index, 0));
+            const s32   end             = (s32)math::min((chunk_index + 1) * ECS4_REDUCE_CHUNK_SIZE, archetype->m_free_index);
+            byte const* run             = nullptr;
+            u32         run_length      = 0;
+            u32         count           = 0;
+
+            en_iterator_t iter = query;
+            iter.begin((s32)(chunk_index * ECS4_REDUCE_CHUNK_SIZE));
+            while (!iter.end() && iter.index() < end)
+            {
+                const s32 entity_index = iter.index();
+                const u64 occupancy    = occupancy_array[entity_index];
+                if (occupancy & bit_mask)
+                {
+                    const s32   local        = (s32)math::countBits(occupancy & (bit_mask - 1));
+                    const u32   cp_reference = s_get_cp_reference(archetype, entity_index, local);
+                    byte const* cp           = soa != nullptr ? s_soa_column(soa, 0) + cp_reference * stride : s_cp_idx2ptr(archetype, component_type_index, cp_reference);
+                    if (cp != run + run_length * stride)
+                    {
+                        s_reduce_run<T>(soa, run, stride, run_length, op, out_lanes, num_lanes);
+                        run        = cp;
+                        run_length = 0;
+                    }
+                    run_length++;
+                    count++;
+                }
+                iter.next();
+            }
+            s_reduce_run<T>(soa, run, stride, run_length, op, out_lanes, num_lanes);
+            return count;
         }
 
-        void g_rem_tag(ecs_t* ecs, entity_t entity, u16 tg_index)
+        template <typename T> static u32 s_reduce(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, ereduce_t op, T* out_lanes, u32 num_lanes)
         {
-            const u8     archetype_index = g_entity_archetype_index(entity);
-            archetype_t* archetype       = &ecs->m_archetypes[archetype_index];
-            s_rem_tag(archetype, entity, tg_index);
+            T partial_lanes[64];
+            ASSERT(num_lanes <= 64);
+
+            s_reduce_identity(op, out_lanes, num_lanes);
+            u32       count      = 0;
+            u32 const num_chunks = g_reduce_num_chunks(ecs, query);
+            for (u32 c = 0; c < num_chunks; ++c)
+            {
+                count += s_reduce_chunk<T>(ecs, query, cp_index, c, op, partial_lanes, num_lanes);
+                s_reduce_combine<T>(op, out_lanes, partial_lanes, num_lanes);
+            }
+            return count;
         }
 
-        en_iterator_t::en_iterator_t(ecs_t* ecs, u8 archetype_index)
-            : m_archetype(nullptr)
-            , m_ref_cp_occupancy(0)
-            , m_ref_tag_occupancy(0)
-            , m_entity_index(-1)
+        u32 g_reduce_num_chunks(ecs_t* ecs, en_iterator_t const& query)
         {
-            m_archetype_index   = archetype_index;
-            m_archetype         = &ecs->m_archetypes[m_archetype_index];
+            archetype_t const* archetype = &ecs->m_archetypes[query.archetype_index()];
+            return (archetype->m_free_index + ECS4_REDUCE_CHUNK_SIZE - 1) / ECS4_REDUCE_CHUNK_SIZE;
         }
 
-        entity_t en_iterator_t::entity() const { return m_entity_index >= 0 ? s_entity_make(0, m_archetype_index, m_entity_index) : ECS_ENTITY_NULL; }
+        u32  g_reduce_f32(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, ereduce_t op, f32* out_lanes, u32 num_lanes) { return s_reduce<f32>(ecs, query, cp_index, op, out_lanes, num_lanes); }
+        u32  g_reduce_s32(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, ereduce_t op, s32* out_lanes, u32 num_lanes) { return s_reduce<s32>(ecs, query, cp_index, op, out_lanes, num_lanes); }
+        u32  g_reduce_chunk_f32(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, u32 chunk_index, ereduce_t op, f32* out_lanes, u32 num_lanes) { return s_reduce_chunk<f32>(ecs, query, cp_index, chunk_index, op, out_lanes, num_lanes); }
+        u32  g_reduce_chunk_s32(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, u32 chunk_index, ereduce_t op, s32* out_lanes, u32 num_lanes) { return s_reduce_chunk<s32>(ecs, query, cp_index, chunk_index, op, out_lanes, num_lanes); }
+        void g_reduce_combine_f32(ereduce_t op, f32* inout_lanes, f32 const* partial_lanes, u32 num_lanes) { s_reduce_combine<f32>(op, inout_lanes, partial_lanes, num_lanes); }
+        void g_reduce_combine_s32(ereduce_t op, s32* inout_lanes, s32 const* partial_lanes, u32 num_lanes) { s_reduce_combine<s32>(op, inout_lanes, partial_lanes, num_lanes); }
 
-        void en_iterator_t::mark_cp(u32 cp_index)
+        u32 g_fold(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, fold_fn fn, void* accumulator, void* user)
         {
-            if (m_archetype == nullptr)
-                return;
-            ASSERT(cp_index < m_archetype->m_max_global_cp_types);
-            const u16 component_type_index = m_archetype->m_global_to_local_cp_type[cp_index];
-            ASSERT(component_type_index != 0xFFFF);
-            m_ref_cp_occupancy |= ((u64)1 << component_type_index);
-        }
+            archetype_t* archetype = &ecs->m_archetypes[query.archetype_index()];
+            if (archetype->m_archetype_arena == nullptr || cp_index >= archetype->m_max_global_cp_types || archetype->m_global_to_local_cp_type[cp_index] == 0xFFFF)
+                return 0;
 
-        void en_iterator_t::mark_tag(u16 tg_index)
-        {
-            if (m_archetype == nullptr)
-                return;
-            ASSERT(tg_index < m_archetype->m_per_entity_tags);
-            const u8 tag_type_index = m_archetype->m_global_to_local_tag_type[tg_index];
-            ASSERT(tag_type_index != 0xFF);
-            m_ref_tag_occupancy |= ((u32)1 << tag_type_index);
+            u32           count = 0;
+            en_iterator_t iter  = query;
+            iter.begin();
+            while (!iter.end())
+            {
+                byte const* cp = s_get_component(archetype, (u32)iter.index(), (u16)cp_index);
+                if (cp != nullptr)
+                {
+                    fn(accumulator, cp, user);
+                    count++;
+                }
+                iter.next();
+            }
+            return count;
         }
 
+        // --------------------------------------------------------------------------------------------------------
+        // --------------------------------------------------------------------------------------------------------
+        // cursor
 
-        void en_iterator_t::begin()
+        en_cursor_t::en_cursor_t(ecs_t* ecs, en_iterator_t const& query)
+            : m_ecs(ecs)
+            , m_iter(query)
+            , m_position(0)
+            , m_laps(0)
         {
-            // Start from the first alive entity
-            m_entity_index = find(0);
         }
 
-        s32 en_iterator_t::find(s32 entity_index) const
+        u32 en_cursor_t::run(cursor_fn fn, void* user, u32 max_entities, clock_fn clock, u64 deadline)
         {
-            if (m_ref_cp_occupancy == 0 && m_ref_tag_occupancy == 0)
-            {
-                if (entity_index >= 0)
-                    entity_index = nstatevec18::find_used_after(&m_archetype->m_free_bin0, m_archetype->m_free_bin1, &m_archetype->m_alive_bin0, m_archetype->m_alive_bin1, narena::base_ptr_as<u64>(m_archetype->m_bin2), m_archetype->m_free_index, entity_index);
-                return entity_index;
-            }
+            // After wrapping around the step stops at the entity index where it started
+            s32 const start = m_position;
+            s32       limit = -1;
+            u32       count = 0;
 
-            while (entity_index >= 0)
+            m_iter.begin(m_position);
+            while (count < max_entities)
             {
-                u64 const* cur_cp_occupancy = (u64*)&m_archetype->m_cp_occupancy->m_base[entity_index * sizeof(u64)];
-                if ((*cur_cp_occupancy & m_ref_cp_occupancy) == m_ref_cp_occupancy)
+                if (m_iter.end())
                 {
-                    u32 cur_tag_occupancy = 0;
-                    switch (m_archetype->m_per_entity_tags)
-                    {
-                        case 8: cur_tag_occupancy = ((u8*)m_archetype->m_tags->m_base)[entity_index]; break;
-                        case 16: cur_tag_occupancy = ((u16*)m_archetype->m_tags->m_base)[entity_index]; break;
-                        case 24:
-                            cur_tag_occupancy = m_archetype->m_tags->m_base[entity_index];
-                            cur_tag_occupancy = (cur_tag_occupancy << 8) | m_archetype->m_tags->m_base[entity_index + 1];
-                            cur_tag_occupancy = (cur_tag_occupancy << 8) | m_archetype->m_tags->m_base[entity_index + 2];
-                            break;
-                        case 32: cur_tag_occupancy = ((u32*)m_archetype->m_tags->m_base)[entity_index]; break;
-                    }
-                    if ((cur_tag_occupancy & m_ref_tag_occupancy) == m_ref_tag_occupancy)
-                        return entity_index;
+                    m_laps++;
+                    m_position = 0;
+                    if (limit >= 0 || start == 0)
+                        break;
+                    limit = start;
+                    m_iter.begin(0);
+                    continue;
                 }
-                entity_index = nstatevec18::find_used_after(&m_archetype->m_free_bin0, m_archetype->m_free_bin1, &m_archetype->m_alive_bin0, m_archetype->m_alive_bin1, narena::base_ptr_as<u64>(m_archetype->m_bin2), m_archetype->m_free_index, entity_index + 1);
+
+                s32 const entity_index = m_iter.index();
+                if (limit >= 0 && entity_index >= limit)
+                    break;
+                if (clock != nullptr && (count & 15) == 0 && clock(user) >= deadline)
+                    break;
+
+                fn(m_ecs, m_iter.entity(), user);
+                count++;
+                m_position = entity_index + 1;
+                m_iter.next();
             }
-            return entity_index;
+            return count;
         }
 
     } // namespace necs4
@@ -15,14 +15,18 @@ namespace ncore
         struct ecs_t;
 
         // Component Type - identifier information
-        // Note: The user needs to create them like cp_type_t position_cp = { -1, sizeof(position_cp_t), "position" }; and register them at the ECS
+        // Note: The user needs to create them like cp_type_t position_cp = { -1, sizeof(position_cp_t), "position", alignof(position_cp_t) }; and register them at the ECS
+        // Note: The component store is cache line aligned and 'cp_alignof' (at most ECS_MAX_ALIGNMENT) pads the stride
         struct cp_type_t
         {
-            s32               cp_id;     // Initialize to -1, calling 'g_register_tag_type' will initialize it
-            s32 const         cp_sizeof; // Size of the component
-            const char* const cp_name;   // Name of the component
+            s32               cp_id;      // Initialize to -1, calling 'g_register_tag_type' will initialize it
+            s32 const         cp_sizeof;  // Size of the component
+            const char* const cp_name;    // Name of the component
+            s32 const         cp_alignof; // Alignment of the component, 0 when the size is the stride
         };
 
+        const s32 ECS_MAX_ALIGNMENT = 64;
+
         // Multi-Thread safe global component type id
         s32 get_global_cp_id();
 
@@ -34,6 +38,17 @@ namespace ncore
             const char* const tg_name; // Name of the tag
         };
 
+        // Singleton Type - identifier information
+        // Note: The user needs to create them like sg_type_t time_sg = { -1, sizeof(time_sg_t), "time" }; and register them at the ECS
+        struct sg_type_t
+        {
+            s32               sg_id;     // Initialize to -1, calling 'g_register_singleton_type' will initialize it
+            s32 const         sg_sizeof; // Size of the singleton
+            const char* const sg_name;   // Name of the singleton
+        };
+
+        const s32 ECS_MAX_SINGLETONS = 32;
+
         // Entity Type
         struct en_type_t;
 
@@ -51,6 +66,13 @@ namespace ncore
         // Registers a tag type and returns its type information
         extern void g_register_tag_type(ecs_t* r, tg_type_t* tg_type);
 
+        // Singletons
+        // Registering a sg_type_t gives it the next free id (at most ECS_MAX_SINGLETONS) and returns its zero initialized
+        // data, registering it again returns the same data. g_get_singleton looks the data up by that id.
+        extern void*             g_register_singleton_type(ecs_t* r, sg_type_t* sg_type);
+        extern void*             g_get_singleton(ecs_t* ecs, sg_type_t* sg_type);
+        template <typename T> T* g_get_singleton(ecs_t* ecs, sg_type_t* sg_type) { return (T*)g_get_singleton(ecs, sg_type); }
+
         extern bool                g_has_cp(ecs_t* ecs, entity_t entity, cp_type_t* cp_type);
         extern void                g_set_cp(ecs_t* ecs, entity_t entity, cp_type_t* cp_type);
         extern void                g_rem_cp(ecs_t* ecs, entity_t entity, cp_type_t* cp_type);
@@ -69,6 +91,8 @@ namespace ncore
             u16        m_cp_type_arr[64]; // Only entities with the following components
             u16        m_tg_type_cnt;
             u8         m_tg_type_arr[32]; // Only entities with the following tags
+            u32        m_sg_read_mask;    // Singletons that are read
+            u32        m_sg_write_mask;   // Singletons that are written
 
             void initialize(ecs_t*);
             void initialize(en_type_t*);
@@ -77,11 +101,32 @@ namespace ncore
             void cp_type(cp_type_t*);
             void tg_type(tg_type_t*);
 
+            // Declare the singletons that are accessed, so that the access of queries can be compared (a write is also a read)
+            void sg_read(sg_type_t*);
+            void sg_write(sg_type_t*);
+
             void     begin();
+            void     begin(u32 en_id); // Start at an entity id, for an iterator of one entity type (see g_partition_begin)
             entity_t item() const;
             void     next();
             bool     end() const;
         };
+
+        // Returns the number of entities that match the query, without iterating them one by one
+        extern u32 g_count(en_iterator_t const& query);
+
+        // Rank / Select
+        // An entity type keeps the number of alive entities before every 512 entities, the first call after entities have
+        // been created or destroyed brings it up to date. This is not thread-safe, call g_rank_build before handing the
+        // entity type to multiple threads. Every part of g_partition_begin has the same number of alive entities:
+        //     u32 const begin = g_partition_begin(en_type, part, num_parts);
+        //     u32 const end   = g_partition_begin(en_type, part + 1, num_parts);
+        //     for (iter.begin(begin); !iter.end() && iter.m_en_id < end; iter.next()) { ... }
+        extern void     g_rank_build(en_type_t* en_type);
+        extern u32      g_rank(ecs_t* ecs, entity_t entity);                            // Number of alive entities before 'entity' in its entity type
+        extern entity_t g_select(en_type_t* en_type, u32 k);                            // The k-th alive entity, g_null_entity if there is none
+        extern u32      g_partition_begin(en_type_t* en_type, u32 part, u32 num_parts); // First entity id of a part
+        extern entity_t g_sample(en_iterator_t const& query, u32 random);               // Uniformly random entity that matches the query
     } // namespace necs2
 } // namespace ncore
 
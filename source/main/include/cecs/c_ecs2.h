@@ -40,6 +40,11 @@ namespace ncore
     {                       \
         ECS_TAG2_INDEX = N  \
     }
+#define DECLARE_ECS2_SINGLETON(N) \
+    enum                          \
+    {                             \
+        ECS_SINGLETON2_INDEX = N  \
+    }
 
         // Register a Component Group with an ECS
         extern bool                g_register_cp_group(ecs_t* ecs, u32 cg_max_entities, u32 cg_index, const char* cg_name);
@@ -48,6 +53,8 @@ namespace ncore
         template <typename T> void g_unregister_group(ecs_t* ecs) { g_unregister_cp_group(ecs, T::ECS_GROUP2_INDEX); }
 
         // Register a Component under a Component Group
+        // The data of a component in a group starts on a cache line, 'cp_alignof' pads the stride (max ECS_MAX_ALIGNMENT).
+        const s32                              ECS_MAX_ALIGNMENT = 64;
         extern bool                            g_register_component(ecs_t* ecs, u32 cg_index, u32 cp_index, const char* cp_name, s32 cp_sizeof, s32 cp_alignof = 8);
         extern void                            g_unregister_component(ecs_t* ecs, u32 cg_index, u32 cp_index);
         template <typename G, typename T> bool g_register_component(ecs_t* ecs, const char* cp_name) { return g_register_component(ecs, G::ECS_GROUP2_INDEX, T::ECS_COMPONENT2_INDEX, cp_name, sizeof(T), alignof(T)); }
@@ -59,6 +66,14 @@ namespace ncore
         template <typename G, typename T> bool g_register_tag(ecs_t* ecs, const char* tg_name) { return g_register_tag(ecs, G::ECS_GROUP2_INDEX, T::ECS_TAG2_INDEX, tg_name); }
         template <typename G, typename T> void g_unregister_tag(ecs_t* ecs) { g_unregister_tag(ecs, G::ECS_GROUP2_INDEX, T::ECS_TAG2_INDEX); }
 
+        // Register a Singleton (e.g. game time or input) by its index, the data is zero initialized and stays at the same
+        // address until the ECS is destroyed. Registering an index twice fails.
+        const u32                  ECS_MAX_SINGLETONS = 32;
+        extern bool                g_register_singleton(ecs_t* ecs, u32 sg_index, s32 sg_sizeof, s32 sg_alignof = 8);
+        extern void*               g_get_singleton(ecs_t* ecs, u32 sg_index);
+        template <typename T> bool g_register_singleton(ecs_t* ecs) { return g_register_singleton(ecs, T::ECS_SINGLETON2_INDEX, sizeof(T), alignof(T)); }
+        template <typename T> T*   g_get_singleton(ecs_t* ecs) { return (T*)g_get_singleton(ecs, T::ECS_SINGLETON2_INDEX); }
+
         extern ecs_t* g_create_ecs(alloc_t* allocator, u32 max_entities);
         extern void   g_destroy_ecs(ecs_t* ecs);
 
@@ -90,6 +105,8 @@ namespace ncore
             s32    m_entity_index;     // Current entity index
             s32    m_entity_index_max; // Maximum entity index
             s8     m_num_groups;       // Number of component groups that the iterator is looking at
+            u32    m_sg_read_mask;     // Singletons that are read
+            u32    m_sg_write_mask;    // Singletons that are written
 
             en_iterator_t(ecs_t* ecs);
 
@@ -99,6 +116,13 @@ namespace ncore
             template <typename T> void set_cp_type() { set_cp_type(T::ECS_COMPONENT2_INDEX); }
             template <typename T> void set_tg_type() { set_tg_type(T::ECS_TAG2_INDEX); }
 
+            // Declare the singletons that are accessed, so that the access of queries can be compared (a write is also a read)
+            void set_sg_read(u32 sg_index);
+            void set_sg_write(u32 sg_index);
+
+            template <typename T> void set_sg_read() { set_sg_read(T::ECS_SINGLETON2_INDEX); }
+            template <typename T> void set_sg_write() { set_sg_write(T::ECS_SINGLETON2_INDEX); }
+
             // Example:
             //     en_iterator_t iter(ecs);
             //
@@ -115,10 +139,27 @@ namespace ncore
             //     }
 
             void     begin();
+            void     begin(s32 entity_index); // Start at an entity index (see g_partition_begin)
             entity_t entity() const;
             void     next();
             bool     end() const;
         };
+
+        // Returns the number of entities that match the query
+        extern u32 g_count(en_iterator_t const& query);
+
+        // Rank / Select
+        // Prefix counts of the alive entities (one per 512 entities) find the k-th alive entity without a full walk. They
+        // are rebuilt on demand after entities are created or destroyed, which is not thread-safe (see g_rank_build).
+        // Splitting an iteration into parts with the same number of alive entities:
+        //     s32 const begin = g_partition_begin(ecs, part, num_parts);
+        //     s32 const end   = g_partition_begin(ecs, part + 1, num_parts);
+        //     for (iter.begin(begin); !iter.end() && iter.m_entity_index < end; iter.next()) { ... }
+        extern void     g_rank_build(ecs_t* ecs);
+        extern u32      g_rank(ecs_t* ecs, entity_t e);                         // The number of alive entities before 'e'
+        extern entity_t g_select(ecs_t* ecs, u32 k);                            // The k-th alive entity, ECS_ENTITY_NULL if there is none
+        extern s32      g_partition_begin(ecs_t* ecs, u32 part, u32 num_parts); // The first entity index of a part
+        extern entity_t g_sample(en_iterator_t const& query, u32 random);       // A uniformly random entity that matches the query
     } // namespace necs2
 } // namespace ncore
 
@@ -40,6 +40,16 @@ namespace ncore
     {                       \
         ECS3_TAG_INDEX = N  \
     }
+#define DECLARE_ECS3_SINGLETON(N) \
+    enum                          \
+    {                             \
+        ECS3_SINGLETON_INDEX = N  \
+    }
+#define DECLARE_ECS3_RELATION(N) \
+    enum                         \
+    {                            \
+        ECS3_RELATION_INDEX = N  \
+    }
 
         // Create and Destroy ECS
         ecs_t* g_create_ecs(alloc_t* allocator, u32 max_entities, u32 max_components, u32 max_tags);
@@ -49,7 +59,18 @@ namespace ncore
         entity_t g_create_entity(ecs_t* ecs);
         void     g_destroy_entity(ecs_t* ecs, entity_t e);
 
+        // Prefabs
+        // Any entity can be used as a prefab, g_instantiate creates 'count' instances of it with a copy of its components and
+        // tags. The components of the instances are appended to each container and filled with large copies. A prefab is an
+        // ordinary entity that queries will visit, give it a tag and remove that tag from the instances (see g_rem_tag) to
+        // tell them apart. Returns the number of instances created, less than 'count' when the maximum number of entities is
+        // reached or when a component container of the prefab is full.
+        u32 g_instantiate(ecs_t* ecs, entity_t prefab, entity_t* out, u32 count);
+
         // Components
+        // A component container is 64 byte aligned and its components are 'cp_alignof' aligned (up to ECS3_MAX_ALIGNMENT),
+        // e.g. a 12 byte vector with an alignment of 16 takes 16 bytes and can be loaded with an aligned SIMD load.
+        const s32                  ECS3_MAX_ALIGNMENT = 64;
         bool                       g_register_component(ecs_t* ecs, u32 max_components, u32 cp_index, s32 cp_sizeof, s32 cp_alignof = 8, const char* cp_name = "");
         void                       g_unregister_component(ecs_t* ecs, u32 cp_index);
         template <typename T> bool g_register_component(ecs_t* ecs, u32 max_components, const char* cp_name="") { return g_register_component(ecs, max_components, T::ECS3_COMPONENT_INDEX, sizeof(T), alignof(T), cp_name); }
@@ -65,6 +86,71 @@ namespace ncore
         template <typename T> void g_rem_cp(ecs_t* ecs, entity_t entity) { g_rem_cp(ecs, entity, T::ECS3_COMPONENT_INDEX); }
         template <typename T> T*   g_get_cp(ecs_t* ecs, entity_t entity) { return (T*)g_get_cp(ecs, entity, T::ECS3_COMPONENT_INDEX); }
 
+        // Shared components
+        // A shared component stores each unique value once in a pool that is deduplicated by hash and reference counted, the
+        // container only holds the (u32) index of the value of each entity. Use it for values that many entities have in
+        // common, e.g. team settings, a mesh + material pair or AI tuning parameters. g_set_shared_cp gives an entity a
+        // value, g_get_cp returns the value of the entity. A value is read-only, changing it means setting another value.
+        // g_add_cp cannot be used, g_rem_cp and destroying the entity release the value. Sorting the container by the value
+        // index (g_sort_storage with a key function that returns g_get_shared_index) groups the entities per value.
+        const u32 ECS3_SHARED_NONE = 0xFFFFFFFF;
+
+        bool        g_register_shared_component(ecs_t* ecs, u32 max_components, u32 cp_index, s32 cp_sizeof, s32 cp_alignof = 8, u32 max_values = 4096, const char* cp_name = "");
+        void const* g_set_shared_cp(ecs_t* ecs, entity_t entity, u32 cp_index, void const* value); // nullptr when the pool is full
+        u32         g_get_shared_index(ecs_t* ecs, entity_t entity, u32 cp_index);                 // ECS3_SHARED_NONE when the entity does not have the component
+        void const* g_get_shared_value(ecs_t* ecs, u32 cp_index, u32 value_index);                 // nullptr when the index is not in use
+        u32         g_shared_value_count(ecs_t* ecs, u32 cp_index);                                // Number of unique values in use
+
+        template <typename T> bool     g_register_shared_component(ecs_t* ecs, u32 max_components, u32 max_values = 4096, const char* cp_name = "") { return g_register_shared_component(ecs, max_components, T::ECS3_COMPONENT_INDEX, sizeof(T), alignof(T), max_values, cp_name); }
+        template <typename T> T const* g_set_shared_cp(ecs_t* ecs, entity_t entity, T const& value) { return (T const*)g_set_shared_cp(ecs, entity, T::ECS3_COMPONENT_INDEX, &value); }
+
+        // Compressed components
+        // A compressed component is kept in blocks of 64 values that are encoded (byte planes, delta and zero run length
+        // coding), use it for large components that are rarely accessed, e.g. save state or history. A block is decoded
+        // into a small LRU cache when one of its values is accessed and encoded again when a changed block leaves the
+        // cache. g_add_cp, g_get_cp, g_rem_cp, g_sort_storage, g_fold and g_reduce_* work as usual, but a pointer to a
+        // compressed component is only valid until another block of the component is accessed. g_compressed_stats writes
+        // back the cache and reports the memory used by the encoded blocks.
+        const u32 ECS3_COMPRESSED_BLOCK_SIZE   = 64;
+        const u32 ECS3_COMPRESSED_CACHE_BLOCKS = 4;
+
+        struct compressed_stats_t
+        {
+            u64 m_raw_bytes;        // size of the values when they are not compressed
+            u64 m_compressed_bytes; // size of the encoded blocks
+            u64 m_cache_bytes;      // size of the decoded blocks in the cache
+            f32 m_ratio;            // raw / compressed, 0 when nothing is encoded
+        };
+
+        bool                       g_register_compressed_component(ecs_t* ecs, u32 max_components, u32 cp_index, s32 cp_sizeof, s32 cp_alignof = 8, const char* cp_name = "");
+        bool                       g_compressed_stats(ecs_t* ecs, u32 cp_index, compressed_stats_t& stats);
+        template <typename T> bool g_register_compressed_component(ecs_t* ecs, u32 max_components, const char* cp_name = "") { return g_register_compressed_component(ecs, max_components, T::ECS3_COMPONENT_INDEX, sizeof(T), alignof(T), cp_name); }
+        template <typename T> bool g_compressed_stats(ecs_t* ecs, compressed_stats_t& stats) { return g_compressed_stats(ecs, T::ECS3_COMPONENT_INDEX, stats); }
+
+        // Split (SoA) components
+        // A split component is made of scalar fields of the same size (e.g. position_t {f32 x, y, z}) and each field is
+        // stored in its own column, so that a kernel can run over x, y and z as plain arrays without shuffles. A column is
+        // 64 byte aligned and padded to a multiple of 64 bytes, slot k of every column belongs to g_select(ecs, cp_index, k).
+        // g_get_cp gathers the fields of the entity into a staging copy and the copy is written back when another entity
+        // of the component is accessed, so a pointer from g_get_cp is only valid until the next access to the component.
+        // g_get_column writes back the staging copy and returns the column of a field, the column stays valid until a
+        // component is added or removed.
+        bool                                         g_register_soa_component(ecs_t* ecs, u32 max_components, u32 cp_index, s32 cp_sizeof, s32 field_sizeof = 4, const char* cp_name = "");
+        void*                                        g_get_column(ecs_t* ecs, u32 cp_index, u32 field_index, u32& count); // nullptr when the component is not split
+        template <typename T, typename F = f32> bool g_register_soa_component(ecs_t* ecs, u32 max_components, const char* cp_name = "") { return g_register_soa_component(ecs, max_components, T::ECS3_COMPONENT_INDEX, sizeof(T), sizeof(F), cp_name); }
+        template <typename T, typename F = f32> F*   g_get_column(ecs_t* ecs, u32 field_index, u32& count) { return (F*)g_get_column(ecs, T::ECS3_COMPONENT_INDEX, field_index, count); }
+
+        // Singletons
+        // Per-world data such as time or input, stored by index (see DECLARE_ECS3_SINGLETON) and zero initialized. A query
+        // declares the singletons it reads and writes (see en_iterator_t) so that two queries can be checked for conflicts.
+        const u32 ECS3_MAX_SINGLETONS = 32;
+
+        bool  g_register_singleton(ecs_t* ecs, u32 sg_index, s32 sg_sizeof, s32 sg_alignof = 8);
+        void* g_get_singleton(ecs_t* ecs, u32 sg_index);
+
+        template <typename T> bool g_register_singleton(ecs_t* ecs) { return g_register_singleton(ecs, T::ECS3_SINGLETON_INDEX, sizeof(T), alignof(T)); }
+        template <typename T> T*   g_get_singleton(ecs_t* ecs) { return (T*)g_get_singleton(ecs, T::ECS3_SINGLETON_INDEX); }
+
         // Tags
         bool g_has_tag(ecs_t* ecs, entity_t entity, u16 tg_index);
         void g_add_tag(ecs_t* ecs, entity_t entity, u16 tg_index);
@@ -86,6 +172,218 @@ namespace ncore
             g_rem_tag(ecs, entity, (u16)T::ECS3_TAG_INDEX);
         }
 
+        // Bulk tags
+        // g_set_tag_all sets the tag on every entity that matches the reference entity (see en_iterator_t) and returns the
+        // number of entities, g_clear_tag_all removes the tag from every entity. The entity array versions of g_add_tag and
+        // g_rem_tag expect alive entities.
+        u32  g_set_tag_all(ecs_t* ecs, entity_t reference, u16 tg_index);
+        void g_clear_tag_all(ecs_t* ecs, u16 tg_index);
+        void g_add_tag(ecs_t* ecs, entity_t const* entities, u32 count, u16 tg_index);
+        void g_rem_tag(ecs_t* ecs, entity_t const* entities, u32 count, u16 tg_index);
+
+        template <typename T> u32  g_set_tag_all(ecs_t* ecs, entity_t reference) { return g_set_tag_all(ecs, reference, (u16)T::ECS3_TAG_INDEX); }
+        template <typename T> void g_clear_tag_all(ecs_t* ecs) { g_clear_tag_all(ecs, (u16)T::ECS3_TAG_INDEX); }
+        template <typename T> void g_add_tag(ecs_t* ecs, entity_t const* entities, u32 count) { g_add_tag(ecs, entities, count, (u16)T::ECS3_TAG_INDEX); }
+        template <typename T> void g_rem_tag(ecs_t* ecs, entity_t const* entities, u32 count) { g_rem_tag(ecs, entities, count, (u16)T::ECS3_TAG_INDEX); }
+
+        // Sleeping entities
+        // An entity can be put to sleep (e.g. an idle NPC out of view, a rigid body that has settled), it keeps its
+        // components and tags but the iterator, g_count, g_set_tag_all and g_sample skip it unless the iterator calls
+        // include_sleeping(). Once an entity has been put to sleep the ECS keeps a second entity state of the alive and
+        // awake entities next to the alive one, queries scan that state so that they do not visit the sleeping entities
+        // at all. Sleep and wake only flip a bit, the entity array versions return the number of entities that changed
+        // state. A new entity is awake. g_count(ecs, ECS_ENTITY_NULL) + g_num_sleeping(ecs) is the number of alive entities.
+        // The components of the awake entities can be grouped in their containers with g_sort_storage and a key of
+        // g_is_awake(ecs, e) ? 0 : 1. The reductions, folds, the spatial grid and the secondary indexes do not look at the
+        // sleep state.
+        void g_sleep(ecs_t* ecs, entity_t e);
+        void g_wake(ecs_t* ecs, entity_t e);
+        u32  g_sleep(ecs_t* ecs, entity_t const* entities, u32 count);
+        u32  g_wake(ecs_t* ecs, entity_t const* entities, u32 count);
+        bool g_is_awake(ecs_t* ecs, entity_t e);
+        u32  g_num_sleeping(ecs_t* ecs);
+
+        // Relations
+        // A pair (relation, target) attaches a target entity to an entity, e.g. (targets, enemy), (owned_by, player) or
+        // (docked_at, station), an entity can have many pairs of the same relation. The pairs of a relation are stored
+        // forward (per entity, its targets) and in a reverse index (per target, the entities that have a pair with it),
+        // adding or removing a pair only relinks the pair. The array versions add or remove the same pair for many
+        // entities. Destroying an entity removes its pairs and the pairs that target it in O(number of pairs).
+        // g_query_pair writes the entities that have the pair and match the reference entity (see en_iterator_t,
+        // ECS_ENTITY_NULL = no filter), at most 'max_out' of them, and returns the number of matching entities.
+        const u32 ECS3_MAX_RELATIONS = 16;
+
+        bool g_register_relation(ecs_t* ecs, u32 rl_index, u32 max_pairs);
+        bool g_add_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target);                     // false when the relation is full
+        void g_rem_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target);
+        bool g_has_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target);
+        u32  g_add_pair(ecs_t* ecs, entity_t const* entities, u32 count, u32 rl_index, entity_t target); // Returns the number of entities that have the pair
+        void g_rem_pair(ecs_t* ecs, entity_t const* entities, u32 count, u32 rl_index, entity_t target);
+        u32  g_get_targets(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t* out, u32 max_out);       // Returns the number of targets
+        u32  g_query_pair(ecs_t* ecs, entity_t reference, u32 rl_index, entity_t target, entity_t* out, u32 max_out);
+
+        template <typename R> bool g_register_relation(ecs_t* ecs, u32 max_pairs) { return g_register_relation(ecs, R::ECS3_RELATION_INDEX, max_pairs); }
+        template <typename R> bool g_add_pair(ecs_t* ecs, entity_t entity, entity_t target) { return g_add_pair(ecs, entity, R::ECS3_RELATION_INDEX, target); }
+        template <typename R> void g_rem_pair(ecs_t* ecs, entity_t entity, entity_t target) { g_rem_pair(ecs, entity, R::ECS3_RELATION_INDEX, target); }
+        template <typename R> bool g_has_pair(ecs_t* ecs, entity_t entity, entity_t target) { return g_has_pair(ecs, entity, R::ECS3_RELATION_INDEX, target); }
+        template <typename R> u32  g_get_targets(ecs_t* ecs, entity_t entity, entity_t* out, u32 max_out) { return g_get_targets(ecs, entity, R::ECS3_RELATION_INDEX, out, max_out); }
+        template <typename R> u32  g_query_pair(ecs_t* ecs, entity_t reference, entity_t target, entity_t* out, u32 max_out) { return g_query_pair(ecs, reference, R::ECS3_RELATION_INDEX, target, out, max_out); }
+
+        // Cardinality
+        // g_count returns the exact number of entities that match the reference entity (see en_iterator_t), it only visits the
+        // entities of the smallest component container of the reference. ECS_ENTITY_NULL counts all awake entities.
+        // g_count_estimate is O(1) and returns an upper bound, it is exact when the reference only has a single component.
+        u32 g_count(ecs_t* ecs, entity_t reference);
+        u32 g_count_estimate(ecs_t* ecs, entity_t reference);
+
+        // Select / Sample
+        // The component containers are dense, the k-th entity that has a component is found in O(1). This can be used to split
+        // work into parts with an equal number of entities, or to pick a random entity. g_sample returns a uniformly random
+        // awake entity that matches the reference entity (see en_iterator_t), the reference needs to have at least one component.
+        entity_t g_select(ecs_t* ecs, u32 cp_index, u32 k);
+        entity_t g_sample(ecs_t* ecs, entity_t reference, u32 random);
+
+        // Storage order
+        // A component container is dense and stored in the order in which the components were added, the reductions, folds
+        // and g_select follow that order. g_sort_storage permutes the container by a user key (e.g. material/mesh for the
+        // renderer, island for physics), the entities keep their identifier. The sort is stable. For data that is nearly
+        // sorted from one frame to the next, 'max_moves' bounds the work (an insertion sort), calling it every frame converges
+        // to the sorted order. Returns the number of components that changed slot.
+        typedef u64 (*sort_key_fn)(ecs_t* ecs, entity_t e, void* user);
+
+        u32 g_sort_storage(ecs_t* ecs, u32 cp_index, sort_key_fn key_fn, void* user, u32 max_moves = 0xFFFFFFFF);
+
+        // Hierarchy
+        // An entity can have a parent, the entities that have a parent or children are in the hierarchy. g_set_parent moves
+        // an entity with its whole subtree (O(subtree)) and refuses a parent that would create a cycle or that would put an
+        // entity of the subtree at a depth of ECS3_HIERARCHY_MAX_DEPTH or more, ECS_ENTITY_NULL detaches the entity.
+        // g_destroy_entity detaches the children of an entity, g_destroy_subtree destroys an entity together with all of
+        // its descendants and returns the number of destroyed entities.
+        // For propagation (e.g. world transforms) the hierarchy is flattened into levels: level 0 are the roots and level d
+        // the entities at depth d. Within a level the children of a parent are contiguous and in the order of their parents
+        // in the level above, each entity knows the position of its parent in the flattened order. g_sort_by_hierarchy sorts
+        // a component container into the flattened order: when every entity in the hierarchy has the component, the
+        // component at position p is in slot p, so propagation is one linear pass per level and the entities of a level can
+        // be split over threads, e.g.:
+        //     g_sort_by_hierarchy(ecs, transform_t::ECS3_COMPONENT_INDEX);
+        //     hierarchy_level_t level;
+        //     for (u32 d = 1; g_hierarchy_level(ecs, d, level); ++d)
+        //         for (u32 i = 0; i < level.m_count; ++i)
+        //             world[level.m_begin + i] = world[level.m_parents[i]] * local[level.m_begin + i];
+        // The flattened order is rebuilt when the hierarchy has changed, a level is valid until the next change.
+        const u32 ECS3_HIERARCHY_MAX_DEPTH = 32;
+
+        struct hierarchy_level_t
+        {
+            u32             m_begin;    // position of the first entity of the level in the flattened order
+            u32             m_count;    // number of entities in the level
+            entity_t const* m_entities; // the entities of the level
+            u32 const*      m_parents;  // per entity, the position of its parent in the flattened order
+        };
+
+        bool     g_set_parent(ecs_t* ecs, entity_t child, entity_t parent);               // false for a cycle or a hierarchy that is too deep
+        entity_t g_get_parent(ecs_t* ecs, entity_t child);                                // ECS_ENTITY_NULL when the entity has no parent
+        u32      g_get_depth(ecs_t* ecs, entity_t e);                                     // 0 for a root or an entity that is not in the hierarchy
+        u32      g_get_children(ecs_t* ecs, entity_t parent, entity_t* out, u32 max_out); // Returns the number of children
+        u32      g_destroy_subtree(ecs_t* ecs, entity_t root);
+        u32      g_hierarchy_levels(ecs_t* ecs);                                          // Number of levels
+        bool     g_hierarchy_level(ecs_t* ecs, u32 depth, hierarchy_level_t& level);      // false when there is no such level
+        u32      g_sort_by_hierarchy(ecs_t* ecs, u32 cp_index);
+
+        // Spatial locality
+        // Sort a component container by the Morton (Z-order) code of the position of its entities, so that entities that are
+        // close in space are close in memory (collision pairs, flocking, area damage). The position component is read as 3
+        // consecutive f32 (x, y, z) at the start of the component and quantized to cells of 'cell_size', 21 bits per axis
+        // around the origin. Sort the position container itself and the containers that are visited together with it, the
+        // entities without a position are placed at the end. 'max_moves' is the per call move budget (see g_sort_storage).
+        u32 g_sort_spatial(ecs_t* ecs, u32 cp_index, u32 position_cp_index, f32 cell_size, u32 max_moves = 0xFFFFFFFF);
+
+        // Spatial grid
+        // An optional hashed uniform grid over a position component (3 consecutive f32 x, y, z at the start of the component).
+        // The grid does not track changes by itself: call g_grid_update when an entity has moved or got the position
+        // component, g_grid_remove before destroying an entity and g_grid_update_all to (re)build it from the position
+        // container. Entities that lost the position are skipped. The queries return entities in bulk, 'reference' is an entity
+        // (see en_iterator_t) whose components and tags the entities also need to have (ECS_ENTITY_NULL = no filter).
+        // Box and radius queries write at most 'max_out' entities and return the number written, g_grid_query_nearest
+        // writes the 'k' nearest entities sorted by distance. 'num_buckets' needs to be a power of 2.
+        struct grid_t;
+
+        grid_t* g_create_grid(ecs_t* ecs, u32 position_cp_index, f32 cell_size, u32 num_buckets = 4096);
+        void    g_destroy_grid(grid_t* grid);
+        void    g_grid_update(grid_t* grid, entity_t e);
+        void    g_grid_remove(grid_t* grid, entity_t e);
+        void    g_grid_update_all(grid_t* grid);
+        u32     g_grid_count(grid_t const* grid);
+        u32     g_grid_query_box(grid_t* grid, entity_t reference, f32 const* min, f32 const* max, entity_t* out, u32 max_out);
+        u32     g_grid_query_radius(grid_t* grid, entity_t reference, f32 const* center, f32 radius, entity_t* out, u32 max_out);
+        u32     g_grid_query_nearest(grid_t* grid, entity_t reference, f32 const* center, u32 k, entity_t* out);
+
+        // Secondary indexes
+        // An optional index over a key of a component, the key is extracted from the component by a user function (e.g. the
+        // id of a player or the team of a unit). A hash index answers equality probes, an ordered index also answers range
+        // probes (its sorted order is rebuilt by the first range probe after a change). Like the grid, an index does not
+        // track changes by itself: call g_index_update after writing the key of an entity or adding the component,
+        // g_index_remove before destroying an entity and g_index_update_all to (re)build it from the component container.
+        // Entities that lost the component are skipped. A probe writes at most 'max_out' entities that also match the
+        // reference entity (see en_iterator_t, ECS_ENTITY_NULL = no filter) and returns the number of matching entities,
+        // so that a query can start from a probe instead of a scan, e.g. all the units of team 3 that are enemies:
+        //     u32 n = g_index_find(team_index, enemy_reference, 3, units, max_units);
+        // 'num_buckets' needs to be a power of 2.
+        enum eindex_t
+        {
+            INDEX_HASH    = 0,
+            INDEX_ORDERED = 1,
+        };
+
+        typedef u64 (*index_key_fn)(void const* component, void* user);
+
+        struct value_index_t;
+
+        value_index_t* g_create_index(ecs_t* ecs, u32 cp_index, index_key_fn key_fn, void* user, eindex_t kind, u32 num_buckets = 4096);
+        void           g_destroy_index(value_index_t* index);
+        void           g_index_update(value_index_t* index, entity_t e);
+        void           g_index_remove(value_index_t* index, entity_t e);
+        void           g_index_update_all(value_index_t* index);
+        u32            g_index_count(value_index_t const* index);
+        u32            g_index_find(value_index_t* index, entity_t reference, u64 key, entity_t* out, u32 max_out);
+        u32            g_index_range(value_index_t* index, entity_t reference, u64 min_key, u64 max_key, entity_t* out, u32 max_out); // Ordered index, keys in [min_key, max_key]
+
+        // Reductions
+        // Reduce a component over all entities that match the reference entity (see en_iterator_t), ECS_ENTITY_NULL means
+        // all entities that have the component. The component is seen as 'num_lanes' consecutive f32 (or s32) values and
+        // each lane is reduced on its own, e.g. the world AABB of all positions:
+        //     g_reduce_f32(ecs, ECS_ENTITY_NULL, position_t::ECS3_COMPONENT_INDEX, REDUCE_MIN, aabb_min, 3);
+        //     g_reduce_f32(ecs, ECS_ENTITY_NULL, position_t::ECS3_COMPONENT_INDEX, REDUCE_MAX, aabb_max, 3);
+        // The return value is the number of components that have been reduced (the count).
+        enum ereduce_t
+        {
+            REDUCE_SUM = 0,
+            REDUCE_MIN = 1,
+            REDUCE_MAX = 2,
+        };
+
+        typedef void (*fold_fn)(void* accumulator, void const* component, void* user);
+
+        u32 g_reduce_f32(ecs_t* ecs, entity_t reference, u32 cp_index, ereduce_t op, f32* out_lanes, u32 num_lanes);
+        u32 g_reduce_s32(ecs_t* ecs, entity_t reference, u32 cp_index, ereduce_t op, s32* out_lanes, u32 num_lanes);
+        u32 g_fold(ecs_t* ecs, entity_t reference, u32 cp_index, fold_fn fn, void* accumulator, void* user);
+
+        // Deterministic parallel reductions
+        // The component container is split into chunks of ECS3_REDUCE_CHUNK_SIZE components, each chunk can be reduced on any
+        // thread into its own partial result. Combining the partials in chunk order gives a result that does not depend on
+        // the number of threads and that is identical to g_reduce_f32/g_reduce_s32.
+        const u32 ECS3_REDUCE_CHUNK_SIZE = 4096;
+
+        u32  g_reduce_num_chunks(ecs_t* ecs, u32 cp_index);
+        u32  g_reduce_chunk_f32(ecs_t* ecs, entity_t reference, u32 cp_index, u32 chunk_index, ereduce_t op, f32* out_lanes, u32 num_lanes);
+        u32  g_reduce_chunk_s32(ecs_t* ecs, entity_t reference, u32 cp_index, u32 chunk_index, ereduce_t op, s32* out_lanes, u32 num_lanes);
+        void g_reduce_combine_f32(ereduce_t op, f32* inout_lanes, f32 const* partial_lanes, u32 num_lanes);
+        void g_reduce_combine_s32(ereduce_t op, s32* inout_lanes, s32 const* partial_lanes, u32 num_lanes);
+
+        template <typename T> u32 g_reduce_f32(ecs_t* ecs, entity_t reference, ereduce_t op, f32* out_lanes) { return g_reduce_f32(ecs, reference, T::ECS3_COMPONENT_INDEX, op, out_lanes, sizeof(T) / sizeof(f32)); }
+        template <typename T> u32 g_reduce_s32(ecs_t* ecs, entity_t reference, ereduce_t op, s32* out_lanes) { return g_reduce_s32(ecs, reference, T::ECS3_COMPONENT_INDEX, op, out_lanes, sizeof(T) / sizeof(s32)); }
+        template <typename T> u32 g_fold(ecs_t* ecs, entity_t reference, fold_fn fn, void* accumulator, void* user) { return g_fold(ecs, reference, T::ECS3_COMPONENT_INDEX, fn, accumulator, user); }
+
         // Iterator
         struct en_iterator_t
         {
@@ -112,16 +410,66 @@ namespace ncore
             //
 
             void        begin() { m_entity_index = find(0); }
+            void        begin(s32 entity_index); // Begin at the first matching entity at or after 'entity_index'
             inline void next() { m_entity_index = m_entity_index >= 0 ? find(m_entity_index + 1) : -1; }
             inline bool end() const { return m_entity_index < 0; }
             entity_t    entity() const;
 
+            inline s32 index() const { return m_entity_index; }
+
+            void        include_sleeping() { m_sleeping = true; } // Also the sleeping entities (see g_sleep)
+            inline bool sleeping() const { return m_sleeping; }
+
+            // Declare the singletons that are accessed, a write is also a read
+            void read_singleton(u32 sg_index);
+            void write_singleton(u32 sg_index);
+
+            template <typename T> void read_singleton() { read_singleton(T::ECS3_SINGLETON_INDEX); }
+            template <typename T> void write_singleton() { write_singleton(T::ECS3_SINGLETON_INDEX); }
+
+            inline u32 singleton_reads() const { return m_sg_read_mask; }
+            inline u32 singleton_writes() const { return m_sg_write_mask; }
+
         private:
             s32 find(s32 entity_index) const;
 
             ecs_t* m_ecs;              // The ECS
             s32    m_entity_reference; // The entity reference that should be searched for
             s32    m_entity_index;     // Current entity index
+            u32    m_sg_read_mask;     // Singletons that are read
+            u32    m_sg_write_mask;    // Singletons that are written
+            bool   m_sleeping;         // Sleeping entities are included
+        };
+
+        // Cursor
+        // A cursor keeps its position in a query so that the matching entities can be processed in slices over multiple
+        // frames, e.g. refreshing the LOD of 1000 entities every frame:
+        //     en_cursor_t cursor(ecs, reference);     // once
+        //     cursor.step(s_refresh_lod, user, 1000); // every frame
+        // A step continues where the previous step stopped and wraps around at the end, but it never visits an entity
+        // twice. Entities that are created or destroyed in between steps are fine, a new entity is visited once the
+        // cursor passes its index. step_until stops when 'clock' reaches 'deadline' (checked every 16 entities), 'clock'
+        // receives the same user pointer as 'fn'.
+        typedef void (*cursor_fn)(ecs_t* ecs, entity_t e, void* user);
+        typedef u64 (*clock_fn)(void* user);
+
+        struct en_cursor_t
+        {
+            en_cursor_t(ecs_t* ecs, entity_t reference);
+
+            u32 step(cursor_fn fn, void* user, u32 max_entities) { return run(fn, user, max_entities, nullptr, 0); }
+            u32 step_until(cursor_fn fn, void* user, clock_fn clock, u64 deadline) { return run(fn, user, 0xFFFFFFFF, clock, deadline); }
+
+            inline void reset() { m_position = 0; }
+            inline u32  laps() const { return m_laps; } // Number of times the cursor reached the end
+
+        private:
+            u32 run(cursor_fn fn, void* user, u32 max_entities, clock_fn clock, u64 deadline);
+
+            ecs_t*        m_ecs;      //
+            en_iterator_t m_iter;     //
+            s32           m_position; // Entity index to continue from
+            u32           m_laps;     //
         };
     } // namespace necs3
 } // namespace ncore
@@ -14,10 +14,12 @@ namespace ncore
     namespace necs4
     {
         // ECS Version 4, an Entity-Component-System (ECS) implementation.
-        // Entity identifier {generation(8) + archetype(8) + index(16)}
+        // Entity identifier {index-high(8) + archetype(8) + index-low(16)}
 
         typedef u32 entity_t;
 
+        const u32 ECS_ENTITY_NULL = (0xFFFFFFFF); // Null entity
+
         struct ecs_t;
         struct archetype_t;
 
@@ -31,6 +33,16 @@ namespace ncore
     {                       \
         ECS4_TAG_INDEX = N  \
     }
+#define DECLARE_ECS4_SINGLETON(N) \
+    enum                          \
+    {                             \
+        ECS4_SINGLETON_INDEX = N  \
+    }
+#define DECLARE_ECS4_RELATION(N) \
+    enum                         \
+    {                            \
+        ECS4_RELATION_INDEX = N  \
+    }
 
         // Create and Destroy ECS
         ecs_t* g_create_ecs(u8 max_archetypes = 128);
@@ -42,18 +54,184 @@ namespace ncore
         //       the archetype, so we can only track up to 64 components per archetype.
         // Note: At the global level you can have a maximum of 256 tags, and the number of tags for each entity in an archetype
         //       can be 8, 16 or 32.
-        void g_register_archetype(ecs_t* ecs, u8 archetype_index, u8 max_cps_per_entity = 16, u16 max_global_cp_types = 256, u8 max_tags_per_entity = 8, u16 max_global_tag_types = 32);
+        // Note: An archetype holds by default a maximum of 65536 entities, by giving a larger 'max_entities' (up to 16M) the
+        //       archetype becomes 'wide', it then uses 32-bit component references and bins, iteration stays a single pass.
+        void g_register_archetype(ecs_t* ecs, u8 archetype_index, u8 max_cps_per_entity = 16, u16 max_global_cp_types = 256, u8 max_tags_per_entity = 8, u16 max_global_tag_types = 32, u32 max_entities = 65536);
 
         // Create and Destroy Entity
         entity_t g_create_entity(ecs_t* ecs, u8 archetype_index = 0);
         void     g_destroy_entity(ecs_t* ecs, entity_t e);
 
+        // Migration
+        // Move an entity to another archetype, the components that the destination archetype has registered are copied, the
+        // others are freed. The tags are carried over. Returns the new entity or ECS_ENTITY_NULL when the destination archetype
+        // is full (the entity is then left untouched). g_move_entities moves the entities one by one, it updates the handles of
+        // the moved entities in place (the others keep their handle) and returns the number of entities that were moved.
+        // A stale entity can be redirected with g_remap_entity, it returns ECS_ENTITY_NULL for an entity that was destroyed.
+        // Note: Entities do not have a generation, once the index of a moved entity is re-used by a new entity the stale
+        //       entity refers to that new entity.
+        entity_t g_move_entity(ecs_t* ecs, entity_t e, u8 dst_archetype_index);
+        u32      g_move_entities(ecs_t* ecs, entity_t* entities, u32 count, u8 dst_archetype_index);
+        entity_t g_remap_entity(ecs_t* ecs, entity_t e);
+
+        // Storage order
+        // Entities are iterated in entity index order, but a component is stored in the slot that its bin handed out when it
+        // was added. g_sort_storage reorders the alive entities of an archetype by a user key (e.g. material/mesh for the
+        // renderer, island for physics) and then lays out every component bin in entity order, so that iterating the
+        // archetype follows the key and walks component memory front to back. Without a key function only the components
+        // are laid out in entity order (defragment), the entities keep their index.
+        // Sorting changes the index of entities, 'moved_fn' is called for every entity that moved with its old and its new
+        // identifier so that references can be fixed up. The sort is stable. For data that is nearly sorted from one frame to
+        // the next, 'max_moves' bounds the work (an insertion sort), calling it every frame converges to the sorted order.
+        // Returns the number of entities that changed index.
+        typedef u64 (*sort_key_fn)(ecs_t* ecs, entity_t e, void* user);
+        typedef void (*sort_moved_fn)(entity_t from, entity_t to, void* user);
+
+        u32 g_sort_storage(ecs_t* ecs, u8 archetype_index, sort_key_fn key_fn, sort_moved_fn moved_fn, void* user, u32 max_moves = 0xFFFFFFFF);
+
+        // Hierarchy
+        // An entity can have a parent in its own archetype, the entities that have a parent or children are in the hierarchy
+        // of the archetype. g_set_parent moves an entity with its whole subtree (O(subtree)) and refuses a parent of another
+        // archetype, a parent that would create a cycle or one that would put an entity of the subtree at a depth of
+        // ECS4_HIERARCHY_MAX_DEPTH or more, ECS_ENTITY_NULL detaches the entity. Destroying an entity or moving it to another
+        // archetype detaches its children, g_destroy_subtree destroys an entity together with all of its descendants and
+        // returns the number of destroyed entities.
+        // For propagation (e.g. world transforms) the hierarchy is flattened into levels: level 0 are the roots and level d
+        // the entities at depth d. Within a level the children of a parent are contiguous and in the order of their parents
+        // in the level above, each entity knows the position of its parent in the flattened order. g_sort_by_hierarchy sorts
+        // the storage of the archetype into the flattened order (see g_sort_storage, the entities that are not in the
+        // hierarchy go to the end), the entity indices and the component bins then follow the flattened order so that
+        // propagation walks component memory front to back one level at a time and the entities of a level can be split
+        // over threads, e.g.:
+        //     g_sort_by_hierarchy(ecs, archetype_index, s_fix_handles, user);
+        //     hierarchy_level_t level;
+        //     for (u32 d = 1; g_hierarchy_level(ecs, archetype_index, d, level); ++d)
+        //         for (u32 i = 0; i < level.m_count; ++i)
+        //         {
+        //             transform_t const* parent = g_get_cp<transform_t>(ecs, level.m_order[level.m_parents[i]]);
+        //             transform_t*       t      = g_get_cp<transform_t>(ecs, level.m_entities[i]);
+        //             t->world                  = parent->world * t->local;
+        //         }
+        // The flattened order is rebuilt when the hierarchy has changed (sorting the storage also changes it), a level is
+        // valid until the next change.
+        const u32 ECS4_HIERARCHY_MAX_DEPTH = 32;
+
+        struct hierarchy_level_t
+        {
+            u32             m_begin;    // position of the first entity of the level in the flattened order
+            u32             m_count;    // number of entities in the level
+            entity_t const* m_entities; // the entities of the level
+            u32 const*      m_parents;  // per entity, the position of its parent in the flattened order
+            entity_t const* m_order;    // the flattened order, the parent of m_entities[i] is m_order[m_parents[i]]
+        };
+
+        bool     g_set_parent(ecs_t* ecs, entity_t child, entity_t parent);                              // false for another archetype, a cycle or a hierarchy that is too deep
+        entity_t g_get_parent(ecs_t* ecs, entity_t child);                                               // ECS_ENTITY_NULL when the entity has no parent
+        u32      g_get_depth(ecs_t* ecs, entity_t e);                                                    // 0 for a root or an entity that is not in the hierarchy
+        u32      g_get_children(ecs_t* ecs, entity_t parent, entity_t* out, u32 max_out);                // Returns the number of children
+        u32      g_destroy_subtree(ecs_t* ecs, entity_t root);
+        u32      g_hierarchy_levels(ecs_t* ecs, u8 archetype_index);                                     // Number of levels
+        bool     g_hierarchy_level(ecs_t* ecs, u8 archetype_index, u32 depth, hierarchy_level_t& level); // false when there is no such level
+        u32      g_sort_by_hierarchy(ecs_t* ecs, u8 archetype_index, sort_moved_fn moved_fn, void* user, u32 max_moves = 0xFFFFFFFF);
+
+        // Spatial locality
+        // Sort the storage of an archetype by the Morton (Z-order) code of a position component, so that entities that are close
+        // in space are close in memory (collision pairs, flocking, area damage). The position is read as 3 consecutive f32
+        // (x, y, z) at the start of the component and quantized to cells of 'cell_size', 21 bits per axis around the origin.
+        // Entities without the position component are placed at the end. See g_sort_storage for 'moved_fn' and 'max_moves',
+        // a typical use is a full sort after loading a level and a small move budget every frame after that:
+        //     g_sort_spatial(ecs, archetype_index, position_t::ECS4_COMPONENT_INDEX, 4.0f, s_fix_handles, user, 256);
+        u32 g_sort_spatial(ecs_t* ecs, u8 archetype_index, u32 position_cp_index, f32 cell_size, sort_moved_fn moved_fn, void* user, u32 max_moves = 0xFFFFFFFF);
+
+        // Spatial grid
+        // An optional hashed uniform grid over a position component (3 consecutive f32 x, y, z at the start of the component)
+        // of the entities of an archetype. The grid does not track changes by itself: call g_grid_update when an entity has
+        // moved or got the position component, g_grid_remove before destroying an entity and g_grid_update_all after the
+        // storage has been sorted (see g_sort_storage). The queries return entities in bulk, 'filter' is an iterator of the
+        // same archetype that the entities also have to match (nullptr = no filter), e.g. the enemies within 20 meters:
+        //     en_iterator_t enemies(ecs, archetype_index);
+        //     enemies.mark_tag<enemy_tag_t>();
+        //     u32 const n = g_grid_query_radius(grid, &enemies, center, 20.0f, out, max_out);
+        // Box and radius queries write at most 'max_out' entities and return the number written, g_grid_query_nearest
+        // writes the 'k' nearest entities sorted by distance. 'num_buckets' needs to be a power of 2.
+        struct grid_t;
+        struct en_iterator_t;
+
+        grid_t* g_create_grid(ecs_t* ecs, u8 archetype_index, u32 position_cp_index, f32 cell_size, u32 num_buckets = 4096);
+        void    g_destroy_grid(grid_t* grid);
+        void    g_grid_update(grid_t* grid, entity_t e);
+        void    g_grid_remove(grid_t* grid, entity_t e);
+        void    g_grid_update_all(grid_t* grid);
+        u32     g_grid_count(grid_t const* grid);
+        u32     g_grid_query_box(grid_t* grid, en_iterator_t const* filter, f32 const* min, f32 const* max, entity_t* out, u32 max_out);
+        u32     g_grid_query_radius(grid_t* grid, en_iterator_t const* filter, f32 const* center, f32 radius, entity_t* out, u32 max_out);
+        u32     g_grid_query_nearest(grid_t* grid, en_iterator_t const* filter, f32 const* center, u32 k, entity_t* out);
+
+        // Secondary indexes
+        // An optional index over a key of a component of the entities of an archetype, the key is extracted from the
+        // component by a user function (e.g. the id of a player or the team of a unit). A hash index answers equality
+        // probes, an ordered index also answers range probes (its sorted order is rebuilt by the first range probe after a
+        // change). Like the grid, an index does not track changes by itself: call g_index_update after writing the key of
+        // an entity or adding the component, g_index_remove before destroying an entity and g_index_update_all after the
+        // storage has been sorted. A probe writes at most 'max_out' entities that also match 'filter' (nullptr = no filter)
+        // and returns the number of matching entities, so that a query can start from a probe instead of a scan, e.g.:
+        //     u32 const n = g_index_find(team_index, &enemies, 3, units, max_units);
+        // 'num_buckets' needs to be a power of 2.
+        enum eindex_t
+        {
+            INDEX_HASH    = 0,
+            INDEX_ORDERED = 1,
+        };
+
+        typedef u64 (*index_key_fn)(void const* component, void* user);
+
+        struct value_index_t;
+
+        value_index_t* g_create_index(ecs_t* ecs, u8 archetype_index, u32 cp_index, index_key_fn key_fn, void* user, eindex_t kind, u32 num_buckets = 4096);
+        void           g_destroy_index(value_index_t* index);
+        void           g_index_update(value_index_t* index, entity_t e);
+        void           g_index_remove(value_index_t* index, entity_t e);
+        void           g_index_update_all(value_index_t* index);
+        u32            g_index_count(value_index_t const* index);
+        u32            g_index_find(value_index_t* index, en_iterator_t const* filter, u64 key, entity_t* out, u32 max_out);
+        u32            g_index_range(value_index_t* index, en_iterator_t const* filter, u64 min_key, u64 max_key, entity_t* out, u32 max_out); // Ordered index, keys in [min_key, max_key]
+
+        // Prefabs
+        // Any entity can be used as a prefab, g_instantiate creates 'count' instances of it in an archetype with a copy of
+        // its components and tags. The components are allocated bin by bin and filled with large copies, the occupancy and
+        // tags are written with one store per instance. The components that the archetype has not registered are skipped,
+        // like g_move_entity. Keeping the prefabs in an archetype of their own keeps them out of the game queries, e.g.:
+        //     entity_t soldiers[500];
+        //     g_instantiate(ecs, soldier_prefab, ARCHETYPE_UNITS, soldiers, 500);
+        // Returns the number of instances created, less than 'count' when the archetype is full.
+        u32 g_instantiate(ecs_t* ecs, entity_t prefab, u8 archetype_index, entity_t* out, u32 count);
+
         // Components
-        void                       g_register_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof);
-        template <typename T> void g_register_component_type(ecs_t* ecs, u8 archetype_index) { g_register_component_type(ecs, archetype_index, T::ECS4_COMPONENT_INDEX, sizeof(T)); }
+        // A component is stored at a stride of its size padded to its alignment (at most ECS4_MAX_ALIGNMENT) and every
+        // component bin starts on a page, so aligned SIMD loads and stores over the components are safe.
+        const u32                  ECS4_MAX_ALIGNMENT = 64;
+        void                       g_register_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 cp_alignof = 8);
+        template <typename T> void g_register_component_type(ecs_t* ecs, u8 archetype_index) { g_register_component_type(ecs, archetype_index, T::ECS4_COMPONENT_INDEX, sizeof(T), alignof(T)); }
 
-        void                       g_register_tag_type(ecs_t* ecs, u8 archetype_index, u16 tg_index);
-        template <typename T> void g_register_tag_type(ecs_t* ecs, u8 archetype_index) { g_register_tag_type(ecs, archetype_index, T::ECS4_TAG_INDEX); }
+        // Singletons
+        // A singleton exists once per ECS (e.g. time, input, camera or physics settings) and does not belong to an archetype.
+        // The singletons are stored in a flat table, g_get_singleton is a single pointer load and the pointer stays valid
+        // until the ECS is destroyed. A query declares the singletons it reads and writes (see en_iterator_t) so that the
+        // access of queries can be compared, together with cp_mask() and tag_mask().
+        const u32 ECS4_MAX_SINGLETONS = 32;
+
+        bool  g_register_singleton(ecs_t* ecs, u32 sg_index, u32 sg_sizeof);
+        void* g_get_singleton(ecs_t* ecs, u32 sg_index);
+
+        template <typename T> bool g_register_singleton(ecs_t* ecs) { return g_register_singleton(ecs, T::ECS4_SINGLETON_INDEX, sizeof(T)); }
+        template <typename T> T*   g_get_singleton(ecs_t* ecs) { return (T*)g_get_singleton(ecs, T::ECS4_SINGLETON_INDEX); }
+
+        // Tags
+        // Note: A tag can have a 'tag column', a bitset over all the entities of the archetype that is kept in sync with the
+        //       tag bits of each entity. Queries that mark such a tag scan the column 64 entities at a time, use this for
+        //       tags that are rarely set (e.g. dirty_tag_t). A tag column costs 1 bit per entity (max_entities / 8 bytes).
+        void                       g_register_tag_type(ecs_t* ecs, u8 archetype_index, u16 tg_index, bool tag_column = false);
+        template <typename T> void g_register_tag_type(ecs_t* ecs, u8 archetype_index, bool tag_column = false) { g_register_tag_type(ecs, archetype_index, T::ECS4_TAG_INDEX, tag_column); }
 
         bool  g_has_cp(ecs_t* ecs, entity_t entity, u32 cp_index);
         void* g_add_cp(ecs_t* ecs, entity_t entity, u32 cp_index);
@@ -65,6 +243,86 @@ namespace ncore
         template <typename T> void g_rem_cp(ecs_t* ecs, entity_t entity) { g_rem_cp(ecs, entity, T::ECS4_COMPONENT_INDEX); }
         template <typename T> T*   g_get_cp(ecs_t* ecs, entity_t entity) { return (T*)g_get_cp(ecs, entity, T::ECS4_COMPONENT_INDEX); }
 
+        // Shared components
+        // A shared component stores each unique value once in a pool that belongs to the ECS, the pool is deduplicated by
+        // hash and reference counted, and every entity only stores the (u32) index of its value. Use it for values that
+        // many entities have in common, e.g. team settings, a mesh + material pair or AI tuning parameters. An archetype
+        // registers the component as shared, the pool of a component type is used by all the archetypes that do so.
+        // g_set_shared_cp gives an entity a value, g_get_cp returns the value of the entity. A value is read-only, changing
+        // it means setting another value. g_add_cp cannot be used, g_rem_cp and destroying the entity release the value.
+        // Entities can be processed one value at a time, e.g. to bind a material once for all the entities that use it:
+        //     for (u32 v = 0; v < g_shared_value_end(ecs, material_t::ECS4_COMPONENT_INDEX); ++v)
+        //     {
+        //         material_t const* material = (material_t const*)g_get_shared_value(ecs, material_t::ECS4_COMPONENT_INDEX, v);
+        //         if (material == nullptr)
+        //             continue;
+        //         en_iterator_t iter(ecs, archetype_index);
+        //         iter.mark_shared<material_t>(v);
+        //         for (iter.begin(); !iter.end(); iter.next()) { ... }
+        //     }
+        // Sorting the storage by the value index (see g_sort_storage) makes the entities of each value contiguous.
+        const u32 ECS4_SHARED_NONE = 0xFFFFFFFF;
+
+        void        g_register_shared_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 cp_alignof = 8, u32 max_values = 4096);
+        void const* g_set_shared_cp(ecs_t* ecs, entity_t entity, u32 cp_index, void const* value); // nullptr when the pool is full
+        u32         g_get_shared_index(ecs_t* ecs, entity_t entity, u32 cp_index);                 // ECS4_SHARED_NONE when the entity does not have the component
+        void const* g_get_shared_value(ecs_t* ecs, u32 cp_index, u32 value_index);                 // nullptr when the index is not in use
+        u32         g_shared_value_count(ecs_t* ecs, u32 cp_index);                                // Number of unique values in use
+        u32         g_shared_value_end(ecs_t* ecs, u32 cp_index);                                  // Value indices are below this
+
+        template <typename T> void     g_register_shared_component_type(ecs_t* ecs, u8 archetype_index, u32 max_values = 4096) { g_register_shared_component_type(ecs, archetype_index, T::ECS4_COMPONENT_INDEX, sizeof(T), alignof(T), max_values); }
+        template <typename T> T const* g_set_shared_cp(ecs_t* ecs, entity_t entity, T const& value) { return (T const*)g_set_shared_cp(ecs, entity, T::ECS4_COMPONENT_INDEX, &value); }
+
+        // Cold components
+        // A cold component is kept out of the hot path of the archetype: it does not take a bit of the per entity occupancy,
+        // a slot in the per entity reference row or a bin, so the rows that every query walks stay small. Use it for data
+        // that is rarely accessed, e.g. spawn parameters, a debug name or save game state. The components of a cold type
+        // are stored densely in a store of their own (max 16 per archetype), in reserved memory that is only committed
+        // as the store grows. g_add_cp, g_get_cp, g_has_cp and g_rem_cp work as usual, but a pointer to a cold component
+        // is only valid until the next cold component of that type is removed, and an iterator cannot mark a cold type.
+        void                       g_register_cold_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 cp_alignof = 8);
+        u32                        g_cold_count(ecs_t* ecs, u8 archetype_index, u16 cp_index); // Number of entities that have the cold component
+        template <typename T> void g_register_cold_component_type(ecs_t* ecs, u8 archetype_index) { g_register_cold_component_type(ecs, archetype_index, T::ECS4_COMPONENT_INDEX, sizeof(T), alignof(T)); }
+        template <typename T> u32  g_cold_count(ecs_t* ecs, u8 archetype_index) { return g_cold_count(ecs, archetype_index, T::ECS4_COMPONENT_INDEX); }
+
+        // Compressed components
+        // A compressed component is a cold component of which the values are kept in blocks of 64 that are encoded (byte
+        // planes, delta and zero run length coding), use it for large components that are rarely accessed, e.g. save state
+        // or history. A block is decoded into a small LRU cache when one of its values is accessed and encoded again when
+        // a changed block leaves the cache. A pointer to a compressed component is only valid until another block of the
+        // component is accessed. g_compressed_stats writes back the cache and reports the memory of the encoded blocks.
+        const u32 ECS4_COMPRESSED_BLOCK_SIZE   = 64;
+        const u32 ECS4_COMPRESSED_CACHE_BLOCKS = 4;
+
+        struct compressed_stats_t
+        {
+            u64 m_raw_bytes;        // size of the values when they are not compressed
+            u64 m_compressed_bytes; // size of the encoded blocks
+            u64 m_cache_bytes;      // size of the decoded blocks in the cache
+            f32 m_ratio;            // raw / compressed, 0 when nothing is encoded
+        };
+
+        void                       g_register_compressed_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 cp_alignof = 8);
+        bool                       g_compressed_stats(ecs_t* ecs, u8 archetype_index, u16 cp_index, compressed_stats_t& stats);
+        template <typename T> void g_register_compressed_component_type(ecs_t* ecs, u8 archetype_index) { g_register_compressed_component_type(ecs, archetype_index, T::ECS4_COMPONENT_INDEX, sizeof(T), alignof(T)); }
+        template <typename T> bool g_compressed_stats(ecs_t* ecs, u8 archetype_index, compressed_stats_t& stats) { return g_compressed_stats(ecs, archetype_index, T::ECS4_COMPONENT_INDEX, stats); }
+
+        // Split (SoA) components
+        // A split component is made of scalar fields of the same size (e.g. position_t {f32 x, y, z}) and each field is
+        // stored in its own column, so that a kernel can run over x, y and z as plain arrays without shuffles. The bin of
+        // the component still hands out the slots, slot k of every column belongs to the entity that has slot k, and a
+        // column is 64 byte aligned. g_get_column returns 'count' slots, the slots that no entity uses (holes left by
+        // removed components) hold stale values that a kernel may read and write. After g_sort_storage the k-th entity
+        // that has the component has the k-th used slot, so the columns are in entity order. g_get_cp gathers the fields
+        // into a staging copy that is written back when another entity of the component is accessed, so a pointer from
+        // g_get_cp is only valid until the next access to the component in the archetype. g_get_column writes back the
+        // staging copy (get the columns again after g_get_cp), the columns do not move but 'count' grows as slots are
+        // handed out. A split component cannot be shared or cold.
+        void                                         g_register_soa_component_type(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 cp_sizeof, u32 field_sizeof = 4);
+        void*                                        g_get_column(ecs_t* ecs, u8 archetype_index, u16 cp_index, u32 field_index, u32& count); // nullptr when the component is not split
+        template <typename T, typename F = f32> void g_register_soa_component_type(ecs_t* ecs, u8 archetype_index) { g_register_soa_component_type(ecs, archetype_index, T::ECS4_COMPONENT_INDEX, sizeof(T), sizeof(F)); }
+        template <typename T, typename F = f32> F*   g_get_column(ecs_t* ecs, u8 archetype_index, u32 field_index, u32& count) { return (F*)g_get_column(ecs, archetype_index, T::ECS4_COMPONENT_INDEX, field_index, count); }
+
         // Tags
         bool g_has_tag(ecs_t* ecs, entity_t entity, u16 tg_index);
         void g_add_tag(ecs_t* ecs, entity_t entity, u16 tg_index);
@@ -74,6 +332,163 @@ namespace ncore
         template <typename T> void g_add_tag(ecs_t* ecs, entity_t entity) { g_add_tag(ecs, entity, (u16)T::ECS4_TAG_INDEX); }
         template <typename T> void g_rem_tag(ecs_t* ecs, entity_t entity) { g_rem_tag(ecs, entity, (u16)T::ECS4_TAG_INDEX); }
 
+        // Bulk tags
+        // g_set_tag_all sets the tag on every entity that matches the query and returns the number of entities, g_clear_tag_all
+        // removes the tag from every entity in the archetype. The entity array versions of g_add_tag and g_rem_tag expect
+        // alive entities, they can be of different archetypes.
+        u32  g_set_tag_all(ecs_t* ecs, en_iterator_t const& query, u16 tg_index);
+        void g_clear_tag_all(ecs_t* ecs, u8 archetype_index, u16 tg_index);
+        void g_add_tag(ecs_t* ecs, entity_t const* entities, u32 count, u16 tg_index);
+        void g_rem_tag(ecs_t* ecs, entity_t const* entities, u32 count, u16 tg_index);
+
+        template <typename T> u32  g_set_tag_all(ecs_t* ecs, en_iterator_t const& query) { return g_set_tag_all(ecs, query, (u16)T::ECS4_TAG_INDEX); }
+        template <typename T> void g_clear_tag_all(ecs_t* ecs, u8 archetype_index) { g_clear_tag_all(ecs, archetype_index, (u16)T::ECS4_TAG_INDEX); }
+        template <typename T> void g_add_tag(ecs_t* ecs, entity_t const* entities, u32 count) { g_add_tag(ecs, entities, count, (u16)T::ECS4_TAG_INDEX); }
+        template <typename T> void g_rem_tag(ecs_t* ecs, entity_t const* entities, u32 count) { g_rem_tag(ecs, entities, count, (u16)T::ECS4_TAG_INDEX); }
+
+        // Sleeping entities
+        // An entity can be put to sleep (e.g. an idle NPC out of view, a rigid body that has settled), it keeps its
+        // components and tags but the iterator, g_count, g_set_tag_all, the reductions and g_sample skip it unless the
+        // query calls include_sleeping(). An archetype keeps an 'awake' bitmap next to the alive bitmap once an entity of
+        // it has been put to sleep, the iterator ANDs the two 64 entities at a time. Sleep and wake only flip a bit, the
+        // entity array versions take entities of different archetypes and return the number of entities that changed
+        // state. A new entity is awake, a moved entity keeps its state. g_sort_awake_first groups the awake entities at
+        // the start of the archetype (see g_sort_storage), so that the sleeping ones end up in whole words that are skipped.
+        // The spatial grid, the secondary indexes and g_query_count do not look at the sleep state.
+        void g_sleep(ecs_t* ecs, entity_t e);
+        void g_wake(ecs_t* ecs, entity_t e);
+        u32  g_sleep(ecs_t* ecs, entity_t const* entities, u32 count);
+        u32  g_wake(ecs_t* ecs, entity_t const* entities, u32 count);
+        bool g_is_awake(ecs_t* ecs, entity_t e);
+        u32  g_num_sleeping(ecs_t* ecs, u8 archetype_index);
+        u32  g_sort_awake_first(ecs_t* ecs, u8 archetype_index, sort_moved_fn moved_fn, void* user, u32 max_moves = 0xFFFFFFFF);
+
+        // Scheduled actions
+        // Structural changes that happen at a later tick, e.g. a buff tag that expires, a projectile that times out or a
+        // cooldown that ends, without a timer component that is scanned every frame. The actions are filed in a hierarchical
+        // timing wheel (4 levels of 64 slots) and g_advance_ticks only visits the actions that are due, they are applied as
+        // a batch that is grouped by action and archetype (tags are changed with the entity array versions). The cost of a
+        // tick follows the number of expirations, not the number of timers. An action that is scheduled at a tick that has
+        // passed is due at the next tick. The actions of an entity follow it when it is moved (see g_move_entity) or sorted
+        // (see g_sort_storage) and are cancelled when it is destroyed. The schedule functions return false when the wheel
+        // has not been registered, is full or the entity is not alive, e.g.:
+        //     g_register_timers(ecs, 65536); // once
+        //     g_schedule_rem_tag<burning_tag_t>(ecs, e, g_current_tick(ecs) + 120);
+        //     g_schedule_destroy(ecs, projectile, g_current_tick(ecs) + 300);
+        //     ...
+        //     g_advance_ticks(ecs); // every frame, returns the number of actions applied
+        void g_register_timers(ecs_t* ecs, u32 max_timers);
+        bool g_schedule_add_tag(ecs_t* ecs, entity_t e, u16 tg_index, u64 at_tick);
+        bool g_schedule_rem_tag(ecs_t* ecs, entity_t e, u16 tg_index, u64 at_tick);
+        bool g_schedule_rem_cp(ecs_t* ecs, entity_t e, u32 cp_index, u64 at_tick);
+        bool g_schedule_destroy(ecs_t* ecs, entity_t e, u64 at_tick);
+        u32  g_cancel_schedule(ecs_t* ecs, entity_t e); // Returns the number of actions that were cancelled
+        u32  g_num_scheduled(ecs_t* ecs);
+        u64  g_current_tick(ecs_t* ecs);
+        u32  g_advance_ticks(ecs_t* ecs, u32 num_ticks = 1);
+
+        template <typename T> bool g_schedule_add_tag(ecs_t* ecs, entity_t e, u64 at_tick) { return g_schedule_add_tag(ecs, e, (u16)T::ECS4_TAG_INDEX, at_tick); }
+        template <typename T> bool g_schedule_rem_tag(ecs_t* ecs, entity_t e, u64 at_tick) { return g_schedule_rem_tag(ecs, e, (u16)T::ECS4_TAG_INDEX, at_tick); }
+        template <typename T> bool g_schedule_rem_cp(ecs_t* ecs, entity_t e, u64 at_tick) { return g_schedule_rem_cp(ecs, e, T::ECS4_COMPONENT_INDEX, at_tick); }
+
+        // Relations
+        // A pair (relation, target) attaches a target entity to an entity, e.g. (targets, enemy), (owned_by, player) or
+        // (docked_at, station), the entity and the target can be in different archetypes and an entity can have many pairs
+        // of the same relation. The pairs of a relation are a pool of the ECS that is linked forward (per entity, its
+        // targets) and in reverse (per target, the entities that have a pair with it), an archetype keeps the heads of
+        // these lists per entity (one cache line per entity, allocated by the first pair of an entity of the archetype).
+        // The pairs follow an entity that is moved (see g_move_entity) or sorted (see g_sort_storage), their handles are
+        // updated, and destroying an entity removes its pairs and the pairs that target it in O(number of pairs). The
+        // functions ignore an entity that is not alive, the array versions add or remove the same pair for many entities.
+        // g_query_pair writes the entities that have the pair and match 'filter' (nullptr = no filter, otherwise only the
+        // entities of the archetype of the filter), at most 'max_out' of them, and returns the number of matching entities.
+        const u32 ECS4_MAX_RELATIONS = 8;
+
+        bool g_register_relation(ecs_t* ecs, u32 rl_index, u32 max_pairs);
+        bool g_add_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target);                     // false when the relation is full
+        void g_rem_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target);
+        bool g_has_pair(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t target);
+        u32  g_add_pair(ecs_t* ecs, entity_t const* entities, u32 count, u32 rl_index, entity_t target); // Returns the number of entities that have the pair
+        void g_rem_pair(ecs_t* ecs, entity_t const* entities, u32 count, u32 rl_index, entity_t target);
+        u32  g_get_targets(ecs_t* ecs, entity_t entity, u32 rl_index, entity_t* out, u32 max_out);       // Returns the number of targets
+        u32  g_query_pair(ecs_t* ecs, en_iterator_t const* filter, u32 rl_index, entity_t target, entity_t* out, u32 max_out);
+
+        template <typename R> bool g_register_relation(ecs_t* ecs, u32 max_pairs) { return g_register_relation(ecs, R::ECS4_RELATION_INDEX, max_pairs); }
+        template <typename R> bool g_add_pair(ecs_t* ecs, entity_t entity, entity_t target) { return g_add_pair(ecs, entity, R::ECS4_RELATION_INDEX, target); }
+        template <typename R> void g_rem_pair(ecs_t* ecs, entity_t entity, entity_t target) { g_rem_pair(ecs, entity, R::ECS4_RELATION_INDEX, target); }
+        template <typename R> bool g_has_pair(ecs_t* ecs, entity_t entity, entity_t target) { return g_has_pair(ecs, entity, R::ECS4_RELATION_INDEX, target); }
+        template <typename R> u32  g_get_targets(ecs_t* ecs, entity_t entity, entity_t* out, u32 max_out) { return g_get_targets(ecs, entity, R::ECS4_RELATION_INDEX, out, max_out); }
+        template <typename R> u32  g_query_pair(ecs_t* ecs, en_iterator_t const* filter, entity_t target, entity_t* out, u32 max_out) { return g_query_pair(ecs, filter, R::ECS4_RELATION_INDEX, target, out, max_out); }
+
+        // Cardinality
+        // g_count returns the exact number of entities that match the query without iterating them one by one.
+        // g_count_estimate is O(1) and returns an upper bound, it is exact when the query only marks a single component.
+        u32 g_count(ecs_t* ecs, en_iterator_t const& query);
+        u32 g_count_estimate(ecs_t* ecs, en_iterator_t const& query);
+
+        // Registered queries
+        // A registered query keeps a membership bitmap per archetype that is updated incrementally when components or
+        // tags are added or removed and when entities are created or destroyed. Iterating or counting a registered query
+        // only looks at the members, e.g. for a rare combination of components in a large archetype:
+        //     s32 const q = g_register_query(ecs, query); // once, -1 when all 64 query slots are in use
+        //     en_iterator_t iter(ecs, archetype_index);
+        //     iter.use_query(q);
+        //     for (iter.begin(); !iter.end(); iter.next()) { ... }
+        s32  g_register_query(ecs_t* ecs, en_iterator_t const& query);
+        void g_unregister_query(ecs_t* ecs, u8 archetype_index, s32 query_index);
+        u32  g_query_count(ecs_t* ecs, u8 archetype_index, s32 query_index); // O(1)
+
+        // Rank / Select
+        // Every 512 entities of an archetype keep a prefix popcount of the alive bitmap, it is brought up to date lazily by
+        // the first call after entities have been created or destroyed. Updating is not thread-safe, call g_rank_build
+        // before handing the archetype to multiple threads.
+        // Balanced parallel iteration, every part has the same number of alive entities:
+        //     s32 const begin = g_partition_begin(ecs, archetype_index, part, num_parts);
+        //     s32 const end   = g_partition_begin(ecs, archetype_index, part + 1, num_parts);
+        //     for (iter.begin(begin); !iter.end() && iter.index() < end; iter.next()) { ... }
+        void     g_rank_build(ecs_t* ecs, u8 archetype_index);
+        u32      g_rank(ecs_t* ecs, entity_t e);                                             // Number of alive entities in the archetype before 'e'
+        entity_t g_select(ecs_t* ecs, u8 archetype_index, u32 k);                            // The k-th alive entity, ECS_ENTITY_NULL if there is none
+        s32      g_partition_begin(ecs_t* ecs, u8 archetype_index, u32 part, u32 num_parts); // First entity index of a part
+        entity_t g_sample(ecs_t* ecs, en_iterator_t const& query, u32 random);               // Uniformly random entity that matches the query
+
+        // Reductions
+        // Reduce a component over all entities that match the query (see en_iterator_t). The component is seen as 'num_lanes'
+        // consecutive f32 (or s32) values and each lane is reduced on its own, e.g. the AABB of all positions in an archetype:
+        //     en_iterator_t query(ecs, archetype_index);
+        //     query.mark_cp<position_t>();
+        //     g_reduce_f32(ecs, query, position_t::ECS4_COMPONENT_INDEX, REDUCE_MIN, aabb_min, 3);
+        //     g_reduce_f32(ecs, query, position_t::ECS4_COMPONENT_INDEX, REDUCE_MAX, aabb_max, 3);
+        // The return value is the number of components that have been reduced (the count).
+        enum ereduce_t
+        {
+            REDUCE_SUM = 0,
+            REDUCE_MIN = 1,
+            REDUCE_MAX = 2,
+        };
+
+        typedef void (*fold_fn)(void* accumulator, void const* component, void* user);
+
+        u32 g_reduce_f32(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, ereduce_t op, f32* out_lanes, u32 num_lanes);
+        u32 g_reduce_s32(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, ereduce_t op, s32* out_lanes, u32 num_lanes);
+        u32 g_fold(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, fold_fn fn, void* accumulator, void* user);
+
+        // Deterministic parallel reductions
+        // The entities of the archetype are split into chunks of ECS4_REDUCE_CHUNK_SIZE entities, each chunk can be reduced on
+        // any thread into its own partial result. Combining the partials in chunk order gives a result that does not depend
+        // on the number of threads and that is identical to g_reduce_f32/g_reduce_s32.
+        const u32 ECS4_REDUCE_CHUNK_SIZE = 4096;
+
+        u32  g_reduce_num_chunks(ecs_t* ecs, en_iterator_t const& query);
+        u32  g_reduce_chunk_f32(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, u32 chunk_index, ereduce_t op, f32* out_lanes, u32 num_lanes);
+        u32  g_reduce_chunk_s32(ecs_t* ecs, en_iterator_t const& query, u32 cp_index, u32 chunk_index, ereduce_t op, s32* out_lanes, u32 num_lanes);
+        void g_reduce_combine_f32(ereduce_t op, f32* inout_lanes, f32 const* partial_lanes, u32 num_lanes);
+        void g_reduce_combine_s32(ereduce_t op, s32* inout_lanes, s32 const* partial_lanes, u32 num_lanes);
+
+        template <typename T> u32 g_reduce_f32(ecs_t* ecs, en_iterator_t const& query, ereduce_t op, f32* out_lanes) { return g_reduce_f32(ecs, query, T::ECS4_COMPONENT_INDEX, op, out_lanes, sizeof(T) / sizeof(f32)); }
+        template <typename T> u32 g_reduce_s32(ecs_t* ecs, en_iterator_t const& query, ereduce_t op, s32* out_lanes) { return g_reduce_s32(ecs, query, T::ECS4_COMPONENT_INDEX, op, out_lanes, sizeof(T) / sizeof(s32)); }
+        template <typename T> u32 g_fold(ecs_t* ecs, en_iterator_t const& query, fold_fn fn, void* accumulator, void* user) { return g_fold(ecs, query, T::ECS4_COMPONENT_INDEX, fn, accumulator, user); }
+
         // Iterator (will only iterate over entities in the archetype of the blueprint entity)
         struct en_iterator_t
         {
@@ -85,6 +500,19 @@ namespace ncore
             template <typename T> void mark_cp() { mark_cp(T::ECS4_COMPONENT_INDEX); }
             template <typename T> void mark_tag() { mark_tag(T::ECS4_TAG_INDEX); }
 
+            void use_query(s32 query_index);                 // Iterate the members of a registered query (see g_register_query)
+            void mark_shared(u32 cp_index, u32 value_index); // Only the entities that have this value of a shared component, used by begin/next
+            void include_sleeping() { m_sleeping = true; }   // Also the sleeping entities (see g_sleep)
+
+            template <typename T> void mark_shared(u32 value_index) { mark_shared(T::ECS4_COMPONENT_INDEX, value_index); }
+
+            // Declare the singletons that are accessed, a write is also a read
+            void read_singleton(u32 sg_index);
+            void write_singleton(u32 sg_index);
+
+            template <typename T> void read_singleton() { read_singleton(T::ECS4_SINGLETON_INDEX); }
+            template <typename T> void write_singleton() { write_singleton(T::ECS4_SINGLETON_INDEX); }
+
             // Example:
             //     u8 archetype_index = 0;
             //     en_iterator_t iter(ecs, archetype_index);
@@ -103,10 +531,19 @@ namespace ncore
             //
 
             void        begin();
+            void        begin(s32 entity_index); // Begin at the first matching entity at or after 'entity_index'
             inline void next() { m_entity_index = m_entity_index >= 0 ? find(m_entity_index + 1) : -1; }
             inline bool end() const { return m_entity_index < 0; }
             entity_t    entity() const;
 
+            inline s32  index() const { return m_entity_index; }
+            inline u8   archetype_index() const { return m_archetype_index; }
+            inline u64  cp_mask() const { return m_ref_cp_occupancy; }
+            inline u32  tag_mask() const { return m_ref_tag_occupancy; }
+            inline u32  singleton_reads() const { return m_sg_read_mask; }
+            inline u32  singleton_writes() const { return m_sg_write_mask; }
+            inline bool sleeping() const { return m_sleeping; }
+
         private:
             s32 find(s32 entity_index) const;
 
@@ -115,6 +552,43 @@ namespace ncore
             u64          m_ref_cp_occupancy;  //
             u32          m_ref_tag_occupancy; //
             i32          m_entity_index;      // Current entity index
+            u64 const*   m_members;           // Membership of a registered query, nullptr if none
+            u16          m_shared_local;      // Local index of the shared component of mark_shared, 0xFFFF if none
+            u32          m_shared_value;      // Value index of mark_shared
+            u32          m_sg_read_mask;      // Singletons that are read
+            u32          m_sg_write_mask;     // Singletons that are written
+            bool         m_sleeping;          // Sleeping entities are included
+        };
+
+        // Cursor
+        // A cursor keeps its position in a query so that the matching entities can be processed in slices over multiple
+        // frames, e.g. refreshing the LOD of 1000 entities every frame:
+        //     en_cursor_t cursor(ecs, query);         // once
+        //     cursor.step(s_refresh_lod, user, 1000); // every frame
+        // A step continues where the previous step stopped and wraps around at the end, but it never visits an entity
+        // twice. Entities that are created or destroyed in between steps are fine, a new entity is visited once the
+        // cursor passes its index. step_until stops when 'clock' reaches 'deadline' (checked every 16 entities), 'clock'
+        // receives the same user pointer as 'fn'.
+        typedef void (*cursor_fn)(ecs_t* ecs, entity_t e, void* user);
+        typedef u64 (*clock_fn)(void* user);
+
+        struct en_cursor_t
+        {
+            en_cursor_t(ecs_t* ecs, en_iterator_t const& query);
+
+            u32 step(cursor_fn fn, void* user, u32 max_entities) { return run(fn, user, max_entities, nullptr, 0); }
+            u32 step_until(cursor_fn fn, void* user, clock_fn clock, u64 deadline) { return run(fn, user, 0xFFFFFFFF, clock, deadline); }
+
+            inline void reset() { m_position = 0; }
+            inline u32  laps() const { return m_laps; } // Number of times the cursor reached the end
+
+        private:
+            u32 run(cursor_fn fn, void* user, u32 max_entities, clock_fn clock, u64 deadline);
+
+            ecs_t*        m_ecs;      //
+            en_iterator_t m_iter;     //
+            s32           m_position; // Entity index to continue from
+            u32           m_laps;     //
         };
     } // namespace necs4
 } // namespace ncore
@@ -25,6 +25,12 @@ namespace ncore
         bool at_rest;
     };
 
+    struct game_time_t
+    {
+        f32 delta_time;
+        u32 frame;
+    };
+
 } // namespace ncore
 
 using namespace ncore;
@@ -57,9 +63,9 @@ UNITTEST_SUITE_BEGIN(necs)
         {
             ecs_t* ecs = g_create_ecs(Allocator);
 
-            cp_type_t byte_cp_type     = {-1, sizeof(u8), "byte"};
-            cp_type_t position_cp_type = {-1, sizeof(position_t), "position"};
-            cp_type_t velocity_cp_type = {-1, sizeof(velocity_t), "velocity"};
+            cp_type_t byte_cp_type     = {-1, sizeof(u8), "byte", alignof(u8)};
+            cp_type_t position_cp_type = {-1, sizeof(position_t), "position", alignof(position_t)};
+            cp_type_t velocity_cp_type = {-1, sizeof(velocity_t), "velocity", alignof(velocity_t)};
 
             g_register_component_type(ecs, &byte_cp_type);
             g_register_component_type(ecs, &position_cp_type);
@@ -138,7 +144,7 @@ UNITTEST_SUITE_BEGIN(necs)
 
             en_type_t* ent0 = g_register_entity_type(ecs, 1024);
 
-            cp_type_t byte_cp_type     = {-1, sizeof(u8), "byte"};
+            cp_type_t byte_cp_type     = {-1, sizeof(u8), "byte", alignof(u8)};
 
             g_register_component_type(ecs, &byte_cp_type);
 
@@ -181,9 +187,9 @@ UNITTEST_SUITE_BEGIN(necs)
             return;
             ecs_t* ecs = g_create_ecs(Allocator);
 
-            cp_type_t byte_cp_type     = {-1, sizeof(u8), "byte"};
-            cp_type_t position_cp_type = {-1, sizeof(position_t), "position"};
-            cp_type_t velocity_cp_type = {-1, sizeof(velocity_t), "velocity"};
+            cp_type_t byte_cp_type     = {-1, sizeof(u8), "byte", alignof(u8)};
+            cp_type_t position_cp_type = {-1, sizeof(position_t), "position", alignof(position_t)};
+            cp_type_t velocity_cp_type = {-1, sizeof(velocity_t), "velocity", alignof(velocity_t)};
 
             en_type_t* ent0 = g_register_entity_type(ecs, 1024);
             g_register_component_type(ecs, &byte_cp_type);
@@ -237,6 +243,131 @@ UNITTEST_SUITE_BEGIN(necs)
             g_destroy_entity(ecs, e04);
             g_destroy_ecs(ecs);
         }
+
+        UNITTEST_TEST(count)
+        {
+            ecs_t*     ecs  = g_create_ecs(Allocator);
+            en_type_t* ent0 = g_register_entity_type(ecs, 1024);
+
+            cp_type_t position_cp_type = {-1, sizeof(position_t), "position", alignof(position_t)};
+            g_register_component_type(ecs, &position_cp_type);
+
+            entity_t entities[100];
+            for (u32 i = 0; i < 100; ++i)
+                entities[i] = g_create_entity(ecs, ent0);
+            for (u32 i = 0; i < 100; i += 4)
+                g_set_cp(ecs, entities[i], &position_cp_type);
+            g_destroy_entity(ecs, entities[0]);
+            g_destroy_entity(ecs, entities[1]);
+
+            en_iterator_t all;
+            all.initialize(ent0);
+            CHECK_EQUAL(g_count(all), (u32)98);
+
+            en_iterator_t positions;
+            positions.initialize(ent0);
+            positions.cp_type(&position_cp_type);
+            CHECK_EQUAL(g_count(positions), (u32)24);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(rank_select)
+        {
+            ecs_t*     ecs  = g_create_ecs(Allocator);
+            en_type_t* ent0 = g_register_entity_type(ecs, 2048);
+
+            cp_type_t position_cp_type = {-1, sizeof(position_t), "position", alignof(position_t)};
+            g_register_component_type(ecs, &position_cp_type);
+
+            entity_t entities[1500];
+            for (u32 i = 0; i < 1500; ++i)
+                entities[i] = g_create_entity(ecs, ent0);
+            for (u32 i = 0; i < 1500; i += 3)
+                g_destroy_entity(ecs, entities[i]);
+
+            // every alive entity can be found back by its rank
+            u32 k = 0;
+            for (u32 i = 0; i < 1500; ++i)
+            {
+                if ((i % 3) == 0)
+                    continue;
+                CHECK_EQUAL(g_rank(ecs, entities[i]), k);
+                CHECK_EQUAL(g_select(ent0, k), entities[i]);
+                k++;
+            }
+            CHECK_EQUAL(g_select(ent0, k), g_null_entity);
+
+            // every part has the same number of alive entities
+            en_iterator_t iter;
+            iter.initialize(ent0);
+            for (u32 part = 0; part < 4; ++part)
+            {
+                u32 const begin = g_partition_begin(ent0, part, 4);
+                u32 const end   = g_partition_begin(ent0, part + 1, 4);
+                u32       count = 0;
+                for (iter.begin(begin); !iter.end() && iter.m_en_id < end; iter.next())
+                    count++;
+                CHECK_EQUAL(count, (u32)250);
+            }
+
+            // a sample matches the query, also when matches are rare
+            for (u32 i = 1; i < 1500; i += 300)
+                g_set_cp(ecs, entities[i], &position_cp_type);
+            en_iterator_t query;
+            query.initialize(ent0);
+            query.cp_type(&position_cp_type);
+            for (u32 random = 0; random < 100; ++random)
+            {
+                entity_t const e = g_sample(query, random * 2654435761u);
+                CHECK_TRUE(e != g_null_entity && g_has_cp(ecs, e, &position_cp_type));
+            }
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(aligned_components)
+        {
+            ecs_t*     ecs  = g_create_ecs(Allocator);
+            en_type_t* ent0 = g_register_entity_type(ecs, 1024);
+
+            cp_type_t vec3_cp_type = {-1, 12, "vec3", 16};
+            g_register_component_type(ecs, &vec3_cp_type);
+
+            for (u32 i = 0; i < 5; ++i)
+            {
+                entity_t e = g_create_entity(ecs, ent0);
+                g_set_cp(ecs, e, &vec3_cp_type);
+                CHECK_EQUAL(((u64)g_get_cp(ecs, e, &vec3_cp_type) & 15), (u64)0);
+            }
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(singletons)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator);
+
+            sg_type_t    time_sg = {-1, sizeof(game_time_t), "time"};
+            game_time_t* time    = (game_time_t*)g_register_singleton_type(ecs, &time_sg);
+            CHECK_NOT_NULL(time);
+            CHECK_EQUAL(time->frame, (u32)0);
+            time->frame = 7;
+
+            // registering again returns the same singleton
+            CHECK_EQUAL((game_time_t*)g_register_singleton_type(ecs, &time_sg), time);
+            CHECK_EQUAL(g_get_singleton<game_time_t>(ecs, &time_sg)->frame, (u32)7);
+
+            en_iterator_t iter;
+            iter.initialize(ecs);
+            iter.sg_read(&time_sg);
+            CHECK_EQUAL(iter.m_sg_read_mask, ((u32)1 << time_sg.sg_id));
+            CHECK_EQUAL(iter.m_sg_write_mask, (u32)0);
+            iter.sg_write(&time_sg);
+            CHECK_EQUAL(iter.m_sg_write_mask, ((u32)1 << time_sg.sg_id));
+
+            g_destroy_ecs(ecs);
+        }
     }
 }
 UNITTEST_SUITE_END
@@ -35,6 +35,12 @@ namespace ncore
         u8 value;
     };
 
+    struct matrix_t
+    {
+        DECLARE_ECS2_COMPONENT(4);
+        alignas(32) f32 m[12];
+    };
+
     struct enemy_tag_t
     {
         DECLARE_ECS2_TAG(0);
@@ -60,6 +66,13 @@ namespace ncore
         DECLARE_ECS2_GROUP(0);
     };
 
+    struct game_time_t
+    {
+        DECLARE_ECS2_SINGLETON(0);
+        f32 delta_time;
+        u32 frame;
+    };
+
 } // namespace ncore
 
 UNITTEST_SUITE_BEGIN(ecs2)
@@ -314,6 +327,103 @@ UNITTEST_SUITE_BEGIN(ecs2)
 
             g_destroy_ecs(ecs);
         }
+
+        UNITTEST_TEST(rank_select)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 2048);
+
+            g_register_group<main_component_group_t>(ecs, "main group", 2048);
+            g_register_component<main_component_group_t, position_t>(ecs, "");
+            g_register_component<main_component_group_t, velocity_t>(ecs, "");
+
+            entity_t entities[1500];
+            for (u32 i = 0; i < 1500; ++i)
+            {
+                entities[i] = g_create_entity(ecs);
+                g_add_cp<velocity_t>(ecs, entities[i]);
+            }
+            for (u32 i = 0; i < 1500; i += 3)
+                g_destroy_entity(ecs, entities[i]);
+
+            // every alive entity can be found back by its rank
+            u32 k = 0;
+            for (u32 i = 0; i < 1500; ++i)
+            {
+                if ((i % 3) == 0)
+                    continue;
+                CHECK_EQUAL(g_rank(ecs, entities[i]), k);
+                CHECK_EQUAL(g_select(ecs, k), entities[i]);
+                k++;
+            }
+            CHECK_EQUAL(g_select(ecs, k), ECS_ENTITY_NULL);
+
+            // every part has the same number of alive entities
+            en_iterator_t iter(ecs);
+            iter.set_cp_type<velocity_t>();
+            for (u32 part = 0; part < 4; ++part)
+            {
+                s32 const begin = g_partition_begin(ecs, part, 4);
+                s32 const end   = g_partition_begin(ecs, part + 1, 4);
+                u32       count = 0;
+                for (iter.begin(begin); !iter.end() && iter.m_entity_index < end; iter.next())
+                    count++;
+                CHECK_EQUAL(count, (u32)250);
+            }
+
+            // a sample matches the query, also when matches are rare
+            for (u32 i = 1; i < 1500; i += 300)
+                g_add_cp<position_t>(ecs, entities[i]);
+            en_iterator_t query(ecs);
+            query.set_cp_type<position_t>();
+            for (u32 random = 0; random < 100; ++random)
+            {
+                entity_t const e = g_sample(query, random * 2654435761u);
+                CHECK_TRUE(e != ECS_ENTITY_NULL && g_has_cp<position_t>(ecs, e));
+            }
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(aligned_components)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024);
+
+            g_register_group<main_component_group_t>(ecs, "main group", 1024);
+            g_register_component<main_component_group_t, matrix_t>(ecs, "matrix");
+            g_register_component(ecs, main_component_group_t::ECS_GROUP2_INDEX, 5, "vec3", 12, 16);
+
+            for (u32 i = 0; i < 5; ++i)
+            {
+                entity_t e = g_create_entity(ecs);
+                CHECK_EQUAL(((u64)g_add_cp<matrix_t>(ecs, e) & 31), (u64)0);
+                CHECK_EQUAL(((u64)g_add_cp(ecs, e, 5) & 15), (u64)0);
+            }
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(singletons)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024);
+
+            CHECK_TRUE(g_register_singleton<game_time_t>(ecs));
+            CHECK_FALSE(g_register_singleton<game_time_t>(ecs));
+
+            game_time_t* time = g_get_singleton<game_time_t>(ecs);
+            CHECK_NOT_NULL(time);
+            CHECK_EQUAL(time->frame, (u32)0);
+            time->frame = 7;
+            CHECK_EQUAL(g_get_singleton<game_time_t>(ecs)->frame, (u32)7);
+
+            en_iterator_t iter(ecs);
+            iter.set_sg_read<game_time_t>();
+            CHECK_EQUAL(iter.m_sg_read_mask, (u32)1);
+            CHECK_EQUAL(iter.m_sg_write_mask, (u32)0);
+            iter.set_sg_write<game_time_t>();
+            CHECK_EQUAL(iter.m_sg_write_mask, (u32)1);
+
+            g_destroy_ecs(ecs);
+        }
     }
 }
 UNITTEST_SUITE_END
@@ -36,6 +36,71 @@ namespace ncore
         u8 value;
     };
 
+    struct mass_t
+    {
+        DECLARE_ECS3_COMPONENT(4);
+        f32 value;
+    };
+
+    struct world_position_t
+    {
+        DECLARE_ECS3_COMPONENT(5);
+        f32 x, y, z;
+    };
+
+    struct material_t
+    {
+        DECLARE_ECS3_COMPONENT(6);
+        u32 shader;
+        u32 texture;
+    };
+
+    struct history_t
+    {
+        DECLARE_ECS3_COMPONENT(7);
+        s32 frame;
+        s32 score;
+        u32 flags[6];
+    };
+
+    struct particle_t
+    {
+        DECLARE_ECS3_COMPONENT(8);
+        f32 x;
+        f32 y;
+        f32 z;
+    };
+
+    struct matrix_t
+    {
+        DECLARE_ECS3_COMPONENT(9);
+        alignas(32) f32 m[12];
+    };
+
+    struct unit_t
+    {
+        DECLARE_ECS3_COMPONENT(10);
+        u32 team;
+        u32 id;
+    };
+
+    struct transform_t
+    {
+        DECLARE_ECS3_COMPONENT(11);
+        f32 local;
+        f32 world;
+    };
+
+    static u64 s_unit_team(void const* component, void*) { return ((unit_t const*)component)->team; }
+    static u64 s_unit_id(void const* component, void*) { return ((unit_t const*)component)->id; }
+
+    struct game_time_t
+    {
+        DECLARE_ECS3_SINGLETON(0);
+        f32 delta_time;
+        u32 frame;
+    };
+
     struct enemy_tag_t
     {
         DECLARE_ECS3_TAG(0);
@@ -56,6 +121,16 @@ namespace ncore
         DECLARE_ECS3_TAG(3);
     };
 
+    struct targets_t
+    {
+        DECLARE_ECS3_RELATION(0);
+    };
+
+    struct owned_by_t
+    {
+        DECLARE_ECS3_RELATION(1);
+    };
+
 } // namespace ncore
 
 UNITTEST_SUITE_BEGIN(ecs3)
@@ -377,6 +452,876 @@ UNITTEST_SUITE_BEGIN(ecs3)
 
             g_destroy_ecs(ecs);
         }
+
+        static void s_fold_sum_x(void* accumulator, void const* component, void*) { *(u32*)accumulator += ((position_t const*)component)->x; }
+
+        UNITTEST_TEST(reductions)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 16384, 256, 64);
+
+            g_register_component<position_t>(ecs, 16384, "position");
+            g_register_component<mass_t>(ecs, 16384, "mass");
+
+            const s32 num_entities = 10000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entity_t    e   = g_create_entity(ecs);
+                position_t* pos = g_add_cp<position_t>(ecs, e);
+                pos->x          = (u32)i;
+                pos->y          = (u32)(num_entities - i);
+                pos->z          = 7;
+                g_add_cp<mass_t>(ecs, e)->value = 0.5f;
+                if (i < 100)
+                    g_add_tag<enemy_tag_t>(ecs, e);
+            }
+
+            s32 lanes_min[3];
+            s32 lanes_max[3];
+            CHECK_EQUAL(g_reduce_s32<position_t>(ecs, ECS_ENTITY_NULL, REDUCE_MIN, lanes_min), (u32)num_entities);
+            CHECK_EQUAL(g_reduce_s32<position_t>(ecs, ECS_ENTITY_NULL, REDUCE_MAX, lanes_max), (u32)num_entities);
+            CHECK_EQUAL(lanes_min[0], 0);
+            CHECK_EQUAL(lanes_max[0], num_entities - 1);
+            CHECK_EQUAL(lanes_min[1], 1);
+            CHECK_EQUAL(lanes_max[1], num_entities);
+            CHECK_EQUAL(lanes_min[2], 7);
+
+            f32 mass = 0.0f;
+            CHECK_EQUAL(g_reduce_f32<mass_t>(ecs, ECS_ENTITY_NULL, REDUCE_SUM, &mass), (u32)num_entities);
+            CHECK_EQUAL(mass, 0.5f * num_entities);
+
+            // the partials of the chunks combined in order give the same result
+            f32       total      = 0.0f;
+            u32 const num_chunks = g_reduce_num_chunks(ecs, mass_t::ECS3_COMPONENT_INDEX);
+            CHECK_EQUAL(num_chunks, (num_entities + ECS3_REDUCE_CHUNK_SIZE - 1) / ECS3_REDUCE_CHUNK_SIZE);
+            for (u32 c = 0; c < num_chunks; ++c)
+            {
+                f32 partial;
+                g_reduce_chunk_f32(ecs, ECS_ENTITY_NULL, mass_t::ECS3_COMPONENT_INDEX, c, REDUCE_SUM, &partial, 1);
+                g_reduce_combine_f32(REDUCE_SUM, &total, &partial, 1);
+            }
+            CHECK_EQUAL(total, mass);
+
+            // only the enemies
+            entity_t reference = g_create_entity(ecs);
+            g_add_cp<position_t>(ecs, reference);
+            g_add_tag<enemy_tag_t>(ecs, reference);
+            CHECK_EQUAL(g_reduce_s32<position_t>(ecs, reference, REDUCE_MAX, lanes_max), (u32)100);
+            CHECK_EQUAL(lanes_max[0], 99);
+
+            u32 sum_x = 0;
+            CHECK_EQUAL(g_fold<position_t>(ecs, reference, s_fold_sum_x, &sum_x, nullptr), (u32)100);
+            CHECK_EQUAL(sum_x, (u32)(99 * 100 / 2));
+            g_destroy_entity(ecs, reference);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(count)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 2048, 256, 64);
+
+            g_register_component<position_t>(ecs, 2048, "position");
+            g_register_component<mass_t>(ecs, 2048, "mass");
+
+            entity_t  entities[1000];
+            const s32 num_entities = 1000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs);
+                g_add_cp<position_t>(ecs, entities[i]);
+                if ((i % 3) == 0)
+                    g_add_cp<mass_t>(ecs, entities[i]);
+                if ((i % 5) == 0)
+                    g_add_tag<enemy_tag_t>(ecs, entities[i]);
+            }
+            for (s32 i = 0; i < num_entities; i += 10)
+                g_destroy_entity(ecs, entities[i]);
+
+            CHECK_EQUAL(g_count(ecs, ECS_ENTITY_NULL), (u32)900);
+
+            entity_t reference = g_create_entity(ecs);
+            g_add_cp<mass_t>(ecs, reference);
+            CHECK_EQUAL(g_count(ecs, reference), (u32)300);
+            CHECK_EQUAL(g_count_estimate(ecs, reference), (u32)301); // includes the reference
+
+            g_add_cp<position_t>(ecs, reference);
+            g_add_tag<enemy_tag_t>(ecs, reference);
+            CHECK_EQUAL(g_count(ecs, reference), (u32)33);
+            CHECK_TRUE(g_count_estimate(ecs, reference) >= g_count(ecs, reference));
+
+            u32           iterated = 0;
+            en_iterator_t iter(ecs, reference);
+            for (iter.begin(); !iter.end(); iter.next())
+                iterated++;
+            CHECK_EQUAL(g_count(ecs, reference), iterated);
+            g_destroy_entity(ecs, reference);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(select_sample)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 2048, 256, 64);
+
+            g_register_component<position_t>(ecs, 2048, "position");
+            g_register_component<mass_t>(ecs, 2048, "mass");
+
+            entity_t  entities[1000];
+            const s32 num_entities = 1000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs);
+                g_add_cp<position_t>(ecs, entities[i]);
+                if ((i & 3) == 0)
+                    g_add_cp<mass_t>(ecs, entities[i]);
+            }
+
+            for (u32 k = 0; k < 250; ++k)
+                CHECK_TRUE(g_has_cp<mass_t>(ecs, g_select(ecs, mass_t::ECS3_COMPONENT_INDEX, k)));
+            CHECK_EQUAL(g_select(ecs, mass_t::ECS3_COMPONENT_INDEX, 250), ECS_ENTITY_NULL);
+
+            entity_t reference = g_create_entity(ecs);
+            g_add_cp<position_t>(ecs, reference);
+            g_add_cp<mass_t>(ecs, reference);
+            for (u32 r = 0; r < 100; ++r)
+            {
+                entity_t e = g_sample(ecs, reference, r * 7919);
+                CHECK_NOT_EQUAL(e, ECS_ENTITY_NULL);
+                CHECK_NOT_EQUAL(e, reference);
+                CHECK_TRUE(g_has_cp<mass_t>(ecs, e));
+            }
+            g_destroy_entity(ecs, reference);
+
+            g_destroy_ecs(ecs);
+        }
+
+        static void s_cursor_visit(ecs_t* ecs, entity_t e, void*) { g_get_cp<mass_t>(ecs, e)->value += 1.0f; }
+        static u64  s_cursor_clock(void* user) { return (*(u64*)user)++; }
+
+        UNITTEST_TEST(cursor)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<mass_t>(ecs, 1024, "mass");
+
+            entity_t  entities[100];
+            const s32 num_entities = 100;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i]                               = g_create_entity(ecs);
+                g_add_cp<mass_t>(ecs, entities[i])->value = 0.0f;
+            }
+
+            entity_t reference = g_create_entity(ecs);
+            g_add_cp<mass_t>(ecs, reference)->value = 0.0f;
+
+            // 7 slices of 30 entities visit every entity twice and 10 entities three times
+            en_cursor_t cursor(ecs, reference);
+            for (s32 i = 0; i < 7; ++i)
+                CHECK_EQUAL(cursor.step(s_cursor_visit, nullptr, 30), (u32)30);
+            CHECK_EQUAL(cursor.laps(), (u32)2);
+            for (s32 i = 0; i < num_entities; ++i)
+                CHECK_EQUAL(g_get_cp<mass_t>(ecs, entities[i])->value, i < 10 ? 3.0f : 2.0f);
+            CHECK_EQUAL(g_get_cp<mass_t>(ecs, reference)->value, 0.0f);
+
+            // destroyed entities are skipped, new entities are picked up
+            g_destroy_entity(ecs, entities[50]);
+            entity_t e = g_create_entity(ecs);
+            g_add_cp<mass_t>(ecs, e)->value = 0.0f;
+            CHECK_EQUAL(cursor.step(s_cursor_visit, nullptr, 1000), (u32)num_entities);
+            CHECK_EQUAL(g_get_cp<mass_t>(ecs, e)->value, 1.0f);
+
+            u64 clock = 0;
+            CHECK_EQUAL(cursor.step_until(s_cursor_visit, &clock, s_cursor_clock, 2), (u32)32);
+            g_destroy_entity(ecs, reference);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(bulk_tags)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<mass_t>(ecs, 1024, "mass");
+
+            entity_t  entities[1000];
+            const s32 num_entities = 1000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs);
+                g_add_tag<enemy_tag_t>(ecs, entities[i]);
+                if ((i & 1) == 0)
+                    g_add_cp<mass_t>(ecs, entities[i]);
+            }
+
+            entity_t reference = g_create_entity(ecs);
+            g_add_cp<mass_t>(ecs, reference);
+            CHECK_EQUAL(g_set_tag_all<dirty_tag_t>(ecs, reference), (u32)500);
+            CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, reference));
+            CHECK_TRUE(g_has_tag<dirty_tag_t>(ecs, entities[0]));
+            CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, entities[1]));
+
+            g_clear_tag_all<dirty_tag_t>(ecs);
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, entities[i]));
+                CHECK_TRUE(g_has_tag<enemy_tag_t>(ecs, entities[i]));
+            }
+
+            entity_t some[3] = {entities[3], entities[5], entities[999]};
+            g_add_tag<dirty_tag_t>(ecs, some, 3);
+            CHECK_TRUE(g_has_tag<dirty_tag_t>(ecs, entities[5]));
+            g_rem_tag<dirty_tag_t>(ecs, some, 2);
+            CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, entities[5]));
+            CHECK_TRUE(g_has_tag<dirty_tag_t>(ecs, entities[999]));
+            g_destroy_entity(ecs, reference);
+
+            g_destroy_ecs(ecs);
+        }
+
+        static u64 s_sort_key_mass(ecs_t* ecs, entity_t e, void*) { return (u64)g_get_cp<mass_t>(ecs, e)->value; }
+
+        UNITTEST_TEST(sort_storage)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<mass_t>(ecs, 1024, "mass");
+
+            entity_t  entities[500];
+            const s32 num_entities = 500;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i]                               = g_create_entity(ecs);
+                g_add_cp<mass_t>(ecs, entities[i])->value = (f32)(num_entities - 1 - i);
+            }
+
+            CHECK_EQUAL(g_sort_storage(ecs, mass_t::ECS3_COMPONENT_INDEX, s_sort_key_mass, nullptr), (u32)num_entities);
+            for (u32 k = 0; k < (u32)num_entities; ++k)
+                CHECK_EQUAL(g_get_cp<mass_t>(ecs, g_select(ecs, mass_t::ECS3_COMPONENT_INDEX, k))->value, (f32)k);
+            for (s32 i = 0; i < num_entities; ++i)
+                CHECK_EQUAL(g_get_cp<mass_t>(ecs, entities[i])->value, (f32)(num_entities - 1 - i));
+
+            // nearly sorted, a bounded number of moves per call converges
+            g_get_cp<mass_t>(ecs, g_select(ecs, mass_t::ECS3_COMPONENT_INDEX, 10))->value = 20.5f;
+            g_get_cp<mass_t>(ecs, g_select(ecs, mass_t::ECS3_COMPONENT_INDEX, 400))->value = 0.5f;
+            u32 calls = 0;
+            while (g_sort_storage(ecs, mass_t::ECS3_COMPONENT_INDEX, s_sort_key_mass, nullptr, 100) != 0)
+                calls++;
+            CHECK_EQUAL(calls, (u32)5);
+            CHECK_EQUAL(g_get_cp<mass_t>(ecs, g_select(ecs, mass_t::ECS3_COMPONENT_INDEX, 1))->value, 0.5f);
+            CHECK_EQUAL(g_get_cp<mass_t>(ecs, g_select(ecs, mass_t::ECS3_COMPONENT_INDEX, 20))->value, 20.5f);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(sort_spatial)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<world_position_t>(ecs, 1024, "world_position");
+            g_register_component<mass_t>(ecs, 1024, "mass");
+
+            // two clusters that are spawned interleaved
+            const s32 num_entities = 200;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entity_t          e        = g_create_entity(ecs);
+                world_position_t* position = g_add_cp<world_position_t>(ecs, e);
+                position->x                = (f32)((i & 1) * 1000 + (i % 7));
+                position->y                = (f32)(i % 5);
+                position->z                = (f32)(i % 3);
+
+                g_add_cp<mass_t>(ecs, e)->value = (f32)(i & 1);
+            }
+
+            g_sort_spatial(ecs, world_position_t::ECS3_COMPONENT_INDEX, world_position_t::ECS3_COMPONENT_INDEX, 1.0f);
+            g_sort_spatial(ecs, mass_t::ECS3_COMPONENT_INDEX, world_position_t::ECS3_COMPONENT_INDEX, 1.0f);
+            for (u32 k = 0; k < (u32)num_entities; ++k)
+            {
+                entity_t e = g_select(ecs, world_position_t::ECS3_COMPONENT_INDEX, k);
+                CHECK_EQUAL(g_get_cp<world_position_t>(ecs, e)->x < 500.0f, k < 100);
+                CHECK_EQUAL(g_get_cp<mass_t>(ecs, g_select(ecs, mass_t::ECS3_COMPONENT_INDEX, k))->value, k < 100 ? 0.0f : 1.0f);
+            }
+
+            // sorted, nothing moves
+            CHECK_EQUAL(g_sort_spatial(ecs, world_position_t::ECS3_COMPONENT_INDEX, world_position_t::ECS3_COMPONENT_INDEX, 1.0f, 16), (u32)0);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(spatial_grid)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<world_position_t>(ecs, 1024, "world_position");
+
+            // a 10 x 10 lattice, the entities with an even x are enemies
+            entity_t entities[100];
+            for (s32 i = 0; i < 100; ++i)
+            {
+                entities[i]                = g_create_entity(ecs);
+                world_position_t* position = g_add_cp<world_position_t>(ecs, entities[i]);
+                position->x                = (f32)(i % 10);
+                position->y                = (f32)(i / 10);
+                position->z                = 0.0f;
+                if (((i % 10) & 1) == 0)
+                    g_add_tag<enemy_tag_t>(ecs, entities[i]);
+            }
+
+            grid_t* grid = g_create_grid(ecs, world_position_t::ECS3_COMPONENT_INDEX, 2.0f, 64);
+            g_grid_update_all(grid);
+            CHECK_EQUAL(g_grid_count(grid), (u32)100);
+
+            entity_t  out[100];
+            const f32 center[3] = {5.0f, 5.0f, 0.0f};
+            CHECK_EQUAL(g_grid_query_radius(grid, ECS_ENTITY_NULL, center, 1.5f, out, 100), (u32)9);
+            CHECK_EQUAL(g_grid_query_radius(grid, ECS_ENTITY_NULL, center, 1.5f, out, 4), (u32)4);
+
+            const f32 box_min[3] = {2.0f, 2.0f, -1.0f};
+            const f32 box_max[3] = {4.0f, 4.0f, 1.0f};
+            CHECK_EQUAL(g_grid_query_box(grid, ECS_ENTITY_NULL, box_min, box_max, out, 100), (u32)9);
+
+            // spatial and tag predicates combined
+            entity_t enemies = g_create_entity(ecs);
+            g_add_tag<enemy_tag_t>(ecs, enemies);
+            CHECK_EQUAL(g_grid_query_radius(grid, enemies, center, 1.5f, out, 100), (u32)6);
+
+            // a box that covers more cells than there are buckets
+            const f32 all_min[3] = {-100.0f, -100.0f, -100.0f};
+            const f32 all_max[3] = {100.0f, 100.0f, 100.0f};
+            CHECK_EQUAL(g_grid_query_box(grid, ECS_ENTITY_NULL, all_min, all_max, out, 100), (u32)100);
+
+            const f32 corner[3] = {0.1f, 0.2f, 0.0f};
+            CHECK_EQUAL(g_grid_query_nearest(grid, ECS_ENTITY_NULL, corner, 3, out), (u32)3);
+            CHECK_EQUAL(out[0], entities[0]);
+            CHECK_EQUAL(out[1], entities[10]);
+            CHECK_EQUAL(out[2], entities[1]);
+            CHECK_EQUAL(g_grid_query_nearest(grid, enemies, corner, 2, out), (u32)2);
+            CHECK_EQUAL(out[1], entities[10]);
+
+            // moving and removing entities
+            g_get_cp<world_position_t>(ecs, entities[99])->x = 5.5f;
+            g_get_cp<world_position_t>(ecs, entities[99])->y = 5.5f;
+            g_grid_update(grid, entities[99]);
+            CHECK_EQUAL(g_grid_query_nearest(grid, ECS_ENTITY_NULL, center, 1, out), (u32)1);
+            CHECK_EQUAL(out[0], entities[55]);
+            CHECK_EQUAL(g_grid_query_radius(grid, ECS_ENTITY_NULL, center, 1.5f, out, 100), (u32)10);
+            g_grid_remove(grid, entities[55]);
+            g_destroy_entity(ecs, entities[55]);
+            CHECK_EQUAL(g_grid_query_radius(grid, ECS_ENTITY_NULL, center, 1.5f, out, 100), (u32)9);
+            CHECK_EQUAL(g_grid_count(grid), (u32)99);
+
+            g_destroy_grid(grid);
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(instantiate)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<position_t>(ecs, 1024, "position");
+            g_register_component<velocity_t>(ecs, 1024, "velocity");
+
+            entity_t soldier = g_create_entity(ecs);
+            g_add_cp<position_t>(ecs, soldier)->x     = 7;
+            g_add_cp<velocity_t>(ecs, soldier)->speed = 3;
+            g_add_tag<enemy_tag_t>(ecs, soldier);
+            g_add_tag<dirty_tag_t>(ecs, soldier);
+
+            entity_t  soldiers[500];
+            const u32 num_soldiers = 500;
+            CHECK_EQUAL(g_instantiate(ecs, soldier, soldiers, num_soldiers), num_soldiers);
+            g_rem_tag<dirty_tag_t>(ecs, soldiers, num_soldiers);
+            for (u32 i = 0; i < num_soldiers; ++i)
+            {
+                CHECK_EQUAL(g_get_cp<position_t>(ecs, soldiers[i])->x, (u32)7);
+                CHECK_EQUAL(g_get_cp<velocity_t>(ecs, soldiers[i])->speed, (u32)3);
+                CHECK_TRUE(g_has_tag<enemy_tag_t>(ecs, soldiers[i]));
+                CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, soldiers[i]));
+            }
+
+            g_get_cp<position_t>(ecs, soldiers[10])->x = 8;
+            CHECK_EQUAL(g_get_cp<position_t>(ecs, soldiers[11])->x, (u32)7);
+            CHECK_EQUAL(g_count(ecs, ECS_ENTITY_NULL), num_soldiers + 1);
+
+            // removing a component of an instance keeps the container dense
+            g_destroy_entity(ecs, soldiers[0]);
+            CHECK_EQUAL(g_get_cp<velocity_t>(ecs, soldiers[499])->speed, (u32)3);
+            CHECK_EQUAL(g_count(ecs, ECS_ENTITY_NULL), num_soldiers);
+
+            // no more instances than the smallest container of the prefab can hold
+            g_register_component<u8_t>(ecs, 8, "u8");
+            g_add_cp<u8_t>(ecs, soldier)->value = 5;
+            CHECK_EQUAL(g_instantiate(ecs, soldier, soldiers, 20), (u32)7);
+            CHECK_EQUAL(g_get_cp<u8_t>(ecs, soldiers[6])->value, (u8)5);
+            CHECK_EQUAL(g_count(ecs, ECS_ENTITY_NULL), num_soldiers + 7);
+            CHECK_EQUAL(g_instantiate(ecs, soldier, soldiers, 20), (u32)0);
+            CHECK_TRUE(g_add_cp<u8_t>(ecs, g_create_entity(ecs)) == nullptr);
+
+            g_destroy_ecs(ecs);
+        }
+
+        static u64 s_material_key(ecs_t* ecs, entity_t e, void*) { return g_get_shared_index(ecs, e, material_t::ECS3_COMPONENT_INDEX); }
+
+        UNITTEST_TEST(shared_components)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_shared_component<material_t>(ecs, 1024, 16, "material");
+
+            entity_t  entities[300];
+            const u32 num_entities = 300;
+            for (u32 i = 0; i < num_entities; ++i)
+            {
+                material_t material;
+                material.shader  = i % 3;
+                material.texture = 10 + (i % 3);
+                entities[i]      = g_create_entity(ecs);
+                CHECK_NOT_NULL(g_set_shared_cp(ecs, entities[i], material));
+            }
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS3_COMPONENT_INDEX), (u32)3);
+            CHECK_EQUAL(g_get_cp<material_t>(ecs, entities[0]), g_get_cp<material_t>(ecs, entities[3]));
+            CHECK_EQUAL(g_get_cp<material_t>(ecs, entities[4])->texture, (u32)11);
+
+            // grouping the container by value
+            g_sort_storage(ecs, material_t::ECS3_COMPONENT_INDEX, s_material_key, nullptr);
+            for (u32 k = 1; k < num_entities; ++k)
+                CHECK_TRUE(s_material_key(ecs, g_select(ecs, material_t::ECS3_COMPONENT_INDEX, k - 1), nullptr) <= s_material_key(ecs, g_select(ecs, material_t::ECS3_COMPONENT_INDEX, k), nullptr));
+
+            // a value is released by the last entity that uses it
+            for (u32 i = 0; i < num_entities; i += 3)
+                g_destroy_entity(ecs, entities[i]);
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS3_COMPONENT_INDEX), (u32)2);
+
+            material_t red;
+            red.shader  = 7;
+            red.texture = 7;
+            g_set_shared_cp(ecs, entities[1], red);
+            CHECK_EQUAL(g_get_cp<material_t>(ecs, entities[1])->shader, (u32)7);
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS3_COMPONENT_INDEX), (u32)3);
+            g_rem_cp<material_t>(ecs, entities[1]);
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS3_COMPONENT_INDEX), (u32)2);
+
+            // prefab instances reference the value of the prefab
+            entity_t instances[10];
+            CHECK_EQUAL(g_instantiate(ecs, entities[2], instances, 10), (u32)10);
+            CHECK_EQUAL(g_get_shared_index(ecs, instances[9], material_t::ECS3_COMPONENT_INDEX), g_get_shared_index(ecs, entities[2], material_t::ECS3_COMPONENT_INDEX));
+            for (u32 i = 2; i < num_entities; i += 3)
+                g_destroy_entity(ecs, entities[i]);
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS3_COMPONENT_INDEX), (u32)2);
+            for (u32 i = 0; i < 10; ++i)
+                g_destroy_entity(ecs, instances[i]);
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS3_COMPONENT_INDEX), (u32)1);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(singletons)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            CHECK_TRUE(g_register_singleton<game_time_t>(ecs));
+            CHECK_FALSE(g_register_singleton<game_time_t>(ecs));
+
+            game_time_t* time = g_get_singleton<game_time_t>(ecs);
+            CHECK_NOT_NULL(time);
+            CHECK_EQUAL(time->frame, (u32)0);
+            time->frame = 7;
+            CHECK_EQUAL(g_get_singleton<game_time_t>(ecs)->frame, (u32)7);
+
+            // the access of a query
+            en_iterator_t iter(ecs);
+            iter.read_singleton<game_time_t>();
+            CHECK_EQUAL(iter.singleton_reads(), (u32)1);
+            CHECK_EQUAL(iter.singleton_writes(), (u32)0);
+            iter.write_singleton<game_time_t>();
+            CHECK_EQUAL(iter.singleton_writes(), (u32)1);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(compressed_components)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_compressed_component<history_t>(ecs, 1024, "history");
+
+            entity_t  entities[500];
+            const u32 num_entities = 500;
+            for (u32 i = 0; i < num_entities; ++i)
+            {
+                entities[i]        = g_create_entity(ecs);
+                history_t* history = g_add_cp<history_t>(ecs, entities[i]);
+                g_memclr(history, sizeof(history_t));
+                history->frame = (s32)i;
+                history->score = (s32)(i * 10);
+            }
+
+            // access that jumps between blocks goes through the cache
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[3])->score, (s32)30);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[400])->frame, (s32)400);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[130])->score, (s32)1300);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[260])->frame, (s32)260);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[499])->score, (s32)4990);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[3])->frame, (s32)3);
+
+            compressed_stats_t stats;
+            CHECK_TRUE(g_compressed_stats<history_t>(ecs, stats));
+            CHECK_EQUAL(stats.m_raw_bytes, (u64)num_entities * sizeof(history_t));
+            CHECK_TRUE(stats.m_compressed_bytes * 4 < stats.m_raw_bytes);
+            CHECK_TRUE(stats.m_ratio > 4.0f);
+
+            // the last value moves into the hole
+            g_destroy_entity(ecs, entities[0]);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[499])->score, (s32)4990);
+
+            s32 lanes[8];
+            CHECK_EQUAL(g_reduce_s32<history_t>(ecs, ECS_ENTITY_NULL, REDUCE_SUM, lanes), num_entities - 1);
+            CHECK_EQUAL(lanes[0], (s32)((num_entities - 1) * num_entities / 2));
+
+            for (u32 i = 1; i < num_entities; ++i)
+                g_destroy_entity(ecs, entities[i]);
+            CHECK_TRUE(g_compressed_stats<history_t>(ecs, stats));
+            CHECK_EQUAL(stats.m_compressed_bytes, (u64)0);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(aligned_components)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<matrix_t>(ecs, 1024, "matrix");
+            g_register_component(ecs, 1024, 10, 12, 16, "vec3");
+
+            for (u32 i = 0; i < 5; ++i)
+            {
+                entity_t e = g_create_entity(ecs);
+                CHECK_EQUAL(((u64)g_add_cp<matrix_t>(ecs, e) & 31), (u64)0);
+                CHECK_EQUAL(((u64)g_add_cp(ecs, e, 10) & 15), (u64)0);
+            }
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(soa_components)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_soa_component<particle_t>(ecs, 1024, "particle");
+
+            entity_t  entities[100];
+            const u32 num_entities = 100;
+            for (u32 i = 0; i < num_entities; ++i)
+            {
+                entities[i]    = g_create_entity(ecs);
+                particle_t* pt = g_add_cp<particle_t>(ecs, entities[i]);
+                pt->x          = (f32)i;
+                pt->y          = (f32)(i * 2);
+                pt->z          = 1.0f;
+            }
+
+            u32        count = 0;
+            f32 const* xs    = g_get_column<particle_t>(ecs, 0, count);
+            f32 const* ys    = g_get_column<particle_t>(ecs, 1, count);
+            CHECK_EQUAL(count, num_entities);
+            CHECK_EQUAL(((u64)xs & 63), (u64)0);
+            CHECK_EQUAL(((u64)ys & 63), (u64)0);
+            CHECK_EQUAL(xs[99], 99.0f);
+            CHECK_EQUAL(ys[50], 100.0f);
+
+            // a write through g_get_cp ends up in the columns
+            g_get_cp<particle_t>(ecs, entities[10])->y = -1.0f;
+            CHECK_EQUAL(g_get_cp<particle_t>(ecs, entities[11])->y, 22.0f);
+            ys = g_get_column<particle_t>(ecs, 1, count);
+            CHECK_EQUAL(ys[10], -1.0f);
+
+            // the last value moves into the hole
+            g_destroy_entity(ecs, entities[0]);
+            xs = g_get_column<particle_t>(ecs, 0, count);
+            CHECK_EQUAL(count, num_entities - 1);
+            CHECK_EQUAL(xs[0], 99.0f);
+            CHECK_EQUAL(g_get_cp<particle_t>(ecs, entities[99])->y, 198.0f);
+
+            f32 lanes[3];
+            CHECK_EQUAL(g_reduce_f32<particle_t>(ecs, ECS_ENTITY_NULL, REDUCE_SUM, lanes), num_entities - 1);
+            CHECK_EQUAL(lanes[0], (f32)((num_entities - 1) * num_entities / 2));
+            CHECK_EQUAL(lanes[2], (f32)(num_entities - 1));
+
+            CHECK_NULL(g_get_column(ecs, history_t::ECS3_COMPONENT_INDEX, 0, count));
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(hierarchy)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<transform_t>(ecs, 1024, "transform");
+
+            entity_t entities[6];
+            for (u32 i = 0; i < 6; ++i)
+            {
+                entities[i]    = g_create_entity(ecs);
+                transform_t* t = g_add_cp<transform_t>(ecs, entities[i]);
+                t->local       = (f32)(1 << i);
+                t->world       = t->local;
+            }
+
+            // 0 -> (1 -> (3, 4), 2 -> (5))
+            CHECK_TRUE(g_set_parent(ecs, entities[1], entities[0]));
+            CHECK_TRUE(g_set_parent(ecs, entities[2], entities[0]));
+            CHECK_TRUE(g_set_parent(ecs, entities[3], entities[1]));
+            CHECK_TRUE(g_set_parent(ecs, entities[5], entities[2]));
+            CHECK_TRUE(g_set_parent(ecs, entities[4], entities[1]));
+            CHECK_FALSE(g_set_parent(ecs, entities[0], entities[3]));
+            CHECK_EQUAL(g_get_parent(ecs, entities[4]), entities[1]);
+            CHECK_EQUAL(g_get_parent(ecs, entities[0]), ECS_ENTITY_NULL);
+            CHECK_EQUAL(g_get_depth(ecs, entities[5]), (u32)2);
+
+            entity_t children[4];
+            CHECK_EQUAL(g_get_children(ecs, entities[1], children, 4), (u32)2);
+
+            // the children of a parent are contiguous and follow the order of the parents
+            hierarchy_level_t level;
+            CHECK_EQUAL(g_hierarchy_levels(ecs), (u32)3);
+            CHECK_TRUE(g_hierarchy_level(ecs, 2, level));
+            CHECK_EQUAL(level.m_begin, (u32)3);
+            CHECK_EQUAL(level.m_count, (u32)3);
+            for (u32 i = 1; i < level.m_count; ++i)
+                CHECK_TRUE(level.m_parents[i - 1] <= level.m_parents[i]);
+            CHECK_FALSE(g_hierarchy_level(ecs, 3, level));
+
+            // propagation, one linear pass per level over the sorted container
+            g_sort_by_hierarchy(ecs, transform_t::ECS3_COMPONENT_INDEX);
+            transform_t* transforms = g_get_cp<transform_t>(ecs, g_select(ecs, transform_t::ECS3_COMPONENT_INDEX, 0));
+            for (u32 d = 1; g_hierarchy_level(ecs, d, level); ++d)
+            {
+                for (u32 i = 0; i < level.m_count; ++i)
+                    transforms[level.m_begin + i].world = transforms[level.m_parents[i]].world + transforms[level.m_begin + i].local;
+            }
+            CHECK_EQUAL(g_get_cp<transform_t>(ecs, entities[4])->world, 1.0f + 2.0f + 16.0f);
+            CHECK_EQUAL(g_get_cp<transform_t>(ecs, entities[5])->world, 1.0f + 4.0f + 32.0f);
+
+            // reparenting moves the subtree
+            CHECK_TRUE(g_set_parent(ecs, entities[2], entities[3]));
+            CHECK_EQUAL(g_get_depth(ecs, entities[5]), (u32)4);
+            CHECK_EQUAL(g_hierarchy_levels(ecs), (u32)5);
+
+            CHECK_EQUAL(g_destroy_subtree(ecs, entities[1]), (u32)5);
+            CHECK_EQUAL(g_get_children(ecs, entities[0], children, 4), (u32)0);
+            CHECK_EQUAL(g_hierarchy_levels(ecs), (u32)0);
+
+            // a chain cannot be deeper than the maximum depth, also when a subtree is attached
+            entity_t chain[ECS3_HIERARCHY_MAX_DEPTH + 1];
+            chain[0] = g_create_entity(ecs);
+            for (u32 i = 1; i <= ECS3_HIERARCHY_MAX_DEPTH; ++i)
+            {
+                chain[i] = g_create_entity(ecs);
+                CHECK_EQUAL(g_set_parent(ecs, chain[i], chain[i - 1]), i < ECS3_HIERARCHY_MAX_DEPTH);
+            }
+            CHECK_EQUAL(g_hierarchy_levels(ecs), ECS3_HIERARCHY_MAX_DEPTH);
+            CHECK_TRUE(g_set_parent(ecs, chain[ECS3_HIERARCHY_MAX_DEPTH], entities[0]));
+            CHECK_FALSE(g_set_parent(ecs, entities[0], chain[ECS3_HIERARCHY_MAX_DEPTH - 2]));
+            CHECK_TRUE(g_set_parent(ecs, entities[0], chain[ECS3_HIERARCHY_MAX_DEPTH - 3]));
+            CHECK_EQUAL(g_get_depth(ecs, chain[ECS3_HIERARCHY_MAX_DEPTH]), ECS3_HIERARCHY_MAX_DEPTH - 1);
+            CHECK_EQUAL(g_hierarchy_levels(ecs), ECS3_HIERARCHY_MAX_DEPTH);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(relations)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            CHECK_TRUE(g_register_relation<targets_t>(ecs, 256));
+            CHECK_TRUE(g_register_relation<owned_by_t>(ecs, 256));
+            CHECK_FALSE(g_register_relation<targets_t>(ecs, 256));
+
+            entity_t player = g_create_entity(ecs);
+            entity_t boss   = g_create_entity(ecs);
+            entity_t units[8];
+            for (u32 i = 0; i < 8; ++i)
+            {
+                units[i] = g_create_entity(ecs);
+                if (i & 1)
+                    g_add_tag<enemy_tag_t>(ecs, units[i]);
+            }
+
+            CHECK_EQUAL(g_add_pair(ecs, units, 8, targets_t::ECS3_RELATION_INDEX, player), (u32)8);
+            CHECK_TRUE(g_add_pair<targets_t>(ecs, units[0], boss));
+            CHECK_TRUE(g_add_pair<owned_by_t>(ecs, units[0], player));
+            CHECK_TRUE(g_has_pair<targets_t>(ecs, units[3], player));
+            CHECK_FALSE(g_has_pair<owned_by_t>(ecs, units[3], player));
+
+            entity_t out[8];
+            CHECK_EQUAL(g_get_targets<targets_t>(ecs, units[0], out, 8), (u32)2);
+
+            // all the enemies that target the player
+            entity_t reference = g_create_entity(ecs);
+            g_add_tag<enemy_tag_t>(ecs, reference);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, ECS_ENTITY_NULL, player, out, 8), (u32)8);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, reference, player, out, 8), (u32)4);
+            for (u32 i = 0; i < 4; ++i)
+                CHECK_TRUE(g_has_tag<enemy_tag_t>(ecs, out[i]));
+
+            g_rem_pair(ecs, units, 4, targets_t::ECS3_RELATION_INDEX, player);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, ECS_ENTITY_NULL, player, out, 8), (u32)4);
+
+            // destroying the target removes the pairs that point at it
+            g_destroy_entity(ecs, player);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, ECS_ENTITY_NULL, player, out, 8), (u32)0);
+            CHECK_FALSE(g_has_pair<owned_by_t>(ecs, units[0], player));
+            CHECK_TRUE(g_has_pair<targets_t>(ecs, units[0], boss));
+            CHECK_FALSE(g_add_pair<targets_t>(ecs, units[1], player));
+
+            g_destroy_entity(ecs, units[0]);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, ECS_ENTITY_NULL, boss, out, 8), (u32)0);
+            CHECK_EQUAL(g_add_pair(ecs, units, 8, targets_t::ECS3_RELATION_INDEX, boss), (u32)7);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(value_index)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<unit_t>(ecs, 1024, "unit");
+
+            // 100 units in 4 teams, the units with an odd id are enemies
+            entity_t units[100];
+            for (u32 i = 0; i < 100; ++i)
+            {
+                units[i]     = g_create_entity(ecs);
+                unit_t* unit = g_add_cp<unit_t>(ecs, units[i]);
+                unit->team   = i & 3;
+                unit->id     = 1000 + i;
+                if (i & 1)
+                    g_add_tag<enemy_tag_t>(ecs, units[i]);
+            }
+
+            value_index_t* teams = g_create_index(ecs, unit_t::ECS3_COMPONENT_INDEX, s_unit_team, nullptr, INDEX_HASH, 16);
+            value_index_t* ids   = g_create_index(ecs, unit_t::ECS3_COMPONENT_INDEX, s_unit_id, nullptr, INDEX_ORDERED, 64);
+            g_index_update_all(teams);
+            g_index_update_all(ids);
+            CHECK_EQUAL(g_index_count(teams), (u32)100);
+
+            entity_t out[100];
+            CHECK_EQUAL(g_index_find(teams, ECS_ENTITY_NULL, 3, out, 100), (u32)25);
+            CHECK_EQUAL(g_index_find(teams, ECS_ENTITY_NULL, 3, out, 4), (u32)25);
+            CHECK_EQUAL(g_index_find(teams, ECS_ENTITY_NULL, 7, out, 100), (u32)0);
+            CHECK_EQUAL(g_index_find(ids, ECS_ENTITY_NULL, 1042, out, 100), (u32)1);
+            CHECK_EQUAL(out[0], units[42]);
+
+            // a probe combined with a tag predicate, team 1 only has enemies and team 2 has none
+            entity_t enemies = g_create_entity(ecs);
+            g_add_tag<enemy_tag_t>(ecs, enemies);
+            CHECK_EQUAL(g_index_find(teams, enemies, 1, out, 100), (u32)25);
+            CHECK_EQUAL(g_index_find(teams, enemies, 2, out, 100), (u32)0);
+
+            // range probes return the entities in key order
+            CHECK_EQUAL(g_index_range(ids, ECS_ENTITY_NULL, 1010, 1019, out, 100), (u32)10);
+            for (u32 i = 0; i < 10; ++i)
+                CHECK_EQUAL(out[i], units[10 + i]);
+            CHECK_EQUAL(g_index_range(ids, enemies, 1010, 1019, out, 100), (u32)5);
+            CHECK_EQUAL(g_index_range(ids, ECS_ENTITY_NULL, 0, 999, out, 100), (u32)0);
+
+            // changing a key and removing entities
+            g_get_cp<unit_t>(ecs, units[0])->team = 3;
+            g_get_cp<unit_t>(ecs, units[0])->id   = 5000;
+            g_index_update(teams, units[0]);
+            g_index_update(ids, units[0]);
+            CHECK_EQUAL(g_index_find(teams, ECS_ENTITY_NULL, 3, out, 100), (u32)26);
+            CHECK_EQUAL(g_index_range(ids, ECS_ENTITY_NULL, 1099, 9999, out, 100), (u32)2);
+            CHECK_EQUAL(out[1], units[0]);
+
+            g_index_remove(teams, units[3]);
+            g_index_remove(ids, units[3]);
+            g_destroy_entity(ecs, units[3]);
+            g_destroy_entity(ecs, units[7]); // not removed from the index, skipped by the probes
+            CHECK_EQUAL(g_index_find(teams, ECS_ENTITY_NULL, 3, out, 100), (u32)24);
+            CHECK_EQUAL(g_index_range(ids, ECS_ENTITY_NULL, 1000, 1009, out, 100), (u32)7);
+            CHECK_EQUAL(g_index_count(teams), (u32)99);
+
+            g_destroy_index(ids);
+            g_destroy_index(teams);
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(sleeping_entities)
+        {
+            ecs_t* ecs = g_create_ecs(Allocator, 1024, 256, 64);
+
+            g_register_component<mass_t>(ecs, 1024, "mass");
+
+            entity_t entities[200];
+            for (s32 i = 0; i < 200; ++i)
+            {
+                entities[i] = g_create_entity(ecs);
+                g_add_cp<mass_t>(ecs, entities[i])->value = (f32)i;
+                if ((i & 1) == 0)
+                    g_add_tag<enemy_tag_t>(ecs, entities[i]);
+            }
+
+            entity_t reference = g_create_entity(ecs);
+            g_add_cp<mass_t>(ecs, reference);
+            entity_t enemy_reference = g_create_entity(ecs);
+            g_add_tag<enemy_tag_t>(ecs, enemy_reference);
+
+            // put the first 150 entities to sleep in a batch, they are skipped by default
+            CHECK_EQUAL(g_sleep(ecs, entities, 150), (u32)150);
+            CHECK_EQUAL(g_sleep(ecs, entities, 10), (u32)0);
+            CHECK_EQUAL(g_num_sleeping(ecs), (u32)150);
+            CHECK_FALSE(g_is_awake(ecs, entities[0]));
+            CHECK_TRUE(g_is_awake(ecs, entities[150]));
+
+            en_iterator_t iter(ecs, reference);
+            iter.begin();
+            CHECK_EQUAL(iter.entity(), entities[150]);
+            CHECK_EQUAL(g_count(ecs, reference), (u32)50);
+            CHECK_EQUAL(g_count(ecs, enemy_reference), (u32)25);
+            CHECK_EQUAL(g_count(ecs, ECS_ENTITY_NULL), (u32)52);
+
+            u32           count = 0;
+            en_iterator_t all(ecs, reference);
+            all.include_sleeping();
+            for (all.begin(); !all.end(); all.next())
+                count++;
+            CHECK_EQUAL(count, (u32)200);
+
+            CHECK_EQUAL(g_wake(ecs, entities, 10), (u32)10);
+            g_sleep(ecs, entities[199]);
+            g_wake(ecs, entities[199]);
+            CHECK_EQUAL(g_num_sleeping(ecs), (u32)140);
+
+            count = 0;
+            en_iterator_t enemies(ecs, enemy_reference);
+            for (enemies.begin(); !enemies.end(); enemies.next())
+                count++;
+            CHECK_EQUAL(count, (u32)30);
+            CHECK_EQUAL(g_set_tag_all<target_tag_t>(ecs, enemy_reference), (u32)30);
+
+            // a destroyed sleeping entity, a new entity is awake
+            g_destroy_entity(ecs, entities[20]);
+            CHECK_EQUAL(g_num_sleeping(ecs), (u32)139);
+            const entity_t created = g_create_entity(ecs);
+            CHECK_TRUE(g_is_awake(ecs, created));
+            CHECK_EQUAL(g_count(ecs, ECS_ENTITY_NULL) + g_num_sleeping(ecs), (u32)202);
+
+            // g_sample only picks awake entities, also when the matches are rare
+            for (u32 r = 0; r < 100; ++r)
+                CHECK_TRUE(g_is_awake(ecs, g_sample(ecs, reference, r * 7919)));
+            g_add_tag<friendly_tag_t>(ecs, reference);
+            g_add_tag<friendly_tag_t>(ecs, entities[100]);
+            g_add_tag<friendly_tag_t>(ecs, entities[150]);
+            for (u32 r = 0; r < 100; ++r)
+                CHECK_EQUAL(g_sample(ecs, reference, r * 7919), entities[150]);
+            g_sleep(ecs, entities[150]);
+            for (u32 r = 0; r < 100; ++r)
+                CHECK_EQUAL(g_sample(ecs, reference, r * 7919), ECS_ENTITY_NULL);
+
+            g_destroy_ecs(ecs);
+        }
     }
 }
 UNITTEST_SUITE_END
@@ -36,6 +36,63 @@ namespace ncore
         u8 value;
     };
 
+    struct mass_t
+    {
+        DECLARE_ECS4_COMPONENT(4);
+        f32 value;
+    };
+
+    struct world_position_t
+    {
+        DECLARE_ECS4_COMPONENT(5);
+        f32 x, y, z;
+    };
+
+    struct material_t
+    {
+        DECLARE_ECS4_COMPONENT(6);
+        u32 shader;
+        u32 texture;
+    };
+
+    struct spawn_info_t
+    {
+        DECLARE_ECS4_COMPONENT(7);
+        u32 wave;
+        u32 spawner;
+    };
+
+    struct history_t
+    {
+        DECLARE_ECS4_COMPONENT(8);
+        s32 frame;
+        s32 score;
+        u32 flags[6];
+    };
+
+    struct matrix_t
+    {
+        DECLARE_ECS4_COMPONENT(9);
+        alignas(32) f32 m[12];
+    };
+
+    struct unit_t
+    {
+        DECLARE_ECS4_COMPONENT(10);
+        u32 team;
+        u32 id;
+    };
+
+    static u64 s_unit_team(void const* component, void*) { return ((unit_t const*)component)->team; }
+    static u64 s_unit_id(void const* component, void*) { return ((unit_t const*)component)->id; }
+
+    struct game_time_t
+    {
+        DECLARE_ECS4_SINGLETON(0);
+        f32 delta_time;
+        u32 frame;
+    };
+
     struct enemy_tag_t
     {
         DECLARE_ECS4_TAG(0);
@@ -56,6 +113,16 @@ namespace ncore
         DECLARE_ECS4_TAG(3);
     };
 
+    struct targets_t
+    {
+        DECLARE_ECS4_RELATION(0);
+    };
+
+    struct owned_by_t
+    {
+        DECLARE_ECS4_RELATION(1);
+    };
+
 } // namespace ncore
 
 UNITTEST_SUITE_BEGIN(ecs4)
@@ -365,6 +432,1559 @@ UNITTEST_SUITE_BEGIN(ecs4)
 
             g_destroy_ecs(ecs);
         }
+
+        UNITTEST_TEST(wide_archetype)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 1, 16, 256, 8, 32, 300000);
+
+            g_register_component_type<position_t>(ecs, 1);
+            g_register_tag_type<enemy_tag_t>(ecs, 1);
+
+            // cross both the 16-bit index and the first state page
+            const s32 num_entities = 270000;
+            entity_t* entities     = g_allocate_array<entity_t>(Allocator, num_entities);
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entity_t e  = g_create_entity(ecs, 1);
+                entities[i] = e;
+                if ((i & 1) == 0)
+                {
+                    position_t* pos = g_add_cp<position_t>(ecs, e);
+                    pos->x          = (u32)i;
+                }
+            }
+
+            CHECK_EQUAL(g_get_cp<position_t>(ecs, entities[num_entities - 2])->x, (u32)(num_entities - 2));
+            CHECK_EQUAL(g_get_cp<position_t>(ecs, entities[70000])->x, (u32)70000);
+            CHECK_FALSE(g_has_cp<position_t>(ecs, entities[70001]));
+
+            g_destroy_entity(ecs, entities[10]);
+            g_destroy_entity(ecs, entities[263000]);
+
+            {
+                en_iterator_t iter(ecs, 1);
+                iter.mark_cp<position_t>();
+
+                s32 count = 0;
+                iter.begin();
+                while (!iter.end())
+                {
+                    entity_t e = iter.entity();
+                    CHECK_EQUAL(g_get_cp<position_t>(ecs, e)->x & 1, (u32)0);
+                    iter.next();
+                    count += 1;
+                }
+                CHECK_EQUAL(count, (num_entities / 2) - 2);
+            }
+
+            // freed slots are re-used before the archetype grows
+            entity_t e = g_create_entity(ecs, 1);
+            CHECK_EQUAL(e, entities[10]);
+
+            g_deallocate_array<entity_t>(Allocator, entities);
+            g_destroy_ecs(ecs);
+        }
+
+        static void s_fold_sum_x(void* accumulator, void const* component, void*) { *(u32*)accumulator += ((position_t const*)component)->x; }
+
+        UNITTEST_TEST(reductions)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+
+            const s32 num_entities = 10000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entity_t    e   = g_create_entity(ecs, 0);
+                position_t* pos = g_add_cp<position_t>(ecs, e);
+                pos->x          = (u32)i;
+                pos->y          = (u32)(num_entities - i);
+                pos->z          = 7;
+                if ((i & 1) == 0)
+                    g_add_cp<mass_t>(ecs, e)->value = 0.5f;
+                if (i < 100)
+                    g_add_tag<enemy_tag_t>(ecs, e);
+            }
+
+            en_iterator_t query(ecs, 0);
+            query.mark_cp<position_t>();
+
+            s32 lanes_min[3];
+            s32 lanes_max[3];
+            CHECK_EQUAL(g_reduce_s32<position_t>(ecs, query, REDUCE_MIN, lanes_min), (u32)num_entities);
+            CHECK_EQUAL(g_reduce_s32<position_t>(ecs, query, REDUCE_MAX, lanes_max), (u32)num_entities);
+            CHECK_EQUAL(lanes_min[0], 0);
+            CHECK_EQUAL(lanes_max[0], num_entities - 1);
+            CHECK_EQUAL(lanes_min[1], 1);
+            CHECK_EQUAL(lanes_max[1], num_entities);
+            CHECK_EQUAL(lanes_min[2], 7);
+
+            en_iterator_t mass_query(ecs, 0);
+            mass_query.mark_cp<mass_t>();
+
+            f32 mass = 0.0f;
+            CHECK_EQUAL(g_reduce_f32<mass_t>(ecs, mass_query, REDUCE_SUM, &mass), (u32)num_entities / 2);
+            CHECK_EQUAL(mass, 0.25f * num_entities);
+
+            // the partials of the chunks combined in order give the same result
+            f32       total      = 0.0f;
+            u32 const num_chunks = g_reduce_num_chunks(ecs, mass_query);
+            for (u32 c = 0; c < num_chunks; ++c)
+            {
+                f32 partial;
+                g_reduce_chunk_f32(ecs, mass_query, mass_t::ECS4_COMPONENT_INDEX, c, REDUCE_SUM, &partial, 1);
+                g_reduce_combine_f32(REDUCE_SUM, &total, &partial, 1);
+            }
+            CHECK_EQUAL(total, mass);
+
+            // only the enemies
+            en_iterator_t enemies(ecs, 0);
+            enemies.mark_cp<position_t>();
+            enemies.mark_tag<enemy_tag_t>();
+            CHECK_EQUAL(g_reduce_s32<position_t>(ecs, enemies, REDUCE_MAX, lanes_max), (u32)100);
+            CHECK_EQUAL(lanes_max[0], 99);
+
+            u32 sum_x = 0;
+            CHECK_EQUAL(g_fold<position_t>(ecs, enemies, s_fold_sum_x, &sum_x, nullptr), (u32)100);
+            CHECK_EQUAL(sum_x, (u32)(99 * 100 / 2));
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(count)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+
+            entity_t  entities[1000];
+            const s32 num_entities = 1000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                g_add_cp<position_t>(ecs, entities[i]);
+                if ((i % 3) == 0)
+                    g_add_cp<mass_t>(ecs, entities[i]);
+                if ((i % 5) == 0)
+                    g_add_tag<enemy_tag_t>(ecs, entities[i]);
+            }
+
+            // destroy some entities to create holes
+            for (s32 i = 0; i < num_entities; i += 10)
+                g_destroy_entity(ecs, entities[i]);
+
+            en_iterator_t all(ecs, 0);
+            CHECK_EQUAL(g_count(ecs, all), (u32)900);
+            CHECK_EQUAL(g_count_estimate(ecs, all), (u32)900);
+
+            en_iterator_t mass_query(ecs, 0);
+            mass_query.mark_cp<mass_t>();
+            CHECK_EQUAL(g_count(ecs, mass_query), (u32)300);
+            CHECK_EQUAL(g_count_estimate(ecs, mass_query), (u32)300);
+
+            en_iterator_t enemies(ecs, 0);
+            enemies.mark_cp<position_t>();
+            enemies.mark_cp<mass_t>();
+            enemies.mark_tag<enemy_tag_t>();
+            CHECK_EQUAL(g_count(ecs, enemies), (u32)33);
+            CHECK_TRUE(g_count_estimate(ecs, enemies) >= g_count(ecs, enemies));
+
+            u32 iterated = 0;
+            for (enemies.begin(); !enemies.end(); enemies.next())
+                iterated++;
+            CHECK_EQUAL(g_count(ecs, enemies), iterated);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(rank_select)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<mass_t>(ecs, 0);
+
+            entity_t  entities[3000];
+            const s32 num_entities = 3000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                if ((i & 7) == 0)
+                    g_add_cp<mass_t>(ecs, entities[i]);
+            }
+            for (s32 i = 0; i < num_entities; i += 3)
+                g_destroy_entity(ecs, entities[i]);
+
+            // every alive entity can be found back by its rank
+            u32 k = 0;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                if ((i % 3) == 0)
+                    continue;
+                CHECK_EQUAL(g_rank(ecs, entities[i]), k);
+                CHECK_EQUAL(g_select(ecs, 0, k), entities[i]);
+                k++;
+            }
+            CHECK_EQUAL(g_select(ecs, 0, k), ECS_ENTITY_NULL);
+
+            // destroying an entity updates the ranks after it
+            g_destroy_entity(ecs, entities[1]);
+            CHECK_EQUAL(g_rank(ecs, entities[2]), (u32)0);
+            CHECK_EQUAL(g_select(ecs, 0, 0), entities[2]);
+
+            // the parts cover all alive entities and differ at most 1 in size
+            en_iterator_t iter(ecs, 0);
+            u32           total = 0;
+            for (u32 part = 0; part < 7; ++part)
+            {
+                s32 const begin = g_partition_begin(ecs, 0, part, 7);
+                s32 const end   = g_partition_begin(ecs, 0, part + 1, 7);
+                u32       count = 0;
+                for (iter.begin(begin); !iter.end() && iter.index() < end; iter.next())
+                    count++;
+                CHECK_TRUE(count == (k - 1) / 7 || count == ((k - 1) / 7) + 1);
+                total += count;
+            }
+            CHECK_EQUAL(total, k - 1);
+
+            en_iterator_t mass_query(ecs, 0);
+            mass_query.mark_cp<mass_t>();
+            for (u32 r = 0; r < 100; ++r)
+            {
+                entity_t e = g_sample(ecs, mass_query, r * 7919);
+                CHECK_NOT_EQUAL(e, ECS_ENTITY_NULL);
+                CHECK_TRUE(g_has_cp<mass_t>(ecs, e));
+            }
+
+            g_destroy_ecs(ecs);
+        }
+
+        static void s_cursor_visit(ecs_t* ecs, entity_t e, void*) { g_get_cp<mass_t>(ecs, e)->value += 1.0f; }
+        static u64  s_cursor_clock(void* user) { return (*(u64*)user)++; }
+
+        UNITTEST_TEST(cursor)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<mass_t>(ecs, 0);
+
+            entity_t  entities[100];
+            const s32 num_entities = 100;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i]                               = g_create_entity(ecs, 0);
+                g_add_cp<mass_t>(ecs, entities[i])->value = 0.0f;
+            }
+
+            en_iterator_t query(ecs, 0);
+            query.mark_cp<mass_t>();
+
+            // 7 slices of 30 entities visit every entity twice and 10 entities three times
+            en_cursor_t cursor(ecs, query);
+            for (s32 i = 0; i < 7; ++i)
+                CHECK_EQUAL(cursor.step(s_cursor_visit, nullptr, 30), (u32)30);
+            CHECK_EQUAL(cursor.laps(), (u32)2);
+            for (s32 i = 0; i < num_entities; ++i)
+                CHECK_EQUAL(g_get_cp<mass_t>(ecs, entities[i])->value, i < 10 ? 3.0f : 2.0f);
+
+            // a step never visits an entity twice
+            CHECK_EQUAL(cursor.step(s_cursor_visit, nullptr, 1000), (u32)num_entities);
+
+            // destroyed entities are skipped, new entities are picked up
+            g_destroy_entity(ecs, entities[50]);
+            entity_t e = g_create_entity(ecs, 0);
+            g_add_cp<mass_t>(ecs, e)->value = 0.0f;
+            CHECK_EQUAL(cursor.step(s_cursor_visit, nullptr, 1000), (u32)num_entities);
+            CHECK_EQUAL(g_get_cp<mass_t>(ecs, e)->value, 1.0f);
+
+            // the clock advances 1 tick per call and is called every 16 entities
+            u64 clock = 0;
+            CHECK_EQUAL(cursor.step_until(s_cursor_visit, &clock, s_cursor_clock, 2), (u32)32);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(tag_columns)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_tag_type<dirty_tag_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+
+            entity_t  entities[1000];
+            const s32 num_entities = 1000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                if ((i % 100) == 7)
+                    g_add_tag<dirty_tag_t>(ecs, entities[i]);
+                if ((i & 1) == 0)
+                    g_add_cp<mass_t>(ecs, entities[i]);
+            }
+
+            // the column is built from the tags that are already set
+            g_register_tag_type<dirty_tag_t>(ecs, 0, true);
+
+            g_add_tag<dirty_tag_t>(ecs, entities[500]);
+            g_add_tag<enemy_tag_t>(ecs, entities[500]);
+            g_rem_tag<dirty_tag_t>(ecs, entities[907]);
+            g_destroy_entity(ecs, entities[107]);
+            CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, g_create_entity(ecs, 0))); // re-uses index 107
+
+            en_iterator_t dirty(ecs, 0);
+            dirty.mark_tag<dirty_tag_t>();
+            CHECK_EQUAL(g_count(ecs, dirty), (u32)9);
+
+            u32 iterated = 0;
+            for (dirty.begin(); !dirty.end(); dirty.next())
+            {
+                CHECK_TRUE(g_has_tag<dirty_tag_t>(ecs, dirty.entity()));
+                iterated++;
+            }
+            CHECK_EQUAL(iterated, (u32)9);
+
+            // columns combine with components and tags that do not have a column
+            en_iterator_t dirty_enemy(ecs, 0);
+            dirty_enemy.mark_cp<mass_t>();
+            dirty_enemy.mark_tag<dirty_tag_t>();
+            dirty_enemy.mark_tag<enemy_tag_t>();
+            CHECK_EQUAL(g_count(ecs, dirty_enemy), (u32)1);
+            dirty_enemy.begin();
+            CHECK_EQUAL(dirty_enemy.entity(), entities[500]);
+            dirty_enemy.next();
+            CHECK_TRUE(dirty_enemy.end());
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(bulk_tags)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+            g_register_archetype(ecs, 1, 16, 256, 24); // 3 bytes of tags per entity
+
+            for (u8 a = 0; a < 2; ++a)
+            {
+                g_register_component_type<mass_t>(ecs, a);
+                g_register_tag_type<enemy_tag_t>(ecs, a);
+                g_register_tag_type<dirty_tag_t>(ecs, a);
+            }
+
+            entity_t  entities[2][1000];
+            const s32 num_entities = 1000;
+            for (u8 a = 0; a < 2; ++a)
+            {
+                for (s32 i = 0; i < num_entities; ++i)
+                {
+                    entities[a][i] = g_create_entity(ecs, a);
+                    g_add_tag<enemy_tag_t>(ecs, entities[a][i]);
+                    if ((i & 1) == 0)
+                        g_add_cp<mass_t>(ecs, entities[a][i]);
+                }
+            }
+
+            for (u8 a = 0; a < 2; ++a)
+            {
+                en_iterator_t with_mass(ecs, a);
+                with_mass.mark_cp<mass_t>();
+                CHECK_EQUAL(g_set_tag_all<dirty_tag_t>(ecs, with_mass), (u32)500);
+
+                en_iterator_t dirty(ecs, a);
+                dirty.mark_tag<dirty_tag_t>();
+                CHECK_EQUAL(g_count(ecs, dirty), (u32)500);
+
+                g_clear_tag_all<dirty_tag_t>(ecs, a);
+                CHECK_EQUAL(g_count(ecs, dirty), (u32)0);
+
+                // other tags are not touched
+                en_iterator_t enemies(ecs, a);
+                enemies.mark_tag<enemy_tag_t>();
+                CHECK_EQUAL(g_count(ecs, enemies), (u32)num_entities);
+            }
+
+            // entity arrays can span archetypes
+            entity_t some[4] = {entities[0][3], entities[1][5], entities[0][999], entities[1][0]};
+            g_add_tag<dirty_tag_t>(ecs, some, 4);
+            for (s32 i = 0; i < 4; ++i)
+                CHECK_TRUE(g_has_tag<dirty_tag_t>(ecs, some[i]));
+            g_rem_tag<dirty_tag_t>(ecs, some, 2);
+            CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, some[0]));
+            CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, some[1]));
+            CHECK_TRUE(g_has_tag<dirty_tag_t>(ecs, some[2]));
+
+            // with a tag column, clearing only visits the tagged entities
+            g_register_tag_type<dirty_tag_t>(ecs, 0, true);
+            en_iterator_t dirty(ecs, 0);
+            dirty.mark_tag<dirty_tag_t>();
+            CHECK_EQUAL(g_count(ecs, dirty), (u32)1);
+            g_clear_tag_all<dirty_tag_t>(ecs, 0);
+            CHECK_EQUAL(g_count(ecs, dirty), (u32)0);
+            CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, some[2]));
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(move_entity)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0); // units
+            g_register_archetype(ecs, 1); // corpses
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_component_type<velocity_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 1);
+            g_register_component_type<position_t>(ecs, 1);
+
+            entity_t unit = g_create_entity(ecs, 0);
+            g_add_cp<position_t>(ecs, unit)->x = 11;
+            g_add_cp<velocity_t>(ecs, unit)->x = 1.0f;
+            g_add_cp<mass_t>(ecs, unit)->value = 80.0f;
+            g_add_tag<enemy_tag_t>(ecs, unit);
+
+            entity_t corpse = g_move_entity(ecs, unit, 1);
+            CHECK_NOT_EQUAL(corpse, ECS_ENTITY_NULL);
+            CHECK_NOT_EQUAL(corpse, unit);
+            CHECK_EQUAL(g_get_cp<position_t>(ecs, corpse)->x, (u32)11);
+            CHECK_EQUAL(g_get_cp<mass_t>(ecs, corpse)->value, 80.0f);
+            CHECK_FALSE(g_has_cp<velocity_t>(ecs, corpse));
+            CHECK_TRUE(g_has_tag<enemy_tag_t>(ecs, corpse));
+
+            // the stale handle is redirected
+            CHECK_EQUAL(g_remap_entity(ecs, unit), corpse);
+            CHECK_EQUAL(g_remap_entity(ecs, corpse), corpse);
+            g_destroy_entity(ecs, corpse);
+            CHECK_EQUAL(g_remap_entity(ecs, corpse), ECS_ENTITY_NULL);
+
+            // batched
+            entity_t units[100];
+            for (s32 i = 0; i < 100; ++i)
+            {
+                units[i]                              = g_create_entity(ecs, 0);
+                g_add_cp<mass_t>(ecs, units[i])->value = (f32)i;
+            }
+            CHECK_EQUAL(g_move_entities(ecs, units, 100, 1), (u32)100);
+            for (s32 i = 0; i < 100; ++i)
+                CHECK_EQUAL(g_get_cp<mass_t>(ecs, units[i])->value, (f32)i);
+
+            en_iterator_t corpses(ecs, 1);
+            CHECK_EQUAL(g_count(ecs, corpses), (u32)100);
+            en_iterator_t alive_units(ecs, 0);
+            CHECK_EQUAL(g_count(ecs, alive_units), (u32)0);
+
+            // the entities that do not fit in the destination keep their handle
+            g_register_archetype(ecs, 2, 16, 256, 8, 32, 64);
+            g_register_component_type<mass_t>(ecs, 2);
+            CHECK_EQUAL(g_move_entities(ecs, units, 100, 2), (u32)64);
+            CHECK_EQUAL(g_get_cp<mass_t>(ecs, units[63])->value, 63.0f);
+            CHECK_EQUAL(g_get_cp<mass_t>(ecs, units[64])->value, 64.0f);
+            CHECK_EQUAL(g_count(ecs, corpses), (u32)36);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(sparse_query)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 0);
+
+            // only a few entities have mass, most blocks of 64 entities are skipped
+            entity_t  entities[20000];
+            const s32 num_entities = 20000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                g_add_cp<position_t>(ecs, entities[i]);
+                if ((i % 1000) == 999)
+                    g_add_cp<mass_t>(ecs, entities[i]);
+            }
+
+            en_iterator_t query(ecs, 0);
+            query.mark_cp<mass_t>();
+            query.mark_cp<position_t>();
+
+            u32 iterated = 0;
+            for (query.begin(); !query.end(); query.next())
+            {
+                CHECK_EQUAL(query.entity(), entities[iterated * 1000 + 999]);
+                iterated++;
+            }
+            CHECK_EQUAL(iterated, (u32)20);
+
+            // the summary follows removals, a block becomes empty again
+            g_rem_cp<mass_t>(ecs, entities[999]);
+            g_destroy_entity(ecs, entities[1999]);
+            CHECK_EQUAL(g_count(ecs, query), (u32)18);
+            query.begin();
+            CHECK_EQUAL(query.entity(), entities[2999]);
+
+            g_add_cp<mass_t>(ecs, entities[5]);
+            query.begin();
+            CHECK_EQUAL(query.entity(), entities[5]);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(registered_query)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+
+            entity_t  entities[1000];
+            const s32 num_entities = 1000;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                g_add_cp<position_t>(ecs, entities[i]);
+                if ((i % 100) == 0)
+                    g_add_cp<mass_t>(ecs, entities[i]);
+            }
+
+            en_iterator_t query(ecs, 0);
+            query.mark_cp<mass_t>();
+            query.mark_tag<enemy_tag_t>();
+
+            const s32 q = g_register_query(ecs, query);
+            CHECK_EQUAL(q, 0);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)0);
+
+            // membership follows tags, components and destruction
+            g_add_tag<enemy_tag_t>(ecs, entities[100]);
+            g_add_tag<enemy_tag_t>(ecs, entities[500]);
+            g_add_tag<enemy_tag_t>(ecs, entities[501]);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)2);
+            g_add_cp<mass_t>(ecs, entities[501]);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)3);
+            g_rem_cp<mass_t>(ecs, entities[100]);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)2);
+            g_destroy_entity(ecs, entities[500]);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)1);
+
+            en_iterator_t iter(ecs, 0);
+            iter.use_query(q);
+            iter.begin();
+            CHECK_EQUAL(iter.entity(), entities[501]);
+            iter.next();
+            CHECK_TRUE(iter.end());
+
+            // bulk tags rebuild the membership
+            en_iterator_t with_mass(ecs, 0);
+            with_mass.mark_cp<mass_t>();
+            g_set_tag_all<enemy_tag_t>(ecs, with_mass);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)g_count(ecs, query));
+            g_clear_tag_all<enemy_tag_t>(ecs, 0);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)0);
+
+            g_unregister_query(ecs, 0, q);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)0);
+            CHECK_EQUAL(g_register_query(ecs, query), q);
+
+            g_destroy_ecs(ecs);
+        }
+
+        static u64  s_sort_key_mass(ecs_t* ecs, entity_t e, void*) { return (u64)g_get_cp<mass_t>(ecs, e)->value; }
+        static void s_sort_moved(entity_t from, entity_t to, void* user)
+        {
+            entity_t* entities = (entity_t*)user;
+            for (s32 i = 0; i < 500; ++i)
+            {
+                if (entities[i] == from)
+                {
+                    entities[i + 500] = to;
+                    return;
+                }
+            }
+        }
+
+        UNITTEST_TEST(sort_storage)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0, true);
+
+            // the components are allocated in the reverse order of the entities
+            entity_t  entities[1000];
+            const s32 num_entities = 500;
+            for (s32 i = 0; i < num_entities; ++i)
+                entities[i] = g_create_entity(ecs, 0);
+            for (s32 i = num_entities - 1; i >= 0; --i)
+            {
+                g_add_cp<mass_t>(ecs, entities[i])->value = (f32)(num_entities - 1 - i);
+                g_add_cp<position_t>(ecs, entities[i])->x = (u32)i;
+                if ((i % 5) == 0)
+                    g_add_tag<enemy_tag_t>(ecs, entities[i]);
+            }
+            for (s32 i = 0; i < num_entities; ++i)
+                entities[i + num_entities] = entities[i];
+
+            en_iterator_t enemies(ecs, 0);
+            enemies.mark_tag<enemy_tag_t>();
+            const s32 q = g_register_query(ecs, enemies);
+
+            CHECK_EQUAL(g_sort_storage(ecs, 0, s_sort_key_mass, s_sort_moved, entities), (u32)num_entities);
+
+            // iteration follows the key and walks the component memory front to back
+            en_iterator_t iter(ecs, 0);
+            iter.mark_cp<mass_t>();
+            u32         k        = 0;
+            byte const* previous = nullptr;
+            for (iter.begin(); !iter.end(); iter.next(), ++k)
+            {
+                mass_t const* mass = g_get_cp<mass_t>(ecs, iter.entity());
+                CHECK_EQUAL(mass->value, (f32)k);
+                CHECK_TRUE((byte const*)mass > previous);
+                previous = (byte const*)mass;
+            }
+            CHECK_EQUAL(k, (u32)num_entities);
+
+            // the moved entities carry their components and tags
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                CHECK_EQUAL(g_get_cp<mass_t>(ecs, entities[i + num_entities])->value, (f32)(num_entities - 1 - i));
+                CHECK_EQUAL(g_get_cp<position_t>(ecs, entities[i + num_entities])->x, (u32)i);
+                CHECK_EQUAL(g_has_tag<enemy_tag_t>(ecs, entities[i + num_entities]), (i % 5) == 0);
+            }
+            CHECK_EQUAL(g_count(ecs, enemies), (u32)100);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)100);
+
+            // sorted data stays put, nearly sorted data converges with a bounded number of moves per call
+            CHECK_EQUAL(g_sort_storage(ecs, 0, s_sort_key_mass, nullptr, nullptr), (u32)0);
+            g_get_cp<mass_t>(ecs, g_select(ecs, 0, 400))->value = 0.5f;
+            u32 calls = 0;
+            while (g_sort_storage(ecs, 0, s_sort_key_mass, nullptr, nullptr, 100) != 0)
+                calls++;
+            CHECK_EQUAL(calls, (u32)4);
+            CHECK_EQUAL(g_get_cp<mass_t>(ecs, g_select(ecs, 0, 1))->value, 0.5f);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(sort_spatial)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<world_position_t>(ecs, 0);
+
+            // two clusters that are spawned interleaved
+            const s32 num_entities = 200;
+            for (s32 i = 0; i < num_entities; ++i)
+            {
+                world_position_t* position = g_add_cp<world_position_t>(ecs, g_create_entity(ecs, 0));
+                position->x                = (f32)((i & 1) * 1000 + (i % 7));
+                position->y                = (f32)(i % 5);
+                position->z                = (f32)(i % 3);
+            }
+
+            // a bounded number of moves per call converges to the sorted order
+            u32 calls = 0;
+            while (g_sort_spatial(ecs, 0, world_position_t::ECS4_COMPONENT_INDEX, 1.0f, nullptr, nullptr, 1000) != 0)
+                calls++;
+            CHECK_TRUE(calls > 1);
+
+            en_iterator_t iter(ecs, 0);
+            u32           k = 0;
+            for (iter.begin(); !iter.end(); iter.next(), ++k)
+                CHECK_EQUAL(g_get_cp<world_position_t>(ecs, iter.entity())->x < 500.0f, k < 100);
+            CHECK_EQUAL(k, (u32)num_entities);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(spatial_grid)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<world_position_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+
+            // a 10 x 10 lattice, the entities with an even x are enemies
+            entity_t entities[100];
+            for (s32 i = 0; i < 100; ++i)
+            {
+                entities[i]                = g_create_entity(ecs, 0);
+                world_position_t* position = g_add_cp<world_position_t>(ecs, entities[i]);
+                position->x                = (f32)(i % 10);
+                position->y                = (f32)(i / 10);
+                position->z                = 0.0f;
+                if (((i % 10) & 1) == 0)
+                    g_add_tag<enemy_tag_t>(ecs, entities[i]);
+            }
+
+            grid_t* grid = g_create_grid(ecs, 0, world_position_t::ECS4_COMPONENT_INDEX, 2.0f, 64);
+            g_grid_update_all(grid);
+            CHECK_EQUAL(g_grid_count(grid), (u32)100);
+
+            entity_t  out[100];
+            const f32 center[3] = {5.0f, 5.0f, 0.0f};
+            CHECK_EQUAL(g_grid_query_radius(grid, nullptr, center, 1.5f, out, 100), (u32)9);
+            CHECK_EQUAL(g_grid_query_radius(grid, nullptr, center, 1.5f, out, 4), (u32)4);
+
+            const f32 box_min[3] = {2.0f, 2.0f, -1.0f};
+            const f32 box_max[3] = {4.0f, 4.0f, 1.0f};
+            CHECK_EQUAL(g_grid_query_box(grid, nullptr, box_min, box_max, out, 100), (u32)9);
+
+            // spatial and tag predicates combined
+            en_iterator_t enemies(ecs, 0);
+            enemies.mark_tag<enemy_tag_t>();
+            CHECK_EQUAL(g_grid_query_radius(grid, &enemies, center, 1.5f, out, 100), (u32)6);
+
+            // a box that covers more cells than there are buckets
+            const f32 all_min[3] = {-100.0f, -100.0f, -100.0f};
+            const f32 all_max[3] = {100.0f, 100.0f, 100.0f};
+            CHECK_EQUAL(g_grid_query_box(grid, nullptr, all_min, all_max, out, 100), (u32)100);
+
+            const f32 corner[3] = {0.1f, 0.2f, 0.0f};
+            CHECK_EQUAL(g_grid_query_nearest(grid, nullptr, corner, 3, out), (u32)3);
+            CHECK_EQUAL(out[0], entities[0]);
+            CHECK_EQUAL(out[1], entities[10]);
+            CHECK_EQUAL(out[2], entities[1]);
+            CHECK_EQUAL(g_grid_query_nearest(grid, &enemies, corner, 2, out), (u32)2);
+            CHECK_EQUAL(out[1], entities[10]);
+
+            // moving and removing entities
+            g_get_cp<world_position_t>(ecs, entities[99])->x = 5.5f;
+            g_get_cp<world_position_t>(ecs, entities[99])->y = 5.5f;
+            g_grid_update(grid, entities[99]);
+            CHECK_EQUAL(g_grid_query_nearest(grid, nullptr, center, 1, out), (u32)1);
+            CHECK_EQUAL(out[0], entities[55]);
+            CHECK_EQUAL(g_grid_query_radius(grid, nullptr, center, 1.5f, out, 100), (u32)10);
+            g_grid_remove(grid, entities[55]);
+            g_destroy_entity(ecs, entities[55]);
+            CHECK_EQUAL(g_grid_query_radius(grid, nullptr, center, 1.5f, out, 100), (u32)9);
+            CHECK_EQUAL(g_grid_count(grid), (u32)99);
+
+            g_destroy_grid(grid);
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(instantiate)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0); // prefabs
+            g_register_archetype(ecs, 1); // units
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_component_type<velocity_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_component_type<velocity_t>(ecs, 1);
+            g_register_component_type<position_t>(ecs, 1);
+
+            entity_t soldier = g_create_entity(ecs, 0);
+            g_add_cp<position_t>(ecs, soldier)->x     = 7;
+            g_add_cp<velocity_t>(ecs, soldier)->speed = 3;
+            g_add_cp<mass_t>(ecs, soldier)->value     = 80.0f;
+            g_add_tag<enemy_tag_t>(ecs, soldier);
+
+            entity_t  soldiers[500];
+            const u32 num_soldiers = 500;
+            CHECK_EQUAL(g_instantiate(ecs, soldier, 1, soldiers, num_soldiers), num_soldiers);
+            for (u32 i = 0; i < num_soldiers; ++i)
+            {
+                CHECK_EQUAL(g_get_cp<position_t>(ecs, soldiers[i])->x, (u32)7);
+                CHECK_EQUAL(g_get_cp<velocity_t>(ecs, soldiers[i])->speed, (u32)3);
+                CHECK_FALSE(g_has_cp<mass_t>(ecs, soldiers[i]));
+                CHECK_TRUE(g_has_tag<enemy_tag_t>(ecs, soldiers[i]));
+            }
+
+            // the instances own their components
+            g_get_cp<position_t>(ecs, soldiers[10])->x = 8;
+            CHECK_EQUAL(g_get_cp<position_t>(ecs, soldiers[11])->x, (u32)7);
+            CHECK_EQUAL(g_get_cp<position_t>(ecs, soldier)->x, (u32)7);
+
+            en_iterator_t units(ecs, 1);
+            units.mark_cp<position_t>();
+            units.mark_tag<enemy_tag_t>();
+            CHECK_EQUAL(g_count(ecs, units), num_soldiers);
+
+            // instances fill the holes of destroyed entities
+            g_destroy_entity(ecs, soldiers[3]);
+            g_destroy_entity(ecs, soldiers[4]);
+            CHECK_EQUAL(g_instantiate(ecs, soldier, 1, soldiers + 3, 2), (u32)2);
+            CHECK_EQUAL(g_get_cp<velocity_t>(ecs, soldiers[4])->speed, (u32)3);
+            CHECK_EQUAL(g_count(ecs, units), num_soldiers);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(shared_components)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+            g_register_archetype(ecs, 1);
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_shared_component_type<material_t>(ecs, 0);
+            g_register_component_type<material_t>(ecs, 1);
+
+            entity_t  entities[300];
+            const u32 num_entities = 300;
+            for (u32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                g_add_cp<position_t>(ecs, entities[i])->x = i;
+
+                material_t material;
+                material.shader  = i % 3;
+                material.texture = 10 + (i % 3);
+                CHECK_NOT_NULL(g_set_shared_cp(ecs, entities[i], material));
+            }
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS4_COMPONENT_INDEX), (u32)3);
+
+            // equal values share one copy
+            CHECK_EQUAL(g_get_shared_index(ecs, entities[0], material_t::ECS4_COMPONENT_INDEX), g_get_shared_index(ecs, entities[3], material_t::ECS4_COMPONENT_INDEX));
+            CHECK_EQUAL(g_get_cp<material_t>(ecs, entities[0]), g_get_cp<material_t>(ecs, entities[3]));
+            CHECK_EQUAL(g_get_cp<material_t>(ecs, entities[4])->texture, (u32)11);
+
+            // iterate one value at a time
+            u32 total = 0;
+            for (u32 v = 0; v < g_shared_value_end(ecs, material_t::ECS4_COMPONENT_INDEX); ++v)
+            {
+                material_t const* material = (material_t const*)g_get_shared_value(ecs, material_t::ECS4_COMPONENT_INDEX, v);
+                CHECK_NOT_NULL(material);
+                en_iterator_t iter(ecs, 0);
+                iter.mark_shared<material_t>(v);
+                u32 count = 0;
+                for (iter.begin(); !iter.end(); iter.next())
+                {
+                    CHECK_EQUAL(g_get_cp<material_t>(ecs, iter.entity())->shader, material->shader);
+                    count++;
+                }
+                CHECK_EQUAL(count, (u32)100);
+                total += count;
+            }
+            CHECK_EQUAL(total, num_entities);
+
+            // a value is released by the last entity that uses it
+            for (u32 i = 0; i < num_entities; i += 3)
+                g_destroy_entity(ecs, entities[i]);
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS4_COMPONENT_INDEX), (u32)2);
+
+            // a new value reuses the released index
+            material_t red;
+            red.shader  = 7;
+            red.texture = 7;
+            g_set_shared_cp(ecs, entities[1], red);
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS4_COMPONENT_INDEX), (u32)3);
+            CHECK_EQUAL(g_shared_value_end(ecs, material_t::ECS4_COMPONENT_INDEX), (u32)3);
+            g_rem_cp<material_t>(ecs, entities[1]);
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS4_COMPONENT_INDEX), (u32)2);
+
+            // prefab instances reference the value of the prefab
+            entity_t instances[10];
+            CHECK_EQUAL(g_instantiate(ecs, entities[2], 0, instances, 10), (u32)10);
+            CHECK_EQUAL(g_get_shared_index(ecs, instances[9], material_t::ECS4_COMPONENT_INDEX), g_get_shared_index(ecs, entities[2], material_t::ECS4_COMPONENT_INDEX));
+
+            // an archetype without the shared registration stores its own copy
+            const entity_t moved = g_move_entity(ecs, entities[2], 1);
+            CHECK_EQUAL(g_get_cp<material_t>(ecs, moved)->texture, (u32)12);
+            CHECK_EQUAL(g_get_shared_index(ecs, moved, material_t::ECS4_COMPONENT_INDEX), ECS4_SHARED_NONE);
+            for (u32 i = 0; i < 10; ++i)
+                g_destroy_entity(ecs, instances[i]);
+            for (u32 i = 5; i < num_entities; i += 3)
+                g_destroy_entity(ecs, entities[i]);
+            CHECK_EQUAL(g_shared_value_count(ecs, material_t::ECS4_COMPONENT_INDEX), (u32)1);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(cold_components)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+            g_register_archetype(ecs, 1);
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_cold_component_type<spawn_info_t>(ecs, 0);
+            g_register_component_type<position_t>(ecs, 1);
+            g_register_component_type<spawn_info_t>(ecs, 1);
+
+            entity_t  entities[100];
+            const u32 num_entities = 100;
+            for (u32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                g_add_cp<position_t>(ecs, entities[i])->x = i;
+                g_add_cp<mass_t>(ecs, entities[i])->value = (f32)(num_entities - 1 - i);
+                if ((i % 2) == 0)
+                {
+                    spawn_info_t* info = g_add_cp<spawn_info_t>(ecs, entities[i]);
+                    info->wave         = i;
+                    info->spawner      = 1;
+                }
+            }
+            CHECK_EQUAL(g_cold_count<spawn_info_t>(ecs, 0), (u32)50);
+            CHECK_TRUE(g_has_cp<spawn_info_t>(ecs, entities[10]));
+            CHECK_FALSE(g_has_cp<spawn_info_t>(ecs, entities[11]));
+            CHECK_NULL(g_get_cp<spawn_info_t>(ecs, entities[11]));
+            CHECK_EQUAL(g_get_cp<spawn_info_t>(ecs, entities[10])->wave, (u32)10);
+
+            // removing a cold component moves the last one into the hole
+            g_rem_cp<spawn_info_t>(ecs, entities[0]);
+            CHECK_EQUAL(g_cold_count<spawn_info_t>(ecs, 0), (u32)49);
+            CHECK_FALSE(g_has_cp<spawn_info_t>(ecs, entities[0]));
+            CHECK_EQUAL(g_get_cp<spawn_info_t>(ecs, entities[98])->wave, (u32)98);
+
+            // the cold components follow their entities when the storage is sorted
+            CHECK_EQUAL(g_sort_storage(ecs, 0, s_sort_key_mass, nullptr, nullptr), (u32)num_entities);
+            entity_t      second = ECS_ENTITY_NULL;
+            u32           count  = 0;
+            en_iterator_t iter(ecs, 0);
+            iter.mark_cp<position_t>();
+            for (iter.begin(); !iter.end(); iter.next())
+            {
+                const u32           x    = g_get_cp<position_t>(ecs, iter.entity())->x;
+                spawn_info_t const* info = g_get_cp<spawn_info_t>(ecs, iter.entity());
+                CHECK_EQUAL(info != nullptr, (x % 2) == 0 && x > 0);
+                if (info != nullptr)
+                    CHECK_EQUAL(info->wave, x);
+                if (x == 2)
+                    second = iter.entity();
+                count++;
+            }
+            CHECK_EQUAL(count, num_entities);
+
+            // a prefab copies its cold components to every instance
+            entity_t instances[5];
+            CHECK_EQUAL(g_instantiate(ecs, second, 0, instances, 5), (u32)5);
+            CHECK_EQUAL(g_cold_count<spawn_info_t>(ecs, 0), (u32)54);
+            CHECK_EQUAL(g_get_cp<spawn_info_t>(ecs, instances[4])->wave, (u32)2);
+
+            // a cold component becomes a regular component in an archetype that has it hot, and back
+            const entity_t moved = g_move_entity(ecs, second, 1);
+            CHECK_EQUAL(g_cold_count<spawn_info_t>(ecs, 0), (u32)53);
+            CHECK_EQUAL(g_get_cp<spawn_info_t>(ecs, moved)->wave, (u32)2);
+            const entity_t back = g_move_entity(ecs, moved, 0);
+            CHECK_EQUAL(g_cold_count<spawn_info_t>(ecs, 0), (u32)54);
+            CHECK_EQUAL(g_get_cp<spawn_info_t>(ecs, back)->spawner, (u32)1);
+
+            for (u32 i = 0; i < 5; ++i)
+                g_destroy_entity(ecs, instances[i]);
+            CHECK_EQUAL(g_cold_count<spawn_info_t>(ecs, 0), (u32)49);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(compressed_components)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<position_t>(ecs, 0);
+            g_register_compressed_component_type<history_t>(ecs, 0);
+
+            entity_t  entities[500];
+            const u32 num_entities = 500;
+            for (u32 i = 0; i < num_entities; ++i)
+            {
+                entities[i]        = g_create_entity(ecs, 0);
+                history_t* history = g_add_cp<history_t>(ecs, entities[i]);
+                g_memclr(history, sizeof(history_t));
+                history->frame = (s32)i;
+                history->score = (s32)(i * 10);
+            }
+
+            // access that jumps between blocks goes through the cache
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[3])->score, (s32)30);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[400])->frame, (s32)400);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[130])->score, (s32)1300);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[260])->frame, (s32)260);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[499])->score, (s32)4990);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[3])->frame, (s32)3);
+
+            compressed_stats_t stats;
+            CHECK_TRUE(g_compressed_stats<history_t>(ecs, 0, stats));
+            CHECK_EQUAL(stats.m_raw_bytes, (u64)num_entities * sizeof(history_t));
+            CHECK_TRUE(stats.m_compressed_bytes * 4 < stats.m_raw_bytes);
+            CHECK_TRUE(stats.m_ratio > 4.0f);
+
+            // a block that grows moves, the values survive
+            for (u32 i = 0; i < num_entities; i += 7)
+                g_get_cp<history_t>(ecs, entities[i])->flags[i % 6] = i * 2654435761u;
+            for (u32 i = 0; i < num_entities; ++i)
+            {
+                history_t const* history = g_get_cp<history_t>(ecs, entities[i]);
+                CHECK_EQUAL(history->frame, (s32)i);
+                CHECK_EQUAL(history->flags[i % 6], (i % 7) == 0 ? i * 2654435761u : 0u);
+            }
+
+            // the last value moves into the hole
+            g_destroy_entity(ecs, entities[0]);
+            CHECK_EQUAL(g_cold_count<history_t>(ecs, 0), num_entities - 1);
+            CHECK_EQUAL(g_get_cp<history_t>(ecs, entities[499])->score, (s32)4990);
+
+            for (u32 i = 1; i < num_entities; ++i)
+                g_destroy_entity(ecs, entities[i]);
+            CHECK_TRUE(g_compressed_stats<history_t>(ecs, 0, stats));
+            CHECK_EQUAL(stats.m_compressed_bytes, (u64)0);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(soa_components)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+            g_register_archetype(ecs, 1);
+
+            g_register_soa_component_type<world_position_t>(ecs, 0);
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_component_type<world_position_t>(ecs, 1);
+
+            entity_t  entities[100];
+            const u32 num_entities = 100;
+            for (u32 i = 0; i < num_entities; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                g_add_cp<mass_t>(ecs, entities[i])->value = (f32)(num_entities - 1 - i);
+
+                world_position_t* p = g_add_cp<world_position_t>(ecs, entities[i]);
+                p->x                = (f32)i;
+                p->y                = (f32)(i * 2);
+                p->z                = 1.0f;
+            }
+
+            u32        count = 0;
+            f32 const* xs    = g_get_column<world_position_t>(ecs, 0, 0, count);
+            f32 const* ys    = g_get_column<world_position_t>(ecs, 0, 1, count);
+            CHECK_EQUAL(count, num_entities);
+            CHECK_EQUAL(((u64)xs & 63), (u64)0);
+            CHECK_EQUAL(((u64)ys & 63), (u64)0);
+            CHECK_EQUAL(xs[99], 99.0f);
+            CHECK_EQUAL(ys[50], 100.0f);
+
+            // a write through g_get_cp ends up in the columns
+            g_get_cp<world_position_t>(ecs, entities[10])->y = -1.0f;
+            CHECK_EQUAL(g_get_cp<world_position_t>(ecs, entities[11])->y, 22.0f);
+            ys = g_get_column<world_position_t>(ecs, 0, 1, count);
+            CHECK_EQUAL(ys[10], -1.0f);
+
+            // a removed component leaves a hole in the columns
+            g_destroy_entity(ecs, entities[0]);
+            en_iterator_t query(ecs, 0);
+            query.mark_cp<world_position_t>();
+            f32 lanes[3];
+            CHECK_EQUAL(g_reduce_f32(ecs, query, world_position_t::ECS4_COMPONENT_INDEX, REDUCE_SUM, lanes, 3), num_entities - 1);
+            CHECK_EQUAL(lanes[0], (f32)((num_entities - 1) * num_entities / 2));
+            CHECK_EQUAL(lanes[2], (f32)(num_entities - 1));
+
+            // after sorting, the k-th entity has the k-th used slot
+            CHECK_EQUAL(g_sort_storage(ecs, 0, s_sort_key_mass, nullptr, nullptr), num_entities - 2);
+            xs = g_get_column<world_position_t>(ecs, 0, 0, count);
+            for (u32 k = 0; k < num_entities - 1; ++k)
+            {
+                CHECK_EQUAL(xs[k + 1], (f32)(num_entities - 1 - k));
+                CHECK_EQUAL(g_get_cp<world_position_t>(ecs, g_select(ecs, 0, k))->x, (f32)(num_entities - 1 - k));
+            }
+
+            // moving and instantiating copy the gathered component
+            const entity_t moved = g_move_entity(ecs, g_select(ecs, 0, 0), 1);
+            CHECK_EQUAL(g_get_cp<world_position_t>(ecs, moved)->y, 198.0f);
+            entity_t copies[4];
+            CHECK_EQUAL(g_instantiate(ecs, g_select(ecs, 0, 0), 0, copies, 4), (u32)4);
+            for (u32 i = 0; i < 4; ++i)
+                CHECK_EQUAL(g_get_cp<world_position_t>(ecs, copies[i])->y, 196.0f);
+            CHECK_EQUAL(g_get_cp<world_position_t>(ecs, g_select(ecs, 0, 0))->x, 98.0f);
+
+            CHECK_NULL(g_get_column(ecs, 0, mass_t::ECS4_COMPONENT_INDEX, 0, count));
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(aligned_components)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<matrix_t>(ecs, 0);
+            g_register_component_type(ecs, 0, 10, 12, 16);
+            g_register_cold_component_type(ecs, 0, 11, 12, 32);
+
+            for (u32 i = 0; i < 5; ++i)
+            {
+                entity_t e = g_create_entity(ecs, 0);
+                CHECK_EQUAL(((u64)g_add_cp<matrix_t>(ecs, e) & 31), (u64)0);
+                CHECK_EQUAL(((u64)g_add_cp(ecs, e, 10) & 15), (u64)0);
+                CHECK_EQUAL(((u64)g_add_cp(ecs, e, 11) & 31), (u64)0);
+            }
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(singletons)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            CHECK_TRUE(g_register_singleton<game_time_t>(ecs));
+            CHECK_FALSE(g_register_singleton<game_time_t>(ecs));
+
+            game_time_t* time = g_get_singleton<game_time_t>(ecs);
+            CHECK_NOT_NULL(time);
+            CHECK_EQUAL(time->frame, (u32)0);
+            time->frame = 7;
+            CHECK_EQUAL(g_get_singleton<game_time_t>(ecs)->frame, (u32)7);
+
+            // the access of a query
+            en_iterator_t iter(ecs, 0);
+            iter.read_singleton<game_time_t>();
+            CHECK_EQUAL(iter.singleton_reads(), (u32)1);
+            CHECK_EQUAL(iter.singleton_writes(), (u32)0);
+            iter.write_singleton<game_time_t>();
+            CHECK_EQUAL(iter.singleton_writes(), (u32)1);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(value_index)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+
+            g_register_component_type<unit_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+
+            // 100 units in 4 teams, the units with an odd id are enemies
+            entity_t units[100];
+            for (u32 i = 0; i < 100; ++i)
+            {
+                units[i]     = g_create_entity(ecs, 0);
+                unit_t* unit = g_add_cp<unit_t>(ecs, units[i]);
+                unit->team   = i & 3;
+                unit->id     = 1000 + i;
+                if (i & 1)
+                    g_add_tag<enemy_tag_t>(ecs, units[i]);
+            }
+
+            value_index_t* teams = g_create_index(ecs, 0, unit_t::ECS4_COMPONENT_INDEX, s_unit_team, nullptr, INDEX_HASH, 16);
+            value_index_t* ids   = g_create_index(ecs, 0, unit_t::ECS4_COMPONENT_INDEX, s_unit_id, nullptr, INDEX_ORDERED, 64);
+            g_index_update_all(teams);
+            g_index_update_all(ids);
+            CHECK_EQUAL(g_index_count(teams), (u32)100);
+
+            entity_t out[100];
+            CHECK_EQUAL(g_index_find(teams, nullptr, 3, out, 100), (u32)25);
+            CHECK_EQUAL(g_index_find(teams, nullptr, 3, out, 4), (u32)25);
+            CHECK_EQUAL(g_index_find(teams, nullptr, 7, out, 100), (u32)0);
+            CHECK_EQUAL(g_index_find(ids, nullptr, 1042, out, 100), (u32)1);
+            CHECK_EQUAL(out[0], units[42]);
+
+            // a probe combined with a tag predicate, team 1 only has enemies and team 2 has none
+            en_iterator_t enemies(ecs, 0);
+            enemies.mark_tag<enemy_tag_t>();
+            CHECK_EQUAL(g_index_find(teams, &enemies, 1, out, 100), (u32)25);
+            CHECK_EQUAL(g_index_find(teams, &enemies, 2, out, 100), (u32)0);
+
+            // range probes return the entities in key order
+            CHECK_EQUAL(g_index_range(ids, nullptr, 1010, 1019, out, 100), (u32)10);
+            for (u32 i = 0; i < 10; ++i)
+                CHECK_EQUAL(out[i], units[10 + i]);
+            CHECK_EQUAL(g_index_range(ids, &enemies, 1010, 1019, out, 100), (u32)5);
+            CHECK_EQUAL(g_index_range(ids, nullptr, 0, 999, out, 100), (u32)0);
+
+            // changing a key and removing entities
+            g_get_cp<unit_t>(ecs, units[0])->team = 3;
+            g_get_cp<unit_t>(ecs, units[0])->id   = 5000;
+            g_index_update(teams, units[0]);
+            g_index_update(ids, units[0]);
+            CHECK_EQUAL(g_index_find(teams, nullptr, 3, out, 100), (u32)26);
+            CHECK_EQUAL(g_index_range(ids, nullptr, 1099, 9999, out, 100), (u32)2);
+            CHECK_EQUAL(out[1], units[0]);
+
+            g_index_remove(teams, units[3]);
+            g_index_remove(ids, units[3]);
+            g_destroy_entity(ecs, units[3]);
+            g_destroy_entity(ecs, units[7]); // not removed from the index, skipped by the probes
+            CHECK_EQUAL(g_index_find(teams, nullptr, 3, out, 100), (u32)24);
+            CHECK_EQUAL(g_index_range(ids, nullptr, 1000, 1009, out, 100), (u32)7);
+            CHECK_EQUAL(g_index_count(teams), (u32)99);
+
+            g_destroy_index(ids);
+            g_destroy_index(teams);
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(scheduled_actions)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+            g_register_archetype(ecs, 1);
+
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+            g_register_tag_type<dirty_tag_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 1);
+
+            entity_t entities[100];
+            for (s32 i = 0; i < 100; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                g_add_cp<mass_t>(ecs, entities[i])->value = (f32)i;
+                g_add_tag<dirty_tag_t>(ecs, entities[i]);
+            }
+
+            CHECK_FALSE(g_schedule_destroy(ecs, entities[0], 5));
+            g_register_timers(ecs, 1024);
+
+            for (s32 i = 0; i < 100; i += 2)
+                CHECK_TRUE(g_schedule_rem_tag<dirty_tag_t>(ecs, entities[i], 10));
+            CHECK_TRUE(g_schedule_destroy(ecs, entities[1], 5));
+            CHECK_TRUE(g_schedule_rem_cp<mass_t>(ecs, entities[3], 100));
+            CHECK_TRUE(g_schedule_destroy(ecs, entities[5], 300000)); // more than 64^3 ticks away
+            CHECK_TRUE(g_schedule_add_tag<enemy_tag_t>(ecs, entities[7], 70));
+            CHECK_EQUAL(g_num_scheduled(ecs), (u32)54);
+
+            // only the actions that are due are applied
+            CHECK_EQUAL(g_advance_ticks(ecs, 4), (u32)0);
+            CHECK_EQUAL(g_advance_ticks(ecs), (u32)1);
+            CHECK_EQUAL(g_remap_entity(ecs, entities[1]), ECS_ENTITY_NULL);
+            CHECK_EQUAL(g_advance_ticks(ecs, 5), (u32)50);
+            CHECK_EQUAL(g_current_tick(ecs), (u64)10);
+            CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, entities[0]));
+            CHECK_TRUE(g_has_tag<dirty_tag_t>(ecs, entities[9]));
+
+            // a tick that has passed is due at the next tick
+            CHECK_TRUE(g_schedule_rem_tag<dirty_tag_t>(ecs, entities[9], 2));
+            CHECK_EQUAL(g_advance_ticks(ecs), (u32)1);
+            CHECK_FALSE(g_has_tag<dirty_tag_t>(ecs, entities[9]));
+
+            // cancelling, destroying the entity cancels its actions as well
+            CHECK_TRUE(g_schedule_destroy(ecs, entities[11], 20));
+            CHECK_EQUAL(g_cancel_schedule(ecs, entities[11]), (u32)1);
+            CHECK_TRUE(g_schedule_destroy(ecs, entities[13], 20));
+            CHECK_EQUAL(g_num_scheduled(ecs), (u32)4);
+            g_destroy_entity(ecs, entities[13]);
+            CHECK_EQUAL(g_num_scheduled(ecs), (u32)3);
+            const entity_t created = g_create_entity(ecs, 0);
+
+            // the actions follow an entity that is moved
+            const entity_t moved = g_move_entity(ecs, entities[7], 1);
+            CHECK_EQUAL(g_advance_ticks(ecs, 60), (u32)1);
+            CHECK_TRUE(g_has_tag<enemy_tag_t>(ecs, moved));
+            CHECK_TRUE(g_remap_entity(ecs, created) == created);
+            CHECK_TRUE(g_remap_entity(ecs, entities[11]) == entities[11]);
+
+            CHECK_EQUAL(g_advance_ticks(ecs, 30), (u32)1);
+            CHECK_FALSE(g_has_cp<mass_t>(ecs, entities[3]));
+            CHECK_EQUAL(g_num_scheduled(ecs), (u32)1);
+
+            CHECK_EQUAL(g_advance_ticks(ecs, 300000 - 102), (u32)0);
+            CHECK_EQUAL(g_advance_ticks(ecs), (u32)1);
+            CHECK_EQUAL(g_remap_entity(ecs, entities[5]), ECS_ENTITY_NULL);
+            CHECK_EQUAL(g_num_scheduled(ecs), (u32)0);
+
+            g_destroy_ecs(ecs);
+        }
+
+        UNITTEST_TEST(sleeping_entities)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+            g_register_archetype(ecs, 1);
+
+            g_register_component_type<mass_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+
+            entity_t entities[200];
+            for (s32 i = 0; i < 200; ++i)
+            {
+                entities[i] = g_create_entity(ecs, 0);
+                g_add_cp<mass_t>(ecs, entities[i])->value = (f32)i;
+                if ((i & 1) == 0)
+                    g_add_tag<enemy_tag_t>(ecs, entities[i]);
+            }
+
+            en_iterator_t enemies(ecs, 0);
+            enemies.mark_tag<enemy_tag_t>();
+            const s32 q = g_register_query(ecs, enemies);
+
+            // put the first 150 entities to sleep in a batch, they are skipped by default
+            CHECK_EQUAL(g_sleep(ecs, entities, 150), (u32)150);
+            CHECK_EQUAL(g_sleep(ecs, entities, 10), (u32)0);
+            CHECK_EQUAL(g_num_sleeping(ecs, 0), (u32)150);
+            CHECK_FALSE(g_is_awake(ecs, entities[0]));
+            CHECK_TRUE(g_is_awake(ecs, entities[150]));
+
+            en_iterator_t all(ecs, 0);
+            all.begin();
+            CHECK_EQUAL(all.entity(), entities[150]);
+            CHECK_EQUAL(g_count(ecs, all), (u32)50);
+            CHECK_EQUAL(g_count(ecs, enemies), (u32)25);
+            all.include_sleeping();
+            CHECK_EQUAL(g_count(ecs, all), (u32)200);
+            CHECK_EQUAL(g_query_count(ecs, 0, q), (u32)100);
+
+            CHECK_EQUAL(g_wake(ecs, entities, 10), (u32)10);
+            g_sleep(ecs, entities[199]);
+            g_wake(ecs, entities[199]);
+            CHECK_EQUAL(g_num_sleeping(ecs, 0), (u32)140);
+
+            // a registered query and the reductions only see the awake entities as well
+            en_iterator_t members(ecs, 0);
+            members.use_query(q);
+            u32 count = 0;
+            for (members.begin(); !members.end(); members.next())
+                count++;
+            CHECK_EQUAL(count, (u32)30);
+
+            en_iterator_t with_mass(ecs, 0);
+            with_mass.mark_cp<mass_t>();
+            f32 sum = 0.0f;
+            CHECK_EQUAL(g_reduce_f32(ecs, with_mass, mass_t::ECS4_COMPONENT_INDEX, REDUCE_SUM, &sum, 1), (u32)60);
+            CHECK_EQUAL(sum, 8770.0f);
+
+            // destroying or moving a sleeping entity
+            g_destroy_entity(ecs, entities[20]);
+            CHECK_EQUAL(g_num_sleeping(ecs, 0), (u32)139);
+            const entity_t moved = g_move_entity(ecs, entities[30], 1);
+            CHECK_FALSE(g_is_awake(ecs, moved));
+            CHECK_EQUAL(g_num_sleeping(ecs, 0), (u32)138);
+            CHECK_EQUAL(g_num_sleeping(ecs, 1), (u32)1);
+
+            // group the awake entities at the start of the archetype
+            CHECK_TRUE(g_sort_awake_first(ecs, 0, nullptr, nullptr) > 0);
+            en_iterator_t awake(ecs, 0);
+            count = 0;
+            for (awake.begin(); !awake.end(); awake.next())
+            {
+                CHECK_TRUE(awake.index() <= 61);
+                count++;
+            }
+            CHECK_EQUAL(count, (u32)60);
+            CHECK_EQUAL(g_count(ecs, all), (u32)198);
+            CHECK_EQUAL(g_reduce_f32(ecs, with_mass, mass_t::ECS4_COMPONENT_INDEX, REDUCE_SUM, &sum, 1), (u32)60);
+            CHECK_EQUAL(sum, 8770.0f);
+
+            g_destroy_ecs(ecs);
+        }
+
+        static void s_hierarchy_moved(entity_t from, entity_t to, void* user)
+        {
+            entity_t* entities = (entity_t*)user;
+            for (s32 i = 0; i < 6; ++i)
+            {
+                if (entities[i] == from)
+                    entities[i + 6] = to;
+            }
+        }
+
+        UNITTEST_TEST(hierarchy)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+            g_register_archetype(ecs, 1);
+
+            g_register_component_type<world_position_t>(ecs, 0);
+
+            // entities that are not in the hierarchy come first, the components are allocated in reverse order
+            entity_t others[4];
+            for (s32 i = 0; i < 4; ++i)
+                others[i] = g_create_entity(ecs, 0);
+            entity_t entities[12];
+            for (s32 i = 0; i < 6; ++i)
+                entities[i] = g_create_entity(ecs, 0);
+            for (s32 i = 5; i >= 0; --i)
+            {
+                world_position_t* t = g_add_cp<world_position_t>(ecs, entities[i]);
+                t->x                = (f32)(1 << i);
+                t->y                = t->x;
+            }
+            for (s32 i = 0; i < 4; ++i)
+                g_add_cp<world_position_t>(ecs, others[i]);
+
+            // 0 -> (1 -> (3, 4), 2 -> (5))
+            CHECK_TRUE(g_set_parent(ecs, entities[1], entities[0]));
+            CHECK_TRUE(g_set_parent(ecs, entities[2], entities[0]));
+            CHECK_TRUE(g_set_parent(ecs, entities[3], entities[1]));
+            CHECK_TRUE(g_set_parent(ecs, entities[5], entities[2]));
+            CHECK_TRUE(g_set_parent(ecs, entities[4], entities[1]));
+            CHECK_FALSE(g_set_parent(ecs, entities[0], entities[3]));
+            CHECK_FALSE(g_set_parent(ecs, entities[0], g_create_entity(ecs, 1)));
+            CHECK_EQUAL(g_get_parent(ecs, entities[4]), entities[1]);
+            CHECK_EQUAL(g_get_parent(ecs, entities[0]), ECS_ENTITY_NULL);
+            CHECK_EQUAL(g_get_depth(ecs, entities[5]), (u32)2);
+            CHECK_EQUAL(g_hierarchy_levels(ecs, 1), (u32)0);
+
+            entity_t children[4];
+            CHECK_EQUAL(g_get_children(ecs, entities[1], children, 4), (u32)2);
+
+            hierarchy_level_t level;
+            CHECK_EQUAL(g_hierarchy_levels(ecs, 0), (u32)3);
+            CHECK_TRUE(g_hierarchy_level(ecs, 0, 2, level));
+            CHECK_EQUAL(level.m_begin, (u32)3);
+            CHECK_EQUAL(level.m_count, (u32)3);
+            for (u32 i = 1; i < level.m_count; ++i)
+                CHECK_TRUE(level.m_parents[i - 1] <= level.m_parents[i]);
+            CHECK_FALSE(g_hierarchy_level(ecs, 0, 3, level));
+
+            // after sorting, the entities and their components follow the flattened order
+            for (s32 i = 0; i < 6; ++i)
+                entities[i + 6] = entities[i];
+            CHECK_TRUE(g_sort_by_hierarchy(ecs, 0, s_hierarchy_moved, entities) > 0);
+            CHECK_EQUAL(g_get_parent(ecs, entities[10]), entities[7]);
+            CHECK_EQUAL(g_get_parent(ecs, entities[11]), entities[8]);
+            byte const* previous = nullptr;
+            for (u32 d = 0; g_hierarchy_level(ecs, 0, d, level); ++d)
+            {
+                for (u32 i = 0; i < level.m_count; ++i)
+                {
+                    CHECK_EQUAL(level.m_entities[i], g_select(ecs, 0, level.m_begin + i));
+                    byte const* t = (byte const*)g_get_cp<world_position_t>(ecs, level.m_entities[i]);
+                    CHECK_TRUE(t > previous);
+                    previous = t;
+                }
+            }
+
+            // propagation, one pass per level
+            for (u32 d = 1; g_hierarchy_level(ecs, 0, d, level); ++d)
+            {
+                for (u32 i = 0; i < level.m_count; ++i)
+                {
+                    world_position_t const* parent = g_get_cp<world_position_t>(ecs, level.m_order[level.m_parents[i]]);
+                    world_position_t*       t      = g_get_cp<world_position_t>(ecs, level.m_entities[i]);
+                    t->y                           = parent->y + t->x;
+                }
+            }
+            CHECK_EQUAL(g_get_cp<world_position_t>(ecs, entities[10])->y, 1.0f + 2.0f + 16.0f);
+            CHECK_EQUAL(g_get_cp<world_position_t>(ecs, entities[11])->y, 1.0f + 4.0f + 32.0f);
+
+            // moving an entity to another archetype detaches its children
+            CHECK_TRUE(g_move_entity(ecs, entities[8], 1) != ECS_ENTITY_NULL);
+            CHECK_EQUAL(g_get_parent(ecs, entities[11]), ECS_ENTITY_NULL);
+            CHECK_EQUAL(g_get_depth(ecs, entities[11]), (u32)0);
+
+            CHECK_EQUAL(g_destroy_subtree(ecs, entities[7]), (u32)3);
+            CHECK_EQUAL(g_get_children(ecs, entities[6], children, 4), (u32)0);
+            CHECK_EQUAL(g_hierarchy_levels(ecs, 0), (u32)0);
+
+            // a chain cannot be deeper than the maximum depth
+            entity_t chain[ECS4_HIERARCHY_MAX_DEPTH + 1];
+            chain[0] = g_create_entity(ecs, 0);
+            for (u32 i = 1; i <= ECS4_HIERARCHY_MAX_DEPTH; ++i)
+            {
+                chain[i] = g_create_entity(ecs, 0);
+                CHECK_EQUAL(g_set_parent(ecs, chain[i], chain[i - 1]), i < ECS4_HIERARCHY_MAX_DEPTH);
+            }
+            CHECK_EQUAL(g_hierarchy_levels(ecs, 0), ECS4_HIERARCHY_MAX_DEPTH);
+
+            g_destroy_ecs(ecs);
+        }
+
+        static u64  s_unit_id_key(ecs_t* ecs, entity_t e, void*) { return 100 - g_get_cp<unit_t>(ecs, e)->id; }
+        static void s_relations_moved(entity_t from, entity_t to, void* user)
+        {
+            entity_t* entities = (entity_t*)user;
+            for (s32 i = 0; i < 8; ++i)
+            {
+                if (entities[i] == from)
+                    entities[i + 8] = to;
+            }
+        }
+
+        UNITTEST_TEST(relations)
+        {
+            ecs_t* ecs = g_create_ecs();
+            g_register_archetype(ecs, 0);
+            g_register_archetype(ecs, 1);
+
+            g_register_component_type<unit_t>(ecs, 0);
+            g_register_tag_type<enemy_tag_t>(ecs, 0);
+
+            CHECK_TRUE(g_register_relation<targets_t>(ecs, 256));
+            CHECK_TRUE(g_register_relation<owned_by_t>(ecs, 2));
+            CHECK_FALSE(g_register_relation<targets_t>(ecs, 256));
+
+            // the entities and their targets are in different archetypes
+            entity_t player = g_create_entity(ecs, 1);
+            entity_t boss   = g_create_entity(ecs, 0);
+            entity_t units[16];
+            for (u32 i = 0; i < 8; ++i)
+            {
+                units[i]                            = g_create_entity(ecs, 0);
+                g_add_cp<unit_t>(ecs, units[i])->id = i;
+                if (i & 1)
+                    g_add_tag<enemy_tag_t>(ecs, units[i]);
+            }
+            g_add_cp<unit_t>(ecs, boss)->id = 99;
+
+            CHECK_EQUAL(g_add_pair(ecs, units, 8, targets_t::ECS4_RELATION_INDEX, player), (u32)8);
+            CHECK_TRUE(g_add_pair<targets_t>(ecs, units[0], boss));
+            CHECK_TRUE(g_add_pair<owned_by_t>(ecs, units[0], player));
+            CHECK_EQUAL(g_add_pair(ecs, units, 8, owned_by_t::ECS4_RELATION_INDEX, boss), (u32)1);
+            CHECK_TRUE(g_has_pair<targets_t>(ecs, units[3], player));
+            CHECK_FALSE(g_has_pair<owned_by_t>(ecs, units[3], player));
+
+            entity_t out[8];
+            CHECK_EQUAL(g_get_targets<targets_t>(ecs, units[0], out, 8), (u32)2);
+
+            // all the enemies that target the player
+            en_iterator_t enemies(ecs, 0);
+            enemies.mark_tag<enemy_tag_t>();
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, nullptr, player, out, 8), (u32)8);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, &enemies, player, out, 8), (u32)4);
+            for (u32 i = 0; i < 4; ++i)
+                CHECK_TRUE(g_has_tag<enemy_tag_t>(ecs, out[i]));
+
+            // the pairs follow the entities when the storage is sorted
+            for (u32 i = 0; i < 8; ++i)
+                units[i + 8] = units[i];
+            CHECK_TRUE(g_sort_storage(ecs, 0, s_unit_id_key, s_relations_moved, units) > 0);
+            boss = g_select(ecs, 0, 0);
+            CHECK_EQUAL(g_get_cp<unit_t>(ecs, boss)->id, (u32)99);
+            for (u32 i = 0; i < 8; ++i)
+                CHECK_TRUE(g_has_pair<targets_t>(ecs, units[i + 8], player));
+            CHECK_EQUAL(g_get_targets<targets_t>(ecs, units[8], out, 8), (u32)2);
+            CHECK_TRUE(out[0] == boss || out[1] == boss);
+            CHECK_EQUAL(g_query_pair<owned_by_t>(ecs, nullptr, boss, out, 8), (u32)1);
+            CHECK_EQUAL(out[0], units[8]);
+
+            // and when they are moved to another archetype
+            const entity_t moved = g_move_entity(ecs, units[9], 1);
+            CHECK_TRUE(g_has_pair<targets_t>(ecs, moved, player));
+            CHECK_FALSE(g_has_pair<targets_t>(ecs, units[9], player));
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, &enemies, player, out, 8), (u32)3);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, nullptr, player, out, 8), (u32)8);
+
+            g_rem_pair(ecs, units + 8, 4, targets_t::ECS4_RELATION_INDEX, player);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, nullptr, player, out, 8), (u32)5);
+
+            // destroying the target removes the pairs that point at it
+            g_destroy_entity(ecs, player);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, nullptr, player, out, 8), (u32)0);
+            CHECK_FALSE(g_has_pair<owned_by_t>(ecs, units[8], player));
+            CHECK_TRUE(g_has_pair<targets_t>(ecs, units[8], boss));
+            CHECK_FALSE(g_add_pair<targets_t>(ecs, units[10], player));
+
+            g_destroy_entity(ecs, units[8]);
+            CHECK_EQUAL(g_query_pair<targets_t>(ecs, nullptr, boss, out, 8), (u32)0);
+            CHECK_EQUAL(g_query_pair<owned_by_t>(ecs, nullptr, boss, out, 8), (u32)0);
+
+            g_destroy_ecs(ecs);
+        }
     }
 }
 UNITTEST_SUITE_END